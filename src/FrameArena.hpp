@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+// Memory a connection decodes incoming frames into, see make_message.
+//
+// A Scope covers the handling of one frame. Everything allocated from the
+// arena inside it is released at once when it ends, so decoded strings and
+// vectors are dropped without a free each. Allocations come from a buffer
+// owned by the arena, what does not fit is taken from the heap and the
+// buffer grows by that much when the scope ends. Once the largest frames
+// have been seen, decoding allocates nothing. The buffer is only allocated
+// by the first frame that needs it, so idle connections cost nothing.
+class FrameArena {
+public:
+    // `max_size` caps the buffer, larger frames keep using the heap for the
+    // rest.
+    explicit FrameArena(size_t max_size) : max_size_(max_size) {
+    }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    class Scope {
+    public:
+        explicit Scope(FrameArena& arena)
+            : arena_(arena),
+              resource_(arena.buffer_.data(), arena.buffer_.size(),
+                        &overflow_) {
+            arena_.resource_ = &resource_;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope() {
+            arena_.resource_ = nullptr;
+            resource_.release();
+            arena_.grow(overflow_.get_bytes());
+        }
+
+    private:
+        // Heap memory the frame needed beyond the buffer.
+        class Overflow : public std::pmr::memory_resource {
+        public:
+            size_t get_bytes() const {
+                return bytes_;
+            }
+
+        private:
+            void* do_allocate(size_t bytes, size_t alignment) override {
+                bytes_ += bytes;
+                return std::pmr::new_delete_resource()->allocate(bytes,
+                                                                 alignment);
+            }
+
+            void do_deallocate(void* pointer, size_t bytes,
+                               size_t alignment) override {
+                std::pmr::new_delete_resource()->deallocate(pointer, bytes,
+                                                            alignment);
+            }
+
+            bool do_is_equal(
+                const std::pmr::memory_resource& other) const noexcept override {
+                return this == &other;
+            }
+
+            size_t bytes_{0};
+        };
+
+        FrameArena& arena_;
+        Overflow overflow_;
+        std::pmr::monotonic_buffer_resource resource_;
+    };
+
+    // The resource of the open scope, the default resource outside of one.
+    std::pmr::memory_resource* get() const {
+        return resource_ ? resource_ : std::pmr::get_default_resource();
+    }
+
+    size_t get_size() const {
+        return buffer_.size();
+    }
+
+private:
+    void grow(size_t overflow) {
+        const auto size = std::min(buffer_.size() + overflow, max_size_);
+        if (size > buffer_.size()) {
+            buffer_.resize(size);
+        }
+    }
+
+    size_t max_size_;
+    std::vector<std::byte> buffer_;
+    std::pmr::memory_resource* resource_{nullptr};
+};
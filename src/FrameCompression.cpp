@@ -0,0 +1,88 @@
+#include "FrameCompression.hpp"
+
+#include <cstring>
+
+namespace {
+constexpr size_t TypeSize = sizeof(MessageType);
+constexpr size_t InflatedSizeSize = sizeof(uint32_t);
+} // namespace
+
+FrameDeflater::FrameDeflater(int level)
+    : is_valid_(deflateInit(&stream_, level) == Z_OK) {
+}
+
+FrameDeflater::~FrameDeflater() {
+    if (is_valid_) {
+        deflateEnd(&stream_);
+    }
+}
+
+std::optional<SerializedMessage>
+FrameDeflater::compress(std::span<const uint8_t> frames) {
+    constexpr size_t prefix_size =
+        MessageHeaderSize + TypeSize + InflatedSizeSize;
+    if (!is_valid_ || frames.size() <= prefix_size ||
+        frames.size() > MaxInflatedSize) {
+        return std::nullopt;
+    }
+
+    // Deflating stops once the frame would be as long as the frames it
+    // carries.
+    SerializedMessage frame(frames.size());
+    deflateReset(&stream_);
+    stream_.next_in = const_cast<Bytef*>(frames.data());
+    stream_.avail_in = static_cast<uInt>(frames.size());
+    stream_.next_out = frame.data() + prefix_size;
+    stream_.avail_out = static_cast<uInt>(frames.size() - prefix_size);
+    if (deflate(&stream_, Z_FINISH) != Z_STREAM_END) {
+        return std::nullopt;
+    }
+    frame.resize(prefix_size + stream_.total_out);
+
+    const MessageHeader header{
+        .type = MessageType::Compressed,
+        .body_size = static_cast<uint32_t>(frame.size() - MessageHeaderSize)};
+    MessageHeader first{};
+    std::memcpy(&first, frames.data(), MessageHeaderSize);
+    const auto inflated_size = static_cast<uint32_t>(frames.size());
+
+    unsigned offset{0};
+    std::memcpy(frame.data() + offset, &header, MessageHeaderSize);
+    offset += MessageHeaderSize;
+    std::memcpy(frame.data() + offset, &first.type, TypeSize);
+    offset += TypeSize;
+    std::memcpy(frame.data() + offset, &inflated_size, InflatedSizeSize);
+    return frame;
+}
+
+FrameInflater::FrameInflater() : is_valid_(inflateInit(&stream_) == Z_OK) {
+}
+
+FrameInflater::~FrameInflater() {
+    if (is_valid_) {
+        inflateEnd(&stream_);
+    }
+}
+
+bool FrameInflater::decompress(std::span<const uint8_t> body,
+                               SerializedMessage& frames) {
+    uint32_t inflated_size{0};
+    if (!is_valid_ || body.size() < TypeSize + InflatedSizeSize) {
+        return false;
+    }
+    std::memcpy(&inflated_size, body.data() + TypeSize, InflatedSizeSize);
+    if (inflated_size > MaxInflatedSize) {
+        return false;
+    }
+
+    const auto deflated = body.subspan(TypeSize + InflatedSizeSize);
+    frames.resize(inflated_size);
+    inflateReset(&stream_);
+    stream_.next_in = const_cast<Bytef*>(deflated.data());
+    stream_.avail_in = static_cast<uInt>(deflated.size());
+    stream_.next_out = frames.data();
+    stream_.avail_out = static_cast<uInt>(frames.size());
+    // Exactly the announced size, and nothing after the end of the stream.
+    return inflate(&stream_, Z_FINISH) == Z_STREAM_END &&
+           stream_.avail_out == 0 && stream_.avail_in == 0;
+}
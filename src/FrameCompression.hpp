@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Message.hpp"
+
+#include <zlib.h>
+
+#include <optional>
+#include <span>
+
+// Frames sent with MessageType::Compressed, to clients that announced in
+// ConnectMessage that they can read them.
+//
+// The body of such a frame is the type of the first frame it carries, so
+// outbound queues can file it without inflating it, the size of the frames
+// it carries and those frames, header and all, deflated. One compressed
+// frame may carry several frames, like the session, roster snapshot and
+// replayed messages a client gets on joining.
+//
+// Both sides keep their z_stream for the life of the connection and only
+// reset it between frames, deflateInit allocates about 256 KiB each time.
+
+// Frames larger than this are not inflated, whatever they claim.
+constexpr size_t MaxInflatedSize = 64 << 20;
+
+class FrameDeflater {
+public:
+    explicit FrameDeflater(int level = Z_DEFAULT_COMPRESSION);
+    ~FrameDeflater();
+
+    FrameDeflater(const FrameDeflater&) = delete;
+    FrameDeflater& operator=(const FrameDeflater&) = delete;
+
+    // The whole Compressed frame carrying `frames`, nullopt if it would not
+    // be smaller than they are.
+    std::optional<SerializedMessage> compress(std::span<const uint8_t> frames);
+
+private:
+    z_stream stream_{};
+    bool is_valid_;
+};
+
+class FrameInflater {
+public:
+    FrameInflater();
+    ~FrameInflater();
+
+    FrameInflater(const FrameInflater&) = delete;
+    FrameInflater& operator=(const FrameInflater&) = delete;
+
+    // The frames carried by the body of a Compressed frame, false if it is
+    // damaged.
+    bool decompress(std::span<const uint8_t> body, SerializedMessage& frames);
+
+private:
+    z_stream stream_{};
+    bool is_valid_;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+// Distribution of latencies, with power-of-two microsecond buckets so
+// recording stays a few instructions.
+class LatencyHistogram {
+public:
+    using Duration = std::chrono::nanoseconds;
+
+    // Negative latencies, from clocks of different hosts, count as 0.
+    void record(Duration latency) {
+        latency = std::max(latency, Duration::zero());
+        const auto us = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(latency)
+                .count());
+        ++count_;
+        total_ += latency;
+        max_ = std::max(max_, latency);
+        ++buckets_[std::min<size_t>(std::bit_width(us), BucketCount - 1)];
+    }
+
+    uint64_t get_count() const {
+        return count_;
+    }
+
+    Duration get_mean() const {
+        return count_ == 0 ? Duration{}
+                           : total_ / static_cast<int64_t>(count_);
+    }
+
+    Duration get_max() const {
+        return max_;
+    }
+
+    // Latency that `fraction` of the records stayed under, rounded up to a
+    // power of two microseconds.
+    std::chrono::microseconds get_bound(double fraction) const {
+        const auto max =
+            std::chrono::duration_cast<std::chrono::microseconds>(max_);
+        const auto wanted = static_cast<uint64_t>(
+            std::ceil(fraction * static_cast<double>(count_)));
+        uint64_t seen{0};
+        for (size_t i = 0; i < BucketCount; ++i) {
+            seen += buckets_[i];
+            if (seen >= wanted) {
+                return std::min(
+                    std::chrono::microseconds{i == 0 ? 0 : uint64_t{1} << i},
+                    max);
+            }
+        }
+        return max;
+    }
+
+private:
+    // Bucket i counts latencies below 2^i microseconds, the last one the
+    // rest.
+    static constexpr size_t BucketCount = 32;
+
+    uint64_t count_{0};
+    Duration total_{};
+    Duration max_{};
+    std::array<uint64_t, BucketCount> buckets_{};
+};
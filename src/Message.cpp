@@ -1,7 +1,19 @@
 #include "Message.hpp"
 
+#include <memory>
 #include <vector>
 
+namespace {
+// Through a char pointer the string copies the bytes directly, instead of
+// building a temporary from the iterators first.
+void assign_text(std::pmr::string& text,
+                 SerializedMessage::const_iterator first,
+                 SerializedMessage::const_iterator last) {
+    text.assign(reinterpret_cast<const char*>(std::to_address(first)),
+                static_cast<size_t>(last - first));
+}
+} // namespace
+
 SerializedMessage serialize(const MessageHeader& header) {
     SerializedMessage buffer(MessageHeaderSize);
     std::memcpy(buffer.data(), &header, MessageHeaderSize);
@@ -19,11 +31,24 @@ bool deserialize(const SerializedMessage& buffer, MessageHeader& header) {
 SerializedMessage serialize(const ConnectMessage& msg) {
     unsigned long nick_length = msg.nick.length();
     constexpr size_t nick_length_size = sizeof(nick_length);
+    constexpr size_t resume_token_size = sizeof(msg.resume_token);
+    constexpr size_t last_sequence_size = sizeof(msg.last_sequence);
+    constexpr size_t compression_size = sizeof(msg.compression);
 
-    SerializedMessage buffer(nick_length + nick_length_size);
+    SerializedMessage buffer(nick_length + nick_length_size +
+                             resume_token_size + last_sequence_size +
+                             compression_size);
 
-    std::memcpy(buffer.data(), &nick_length, nick_length_size);
-    std::memcpy(buffer.data() + nick_length_size, msg.nick.data(), nick_length);
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &nick_length, nick_length_size);
+    offset += nick_length_size;
+    std::memcpy(buffer.data() + offset, msg.nick.data(), nick_length);
+    offset += nick_length;
+    std::memcpy(buffer.data() + offset, &msg.resume_token, resume_token_size);
+    offset += resume_token_size;
+    std::memcpy(buffer.data() + offset, &msg.last_sequence, last_sequence_size);
+    offset += last_sequence_size;
+    std::memcpy(buffer.data() + offset, &msg.compression, compression_size);
 
     return buffer;
 }
@@ -31,13 +56,33 @@ SerializedMessage serialize(const ConnectMessage& msg) {
 bool deserialize(const SerializedMessage& buffer, ConnectMessage& msg) {
     unsigned long nick_length{0};
     constexpr size_t nick_length_size = sizeof(nick_length);
+    constexpr size_t resume_token_size = sizeof(msg.resume_token);
+    constexpr size_t last_sequence_size = sizeof(msg.last_sequence);
+    constexpr size_t compression_size = sizeof(msg.compression);
+
+    if (buffer.size() < nick_length_size) {
+        return false;
+    }
     std::memcpy(&nick_length, buffer.data(), nick_length_size);
 
-    if (buffer.size() != nick_length_size + nick_length) {
+    // The length is checked against what is left, adding it to the sizes
+    // could wrap around.
+    constexpr size_t fixed_size = nick_length_size + resume_token_size +
+                                  last_sequence_size + compression_size;
+    if (buffer.size() < fixed_size ||
+        nick_length != buffer.size() - fixed_size) {
         return false;
     }
 
-    msg.nick.assign(buffer.begin() + nick_length_size, buffer.end());
+    unsigned offset = nick_length_size;
+    assign_text(msg.nick, buffer.begin() + offset,
+                buffer.begin() + offset + nick_length);
+    offset += nick_length;
+    std::memcpy(&msg.resume_token, buffer.data() + offset, resume_token_size);
+    offset += resume_token_size;
+    std::memcpy(&msg.last_sequence, buffer.data() + offset, last_sequence_size);
+    offset += last_sequence_size;
+    std::memcpy(&msg.compression, buffer.data() + offset, compression_size);
     return true;
 }
 
@@ -62,25 +107,25 @@ bool deserialize(const SerializedMessage& buffer, DisconnectMessage& msg) {
         return false;
     }
 
-    msg.nick.assign(buffer.begin() + nick_length_size, buffer.end());
+    assign_text(msg.nick, buffer.begin() + nick_length_size, buffer.end());
     return true;
 }
 
 SerializedMessage serialize(const TextMessage& msg) {
-    unsigned long from_length = msg.from.length();
     unsigned long message_length = msg.message.length();
 
-    constexpr size_t from_length_size = sizeof(from_length);
+    constexpr size_t sequence_size = sizeof(msg.sequence);
+    constexpr size_t from_size = sizeof(msg.from);
     constexpr size_t message_length_size = sizeof(message_length);
 
-    SerializedMessage buffer(from_length + message_length +
-                                from_length_size + message_length_size);
+    SerializedMessage buffer(sequence_size + from_size + message_length_size +
+                             message_length);
 
     unsigned offset{0};
-    std::memcpy(buffer.data() + offset, &from_length, from_length_size);
-    offset += from_length_size;
-    std::memcpy(buffer.data() + offset, msg.from.data(), from_length);
-    offset += from_length;
+    std::memcpy(buffer.data() + offset, &msg.sequence, sequence_size);
+    offset += sequence_size;
+    std::memcpy(buffer.data() + offset, &msg.from, from_size);
+    offset += from_size;
     std::memcpy(buffer.data() + offset, &message_length, message_length_size);
     offset += message_length_size;
     std::memcpy(buffer.data() + offset, msg.message.data(), message_length);
@@ -89,124 +134,769 @@ SerializedMessage serialize(const TextMessage& msg) {
 }
 
 bool deserialize(const SerializedMessage& buffer, TextMessage& msg) {
-    unsigned long from_length{0};
     unsigned long message_length{0};
 
-    constexpr size_t from_length_size = sizeof(from_length);
+    constexpr size_t sequence_size = sizeof(msg.sequence);
+    constexpr size_t from_size = sizeof(msg.from);
     constexpr size_t message_length_size = sizeof(message_length);
 
+    if (buffer.size() < sequence_size + from_size + message_length_size) {
+        return false;
+    }
+
     unsigned offset{0};
-    std::memcpy(&from_length, buffer.data() + offset, from_length_size);
-    offset += from_length_size;
-    msg.from.assign(buffer.begin() + offset,
-                    buffer.begin() + offset + from_length);
-    offset += from_length;
+    std::memcpy(&msg.sequence, buffer.data() + offset, sequence_size);
+    offset += sequence_size;
+    std::memcpy(&msg.from, buffer.data() + offset, from_size);
+    offset += from_size;
     std::memcpy(&message_length, buffer.data() + offset, message_length_size);
     offset += message_length_size;
-    msg.message.assign(buffer.begin() + offset, buffer.end());
 
-    if (buffer.size() !=
-        from_length_size + from_length + message_length_size + message_length) {
+    if (buffer.size() != offset + message_length) {
         return false;
     }
 
+    assign_text(msg.message, buffer.begin() + offset, buffer.end());
     return true;
 }
 
 SerializedMessage serialize(const PrivateMessage& msg) {
+    unsigned long to_nick_length = msg.to_nick.length();
+    unsigned long message_length = msg.message.length();
+
+    constexpr size_t sequence_size = sizeof(msg.sequence);
+    constexpr size_t from_size = sizeof(msg.from);
+    constexpr size_t to_size = sizeof(msg.to);
+    constexpr size_t length_size = sizeof(unsigned long);
+
+    SerializedMessage buffer(sequence_size + from_size + to_size +
+                             2 * length_size + to_nick_length +
+                             message_length);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.sequence, sequence_size);
+    offset += sequence_size;
+    std::memcpy(buffer.data() + offset, &msg.from, from_size);
+    offset += from_size;
+    std::memcpy(buffer.data() + offset, &msg.to, to_size);
+    offset += to_size;
+    std::memcpy(buffer.data() + offset, &to_nick_length, length_size);
+    offset += length_size;
+    std::memcpy(buffer.data() + offset, msg.to_nick.data(), to_nick_length);
+    offset += to_nick_length;
+    std::memcpy(buffer.data() + offset, &message_length, length_size);
+    offset += length_size;
+    std::memcpy(buffer.data() + offset, msg.message.data(), message_length);
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, PrivateMessage& msg) {
+    unsigned long to_nick_length{0};
+    unsigned long message_length{0};
+
+    constexpr size_t sequence_size = sizeof(msg.sequence);
+    constexpr size_t from_size = sizeof(msg.from);
+    constexpr size_t to_size = sizeof(msg.to);
+    constexpr size_t length_size = sizeof(unsigned long);
+
+    if (buffer.size() < sequence_size + from_size + to_size + length_size) {
+        return false;
+    }
+
+    unsigned offset{0};
+    std::memcpy(&msg.sequence, buffer.data() + offset, sequence_size);
+    offset += sequence_size;
+    std::memcpy(&msg.from, buffer.data() + offset, from_size);
+    offset += from_size;
+    std::memcpy(&msg.to, buffer.data() + offset, to_size);
+    offset += to_size;
+    std::memcpy(&to_nick_length, buffer.data() + offset, length_size);
+    offset += length_size;
+
+    // Adding the length to length_size could wrap around.
+    if (buffer.size() - offset < length_size ||
+        to_nick_length > buffer.size() - offset - length_size) {
+        return false;
+    }
+
+    assign_text(msg.to_nick, buffer.begin() + offset,
+                buffer.begin() + offset + to_nick_length);
+    offset += to_nick_length;
+    std::memcpy(&message_length, buffer.data() + offset, length_size);
+    offset += length_size;
+
+    if (buffer.size() != offset + message_length) {
+        return false;
+    }
+
+    assign_text(msg.message, buffer.begin() + offset, buffer.end());
+    return true;
+}
+
+SerializedMessage serialize(const ChatUsersMessage& msg) {
+    const auto users_count = msg.users.size();
+    unsigned long users_data_count{};
+    for (const auto& user : msg.users) {
+        users_data_count += user.nick.length();
+    }
+
+    constexpr size_t version_size = sizeof(msg.version);
+    constexpr size_t id_size = sizeof(UserId);
+
+    SerializedMessage buffer(version_size +
+                             users_count * (id_size + sizeof(unsigned long)) +
+                             users_data_count);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.version, version_size);
+    offset += version_size;
+    for (const auto& user : msg.users) {
+        unsigned long nick_length = user.nick.length();
+        constexpr size_t nick_length_size = sizeof(nick_length);
+        std::memcpy(buffer.data() + offset, &user.id, id_size);
+        offset += id_size;
+        std::memcpy(buffer.data() + offset, &nick_length, nick_length_size);
+        offset += nick_length_size;
+        std::memcpy(buffer.data() + offset, user.nick.data(), nick_length);
+        offset += nick_length;
+    }
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, ChatUsersMessage& msg) {
+    unsigned long nick_length{0};
+    constexpr size_t nick_length_size = sizeof(nick_length);
+    constexpr size_t version_size = sizeof(msg.version);
+    constexpr size_t id_size = sizeof(UserId);
+
+    if (buffer.size() < version_size) {
+        return false;
+    }
+
+    unsigned offset{0};
+    std::memcpy(&msg.version, buffer.data() + offset, version_size);
+    offset += version_size;
+    while (offset < buffer.size()) {
+        if (buffer.size() - offset < id_size + nick_length_size) {
+            return false;
+        }
+        ChatUser user{.id = InvalidUserId,
+                      .nick = std::pmr::string{msg.users.get_allocator()}};
+        std::memcpy(&user.id, buffer.data() + offset, id_size);
+        offset += id_size;
+        std::memcpy(&nick_length, buffer.data() + offset, nick_length_size);
+        offset += nick_length_size;
+        if (buffer.size() - offset < nick_length) {
+            return false;
+        }
+        assign_text(user.nick, buffer.begin() + offset,
+                    buffer.begin() + offset + nick_length);
+        offset += nick_length;
+        msg.users.push_back(std::move(user));
+    }
+
+    return true;
+}
+
+SerializedMessage serialize(const UserJoinedMessage& msg) {
+    unsigned long nick_length = msg.nick.length();
+    constexpr size_t version_size = sizeof(msg.version);
+    constexpr size_t id_size = sizeof(msg.id);
+    constexpr size_t nick_length_size = sizeof(nick_length);
+
+    SerializedMessage buffer(version_size + id_size + nick_length_size +
+                             nick_length);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.version, version_size);
+    offset += version_size;
+    std::memcpy(buffer.data() + offset, &msg.id, id_size);
+    offset += id_size;
+    std::memcpy(buffer.data() + offset, &nick_length, nick_length_size);
+    offset += nick_length_size;
+    std::memcpy(buffer.data() + offset, msg.nick.data(), nick_length);
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, UserJoinedMessage& msg) {
+    unsigned long nick_length{0};
+    constexpr size_t version_size = sizeof(msg.version);
+    constexpr size_t id_size = sizeof(msg.id);
+    constexpr size_t nick_length_size = sizeof(nick_length);
+
+    if (buffer.size() < version_size + id_size + nick_length_size) {
+        return false;
+    }
+
+    unsigned offset{0};
+    std::memcpy(&msg.version, buffer.data() + offset, version_size);
+    offset += version_size;
+    std::memcpy(&msg.id, buffer.data() + offset, id_size);
+    offset += id_size;
+    std::memcpy(&nick_length, buffer.data() + offset, nick_length_size);
+    offset += nick_length_size;
+
+    if (buffer.size() != offset + nick_length) {
+        return false;
+    }
+
+    assign_text(msg.nick, buffer.begin() + offset, buffer.end());
+    return true;
+}
+
+SerializedMessage serialize(const UserLeftMessage& msg) {
+    constexpr size_t version_size = sizeof(msg.version);
+    constexpr size_t id_size = sizeof(msg.id);
+
+    SerializedMessage buffer(version_size + id_size);
+
+    std::memcpy(buffer.data(), &msg.version, version_size);
+    std::memcpy(buffer.data() + version_size, &msg.id, id_size);
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, UserLeftMessage& msg) {
+    constexpr size_t version_size = sizeof(msg.version);
+    constexpr size_t id_size = sizeof(msg.id);
+
+    if (buffer.size() != version_size + id_size) {
+        return false;
+    }
+
+    std::memcpy(&msg.version, buffer.data(), version_size);
+    std::memcpy(&msg.id, buffer.data() + version_size, id_size);
+    return true;
+}
+
+SerializedMessage serialize(const SearchRequestMessage& msg) {
+    unsigned long query_length = msg.query.length();
+    constexpr size_t request_id_size = sizeof(msg.request_id);
+    constexpr size_t query_length_size = sizeof(query_length);
+
+    SerializedMessage buffer(request_id_size + query_length_size +
+                             query_length);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.request_id, request_id_size);
+    offset += request_id_size;
+    std::memcpy(buffer.data() + offset, &query_length, query_length_size);
+    offset += query_length_size;
+    std::memcpy(buffer.data() + offset, msg.query.data(), query_length);
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, SearchRequestMessage& msg) {
+    unsigned long query_length{0};
+    constexpr size_t request_id_size = sizeof(msg.request_id);
+    constexpr size_t query_length_size = sizeof(query_length);
+
+    if (buffer.size() < request_id_size + query_length_size) {
+        return false;
+    }
+
+    unsigned offset{0};
+    std::memcpy(&msg.request_id, buffer.data() + offset, request_id_size);
+    offset += request_id_size;
+    std::memcpy(&query_length, buffer.data() + offset, query_length_size);
+    offset += query_length_size;
+
+    if (buffer.size() != offset + query_length) {
+        return false;
+    }
+
+    assign_text(msg.query, buffer.begin() + offset, buffer.end());
+    return true;
+}
+
+SerializedMessage serialize(const SearchResponseMessage& msg) {
+    constexpr size_t request_id_size = sizeof(msg.request_id);
+    constexpr size_t sequence_size = sizeof(uint64_t);
+    constexpr size_t length_size = sizeof(unsigned long);
+
+    size_t size = request_id_size;
+    for (const auto& result : msg.results) {
+        size += sequence_size + 2 * length_size + result.from.length() +
+                result.message.length();
+    }
+
+    SerializedMessage buffer(size);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.request_id, request_id_size);
+    offset += request_id_size;
+    for (const auto& result : msg.results) {
+        unsigned long from_length = result.from.length();
+        unsigned long message_length = result.message.length();
+        std::memcpy(buffer.data() + offset, &result.sequence, sequence_size);
+        offset += sequence_size;
+        std::memcpy(buffer.data() + offset, &from_length, length_size);
+        offset += length_size;
+        std::memcpy(buffer.data() + offset, result.from.data(), from_length);
+        offset += from_length;
+        std::memcpy(buffer.data() + offset, &message_length, length_size);
+        offset += length_size;
+        std::memcpy(buffer.data() + offset, result.message.data(),
+                    message_length);
+        offset += message_length;
+    }
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, SearchResponseMessage& msg) {
+    constexpr size_t request_id_size = sizeof(msg.request_id);
+    constexpr size_t sequence_size = sizeof(uint64_t);
+    constexpr size_t length_size = sizeof(unsigned long);
+
+    if (buffer.size() < request_id_size) {
+        return false;
+    }
+
+    unsigned offset{0};
+    std::memcpy(&msg.request_id, buffer.data() + offset, request_id_size);
+    offset += request_id_size;
+
+    auto read_string = [&](std::pmr::string& out) {
+        unsigned long length{0};
+        if (buffer.size() - offset < length_size) {
+            return false;
+        }
+        std::memcpy(&length, buffer.data() + offset, length_size);
+        offset += length_size;
+        if (buffer.size() - offset < length) {
+            return false;
+        }
+        assign_text(out, buffer.begin() + offset,
+                    buffer.begin() + offset + length);
+        offset += length;
+        return true;
+    };
+
+    while (offset < buffer.size()) {
+        SearchResult result{
+            .sequence = 0,
+            .from = std::pmr::string{msg.results.get_allocator()},
+            .message = std::pmr::string{msg.results.get_allocator()}};
+        if (buffer.size() - offset < sequence_size) {
+            return false;
+        }
+        std::memcpy(&result.sequence, buffer.data() + offset, sequence_size);
+        offset += sequence_size;
+        if (!read_string(result.from) || !read_string(result.message)) {
+            return false;
+        }
+        msg.results.push_back(std::move(result));
+    }
+
+    return true;
+}
+
+SerializedMessage serialize(const OfflineMessage& msg) {
     unsigned long from_length = msg.from.length();
-    unsigned long to_length = msg.to.length();
     unsigned long message_length = msg.message.length();
 
-    constexpr size_t from_length_size = sizeof(from_length);
-    constexpr size_t to_length_size = sizeof(to_length);
-    constexpr size_t message_length_size = sizeof(message_length);
+    constexpr size_t length_size = sizeof(unsigned long);
+    constexpr size_t sent_at_size = sizeof(msg.sent_at);
 
-    SerializedMessage buffer(from_length + message_length + to_length +
-                                to_length_size + from_length_size +
-                                message_length_size);
+    SerializedMessage buffer(sent_at_size + 2 * length_size + from_length +
+                             message_length);
 
     unsigned offset{0};
-    std::memcpy(buffer.data() + offset, &from_length, from_length_size);
-    offset += from_length_size;
+    std::memcpy(buffer.data() + offset, &msg.sent_at, sent_at_size);
+    offset += sent_at_size;
+    std::memcpy(buffer.data() + offset, &from_length, length_size);
+    offset += length_size;
     std::memcpy(buffer.data() + offset, msg.from.data(), from_length);
     offset += from_length;
+    std::memcpy(buffer.data() + offset, &message_length, length_size);
+    offset += length_size;
+    std::memcpy(buffer.data() + offset, msg.message.data(), message_length);
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, OfflineMessage& msg) {
+    unsigned long from_length{0};
+    unsigned long message_length{0};
+
+    constexpr size_t length_size = sizeof(unsigned long);
+    constexpr size_t sent_at_size = sizeof(msg.sent_at);
+
+    if (buffer.size() < sent_at_size + length_size) {
+        return false;
+    }
+
+    unsigned offset{0};
+    std::memcpy(&msg.sent_at, buffer.data() + offset, sent_at_size);
+    offset += sent_at_size;
+    std::memcpy(&from_length, buffer.data() + offset, length_size);
+    offset += length_size;
+
+    // Adding the length to length_size could wrap around.
+    if (buffer.size() - offset < length_size ||
+        from_length > buffer.size() - offset - length_size) {
+        return false;
+    }
+
+    assign_text(msg.from, buffer.begin() + offset,
+                buffer.begin() + offset + from_length);
+    offset += from_length;
+    std::memcpy(&message_length, buffer.data() + offset, length_size);
+    offset += length_size;
+
+    if (buffer.size() != offset + message_length) {
+        return false;
+    }
+
+    assign_text(msg.message, buffer.begin() + offset, buffer.end());
+    return true;
+}
+
+SerializedMessage serialize(const DeliveryStatusMessage& msg) {
+    unsigned long to_length = msg.to.length();
+
+    constexpr size_t status_size = sizeof(msg.status);
+    constexpr size_t count_size = sizeof(msg.count);
+    constexpr size_t to_length_size = sizeof(to_length);
+
+    SerializedMessage buffer(status_size + count_size + to_length_size +
+                             to_length);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.status, status_size);
+    offset += status_size;
+    std::memcpy(buffer.data() + offset, &msg.count, count_size);
+    offset += count_size;
     std::memcpy(buffer.data() + offset, &to_length, to_length_size);
     offset += to_length_size;
     std::memcpy(buffer.data() + offset, msg.to.data(), to_length);
-    offset += to_length;
-    std::memcpy(buffer.data() + offset, &message_length, message_length_size);
-    offset += message_length_size;
-    std::memcpy(buffer.data() + offset, msg.message.data(), message_length);
 
     return buffer;
 }
 
-bool deserialize(const SerializedMessage& buffer, PrivateMessage& msg) {
-    unsigned long from_length = msg.from.length();
-    unsigned long to_length = msg.to.length();
-    unsigned long message_length = msg.message.length();
+bool deserialize(const SerializedMessage& buffer, DeliveryStatusMessage& msg) {
+    unsigned long to_length{0};
 
-    constexpr size_t from_length_size = sizeof(from_length);
+    constexpr size_t status_size = sizeof(msg.status);
+    constexpr size_t count_size = sizeof(msg.count);
     constexpr size_t to_length_size = sizeof(to_length);
-    constexpr size_t message_length_size = sizeof(message_length);
+
+    if (buffer.size() < status_size + count_size + to_length_size) {
+        return false;
+    }
 
     unsigned offset{0};
-    std::memcpy(&from_length, buffer.data() + offset, from_length_size);
-    offset += from_length_size;
-    msg.from.assign(buffer.begin() + offset,
-                    buffer.begin() + offset + from_length);
-    offset += from_length;
+    std::memcpy(&msg.status, buffer.data() + offset, status_size);
+    offset += status_size;
+    std::memcpy(&msg.count, buffer.data() + offset, count_size);
+    offset += count_size;
     std::memcpy(&to_length, buffer.data() + offset, to_length_size);
     offset += to_length_size;
-    msg.to.assign(buffer.begin() + offset, buffer.begin() + offset + to_length);
-    offset += to_length;
-    std::memcpy(&message_length, buffer.data() + offset, message_length_size);
-    offset += message_length_size;
-    msg.message.assign(buffer.begin() + offset, buffer.end());
 
-    if (buffer.size() != from_length_size + from_length + to_length_size +
-                             to_length + message_length_size + message_length) {
+    if (msg.status > DeliveryStatus::Rejected ||
+        buffer.size() != offset + to_length) {
         return false;
     }
 
+    assign_text(msg.to, buffer.begin() + offset, buffer.end());
     return true;
 }
 
-SerializedMessage serialize(const ChatUsersMessage& msg) {
-    const auto users_count = msg.users.size();
-    unsigned long users_data_count{};
-    for (const auto& users : msg.users) {
-        users_data_count += users.length();
+SerializedMessage serialize(const PeerHelloMessage& msg) {
+    constexpr size_t node_id_size = sizeof(msg.node_id);
+    constexpr size_t nonce_size = sizeof(msg.nonce);
+
+    SerializedMessage buffer(node_id_size + nonce_size + sizeof(msg.proof));
+    std::memcpy(buffer.data(), &msg.node_id, node_id_size);
+    std::memcpy(buffer.data() + node_id_size, msg.nonce.data(), nonce_size);
+    std::memcpy(buffer.data() + node_id_size + nonce_size, msg.proof.data(),
+                sizeof(msg.proof));
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, PeerHelloMessage& msg) {
+    constexpr size_t node_id_size = sizeof(msg.node_id);
+    constexpr size_t nonce_size = sizeof(msg.nonce);
+
+    if (buffer.size() != node_id_size + nonce_size + sizeof(msg.proof)) {
+        return false;
+    }
+    std::memcpy(&msg.node_id, buffer.data(), node_id_size);
+    std::memcpy(msg.nonce.data(), buffer.data() + node_id_size, nonce_size);
+    std::memcpy(msg.proof.data(), buffer.data() + node_id_size + nonce_size,
+                sizeof(msg.proof));
+    return true;
+}
+
+SerializedMessage serialize(const PeerMailboxMessage& msg) {
+    constexpr size_t to_size = sizeof(msg.to);
+
+    SerializedMessage buffer(to_size + msg.frames.size());
+    std::memcpy(buffer.data(), &msg.to, to_size);
+    std::memcpy(buffer.data() + to_size, msg.frames.data(), msg.frames.size());
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, PeerMailboxMessage& msg) {
+    constexpr size_t to_size = sizeof(msg.to);
+
+    if (buffer.size() < to_size) {
+        return false;
+    }
+    std::memcpy(&msg.to, buffer.data(), to_size);
+    msg.frames.assign(buffer.begin() + to_size, buffer.end());
+    return true;
+}
+
+SerializedMessage serialize(const FileOfferMessage& msg) {
+    unsigned long name_length = msg.name.length();
+
+    constexpr size_t from_size = sizeof(msg.from);
+    constexpr size_t to_size = sizeof(msg.to);
+    constexpr size_t transfer_id_size = sizeof(msg.transfer_id);
+    constexpr size_t size_size = sizeof(msg.size);
+    constexpr size_t name_length_size = sizeof(name_length);
+
+    SerializedMessage buffer(from_size + to_size + transfer_id_size +
+                             size_size + name_length_size + name_length);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.from, from_size);
+    offset += from_size;
+    std::memcpy(buffer.data() + offset, &msg.to, to_size);
+    offset += to_size;
+    std::memcpy(buffer.data() + offset, &msg.transfer_id, transfer_id_size);
+    offset += transfer_id_size;
+    std::memcpy(buffer.data() + offset, &msg.size, size_size);
+    offset += size_size;
+    std::memcpy(buffer.data() + offset, &name_length, name_length_size);
+    offset += name_length_size;
+    std::memcpy(buffer.data() + offset, msg.name.data(), name_length);
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, FileOfferMessage& msg) {
+    unsigned long name_length{0};
+
+    constexpr size_t from_size = sizeof(msg.from);
+    constexpr size_t to_size = sizeof(msg.to);
+    constexpr size_t transfer_id_size = sizeof(msg.transfer_id);
+    constexpr size_t size_size = sizeof(msg.size);
+    constexpr size_t name_length_size = sizeof(name_length);
+
+    if (buffer.size() < from_size + to_size + transfer_id_size + size_size +
+                            name_length_size) {
+        return false;
     }
 
-    SerializedMessage buffer(users_count * sizeof(unsigned long) + users_data_count);
+    unsigned offset{0};
+    std::memcpy(&msg.from, buffer.data() + offset, from_size);
+    offset += from_size;
+    std::memcpy(&msg.to, buffer.data() + offset, to_size);
+    offset += to_size;
+    std::memcpy(&msg.transfer_id, buffer.data() + offset, transfer_id_size);
+    offset += transfer_id_size;
+    std::memcpy(&msg.size, buffer.data() + offset, size_size);
+    offset += size_size;
+    std::memcpy(&name_length, buffer.data() + offset, name_length_size);
+    offset += name_length_size;
+
+    if (buffer.size() != offset + name_length) {
+        return false;
+    }
+
+    assign_text(msg.name, buffer.begin() + offset, buffer.end());
+    return true;
+}
+
+SerializedMessage serialize(const FileChunkMessage& msg) {
+    constexpr size_t from_size = sizeof(msg.from);
+    constexpr size_t transfer_id_size = sizeof(msg.transfer_id);
+    constexpr size_t offset_size = sizeof(msg.offset);
+    constexpr size_t checksum_size = sizeof(msg.checksum);
+
+    SerializedMessage buffer(from_size + transfer_id_size + offset_size +
+                             checksum_size + msg.data.size());
 
     unsigned offset{0};
-    for (const auto& user : msg.users) {
-        unsigned long user_length = user.length();
-        constexpr size_t user_length_size = sizeof(user_length);
-        std::memcpy(buffer.data() + offset, &user_length, user_length_size);    
-        offset += user_length_size;
-        std::memcpy(buffer.data() + offset, user.data(), user_length);
-        offset += user_length;
+    std::memcpy(buffer.data() + offset, &msg.from, from_size);
+    offset += from_size;
+    std::memcpy(buffer.data() + offset, &msg.transfer_id, transfer_id_size);
+    offset += transfer_id_size;
+    std::memcpy(buffer.data() + offset, &msg.offset, offset_size);
+    offset += offset_size;
+    std::memcpy(buffer.data() + offset, &msg.checksum, checksum_size);
+    offset += checksum_size;
+    std::memcpy(buffer.data() + offset, msg.data.data(), msg.data.size());
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, FileChunkMessage& msg) {
+    constexpr size_t from_size = sizeof(msg.from);
+    constexpr size_t transfer_id_size = sizeof(msg.transfer_id);
+    constexpr size_t offset_size = sizeof(msg.offset);
+    constexpr size_t checksum_size = sizeof(msg.checksum);
+
+    if (buffer.size() < from_size + transfer_id_size + offset_size +
+                            checksum_size) {
+        return false;
+    }
+
+    unsigned offset{0};
+    std::memcpy(&msg.from, buffer.data() + offset, from_size);
+    offset += from_size;
+    std::memcpy(&msg.transfer_id, buffer.data() + offset, transfer_id_size);
+    offset += transfer_id_size;
+    std::memcpy(&msg.offset, buffer.data() + offset, offset_size);
+    offset += offset_size;
+    std::memcpy(&msg.checksum, buffer.data() + offset, checksum_size);
+    offset += checksum_size;
+
+    if (buffer.size() - offset > FileChunkSize) {
+        return false;
+    }
+
+    msg.data.resize(buffer.size() - offset);
+    std::memcpy(msg.data.data(), buffer.data() + offset, msg.data.size());
+    return true;
+}
+
+SerializedMessage serialize(const FileAckMessage& msg) {
+    constexpr size_t sender_size = sizeof(msg.sender);
+    constexpr size_t transfer_id_size = sizeof(msg.transfer_id);
+    constexpr size_t status_size = sizeof(msg.status);
+    constexpr size_t received_size = sizeof(msg.received);
+    constexpr size_t window_size = sizeof(msg.window);
+
+    SerializedMessage buffer(sender_size + transfer_id_size + status_size +
+                             received_size + window_size);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.sender, sender_size);
+    offset += sender_size;
+    std::memcpy(buffer.data() + offset, &msg.transfer_id, transfer_id_size);
+    offset += transfer_id_size;
+    std::memcpy(buffer.data() + offset, &msg.status, status_size);
+    offset += status_size;
+    std::memcpy(buffer.data() + offset, &msg.received, received_size);
+    offset += received_size;
+    std::memcpy(buffer.data() + offset, &msg.window, window_size);
+
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, FileAckMessage& msg) {
+    constexpr size_t sender_size = sizeof(msg.sender);
+    constexpr size_t transfer_id_size = sizeof(msg.transfer_id);
+    constexpr size_t status_size = sizeof(msg.status);
+    constexpr size_t received_size = sizeof(msg.received);
+    constexpr size_t window_size = sizeof(msg.window);
+
+    if (buffer.size() != sender_size + transfer_id_size + status_size +
+                             received_size + window_size) {
+        return false;
+    }
+
+    unsigned offset{0};
+    std::memcpy(&msg.sender, buffer.data() + offset, sender_size);
+    offset += sender_size;
+    std::memcpy(&msg.transfer_id, buffer.data() + offset, transfer_id_size);
+    offset += transfer_id_size;
+    std::memcpy(&msg.status, buffer.data() + offset, status_size);
+    offset += status_size;
+    std::memcpy(&msg.received, buffer.data() + offset, received_size);
+    offset += received_size;
+    std::memcpy(&msg.window, buffer.data() + offset, window_size);
+
+    return msg.status <= FileAckStatus::Cancel;
+}
+
+SerializedMessage serialize(const TraceMessage& msg) {
+    constexpr size_t trace_id_size = sizeof(msg.trace_id);
+    constexpr size_t stamp_size = sizeof(msg.client_send);
+
+    SerializedMessage buffer(trace_id_size + 4 * stamp_size);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.trace_id, trace_id_size);
+    offset += trace_id_size;
+    for (const auto* stamp : {&msg.client_send, &msg.server_receive,
+                              &msg.server_enqueue, &msg.server_write}) {
+        std::memcpy(buffer.data() + offset, stamp, stamp_size);
+        offset += stamp_size;
     }
 
     return buffer;
 }
 
-bool deserialize(const SerializedMessage& buffer, ChatUsersMessage& msg) {
-    unsigned long user_length{0};
-    constexpr size_t user_length_size = sizeof(user_length);
+bool deserialize(const SerializedMessage& buffer, TraceMessage& msg) {
+    constexpr size_t trace_id_size = sizeof(msg.trace_id);
+    constexpr size_t stamp_size = sizeof(msg.client_send);
+
+    if (buffer.size() != trace_id_size + 4 * stamp_size) {
+        return false;
+    }
 
     unsigned offset{0};
-    while (offset < buffer.size()) {
-        std::memcpy(&user_length, buffer.data() + offset, user_length_size);
-        offset += user_length_size;
-        msg.users.emplace_back(buffer.begin() + offset, buffer.begin() + offset + user_length);
-        offset += user_length;
+    std::memcpy(&msg.trace_id, buffer.data() + offset, trace_id_size);
+    offset += trace_id_size;
+    for (auto* stamp : {&msg.client_send, &msg.server_receive,
+                        &msg.server_enqueue, &msg.server_write}) {
+        std::memcpy(stamp, buffer.data() + offset, stamp_size);
+        offset += stamp_size;
     }
+    msg.client_receive = 0;
+
+    return true;
+}
+
+SerializedMessage serialize(const SessionMessage& msg) {
+    constexpr size_t resume_token_size = sizeof(msg.resume_token);
+    constexpr size_t user_id_size = sizeof(msg.user_id);
+    constexpr size_t sequence_size = sizeof(msg.sequence);
+    constexpr size_t is_gap_size = sizeof(msg.is_gap);
+
+    SerializedMessage buffer(resume_token_size + user_id_size + sequence_size +
+                             is_gap_size);
+
+    unsigned offset{0};
+    std::memcpy(buffer.data() + offset, &msg.resume_token, resume_token_size);
+    offset += resume_token_size;
+    std::memcpy(buffer.data() + offset, &msg.user_id, user_id_size);
+    offset += user_id_size;
+    std::memcpy(buffer.data() + offset, &msg.sequence, sequence_size);
+    offset += sequence_size;
+    std::memcpy(buffer.data() + offset, &msg.is_gap, is_gap_size);
 
+    return buffer;
+}
+
+bool deserialize(const SerializedMessage& buffer, SessionMessage& msg) {
+    constexpr size_t resume_token_size = sizeof(msg.resume_token);
+    constexpr size_t user_id_size = sizeof(msg.user_id);
+    constexpr size_t sequence_size = sizeof(msg.sequence);
+    constexpr size_t is_gap_size = sizeof(msg.is_gap);
+
+    if (buffer.size() !=
+        resume_token_size + user_id_size + sequence_size + is_gap_size) {
+        return false;
+    }
+
+    unsigned offset{0};
+    std::memcpy(&msg.resume_token, buffer.data() + offset, resume_token_size);
+    offset += resume_token_size;
+    std::memcpy(&msg.user_id, buffer.data() + offset, user_id_size);
+    offset += user_id_size;
+    std::memcpy(&msg.sequence, buffer.data() + offset, sequence_size);
+    offset += sequence_size;
+    std::memcpy(&msg.is_gap, buffer.data() + offset, is_gap_size);
     return true;
 }
 
@@ -215,7 +905,9 @@ SerializedMessage serialize(const Message& msg) {
     SerializedMessage serialized_message;
 
     auto visitor = [&]<typename MsgType>(const MsgType& msg) {
-        if constexpr (!std::is_same_v<MsgType, PingServerMessage>) {
+        if constexpr (!std::is_same_v<MsgType, PingServerMessage> &&
+                      !std::is_same_v<MsgType, ResyncUsersMessage> &&
+                      !std::is_same_v<MsgType, ShmAttachMessage>) {
             serialized_message = serialize(msg);
         }
 
@@ -232,6 +924,36 @@ SerializedMessage serialize(const Message& msg) {
             type = MessageType::PingServer;
         } else if constexpr (std::is_same_v<MsgType, ChatUsersMessage>) {
             type = MessageType::ChatUsers;
+        } else if constexpr (std::is_same_v<MsgType, SessionMessage>) {
+            type = MessageType::Session;
+        } else if constexpr (std::is_same_v<MsgType, UserJoinedMessage>) {
+            type = MessageType::UserJoined;
+        } else if constexpr (std::is_same_v<MsgType, UserLeftMessage>) {
+            type = MessageType::UserLeft;
+        } else if constexpr (std::is_same_v<MsgType, ResyncUsersMessage>) {
+            type = MessageType::ResyncUsers;
+        } else if constexpr (std::is_same_v<MsgType, SearchRequestMessage>) {
+            type = MessageType::SearchRequest;
+        } else if constexpr (std::is_same_v<MsgType, SearchResponseMessage>) {
+            type = MessageType::SearchResponse;
+        } else if constexpr (std::is_same_v<MsgType, OfflineMessage>) {
+            type = MessageType::OfflineMessage;
+        } else if constexpr (std::is_same_v<MsgType, DeliveryStatusMessage>) {
+            type = MessageType::DeliveryStatus;
+        } else if constexpr (std::is_same_v<MsgType, PeerHelloMessage>) {
+            type = MessageType::PeerHello;
+        } else if constexpr (std::is_same_v<MsgType, PeerMailboxMessage>) {
+            type = MessageType::PeerMailbox;
+        } else if constexpr (std::is_same_v<MsgType, ShmAttachMessage>) {
+            type = MessageType::ShmAttach;
+        } else if constexpr (std::is_same_v<MsgType, FileOfferMessage>) {
+            type = MessageType::FileOffer;
+        } else if constexpr (std::is_same_v<MsgType, FileChunkMessage>) {
+            type = MessageType::FileChunk;
+        } else if constexpr (std::is_same_v<MsgType, FileAckMessage>) {
+            type = MessageType::FileAck;
+        } else if constexpr (std::is_same_v<MsgType, TraceMessage>) {
+            type = MessageType::Trace;
         }
 
         header = {.type = std::move(type),
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <array>
 #include <cassert>
 #include <cstdint>
 #include <cstring>
+#include <memory_resource>
 #include <string>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
@@ -14,6 +17,23 @@ enum class MessageType {
     PrivateMessage,
     PingServer,
     ChatUsers,
+    Session,
+    UserJoined,
+    UserLeft,
+    ResyncUsers,
+    SearchRequest,
+    SearchResponse,
+    OfflineMessage,
+    DeliveryStatus,
+    PeerHello,
+    PeerMailbox,
+    ShmAttach,
+    FileOffer,
+    FileChunk,
+    FileAck,
+    Trace,
+    // Deflated frames, see FrameCompression.
+    Compressed,
 };
 
 struct MessageHeader {
@@ -23,37 +43,58 @@ struct MessageHeader {
 
 using SerializedMessage = std::vector<uint8_t>;
 
+// Compact id the server assigns to a user at join. 0 never names a user.
+using UserId = uint32_t;
+constexpr UserId InvalidUserId = 0;
+
 SerializedMessage serialize(const MessageHeader& header);
 bool deserialize(const SerializedMessage& buffer, MessageHeader& header);
 
 constexpr size_t MessageHeaderSize = sizeof(MessageHeader);
 
+// Compression of the frames a client can read.
+enum class Compression : uint8_t { None, Zlib };
+
 struct ConnectMessage {
-    std::string nick;
+    std::pmr::string nick;
+    // Token received in SessionMessage, 0 when joining with a new session.
+    uint64_t resume_token{0};
+    // Sequence of the last TextMessage/PrivateMessage seen by the client.
+    uint64_t last_sequence{0};
+    Compression compression{Compression::None};
 };
 
 SerializedMessage serialize(const ConnectMessage& msg);
 bool deserialize(const SerializedMessage& buffer, ConnectMessage& msg);
 
 struct DisconnectMessage {
-    std::string nick;
+    std::pmr::string nick;
 };
 
 SerializedMessage serialize(const DisconnectMessage& msg);
 bool deserialize(const SerializedMessage& buffer, DisconnectMessage& msg);
 
 struct TextMessage {
-    std::string from;
-    std::string message;
+    // Filled in by the server from the sending connection.
+    UserId from{InvalidUserId};
+    std::pmr::string message;
+    // Assigned by the server, 0 on frames sent by the client.
+    uint64_t sequence{0};
 };
 
 SerializedMessage serialize(const TextMessage& msg);
 bool deserialize(const SerializedMessage& buffer, TextMessage& msg);
 
 struct PrivateMessage {
-    std::string from;
-    std::string to;
-    std::string message;
+    // Filled in by the server from the sending connection.
+    UserId from{InvalidUserId};
+    UserId to{InvalidUserId};
+    // Set by the client, the server falls back to it when `to` is not online
+    // and queues the message for the nick if nobody by that name is joined.
+    std::pmr::string to_nick;
+    std::pmr::string message;
+    // Assigned by the server, 0 on frames sent by the client.
+    uint64_t sequence{0};
 };
 
 SerializedMessage serialize(const PrivateMessage& msg);
@@ -61,13 +102,268 @@ bool deserialize(const SerializedMessage& buffer, PrivateMessage& msg);
 
 struct PingServerMessage {};
 
+// Full roster snapshot, sent on join and on ResyncUsers. Later changes arrive
+// as UserJoined/UserLeft deltas, each bumping `version` by one.
+struct ChatUser {
+    UserId id;
+    std::pmr::string nick;
+};
+
 struct ChatUsersMessage {
-    std::vector<std::string> users;
+    uint64_t version{0};
+    std::pmr::vector<ChatUser> users;
 };
 
 SerializedMessage serialize(const ChatUsersMessage& msg);
 bool deserialize(const SerializedMessage& buffer, ChatUsersMessage& msg);
 
-using Message = std::variant<ConnectMessage, TextMessage, DisconnectMessage, PrivateMessage, PingServerMessage, ChatUsersMessage>;
+// Announces the id to nick mapping, later frames only carry the id.
+struct UserJoinedMessage {
+    uint64_t version;
+    UserId id;
+    std::pmr::string nick;
+};
+
+SerializedMessage serialize(const UserJoinedMessage& msg);
+bool deserialize(const SerializedMessage& buffer, UserJoinedMessage& msg);
+
+struct UserLeftMessage {
+    uint64_t version;
+    UserId id;
+};
+
+SerializedMessage serialize(const UserLeftMessage& msg);
+bool deserialize(const SerializedMessage& buffer, UserLeftMessage& msg);
+
+// Sent by a client that noticed a roster version gap, answered with a
+// ChatUsersMessage snapshot.
+struct ResyncUsersMessage {};
+
+struct SearchRequestMessage {
+    // Echoed back in the response.
+    uint32_t request_id;
+    std::pmr::string query;
+};
+
+SerializedMessage serialize(const SearchRequestMessage& msg);
+bool deserialize(const SerializedMessage& buffer, SearchRequestMessage& msg);
+
+struct SearchResult {
+    uint64_t sequence;
+    // Nick of the sender at the time the message was sent.
+    std::pmr::string from;
+    std::pmr::string message;
+};
+
+struct SearchResponseMessage {
+    uint32_t request_id;
+    // Newest first.
+    std::pmr::vector<SearchResult> results;
+};
+
+SerializedMessage serialize(const SearchResponseMessage& msg);
+bool deserialize(const SerializedMessage& buffer, SearchResponseMessage& msg);
+
+// Private message that was queued while the recipient was offline. Carries
+// the sender nick since the sender may have left by now.
+struct OfflineMessage {
+    std::pmr::string from;
+    std::pmr::string message;
+    // Seconds since the Unix epoch when the server queued it.
+    int64_t sent_at;
+};
+
+SerializedMessage serialize(const OfflineMessage& msg);
+bool deserialize(const SerializedMessage& buffer, OfflineMessage& msg);
+
+enum class DeliveryStatus : uint8_t {
+    // Handed to the online recipient.
+    Sent,
+    // Queued until the recipient joins.
+    Stored,
+    // Queued messages were handed to the recipient.
+    Delivered,
+    // Recipient unknown or its mailbox is full.
+    Rejected,
+};
+
+// Tells the sender of private messages what became of them.
+struct DeliveryStatusMessage {
+    std::pmr::string to;
+    DeliveryStatus status;
+    uint32_t count;
+};
+
+SerializedMessage serialize(const DeliveryStatusMessage& msg);
+bool deserialize(const SerializedMessage& buffer, DeliveryStatusMessage& msg);
+
+// First frames on a link between federated servers. Each side opens with
+// its node id, a fresh nonce and a zero proof, then answers the hello of
+// the other side with a second one proving it knows the mesh's secret: the
+// HMAC-SHA256 of the other side's nonce and its own node id.
+struct PeerHelloMessage {
+    uint16_t node_id;
+    std::array<uint8_t, 16> nonce;
+    std::array<uint8_t, 32> proof;
+};
+
+SerializedMessage serialize(const PeerHelloMessage& msg);
+bool deserialize(const SerializedMessage& buffer, PeerHelloMessage& msg);
+
+// Serialized OfflineMessage frames queued on one server for a user joined on
+// another.
+struct PeerMailboxMessage {
+    UserId to;
+    SerializedMessage frames;
+};
+
+SerializedMessage serialize(const PeerMailboxMessage& msg);
+bool deserialize(const SerializedMessage& buffer, PeerMailboxMessage& msg);
+
+// Sent by a client on the unix socket, before it joins, to move its frames
+// to a shared memory channel. The server answers with the same frame, which
+// carries the channel descriptors (see ShmChannel) unless it refused.
+struct ShmAttachMessage {};
+
+// Announces a file (or a long paste) `from` is about to stream to `to`.
+// The recipient answers with a FileAckMessage granting a window, chunks
+// follow as the window allows. A transfer is named by its sender and
+// `transfer_id`.
+struct FileOfferMessage {
+    // Filled in by the server from the sending connection.
+    UserId from{InvalidUserId};
+    UserId to{InvalidUserId};
+    // Chosen by the sender, unique among its open transfers.
+    uint32_t transfer_id;
+    uint64_t size;
+    // File name without directories.
+    std::pmr::string name;
+};
+
+SerializedMessage serialize(const FileOfferMessage& msg);
+bool deserialize(const SerializedMessage& buffer, FileOfferMessage& msg);
+
+// Largest `data` of a FileChunkMessage.
+constexpr size_t FileChunkSize = 16 << 10;
+
+struct FileChunkMessage {
+    // Filled in by the server from the sending connection.
+    UserId from{InvalidUserId};
+    uint32_t transfer_id;
+    uint64_t offset;
+    // CRC-32 of `data`, checked by the recipient.
+    uint32_t checksum;
+    // Fill it with resize and memcpy, and move rather than copy it: through
+    // a polymorphic allocator bytes are copied one at a time.
+    std::pmr::vector<uint8_t> data;
+};
+
+SerializedMessage serialize(const FileChunkMessage& msg);
+bool deserialize(const SerializedMessage& buffer, FileChunkMessage& msg);
+
+enum class FileAckStatus : uint8_t {
+    // The sender may send up to `received` + `window`.
+    Window,
+    // The transfer is over, declined or aborted by either side or by the
+    // server.
+    Cancel,
+};
+
+// Credit from the recipient to the sender, or a cancel in either direction.
+// The server forwards it to the other side of the transfer.
+struct FileAckMessage {
+    // Sender of the transfer, `transfer_id` is unique among its transfers.
+    UserId sender{InvalidUserId};
+    uint32_t transfer_id;
+    FileAckStatus status;
+    // Bytes the recipient has received and stored, in order.
+    uint64_t received;
+    uint32_t window;
+};
+
+SerializedMessage serialize(const FileAckMessage& msg);
+bool deserialize(const SerializedMessage& buffer, FileAckMessage& msg);
+
+// Sent right before a chat or private message to trace it, and forwarded
+// right before it. Stamps are nanoseconds of the system clock of the host
+// that took them, 0 until taken.
+struct TraceMessage {
+    // Chosen by the sending client.
+    uint64_t trace_id{0};
+    int64_t client_send{0};
+    // When the server read the trace, and when it queued the message for
+    // the recipients.
+    int64_t server_receive{0};
+    int64_t server_enqueue{0};
+    // When the server handed the write carrying the message to the socket.
+    int64_t server_write{0};
+    // Taken by the receiving client, never sent.
+    int64_t client_receive{0};
+};
+
+SerializedMessage serialize(const TraceMessage& msg);
+bool deserialize(const SerializedMessage& buffer, TraceMessage& msg);
+
+struct SessionMessage {
+    uint64_t resume_token;
+    UserId user_id;
+    // Sequence after which the server replays (or starts delivering) frames.
+    uint64_t sequence;
+    // Set on a resume from further back than the server keeps messages,
+    // some of the ones sent in between are lost.
+    bool is_gap{false};
+};
+
+SerializedMessage serialize(const SessionMessage& msg);
+bool deserialize(const SerializedMessage& buffer, SessionMessage& msg);
+
+using Message = std::variant<ConnectMessage, TextMessage, DisconnectMessage, PrivateMessage, PingServerMessage, ChatUsersMessage, SessionMessage, UserJoinedMessage, UserLeftMessage, ResyncUsersMessage, SearchRequestMessage, SearchResponseMessage, OfflineMessage, DeliveryStatusMessage, PeerHelloMessage, PeerMailboxMessage, ShmAttachMessage, FileOfferMessage, FileChunkMessage, FileAckMessage, TraceMessage>;
 
 SerializedMessage serialize(const Message& msg);
+
+// An empty message whose strings and vectors allocate from `resource`, for
+// decoding a frame that is dropped once handled (see FrameArena). Copies
+// allocate from the default resource again, moves keep `resource`.
+template <typename T>
+T make_message(std::pmr::memory_resource* resource) {
+    const std::pmr::polymorphic_allocator<> allocator{resource};
+    if constexpr (std::is_same_v<T, ConnectMessage> ||
+                  std::is_same_v<T, DisconnectMessage>) {
+        return T{.nick = std::pmr::string{allocator}};
+    } else if constexpr (std::is_same_v<T, UserJoinedMessage>) {
+        return T{.version = 0,
+                 .id = InvalidUserId,
+                 .nick = std::pmr::string{allocator}};
+    } else if constexpr (std::is_same_v<T, TextMessage>) {
+        return T{.message = std::pmr::string{allocator}};
+    } else if constexpr (std::is_same_v<T, PrivateMessage>) {
+        return T{.to_nick = std::pmr::string{allocator},
+                 .message = std::pmr::string{allocator}};
+    } else if constexpr (std::is_same_v<T, ChatUsersMessage>) {
+        return T{.users = std::pmr::vector<ChatUser>{allocator}};
+    } else if constexpr (std::is_same_v<T, SearchRequestMessage>) {
+        return T{.request_id = 0, .query = std::pmr::string{allocator}};
+    } else if constexpr (std::is_same_v<T, SearchResponseMessage>) {
+        return T{.request_id = 0,
+                 .results = std::pmr::vector<SearchResult>{allocator}};
+    } else if constexpr (std::is_same_v<T, OfflineMessage>) {
+        return T{.from = std::pmr::string{allocator},
+                 .message = std::pmr::string{allocator},
+                 .sent_at = 0};
+    } else if constexpr (std::is_same_v<T, DeliveryStatusMessage>) {
+        return T{.to = std::pmr::string{allocator},
+                 .status = DeliveryStatus::Sent,
+                 .count = 0};
+    } else if constexpr (std::is_same_v<T, FileOfferMessage>) {
+        return T{.transfer_id = 0,
+                 .size = 0,
+                 .name = std::pmr::string{allocator}};
+    } else if constexpr (std::is_same_v<T, FileChunkMessage>) {
+        return T{.transfer_id = 0,
+                 .offset = 0,
+                 .checksum = 0,
+                 .data = std::pmr::vector<uint8_t>{allocator}};
+    } else {
+        return T{};
+    }
+}
@@ -0,0 +1,346 @@
+#include "ShmChannel.hpp"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <new>
+
+struct ShmChannel::RingControl {
+    // Bytes written so far, only advanced by the producer.
+    alignas(64) std::atomic<uint64_t> head;
+    // Bytes read so far, only advanced by the consumer.
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> is_reader_waiting;
+    std::atomic<uint32_t> is_writer_waiting;
+};
+
+struct ShmChannel::SharedHeader {
+    uint64_t capacity;
+    // Client to server, then server to client. The data of both rings
+    // follows the header.
+    RingControl rings[2];
+};
+
+namespace {
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "rings are shared between processes");
+
+void copy_in(uint8_t* data, size_t capacity, uint64_t position,
+             const uint8_t* bytes, size_t size) {
+    const size_t offset = position & (capacity - 1);
+    const size_t first = std::min(size, capacity - offset);
+    std::memcpy(data + offset, bytes, first);
+    std::memcpy(data, bytes + first, size - first);
+}
+
+void copy_out(const uint8_t* data, size_t capacity, uint64_t position,
+              uint8_t* bytes, size_t size) {
+    const size_t offset = position & (capacity - 1);
+    const size_t first = std::min(size, capacity - offset);
+    std::memcpy(bytes, data + offset, first);
+    std::memcpy(bytes + first, data, size - first);
+}
+
+// The size is fixed once the server has set it. A memfd shrunk by the client
+// would make the next access of the mapping fault with SIGBUS.
+constexpr int RequiredSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+void close_descriptor(int fd) {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+} // namespace
+
+ShmChannel::ShmChannel(bool is_server, const Descriptors& descriptors)
+    : is_server_(is_server), memory_fd_(descriptors[0]),
+      server_event_fd_(descriptors[1]), client_event_fd_(descriptors[2]) {
+}
+
+ShmChannel::~ShmChannel() {
+    if (mapping_) {
+        ::munmap(mapping_, mapping_size_);
+    }
+    close_descriptor(memory_fd_);
+    close_descriptor(server_event_fd_);
+    close_descriptor(client_event_fd_);
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::create(size_t ring_capacity) {
+    const Descriptors descriptors{
+        ::memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING),
+        ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+        ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)};
+    std::unique_ptr<ShmChannel> channel{new ShmChannel{true, descriptors}};
+    if (std::ranges::find(descriptors, -1) != std::ranges::end(descriptors)) {
+        return nullptr;
+    }
+
+    const size_t capacity = std::bit_ceil(std::max<size_t>(ring_capacity, 64));
+    if (::ftruncate(channel->memory_fd_,
+                    static_cast<off_t>(sizeof(SharedHeader) + 2 * capacity)) !=
+            0 ||
+        ::fcntl(channel->memory_fd_, F_ADD_SEALS, RequiredSeals) != 0 ||
+        !channel->map(capacity)) {
+        return nullptr;
+    }
+    return channel;
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::attach(const Descriptors& descriptors) {
+    std::unique_ptr<ShmChannel> channel{new ShmChannel{false, descriptors}};
+    const int seals = ::fcntl(channel->memory_fd_, F_GET_SEALS);
+    if (seals < 0 || (seals & RequiredSeals) != RequiredSeals) {
+        return nullptr;
+    }
+    struct stat status{};
+    if (::fstat(channel->memory_fd_, &status) != 0 ||
+        static_cast<size_t>(status.st_size) <= sizeof(SharedHeader)) {
+        return nullptr;
+    }
+
+    const size_t capacity =
+        (static_cast<size_t>(status.st_size) - sizeof(SharedHeader)) / 2;
+    if (!std::has_single_bit(capacity) || !channel->map(capacity)) {
+        return nullptr;
+    }
+    return channel;
+}
+
+bool ShmChannel::map(size_t ring_capacity) {
+    mapping_size_ = sizeof(SharedHeader) + 2 * ring_capacity;
+    void* mapping = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, memory_fd_, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    mapping_ = mapping;
+    capacity_ = ring_capacity;
+
+    // A fresh memfd is zero filled, which is the empty state of both rings.
+    auto* header = is_server_ ? new (mapping_) SharedHeader{}
+                              : static_cast<SharedHeader*>(mapping_);
+    if (is_server_) {
+        header->capacity = ring_capacity;
+    } else if (header->capacity != ring_capacity) {
+        return false;
+    }
+
+    auto* data = static_cast<uint8_t*>(mapping_) + sizeof(SharedHeader);
+    const Ring to_server{.control = &header->rings[0], .data = data};
+    const Ring to_client{.control = &header->rings[1],
+                         .data = data + ring_capacity};
+    in_ = is_server_ ? to_server : to_client;
+    out_ = is_server_ ? to_client : to_server;
+    in_tail_ = in_.control->tail.load(std::memory_order_relaxed);
+    out_head_ = out_.control->head.load(std::memory_order_relaxed);
+    return true;
+}
+
+std::optional<size_t> ShmChannel::write(std::span<const uint8_t> bytes) {
+    auto& control = *out_.control;
+    const auto head = out_head_;
+    const auto tail = control.tail.load(std::memory_order_acquire);
+    // A tail past the head or more than a ring behind it would make the
+    // room below wrap around.
+    if (tail > head || head - tail > capacity_) {
+        return std::nullopt;
+    }
+    const size_t size =
+        std::min<size_t>(bytes.size(), capacity_ - (head - tail));
+    if (size == 0) {
+        return 0;
+    }
+
+    copy_in(out_.data, capacity_, head, bytes.data(), size);
+    out_head_ = head + size;
+    control.head.store(out_head_, std::memory_order_release);
+
+    // Pairs with the fence in prepare_wait: either the reader sees the new
+    // head, or this sees its flag.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (control.is_reader_waiting.load(std::memory_order_relaxed) &&
+        control.is_reader_waiting.exchange(0)) {
+        wake_other_side();
+    }
+    return size;
+}
+
+ShmChannel::ReadResult ShmChannel::read(SerializedMessage& frame,
+                                        size_t max_body_size) {
+    auto& control = *in_.control;
+    const auto tail = in_tail_;
+    const auto head = control.head.load(std::memory_order_acquire);
+    if (head < tail || head - tail > capacity_) {
+        return ReadResult::Invalid;
+    }
+
+    uint64_t consumed{0};
+    const auto take = [&](size_t wanted) {
+        const size_t size = std::min<size_t>(wanted, head - tail - consumed);
+        const size_t offset = partial_.size();
+        partial_.resize(offset + size);
+        copy_out(in_.data, capacity_, tail + consumed, partial_.data() + offset,
+                 size);
+        consumed += size;
+    };
+
+    size_t frame_size{0};
+    if (partial_.size() < MessageHeaderSize) {
+        take(MessageHeaderSize - partial_.size());
+    }
+    if (partial_.size() >= MessageHeaderSize) {
+        MessageHeader header{};
+        std::memcpy(&header, partial_.data(), MessageHeaderSize);
+        if (header.body_size > max_body_size) {
+            return ReadResult::Invalid;
+        }
+        frame_size = MessageHeaderSize + header.body_size;
+        take(frame_size - partial_.size());
+    }
+
+    if (consumed != 0) {
+        in_tail_ = tail + consumed;
+        control.tail.store(in_tail_, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (control.is_writer_waiting.load(std::memory_order_relaxed) &&
+            control.is_writer_waiting.exchange(0)) {
+            wake_other_side();
+        }
+    }
+
+    if (frame_size == 0 || partial_.size() < frame_size) {
+        return ReadResult::Empty;
+    }
+    frame.swap(partial_);
+    partial_.clear();
+    return ReadResult::Frame;
+}
+
+bool ShmChannel::prepare_wait(bool for_frame, bool for_room) {
+    if (for_frame) {
+        in_.control->is_reader_waiting.store(1, std::memory_order_relaxed);
+    }
+    if (for_room) {
+        out_.control->is_writer_waiting.store(1, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // A broken ring counts as ready, the next read or write reports it.
+    const bool has_frame =
+        for_frame &&
+        in_.control->head.load(std::memory_order_acquire) != in_tail_;
+    const bool has_room =
+        for_room &&
+        out_head_ - out_.control->tail.load(std::memory_order_acquire) !=
+            capacity_;
+    if (!has_frame && !has_room) {
+        return true;
+    }
+
+    // A wakeup the other side sends meanwhile only costs a spurious loop.
+    if (for_frame) {
+        in_.control->is_reader_waiting.store(0, std::memory_order_relaxed);
+    }
+    if (for_room) {
+        out_.control->is_writer_waiting.store(0, std::memory_order_relaxed);
+    }
+    return false;
+}
+
+void ShmChannel::consume_event() {
+    uint64_t count{0};
+    [[maybe_unused]] const auto result =
+        ::read(get_event_fd(), &count, sizeof(count));
+}
+
+void ShmChannel::wake_other_side() {
+    const uint64_t count{1};
+    [[maybe_unused]] const auto result =
+        ::write(is_server_ ? client_event_fd_ : server_event_fd_, &count,
+                sizeof(count));
+}
+
+bool send_descriptors(int socket, std::span<const uint8_t> bytes,
+                      std::span<const int> descriptors) {
+    iovec io{.iov_base = const_cast<uint8_t*>(bytes.data()),
+             .iov_len = bytes.size()};
+    alignas(cmsghdr) char control[CMSG_SPACE(
+        sizeof(int) * ShmChannel::DescriptorsCount)]{};
+    const size_t descriptors_size = sizeof(int) * descriptors.size();
+    if (CMSG_SPACE(descriptors_size) > sizeof(control)) {
+        return false;
+    }
+
+    msghdr message{};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    if (!descriptors.empty()) {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(descriptors_size);
+        auto* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(descriptors_size);
+        std::memcpy(CMSG_DATA(header), descriptors.data(), descriptors_size);
+    }
+
+    const auto sent = ::sendmsg(socket, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return sent == static_cast<ssize_t>(bytes.size());
+}
+
+int receive_descriptors(int socket, std::span<uint8_t> bytes,
+                        std::span<int> descriptors) {
+    iovec io{.iov_base = bytes.data(), .iov_len = bytes.size()};
+    alignas(cmsghdr) char control[CMSG_SPACE(
+        sizeof(int) * ShmChannel::DescriptorsCount)]{};
+
+    msghdr message{};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    const auto received = ::recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    if (received <= 0) {
+        return -1;
+    }
+
+    int count{0};
+    for (auto* header = CMSG_FIRSTHDR(&message); header;
+         header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET ||
+            header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const auto received_count =
+            (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < received_count; ++i) {
+            int fd{-1};
+            std::memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(fd));
+            if (static_cast<size_t>(count) < descriptors.size()) {
+                descriptors[count++] = fd;
+            } else {
+                ::close(fd);
+            }
+        }
+    }
+
+    for (auto offset = static_cast<size_t>(received); offset < bytes.size();) {
+        const auto more =
+            ::recv(socket, bytes.data() + offset, bytes.size() - offset, 0);
+        if (more <= 0) {
+            std::ranges::for_each(descriptors.first(count), ::close);
+            return -1;
+        }
+        offset += static_cast<size_t>(more);
+    }
+    return count;
+}
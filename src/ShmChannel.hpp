@@ -0,0 +1,110 @@
+#pragma once
+
+#include "Message.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+
+// Shared memory transport between the server and one client on the same
+// host. Two single-producer single-consumer byte rings in a memfd carry the
+// same frames as the socket, one per direction. Frames may be split across
+// writes when a ring is short of room and are reassembled by the reader.
+//
+// Each side sleeps on its own eventfd. Writers only signal it after the
+// other side announced a wait (see prepare_wait), so a producer and a
+// consumer that keep up with each other exchange frames without a single
+// system call.
+//
+// The server creates the channel and hands its descriptors to the client
+// over the unix socket (see ShmAttachMessage and send_descriptors). The
+// memfd is sealed against resizing before that, so a client can not make
+// the server's mapping fault, and attach() refuses one that is not.
+class ShmChannel {
+public:
+    // The memfd, the server eventfd and the client eventfd.
+    static constexpr size_t DescriptorsCount = 3;
+    using Descriptors = std::array<int, DescriptorsCount>;
+
+    enum class ReadResult {
+        Frame,
+        // Nothing or only part of a frame was available.
+        Empty,
+        // The other side wrote a body over the limit or broke the ring.
+        Invalid,
+    };
+
+    // Server side. `ring_capacity` is rounded up to a power of two, nullptr
+    // if the memfd or eventfds could not be created.
+    static std::unique_ptr<ShmChannel> create(size_t ring_capacity);
+    // Client side, takes ownership of the received descriptors.
+    static std::unique_ptr<ShmChannel> attach(const Descriptors& descriptors);
+
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+    ~ShmChannel();
+
+    // Appends as much of `bytes` as the ring has room for, returns how much.
+    // nullopt if the other side broke the ring.
+    std::optional<size_t> write(std::span<const uint8_t> bytes);
+    // Moves the next whole frame into `frame`.
+    ReadResult read(SerializedMessage& frame, size_t max_body_size);
+
+    // Announces that the caller is about to sleep on get_event_fd() until a
+    // frame arrives and/or the other side frees room to write. False if that
+    // already happened, then the caller must not sleep.
+    bool prepare_wait(bool for_frame, bool for_room);
+    // Resets the eventfd after a wakeup.
+    void consume_event();
+
+    int get_event_fd() const {
+        return is_server_ ? server_event_fd_ : client_event_fd_;
+    }
+
+    // Descriptors for attach() on the other side, still owned by the channel.
+    Descriptors get_descriptors() const {
+        return {memory_fd_, server_event_fd_, client_event_fd_};
+    }
+
+private:
+    struct RingControl;
+    struct SharedHeader;
+
+    struct Ring {
+        RingControl* control;
+        uint8_t* data;
+    };
+
+    ShmChannel(bool is_server, const Descriptors& descriptors);
+    bool map(size_t ring_capacity);
+    void wake_other_side();
+
+    bool is_server_;
+    int memory_fd_;
+    int server_event_fd_;
+    int client_event_fd_;
+    void* mapping_{nullptr};
+    size_t mapping_size_{0};
+    size_t capacity_{0};
+    Ring in_{};
+    Ring out_{};
+    // Own copies of the counters only this side advances. The other side
+    // can write anything to the shared ones.
+    uint64_t in_tail_{0};
+    uint64_t out_head_{0};
+    // Bytes of the frame being reassembled.
+    SerializedMessage partial_;
+};
+
+// Sends `bytes` on a unix stream socket with `descriptors` attached
+// (SCM_RIGHTS). False unless all of it went out in one call.
+bool send_descriptors(int socket, std::span<const uint8_t> bytes,
+                      std::span<const int> descriptors);
+
+// Blocking counterpart of send_descriptors, reads exactly `bytes.size()`
+// bytes. Returns how many descriptors arrived, or -1 on error.
+int receive_descriptors(int socket, std::span<uint8_t> bytes,
+                        std::span<int> descriptors);
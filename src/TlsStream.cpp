@@ -0,0 +1,135 @@
+#include "TlsStream.hpp"
+
+#include <openssl/x509v3.h>
+
+#include <cerrno>
+
+namespace {
+// Full handshakes the server remembers for resumption by session id.
+// Clients offering a ticket do not need an entry.
+constexpr long ServerSessionCacheSize = 20000;
+
+// Index of the owning TlsStream in the SSL ex data, for callbacks.
+int stream_index() {
+    static const int index =
+        SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+void set_common_options(asio::ssl::context& context) {
+    context.set_options(asio::ssl::context::default_workarounds |
+                        asio::ssl::context::no_sslv2 |
+                        asio::ssl::context::no_sslv3 |
+                        asio::ssl::context::no_tlsv1 |
+                        asio::ssl::context::no_tlsv1_1);
+    SSL_CTX_set_options(context.native_handle(), SSL_OP_ENABLE_KTLS);
+}
+} // namespace
+
+void TlsStream::configure_server(asio::ssl::context& context,
+                                 const std::string& certificate_file,
+                                 const std::string& private_key_file) {
+    set_common_options(context);
+    context.use_certificate_chain_file(certificate_file);
+    context.use_private_key_file(private_key_file, asio::ssl::context::pem);
+
+    auto* native = context.native_handle();
+    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(native, ServerSessionCacheSize);
+}
+
+void TlsStream::configure_client(asio::ssl::context& context,
+                                 const std::string& ca_file) {
+    set_common_options(context);
+    context.load_verify_file(ca_file);
+    context.set_verify_mode(asio::ssl::verify_peer);
+
+    // Tickets arrive after the handshake, they are kept by the stream that
+    // received them rather than in a cache shared by all connections.
+    auto* native = context.native_handle();
+    SSL_CTX_set_session_cache_mode(
+        native, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(native, &TlsStream::handle_new_session);
+}
+
+TlsStream::TlsStream(Socket& socket, asio::ssl::context& context,
+                     bool is_server)
+    : socket_(socket), ssl_(SSL_new(context.native_handle())) {
+    if (!ssl_) {
+        throw asio::system_error{
+            asio::error_code{static_cast<int>(ERR_get_error()),
+                             asio::error::get_ssl_category()}};
+    }
+    // OpenSSL reads and writes the descriptor itself.
+    socket_.non_blocking(true);
+    SSL_set_fd(ssl_, socket_.native_handle());
+    SSL_set_ex_data(ssl_, stream_index(), this);
+    if (is_server) {
+        SSL_set_accept_state(ssl_);
+    } else {
+        SSL_set_connect_state(ssl_);
+    }
+}
+
+TlsStream::TlsStream(Socket& socket, asio::ssl::context& context)
+    : TlsStream(socket, context, true) {
+}
+
+TlsStream::TlsStream(Socket& socket, asio::ssl::context& context,
+                     const std::string& host, Session session)
+    : TlsStream(socket, context, false) {
+    // Accepts either form, only one of them applies to `host`.
+    if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl_), host.c_str()) !=
+        1) {
+        SSL_set_tlsext_host_name(ssl_, host.c_str());
+        SSL_set1_host(ssl_, host.c_str());
+    }
+    if (session) {
+        SSL_set_session(ssl_, session.get());
+        session_ = std::move(session);
+    }
+}
+
+TlsStream::~TlsStream() {
+    // Connections mostly end with the socket being closed. OpenSSL would take
+    // that for a failure and keep the session from being resumed.
+    SSL_set_shutdown(ssl_, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(ssl_);
+}
+
+void TlsStream::shutdown() {
+    ERR_clear_error();
+    SSL_shutdown(ssl_);
+}
+
+int TlsStream::handle_new_session(SSL* ssl, SSL_SESSION* session) {
+    auto* stream = static_cast<TlsStream*>(SSL_get_ex_data(ssl, stream_index()));
+    if (!stream) {
+        return 0;
+    }
+    // Takes over the reference OpenSSL passes in.
+    stream->session_ = Session{session, &SSL_SESSION_free};
+    return 1;
+}
+
+std::optional<TlsStream::Socket::wait_type>
+TlsStream::classify(int result, asio::error_code& ec) const {
+    switch (SSL_get_error(ssl_, result)) {
+        case SSL_ERROR_WANT_READ:
+            return Socket::wait_read;
+        case SSL_ERROR_WANT_WRITE:
+            return Socket::wait_write;
+        case SSL_ERROR_ZERO_RETURN:
+            ec = asio::error::eof;
+            return std::nullopt;
+        case SSL_ERROR_SYSCALL:
+            // No errno means the peer closed without close_notify.
+            ec = errno != 0 ? asio::error_code{errno, asio::system_category()}
+                            : asio::error_code{asio::error::eof};
+            return std::nullopt;
+        default:
+            ec = asio::error_code{static_cast<int>(ERR_get_error()),
+                                  asio::error::get_ssl_category()};
+            return std::nullopt;
+    }
+}
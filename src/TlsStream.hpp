@@ -0,0 +1,165 @@
+#pragma once
+
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+
+// TLS on a connected stream socket, usable with asio::async_read and
+// asio::async_write like the socket itself.
+//
+// asio::ssl::stream feeds OpenSSL through memory BIOs, which keeps OpenSSL
+// from handing the record encryption to the kernel. Here OpenSSL works on
+// the socket descriptor instead, so after the handshake it can switch the
+// socket to kernel TLS (kTLS) where the kernel supports it. Writes then go
+// to the socket as they are and the kernel encrypts them, without another
+// pass through user space. Otherwise every read and write goes through
+// SSL_read/SSL_write, retried whenever the socket becomes ready.
+//
+// Like SSL_write, only one write may be in flight at a time. OpenSSL writes
+// the descriptor with write(), not send(MSG_NOSIGNAL), so programs using
+// this must ignore SIGPIPE or be killed by a peer that went away.
+class TlsStream {
+public:
+    using Socket = asio::generic::stream_protocol::socket;
+    using executor_type = Socket::executor_type;
+    // Ticket of an earlier connection, offered by a client to resume it.
+    using Session = std::shared_ptr<SSL_SESSION>;
+
+    // Loads the certificate chain and key of a server, both PEM. Throws
+    // asio::system_error if they cannot be used.
+    static void configure_server(asio::ssl::context& context,
+                                 const std::string& certificate_file,
+                                 const std::string& private_key_file);
+    // Trusts the certificates in `ca_file` (PEM) for verifying servers.
+    static void configure_client(asio::ssl::context& context,
+                                 const std::string& ca_file);
+
+    // Server side.
+    TlsStream(Socket& socket, asio::ssl::context& context);
+    // Client side, the server certificate must name `host` (an IP address
+    // or DNS name). `session` may be null.
+    TlsStream(Socket& socket, asio::ssl::context& context,
+              const std::string& host, Session session);
+
+    TlsStream(const TlsStream&) = delete;
+    TlsStream& operator=(const TlsStream&) = delete;
+    ~TlsStream();
+
+    executor_type get_executor() {
+        return socket_.get_executor();
+    }
+
+    template <typename Handler>
+    void async_handshake(Handler&& handler) {
+        async_call(
+            [this](size_t&) {
+                const int result = SSL_do_handshake(ssl_);
+                if (result == 1) {
+                    is_ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+                }
+                return result;
+            },
+            [handler = std::forward<Handler>(handler)](
+                asio::error_code ec, size_t) mutable { handler(ec); });
+    }
+
+    template <typename MutableBuffers, typename Handler>
+    void async_read_some(const MutableBuffers& buffers, Handler&& handler) {
+        const asio::mutable_buffer buffer = *asio::buffer_sequence_begin(buffers);
+        async_call(
+            [this, buffer](size_t& bytes) {
+                return SSL_read_ex(ssl_, buffer.data(), buffer.size(), &bytes);
+            },
+            std::forward<Handler>(handler));
+    }
+
+    template <typename ConstBuffers, typename Handler>
+    void async_write_some(const ConstBuffers& buffers, Handler&& handler) {
+        if (is_ktls_send_) {
+            socket_.async_write_some(buffers, std::forward<Handler>(handler));
+            return;
+        }
+        const asio::const_buffer buffer = *asio::buffer_sequence_begin(buffers);
+        async_call(
+            [this, buffer](size_t& bytes) {
+                return SSL_write_ex(ssl_, buffer.data(), buffer.size(), &bytes);
+            },
+            std::forward<Handler>(handler));
+    }
+
+    // Sends close_notify if the socket takes it right away.
+    void shutdown();
+
+    // Valid once the handshake completed.
+    bool is_ktls_send() const {
+        return is_ktls_send_;
+    }
+
+    bool is_resumed() const {
+        return SSL_session_reused(ssl_) == 1;
+    }
+
+    // Latest ticket the server issued on this connection, null if none.
+    const Session& get_session() const {
+        return session_;
+    }
+
+private:
+    static int handle_new_session(SSL* ssl, SSL_SESSION* session);
+
+    TlsStream(Socket& socket, asio::ssl::context& context, bool is_server);
+
+    // For an SSL call that did not succeed: what the socket has to become
+    // ready for before it is retried, or nullopt with `ec` set.
+    std::optional<Socket::wait_type> classify(int result,
+                                              asio::error_code& ec) const;
+
+    // Runs `call` (an SSL function returning 1 on success) until it
+    // succeeds or fails. Completions are never invoked from within the
+    // initiating call, so read loops cannot grow the stack while OpenSSL
+    // has buffered records.
+    template <typename Call, typename Handler>
+    void async_call(Call call, Handler&& handler) {
+        asio::async_compose<Handler, void(asio::error_code, size_t)>(
+            [this, call, is_started = false, is_done = false,
+             result = asio::error_code{},
+             bytes = size_t{0}](auto& self, asio::error_code ec = {}) mutable {
+                if (is_done) {
+                    self.complete(result, bytes);
+                    return;
+                }
+                const bool is_immediate = !is_started;
+                is_started = true;
+
+                if (!ec) {
+                    ERR_clear_error();
+                    const int status = call(bytes);
+                    if (status != 1) {
+                        if (const auto wait = classify(status, ec)) {
+                            socket_.async_wait(*wait, std::move(self));
+                            return;
+                        }
+                    }
+                }
+
+                if (is_immediate) {
+                    is_done = true;
+                    result = ec;
+                    asio::post(socket_.get_executor(), std::move(self));
+                    return;
+                }
+                self.complete(ec, bytes);
+            },
+            handler, socket_);
+    }
+
+    Socket& socket_;
+    SSL* ssl_;
+    bool is_ktls_send_{false};
+    Session session_;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "LatencyHistogram.hpp"
+#include "Message.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+
+// Now as a TraceMessage stamp.
+inline int64_t trace_clock_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// Legs of a traced message's way from the sender's input to the
+// recipient's screen. The server records its own legs, the recipient the
+// others. Uplink and Downlink compare clocks of two hosts and include their
+// offset.
+enum class TraceStage {
+    // Sender's send call to the server reading the trace.
+    Uplink,
+    // Read to queued for the recipients.
+    ServerProcessing,
+    // Queued to handed to the recipient's socket.
+    ServerQueueing,
+    // Handed to the socket to the write completing.
+    ServerWrite,
+    // Handed to the socket to the recipient reading it.
+    Downlink,
+    // Read by the recipient to shown.
+    Render,
+    // Sender's send call to shown.
+    EndToEnd,
+};
+constexpr size_t TraceStageCount = 7;
+
+constexpr std::string_view to_string(TraceStage stage) {
+    switch (stage) {
+        case TraceStage::Uplink:
+            return "uplink";
+        case TraceStage::ServerProcessing:
+            return "server processing";
+        case TraceStage::ServerQueueing:
+            return "server queueing";
+        case TraceStage::ServerWrite:
+            return "server write";
+        case TraceStage::Downlink:
+            return "downlink";
+        case TraceStage::Render:
+            return "render";
+        case TraceStage::EndToEnd:
+            return "end to end";
+    }
+    return "unknown";
+}
+
+class TraceStats {
+public:
+    void record(TraceStage stage, int64_t from, int64_t to) {
+        if (from != 0 && to != 0) {
+            stages_[static_cast<size_t>(stage)].record(
+                std::chrono::nanoseconds{to - from});
+        }
+    }
+
+    // The legs a recipient sees, `rendered` is when the message was shown.
+    void record_received(const TraceMessage& trace, int64_t rendered) {
+        record(TraceStage::Uplink, trace.client_send, trace.server_receive);
+        record(TraceStage::Downlink, trace.server_write, trace.client_receive);
+        record(TraceStage::Render, trace.client_receive, rendered);
+        record(TraceStage::EndToEnd, trace.client_send, rendered);
+    }
+
+    const LatencyHistogram& get(TraceStage stage) const {
+        return stages_[static_cast<size_t>(stage)];
+    }
+
+private:
+    std::array<LatencyHistogram, TraceStageCount> stages_;
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "../Message.hpp"
+#include "../server/ChatServer.hpp"
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <utility>
+
+// What the benchmarks running a server have in common: forking it,
+// connecting to it and reading what it sends.
+namespace bench {
+inline constexpr const char* Address{"127.0.0.1"};
+
+// A server on Address and `port` that neither rate limits nor turns clients
+// away, benchmarks flood and open many connections on purpose.
+inline ServerOptions server_options(uint16_t port) {
+    ServerOptions options{};
+    options.address = Address;
+    options.port = std::to_string(port);
+    options.rate_limits = {.messages = {}, .bytes = {}, .disconnect_after = 0};
+    options.admission.max_connections = 0;
+    return options;
+}
+
+// Runs a server in a forked child with its output discarded. Unless `start`
+// is -1 the child waits for a byte on it first. Servers are forked before
+// the benchmark starts threads, a child forked later could inherit the
+// allocator locked by one of them.
+inline pid_t spawn_server(ServerOptions options, int start = -1) {
+    // Buffered output would otherwise be written a second time by the child.
+    std::fflush(stdout);
+    const pid_t pid = ::fork();
+    if (pid == 0) {
+        std::freopen("/dev/null", "w", stdout);
+        char byte{0};
+        if (start >= 0 && ::read(start, &byte, 1) != 1) {
+            std::_Exit(1);
+        }
+        ChatServer server{std::move(options)};
+        server.start();
+        std::_Exit(0);
+    }
+    return pid;
+}
+
+inline void stop_server(pid_t pid) {
+    ::kill(pid, SIGTERM);
+    ::waitpid(pid, nullptr, 0);
+}
+
+// Connects `socket` to Address and `port`, retrying until the server
+// listens.
+template <typename Socket>
+void connect(Socket& socket, uint16_t port) {
+    const asio::ip::tcp::endpoint endpoint{asio::ip::make_address(Address),
+                                           port};
+    for (;;) {
+        asio::error_code ec;
+        socket.connect(endpoint, ec);
+        if (!ec) {
+            return;
+        }
+        socket.close(ec);
+        std::this_thread::sleep_for(std::chrono::milliseconds{50});
+    }
+}
+
+inline asio::ip::tcp::socket connect_client(asio::io_context& io_context,
+                                            uint16_t port) {
+    asio::ip::tcp::socket socket{io_context};
+    connect(socket, port);
+    return socket;
+}
+
+// Reads the next frame, false on error.
+template <typename SyncReadStream>
+bool read_frame(SyncReadStream& stream, MessageHeader& header,
+                SerializedMessage& body) {
+    asio::error_code ec;
+    asio::read(stream, asio::buffer(&header, MessageHeaderSize), ec);
+    if (ec) {
+        return false;
+    }
+    body.resize(header.body_size);
+    asio::read(stream, asio::buffer(body), ec);
+    return !ec;
+}
+
+// Where read_texts() reads frames into and counts text messages.
+struct TextReader {
+    SerializedMessage header = SerializedMessage(MessageHeaderSize);
+    SerializedMessage body;
+    size_t texts{0};
+};
+
+// Reads frames until `expected` text messages arrived or a read failed.
+// `stream` and `reader` must outlive the reads.
+template <typename AsyncReadStream>
+void read_texts(AsyncReadStream& stream, TextReader& reader, size_t expected) {
+    asio::async_read(
+        stream, asio::buffer(reader.header),
+        [&stream, &reader, expected](asio::error_code ec, size_t) {
+            MessageHeader header{};
+            if (ec || !deserialize(reader.header, header)) {
+                return;
+            }
+            reader.body.resize(header.body_size);
+            asio::async_read(
+                stream, asio::buffer(reader.body),
+                [&stream, &reader, expected,
+                 type = header.type](asio::error_code ec, size_t) {
+                    if (ec) {
+                        return;
+                    }
+                    if (type == MessageType::Text &&
+                        ++reader.texts == expected) {
+                        return;
+                    }
+                    read_texts(stream, reader, expected);
+                });
+        });
+}
+} // namespace bench
@@ -0,0 +1,115 @@
+// Broadcast fan-out cost of the I/O backend the server was built with.
+//
+// Build once as is (epoll) and once with -DCHAT_USE_IO_URING=ON and compare
+// the output, the workload is the same. The server runs in a forked child,
+// a set of receivers join, then one sender writes all of its messages at
+// once and the time until every receiver has all of them is recorded along
+// with the CPU time the server spent meanwhile.
+//
+// usage: fanout_backend [receivers] [messages]  (default: 256 2000)
+
+#include "BenchSupport.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <print>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+constexpr uint16_t Port{19600};
+
+#if defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+constexpr const char* Backend{"io_uring"};
+#else
+constexpr const char* Backend{"epoll"};
+#endif
+
+// User plus system time of `pid` so far.
+std::chrono::duration<double> cpu_time(pid_t pid) {
+    std::ifstream stat{std::format("/proc/{}/stat", pid)};
+    std::string field;
+    // utime and stime are the 14th and 15th fields, the command name before
+    // them has no spaces here.
+    for (int i = 0; i < 13; ++i) {
+        stat >> field;
+    }
+    double user{0};
+    double system{0};
+    stat >> user >> system;
+    return std::chrono::duration<double>{(user + system) /
+                                         static_cast<double>(
+                                             ::sysconf(_SC_CLK_TCK))};
+}
+
+struct Receiver {
+    asio::ip::tcp::socket socket;
+    bench::TextReader reader;
+};
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t receivers_count = argc > 1 ? std::stoul(argv[1]) : 256;
+    const size_t messages = argc > 2 ? std::stoul(argv[2]) : 2000;
+
+    const auto pid = bench::spawn_server(bench::server_options(Port));
+    asio::io_context io_context;
+    std::vector<std::unique_ptr<Receiver>> receivers;
+    for (size_t i = 0; i < receivers_count; ++i) {
+        receivers.push_back(std::make_unique<Receiver>(
+            Receiver{.socket = bench::connect_client(io_context, Port),
+                     .reader = {}}));
+        asio::write(receivers.back()->socket,
+                    asio::buffer(serialize(Message{ConnectMessage{
+                        .nick = std::pmr::string{std::format("r{}", i)}}})));
+    }
+    auto sender = bench::connect_client(io_context, Port);
+    asio::write(sender, asio::buffer(serialize(Message{
+                            ConnectMessage{.nick = "sender"}})));
+    // Lets every join land before the sender starts.
+    std::this_thread::sleep_for(500ms);
+
+    SerializedMessage frames;
+    const auto frame = serialize(Message{TextMessage{
+        .message = "the quick brown fox jumps over the lazy dog"}});
+    for (size_t i = 0; i < messages; ++i) {
+        frames.insert(frames.end(), frame.begin(), frame.end());
+    }
+
+    for (auto& receiver : receivers) {
+        bench::read_texts(receiver->socket, receiver->reader, messages);
+    }
+    const auto cpu_start = cpu_time(pid);
+    const auto start = std::chrono::steady_clock::now();
+    asio::async_write(sender, asio::buffer(frames),
+                      [](asio::error_code, size_t) {});
+    io_context.run_for(60s);
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const auto server_cpu = cpu_time(pid) - cpu_start;
+
+    size_t delivered{0};
+    for (const auto& receiver : receivers) {
+        delivered += receiver->reader.texts;
+    }
+    std::println("{:>10} {:>10} {:>16} {:>22}", "backend", "receivers",
+                 "deliveries/s", "server cpu us/1k dlv");
+    std::println("{:>10} {:>10} {:>16.0f} {:>22.1f}{}", Backend,
+                 receivers_count,
+                 static_cast<double>(delivered) / elapsed.count(),
+                 server_cpu.count() * 1e9 /
+                     static_cast<double>(std::max<size_t>(delivered, 1)),
+                 delivered == receivers_count * messages ? ""
+                                                         : "  (timed out)");
+
+    bench::stop_server(pid);
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Aggregate text message throughput of a federated mesh as nodes are added.
+//
+// Every node runs in a forked child and links to the nodes started before
+// it. Each node gets the same number of clients, every client sends its
+// share of messages and reads until it has received the messages of all
+// other clients in the mesh, wherever they joined.
+//
+// usage: federation_throughput [max nodes] [clients per node] [messages per client]
+//        (default: 4 4 2000)
+
+#include "BenchSupport.hpp"
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <print>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+constexpr uint16_t ClientPortBase{19100};
+constexpr uint16_t PeerPortBase{19200};
+
+pid_t spawn_node(NodeId node) {
+    auto options =
+        bench::server_options(static_cast<uint16_t>(ClientPortBase + node));
+    options.federation.node_id = node;
+    options.federation.port = std::to_string(PeerPortBase + node);
+    options.federation.secret = "federation_throughput";
+    for (NodeId peer = 1; peer < node; ++peer) {
+        options.federation.peers.push_back(
+            std::format("{}:{}", bench::Address, PeerPortBase + peer));
+    }
+    return bench::spawn_server(std::move(options));
+}
+
+// Reads frames until `expected` text messages arrived, false on timeout.
+bool receive_texts(asio::ip::tcp::socket& socket, size_t expected) {
+    timeval timeout{.tv_sec = 10, .tv_usec = 0};
+    ::setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof(timeout));
+
+    MessageHeader header{};
+    SerializedMessage body;
+    size_t received{0};
+    while (received < expected) {
+        if (!bench::read_frame(socket, header, body)) {
+            return false;
+        }
+        received += header.type == MessageType::Text;
+    }
+    return true;
+}
+
+struct Result {
+    double seconds;
+    size_t delivered;
+    bool is_complete;
+};
+
+Result run_mesh(NodeId nodes, size_t clients_per_node,
+                size_t messages_per_client) {
+    std::vector<pid_t> pids;
+    for (NodeId node = 1; node <= nodes; ++node) {
+        pids.push_back(spawn_node(node));
+    }
+
+    asio::io_context io_context;
+    std::vector<asio::ip::tcp::socket> clients;
+    for (NodeId node = 1; node <= nodes; ++node) {
+        for (size_t i = 0; i < clients_per_node; ++i) {
+            // Links are up once every node accepts clients and had a moment
+            // to dial.
+            std::this_thread::sleep_for(i == 0 ? 300ms : 0ms);
+            auto socket = bench::connect_client(
+                io_context, static_cast<uint16_t>(ClientPortBase + node));
+            const auto join = serialize(Message{ConnectMessage{
+                .nick = std::pmr::string{std::format("n{}c{}", node, i)}}});
+            asio::write(socket, asio::buffer(join));
+            clients.push_back(std::move(socket));
+        }
+    }
+    // Lets the joins reach every node before anyone sends.
+    std::this_thread::sleep_for(500ms);
+
+    const size_t expected = (clients.size() - 1) * messages_per_client;
+    const auto frame = serialize(Message{TextMessage{
+        .message = "the quick brown fox jumps over the lazy dog"}});
+    std::atomic<size_t> complete{0};
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::jthread> threads;
+    for (auto& client : clients) {
+        threads.emplace_back([&] {
+            if (receive_texts(client, expected)) {
+                ++complete;
+            }
+        });
+        threads.emplace_back([&] {
+            for (size_t i = 0; i < messages_per_client; ++i) {
+                asio::write(client, asio::buffer(frame));
+            }
+        });
+    }
+    threads.clear();
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    for (const auto pid : pids) {
+        bench::stop_server(pid);
+    }
+    return {.seconds = elapsed.count(),
+            .delivered = clients.size() * expected,
+            .is_complete = complete == clients.size()};
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    const NodeId max_nodes =
+        argc > 1 ? static_cast<NodeId>(std::stoul(argv[1])) : 4;
+    const size_t clients_per_node = argc > 2 ? std::stoul(argv[2]) : 4;
+    const size_t messages_per_client = argc > 3 ? std::stoul(argv[3]) : 2000;
+
+    std::println("{:>6} {:>8} {:>12} {:>10} {:>16}", "nodes", "clients",
+                 "delivered", "seconds", "deliveries/s");
+    for (NodeId nodes = 1; nodes <= max_nodes; ++nodes) {
+        const auto result =
+            run_mesh(nodes, clients_per_node, messages_per_client);
+        std::println("{:>6} {:>8} {:>12} {:>10.2f} {:>16.0f}{}", nodes,
+                     nodes * clients_per_node, result.delivered,
+                     result.seconds,
+                     static_cast<double>(result.delivered) / result.seconds,
+                     result.is_complete ? "" : "  (timed out)");
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+// Heap allocations and time per decoded frame on the receive paths, with
+// the messages' strings and vectors on the heap and in a FrameArena.
+//
+// Frames are the ones clients send to the server (chat, private messages,
+// joins, searches, file offers and chunks) and the ones the server sends to
+// clients (roster snapshots, search results, offline messages). Each is
+// decoded once before measuring, like a connection that has seen it before,
+// and the arena is released after every frame like on the read paths.
+//
+// Only decoding is measured. Handlers allocate on top of it for what
+// outlives the frame: frames they send, the session of a new join and the
+// copy of a search query the search thread works on.
+//
+// usage: frame_allocations [frames per kind]  (default: 200000)
+
+#include "../FrameArena.hpp"
+#include "../Message.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <print>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+std::atomic<bool> is_counting{false};
+std::atomic<size_t> allocations{0};
+
+struct Result {
+    double allocations;
+    double nanoseconds;
+};
+
+template <typename T>
+Result decode(const SerializedMessage& body, size_t frames,
+              FrameArena* arena) {
+    auto decode_one = [&] {
+        if (!arena) {
+            T msg;
+            return deserialize(body, msg);
+        }
+        const FrameArena::Scope frame{*arena};
+        auto msg = make_message<T>(arena->get());
+        return deserialize(body, msg);
+    };
+
+    if (!decode_one()) {
+        std::println("could not decode the frame");
+        std::exit(1);
+    }
+
+    allocations = 0;
+    is_counting = true;
+    const auto start = std::chrono::steady_clock::now();
+    size_t decoded{0};
+    for (size_t i = 0; i < frames; ++i) {
+        decoded += decode_one();
+    }
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    is_counting = false;
+
+    return {.allocations = static_cast<double>(allocations) /
+                           static_cast<double>(decoded),
+            .nanoseconds = elapsed.count() / static_cast<double>(decoded)};
+}
+
+template <typename T>
+void measure(std::string_view kind, const T& msg, size_t frames) {
+    const auto body = serialize(msg);
+    FrameArena arena{1 << 20};
+    const auto heap = decode<T>(body, frames, nullptr);
+    const auto pooled = decode<T>(body, frames, &arena);
+    std::println("{:>16} {:>8} {:>12.2f} {:>10.1f} {:>12.2f} {:>10.1f}", kind,
+                 body.size(), heap.allocations, heap.nanoseconds,
+                 pooled.allocations, pooled.nanoseconds);
+}
+
+std::pmr::string make_text(size_t size) {
+    std::pmr::string text;
+    while (text.size() < size) {
+        text += "the quick brown fox jumps over the lazy dog ";
+    }
+    text.resize(size);
+    return text;
+}
+} // namespace
+
+void* operator new(size_t size) {
+    if (is_counting.load(std::memory_order_relaxed)) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc{};
+}
+
+// The default memory resource allocates with the aligned forms.
+void* operator new(size_t size, std::align_val_t alignment) {
+    if (is_counting.load(std::memory_order_relaxed)) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    const auto align = static_cast<size_t>(alignment);
+    if (void* pointer =
+            std::aligned_alloc(align, (size + align - 1) / align * align)) {
+        return pointer;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+int main(int argc, char** argv) {
+    const size_t frames = argc > 1 ? std::stoul(argv[1]) : 200000;
+
+    ChatUsersMessage roster{.version = 1, .users = {}};
+    for (UserId id = 1; id <= 1000; ++id) {
+        roster.users.push_back(
+            {.id = id, .nick = std::pmr::string{"user" + std::to_string(id)}});
+    }
+    SearchResponseMessage results{.request_id = 1, .results = {}};
+    for (uint64_t sequence = 1; sequence <= 50; ++sequence) {
+        results.results.push_back({.sequence = sequence,
+                                   .from = "someone",
+                                   .message = make_text(80)});
+    }
+
+    std::println("{:>16} {:>8} {:>12} {:>10} {:>12} {:>10}", "frame", "bytes",
+                 "heap allocs", "heap ns", "arena allocs", "arena ns");
+    measure("text", TextMessage{.message = make_text(40)}, frames);
+    measure("long text", TextMessage{.message = make_text(400)}, frames);
+    measure("private", PrivateMessage{.to_nick = "somebody",
+                                      .message = make_text(60)},
+            frames);
+    measure("connect", ConnectMessage{.nick = "a rather long nickname"},
+            frames);
+    measure("search", SearchRequestMessage{.request_id = 1,
+                                           .query = "quick brown fox"},
+            frames);
+    measure("file offer",
+            FileOfferMessage{.transfer_id = 1,
+                             .size = 1 << 20,
+                             .name = "holiday photos from last summer.tar"},
+            frames);
+    measure("file chunk",
+            FileChunkMessage{.transfer_id = 1,
+                             .offset = 0,
+                             .checksum = 0,
+                             .data = std::pmr::vector<uint8_t>(FileChunkSize)},
+            frames / 10);
+    measure("offline", OfflineMessage{.from = "somebody",
+                                      .message = make_text(60),
+                                      .sent_at = 0},
+            frames);
+    measure("search results", results, frames / 10);
+    measure("roster", roster, frames / 100);
+    return 0;
+}
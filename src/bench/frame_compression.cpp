@@ -0,0 +1,166 @@
+// CPU cost of frame compression against the bytes it saves.
+//
+// Chat messages of growing length, roster snapshots of growing rooms and a
+// page of search results are deflated at the fastest level, which the
+// server uses, and at zlib's default level, and inflated again as a client
+// does. Text is drawn from a fixed vocabulary with a fixed seed, so runs
+// compare; a frame of random bytes shows the cost of trying on data that
+// does not compress. Finally one frame is broadcast to many recipients
+// through the server's FrameCompressor, which compresses it once for all
+// of them.
+//
+// usage: frame_compression [frames per kind] [recipients]
+//        (default: 2000 1000)
+
+#include "../FrameCompression.hpp"
+#include "../server/FrameCompressor.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <print>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+constexpr std::string_view Words[]{
+    "the",     "a",       "meeting", "is",     "at",      "noon",
+    "can",     "you",     "send",    "me",     "build",   "log",
+    "server",  "restart", "again",   "looks",  "fine",    "now",
+    "thanks",  "deploy",  "failed",  "on",     "staging", "because",
+    "of",      "missing", "config",  "file",   "please",  "check",
+    "latency", "spike",   "around",  "ten",    "minutes", "ago",
+    "lunch",   "coffee",  "tomorrow", "review", "branch",  "merged"};
+
+std::mt19937 random_engine{1};
+
+std::pmr::string make_text(size_t size) {
+    std::uniform_int_distribution<size_t> word{0, std::size(Words) - 1};
+    std::pmr::string text;
+    while (text.size() < size) {
+        text += Words[word(random_engine)];
+        text += ' ';
+    }
+    text.resize(size);
+    return text;
+}
+
+std::pmr::string make_random_bytes(size_t size) {
+    std::uniform_int_distribution<int> byte{0, 255};
+    std::pmr::string text(size, '\0');
+    for (auto& c : text) {
+        c = static_cast<char>(byte(random_engine));
+    }
+    return text;
+}
+
+ChatUsersMessage make_roster(UserId users) {
+    ChatUsersMessage roster{.version = 1, .users = {}};
+    for (UserId id = 1; id <= users; ++id) {
+        roster.users.push_back(
+            {.id = id, .nick = std::pmr::string{std::format("user{}", id)}});
+    }
+    return roster;
+}
+
+// Microseconds per call of `operation`, run `count` times.
+template <typename Operation>
+double time_us(size_t count, Operation&& operation) {
+    const auto start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        operation();
+    }
+    const std::chrono::duration<double, std::micro> elapsed =
+        Clock::now() - start;
+    return elapsed.count() / static_cast<double>(count);
+}
+
+void measure(std::string_view kind, const Message& msg, size_t frames) {
+    const auto frame = serialize(msg);
+    for (const int level : {Z_BEST_SPEED, Z_DEFAULT_COMPRESSION}) {
+        FrameDeflater deflater{level};
+        const auto compressed = deflater.compress(frame);
+        if (!compressed) {
+            std::println("{:>16} {:>8} {:>6} {:>10} {:>7} {:>10.2f} {:>10}",
+                         kind, frame.size(), level, "as is", "0%",
+                         time_us(frames, [&] { deflater.compress(frame); }),
+                         "-");
+            continue;
+        }
+
+        FrameInflater inflater;
+        SerializedMessage inflated;
+        const std::span body{compressed->begin() + MessageHeaderSize,
+                             compressed->end()};
+        if (!inflater.decompress(body, inflated) || inflated != frame) {
+            std::println("{}: the frame did not survive compression", kind);
+            std::exit(1);
+        }
+        const auto deflate_us =
+            time_us(frames, [&] { deflater.compress(frame); });
+        const auto inflate_us =
+            time_us(frames, [&] { inflater.decompress(body, inflated); });
+        std::println("{:>16} {:>8} {:>6} {:>10} {:>6.0f}% {:>10.2f} {:>10.2f}",
+                     kind, frame.size(), level, compressed->size(),
+                     100.0 * (1.0 - static_cast<double>(compressed->size()) /
+                                        static_cast<double>(frame.size())),
+                     deflate_us, inflate_us);
+    }
+}
+
+// A broadcast queues the same frame for every recipient.
+void measure_broadcast(size_t recipients) {
+    const auto frame = std::make_shared<const SerializedMessage>(
+        serialize(Message{TextMessage{.message = make_text(900)}}));
+    FrameCompressor compressor;
+    const auto shared_us = time_us(1, [&] {
+        for (size_t i = 0; i < recipients; ++i) {
+            compressor.compress(frame);
+        }
+    });
+    FrameDeflater deflater;
+    const auto per_recipient_us = time_us(1, [&] {
+        for (size_t i = 0; i < recipients; ++i) {
+            deflater.compress(*frame);
+        }
+    });
+    std::println("\nbroadcast of {} bytes to {} recipients: {:.1f} us "
+                 "compressed once, {:.1f} us compressed per recipient",
+                 frame->size(), recipients, shared_us, per_recipient_us);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t frames = argc > 1 ? std::stoul(argv[1]) : 2000;
+    const size_t recipients = argc > 2 ? std::stoul(argv[2]) : 1000;
+
+    std::println("{:>16} {:>8} {:>6} {:>10} {:>7} {:>10} {:>10}", "frame",
+                 "bytes", "level", "compressed", "saved", "deflate us",
+                 "inflate us");
+    for (const size_t size : {128, 512, 1024, 4096}) {
+        measure(std::format("text {}", size),
+                TextMessage{.message = make_text(size)}, frames);
+    }
+    measure("random 1024", TextMessage{.message = make_random_bytes(1024)},
+            frames);
+    for (const UserId users : {10, 100, 1000, 10000}) {
+        measure(std::format("roster {}", users), make_roster(users),
+                std::max<size_t>(frames * 10 / users, 10));
+    }
+
+    SearchResponseMessage results{.request_id = 1, .results = {}};
+    for (uint64_t sequence = 1; sequence <= 50; ++sequence) {
+        results.results.push_back({.sequence = sequence,
+                                   .from = std::pmr::string{
+                                       std::format("user{}", sequence % 7)},
+                                   .message = make_text(80)});
+    }
+    measure("search results", results, frames);
+
+    measure_broadcast(recipients);
+    return 0;
+}
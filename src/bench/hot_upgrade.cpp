@@ -0,0 +1,203 @@
+// Hot upgrade between server processes, as clients see it.
+//
+// A server runs in a forked child with an upgrade socket. A sender and a
+// receiver client join, then the sender sends a text message every
+// millisecond while new server processes are started with the same options,
+// one per interval, each taking over from the one before. For each upgrade
+// the longest time the receiver went without a message is reported, and at
+// the end whether every message arrived, in order, over the connections the
+// clients started with.
+//
+// usage: hot_upgrade [upgrades] [interval ms]   (default: 3 1000)
+
+#include "BenchSupport.hpp"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+constexpr uint16_t Port{19320};
+// How long the receiver may lag behind once the sender stopped.
+constexpr auto DrainTimeout = 5s;
+
+using Clock = std::chrono::steady_clock;
+
+// The server waits for a byte on `start` first, unless it is -1.
+pid_t spawn_server(const std::string& upgrade_socket, int start) {
+    auto options = bench::server_options(Port);
+    options.upgrade_socket = upgrade_socket;
+    return bench::spawn_server(std::move(options), start);
+}
+
+class Client {
+public:
+    explicit Client(asio::io_context& io_context) : socket_(io_context) {
+        bench::connect(socket_, Port);
+        socket_.set_option(asio::ip::tcp::no_delay(true));
+    }
+
+    bool send(const SerializedMessage& frame) {
+        asio::error_code ec;
+        asio::write(socket_, asio::buffer(frame), ec);
+        return !ec;
+    }
+
+    void join(const std::string& nick) {
+        send(serialize(Message{ConnectMessage{.nick = std::pmr::string{nick}}}));
+    }
+
+    // Makes a receive() blocked in another thread return false.
+    void shut_down() {
+        asio::error_code ignored;
+        socket_.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+    }
+
+    // Reads the next frame, false on error.
+    bool receive(MessageHeader& header, SerializedMessage& body) {
+        return bench::read_frame(socket_, header, body);
+    }
+
+    // Reads frames until one of `type` arrived, false on error.
+    bool receive(MessageType type) {
+        MessageHeader header{};
+        SerializedMessage body;
+        while (receive(header, body)) {
+            if (header.type == type) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    asio::ip::tcp::socket socket_;
+};
+
+struct Received {
+    std::vector<Clock::time_point> arrivals;
+    std::atomic<size_t> in_order{0};
+    std::atomic<bool> is_out_of_order{false};
+};
+
+// Takes messages numbered from 0 until one is out of order or the connection
+// fails or is shut down.
+void receive_all(Client& receiver, Received& received) {
+    MessageHeader header{};
+    SerializedMessage body;
+    while (receiver.receive(header, body)) {
+        TextMessage text_message;
+        if (header.type != MessageType::Text ||
+            !deserialize(body, text_message)) {
+            continue;
+        }
+        received.arrivals.push_back(Clock::now());
+        if (std::string_view{text_message.message} !=
+            std::to_string(received.in_order.load())) {
+            received.is_out_of_order = true;
+            return;
+        }
+        ++received.in_order;
+    }
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t upgrades = argc > 1 ? std::stoul(argv[1]) : 3;
+    const std::chrono::milliseconds interval{argc > 2 ? std::stol(argv[2])
+                                                      : 1000};
+    const auto upgrade_socket =
+        std::format("/tmp/chat-bench-{}-upgrade.sock", ::getpid());
+
+    auto pid = spawn_server(upgrade_socket, -1);
+    // One pipe per successor, closing it without a byte ends the child.
+    std::vector<std::pair<pid_t, int>> successors;
+    for (size_t i = 0; i < upgrades; ++i) {
+        int start[2];
+        if (::pipe(start) != 0) {
+            std::println("Could not create a pipe");
+            return 1;
+        }
+        successors.emplace_back(spawn_server(upgrade_socket, start[0]),
+                                start[1]);
+        ::close(start[0]);
+    }
+
+    asio::io_context io_context;
+    Client receiver{io_context};
+    Client sender{io_context};
+    receiver.join("receiver");
+    receiver.receive(MessageType::ChatUsers);
+    sender.join("sender");
+    sender.receive(MessageType::ChatUsers);
+    receiver.receive(MessageType::UserJoined);
+
+    Received received;
+    std::thread receiving{[&] { receive_all(receiver, received); }};
+
+    std::atomic<bool> is_sending{true};
+    std::atomic<size_t> sent{0};
+    std::thread sending{[&] {
+        while (is_sending && sender.send(serialize(Message{TextMessage{
+                                 .message = std::pmr::string{
+                                     std::to_string(sent.load())}}}))) {
+            ++sent;
+            std::this_thread::sleep_for(1ms);
+        }
+    }};
+
+    std::vector<Clock::time_point> upgraded_at;
+    for (const auto& [successor, start] : successors) {
+        std::this_thread::sleep_for(interval);
+        upgraded_at.push_back(Clock::now());
+        const char byte{1};
+        [[maybe_unused]] const auto result = ::write(start, &byte, 1);
+        ::close(start);
+        // The predecessor exits once it handed everything over.
+        ::waitpid(pid, nullptr, 0);
+        pid = successor;
+    }
+    std::this_thread::sleep_for(interval);
+    is_sending = false;
+    sending.join();
+    const auto drain_end = Clock::now() + DrainTimeout;
+    while (received.in_order < sent && !received.is_out_of_order &&
+           Clock::now() < drain_end) {
+        std::this_thread::sleep_for(10ms);
+    }
+    receiver.shut_down();
+    receiving.join();
+
+    std::println("{:>8} {:>12}", "upgrade", "longest gap ms");
+    upgraded_at.push_back(Clock::time_point::max());
+    for (size_t i = 0; i + 1 < upgraded_at.size(); ++i) {
+        Clock::duration gap{};
+        for (size_t j = 1; j < received.arrivals.size(); ++j) {
+            if (received.arrivals[j] >= upgraded_at[i] &&
+                received.arrivals[j - 1] < upgraded_at[i + 1]) {
+                gap = std::max(gap, received.arrivals[j] -
+                                        received.arrivals[j - 1]);
+            }
+        }
+        std::println("{:>8} {:>12.1f}", i + 1,
+                     std::chrono::duration<double, std::milli>(gap).count());
+    }
+    std::println("{} of {} messages arrived in order{}",
+                 received.in_order.load(), sent.load(),
+                 received.is_out_of_order ? ", then one out of order" : "");
+
+    bench::stop_server(pid);
+    return received.in_order == sent.load() ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+// Reports how much resident memory the server spends per idle connection.
+//
+// The server runs in a forked child so its RSS can be read from /proc without
+// the client side polluting the numbers. Clients are plain blocking sockets
+// that connect and then stay silent.
+//
+// usage: idle_connections [connections...]   (default: 10000 100000)
+
+#include "BenchSupport.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <print>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+constexpr uint16_t Port{19999};
+// Loopback connections from one source address run out of ephemeral ports
+// around 28k, so clients are spread over 127.0.0.2, 127.0.0.3, ...
+constexpr size_t ConnectionsPerSourceAddress{20000};
+
+size_t rss_bytes(pid_t pid) {
+    std::ifstream statm{std::format("/proc/{}/statm", pid)};
+    size_t size{0};
+    size_t resident{0};
+    statm >> size >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+size_t open_descriptors(pid_t pid) {
+    return static_cast<size_t>(std::distance(
+        std::filesystem::directory_iterator{std::format("/proc/{}/fd", pid)},
+        std::filesystem::directory_iterator{}));
+}
+
+int connect_client(size_t index) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int enable{1};
+    ::setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable,
+                 sizeof(enable));
+
+    sockaddr_in source{};
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr =
+        htonl(INADDR_LOOPBACK + 1 + index / ConnectionsPerSourceAddress);
+
+    sockaddr_in destination{};
+    destination.sin_family = AF_INET;
+    destination.sin_port = htons(Port);
+    destination.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&source), sizeof(source)) != 0 ||
+        ::connect(fd, reinterpret_cast<sockaddr*>(&destination),
+                  sizeof(destination)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void wait_for_server() {
+    for (;;) {
+        if (int fd = connect_client(0); fd >= 0) {
+            ::close(fd);
+            return;
+        }
+        std::this_thread::sleep_for(50ms);
+    }
+}
+
+void raise_descriptor_limit(size_t connections) {
+    rlimit limit{};
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < connections + 64) {
+        std::println("Warning: descriptor limit {} is too low for {} "
+                     "connections, raise it with ulimit -n",
+                     limit.rlim_cur, connections);
+    }
+}
+
+void measure(size_t connections) {
+    const pid_t server = bench::spawn_server(bench::server_options(Port));
+    wait_for_server();
+    std::this_thread::sleep_for(200ms);
+
+    const auto baseline_descriptors = open_descriptors(server);
+    const auto baseline_rss = rss_bytes(server);
+
+    std::vector<int> clients;
+    clients.reserve(connections);
+    for (size_t i = 0; i < connections; ++i) {
+        const int fd = connect_client(i);
+        if (fd < 0) {
+            std::println("Could only open {} of {} connections",
+                         clients.size(), connections);
+            break;
+        }
+        clients.push_back(fd);
+    }
+
+    // Wait until the server has accepted everything, then let it settle.
+    const auto deadline = std::chrono::steady_clock::now() + 60s;
+    while (open_descriptors(server) < baseline_descriptors + clients.size() &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(50ms);
+    }
+    std::this_thread::sleep_for(500ms);
+
+    const auto rss = rss_bytes(server);
+    const auto delta = rss > baseline_rss ? rss - baseline_rss : 0;
+    if (!clients.empty()) {
+        std::println("{:>7} idle connections: {:>12} bytes RSS, {:>6} bytes "
+                     "per connection",
+                     clients.size(), delta, delta / clients.size());
+    }
+
+    for (int fd : clients) {
+        ::close(fd);
+    }
+    bench::stop_server(server);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    std::vector<size_t> counts{10'000, 100'000};
+    if (argc > 1) {
+        counts.clear();
+        for (int i = 1; i < argc; ++i) {
+            counts.push_back(std::stoul(argv[i]));
+        }
+    }
+
+    raise_descriptor_limit(std::ranges::max(counts));
+    for (auto count : counts) {
+        measure(count);
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Message latency over TCP loopback with the default and the low-latency
+// profile of the server (see LatencyOptions), and with each of its parts.
+//
+// The server runs in a forked child. A sender and a receiver client join,
+// then the sender sends text messages one at a time, each one a pause after
+// the receiver got the previous one so the server goes idle in between, and
+// the time until the receiver has each one is recorded. Clients turn Nagle
+// off on their side, only the server's sockets differ between runs.
+//
+// usage: latency_profile [round trips] [pause us] [server cpu]
+//        (default: 20000 100, the server is only pinned when a CPU is given)
+
+#include "BenchSupport.hpp"
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <print>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+constexpr uint16_t Port{19310};
+constexpr int ReceiveTimeoutMs{10000};
+
+pid_t spawn_server(LatencyOptions latency) {
+    auto options = bench::server_options(Port);
+    options.latency = std::move(latency);
+    return bench::spawn_server(std::move(options));
+}
+
+class Client {
+public:
+    explicit Client(asio::io_context& io_context) : socket_(io_context) {
+        bench::connect(socket_, Port);
+        socket_.set_option(asio::ip::tcp::no_delay(true));
+        timeval timeout{.tv_sec = ReceiveTimeoutMs / 1000, .tv_usec = 0};
+        ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_RCVTIMEO,
+                     &timeout, sizeof(timeout));
+    }
+
+    void send(const SerializedMessage& frame) {
+        asio::write(socket_, asio::buffer(frame));
+    }
+
+    void join(const std::string& nick) {
+        send(serialize(Message{ConnectMessage{.nick = std::pmr::string{nick}}}));
+    }
+
+    // Reads frames until one of `type` arrived, false on error or timeout.
+    bool receive(MessageType type) {
+        MessageHeader header{};
+        while (bench::read_frame(socket_, header, body_)) {
+            if (header.type == type) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    asio::ip::tcp::socket socket_;
+    SerializedMessage body_;
+};
+
+struct Result {
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double max_us;
+    bool is_complete;
+};
+
+Result run(LatencyOptions latency, size_t round_trips,
+           std::chrono::microseconds pause) {
+    const auto pid = spawn_server(std::move(latency));
+
+    asio::io_context io_context;
+    Client receiver{io_context};
+    Client sender{io_context};
+    receiver.join("receiver");
+    receiver.receive(MessageType::ChatUsers);
+    sender.join("sender");
+    sender.receive(MessageType::ChatUsers);
+    Result result{};
+    result.is_complete = receiver.receive(MessageType::UserJoined);
+
+    const auto frame = serialize(Message{TextMessage{
+        .message = "the quick brown fox jumps over the lazy dog"}});
+    std::vector<double> latencies;
+    latencies.reserve(round_trips);
+    for (size_t i = 0; i < round_trips && result.is_complete; ++i) {
+        std::this_thread::sleep_for(pause);
+        const auto start = std::chrono::steady_clock::now();
+        sender.send(frame);
+        result.is_complete = receiver.receive(MessageType::Text);
+        latencies.push_back(std::chrono::duration<double, std::micro>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+    }
+
+    if (result.is_complete) {
+        std::ranges::sort(latencies);
+        result.p50_us = latencies[latencies.size() / 2];
+        result.p99_us = latencies[latencies.size() * 99 / 100];
+        result.p999_us = latencies[latencies.size() * 999 / 1000];
+        result.max_us = latencies.back();
+    }
+
+    bench::stop_server(pid);
+    return result;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t round_trips = argc > 1 ? std::stoul(argv[1]) : 20000;
+    const std::chrono::microseconds pause{argc > 2 ? std::stol(argv[2]) : 100};
+    // Below 0 leaves the server unpinned.
+    const int cpu = argc > 3 ? std::stoi(argv[3]) : -1;
+
+    const auto low = low_latency_profile();
+    std::vector<std::pair<LatencyOptions, std::string>> profiles{
+        {LatencyOptions{}, "default"},
+        {LatencyOptions{.cpus = {}, .no_delay = true}, "no delay"},
+        {LatencyOptions{.cpus = {}, .spin = low.spin}, "spin poll"},
+        {low, "low"}};
+    if (cpu >= 0) {
+        auto pinned = low;
+        pinned.cpus = {cpu};
+        profiles.emplace_back(std::move(pinned),
+                              std::format("low, cpu {}", cpu));
+    }
+
+    std::println("{:>16} {:>10} {:>10} {:>10} {:>10}", "profile", "p50 us",
+                 "p99 us", "p99.9 us", "max us");
+    for (const auto& [latency, name] : profiles) {
+        const auto result = run(latency, round_trips, pause);
+        std::println("{:>16} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}{}", name,
+                     result.p50_us, result.p99_us, result.p999_us,
+                     result.max_us, result.is_complete ? "" : "  (timed out)");
+    }
+    return 0;
+}
@@ -0,0 +1,280 @@
+// Latency and throughput of the transports a client on the same host can
+// use: TCP over loopback, the unix socket, and shared memory attached over
+// the unix socket.
+//
+// The server runs in a forked child. For each transport a sender and a
+// receiver client join, then the sender sends text messages one at a time
+// and the time until the receiver has each one is recorded, then the sender
+// streams messages as fast as it can while the receiver counts them.
+//
+// usage: local_transports [round trips] [messages]  (default: 20000 200000)
+
+#include "../ShmChannel.hpp"
+#include "BenchSupport.hpp"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <memory>
+#include <print>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+constexpr uint16_t Port{19300};
+constexpr size_t MaxBodySize{64 << 10};
+constexpr int ReceiveTimeoutMs{10000};
+
+pid_t spawn_server(const std::string& unix_socket) {
+    auto options = bench::server_options(Port);
+    options.unix_socket = unix_socket;
+    return bench::spawn_server(std::move(options));
+}
+
+class Client {
+public:
+    virtual ~Client() = default;
+    virtual void send(const SerializedMessage& frame) = 0;
+    // Whole frame including the header, false on error or timeout.
+    virtual bool receive(SerializedMessage& frame) = 0;
+
+    void join(const std::string& nick) {
+        send(serialize(Message{ConnectMessage{.nick = std::pmr::string{nick}}}));
+    }
+
+    // Reads frames until one of `type` arrived.
+    bool receive(MessageType type) {
+        SerializedMessage frame;
+        while (receive(frame)) {
+            MessageHeader header{};
+            std::memcpy(&header, frame.data(), MessageHeaderSize);
+            if (header.type == type) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+class SocketClient : public Client {
+public:
+    explicit SocketClient(asio::generic::stream_protocol::socket socket)
+        : socket_(std::move(socket)) {
+        timeval timeout{.tv_sec = ReceiveTimeoutMs / 1000, .tv_usec = 0};
+        ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_RCVTIMEO,
+                     &timeout, sizeof(timeout));
+    }
+
+    void send(const SerializedMessage& frame) override {
+        asio::write(socket_, asio::buffer(frame));
+    }
+
+    bool receive(SerializedMessage& frame) override {
+        asio::error_code ec;
+        frame.resize(MessageHeaderSize);
+        asio::read(socket_, asio::buffer(frame), ec);
+        MessageHeader header{};
+        if (ec || !deserialize(frame, header)) {
+            return false;
+        }
+        frame.resize(MessageHeaderSize + header.body_size);
+        asio::read(socket_,
+                   asio::buffer(frame.data() + MessageHeaderSize,
+                                header.body_size),
+                   ec);
+        return !ec;
+    }
+
+protected:
+    asio::generic::stream_protocol::socket socket_;
+};
+
+// Keeps the unix socket open, the server drops the client when it closes.
+class ShmClient : public SocketClient {
+public:
+    using SocketClient::SocketClient;
+
+    bool attach() {
+        const auto request = serialize(Message{ShmAttachMessage{}});
+        asio::write(socket_, asio::buffer(request));
+
+        SerializedMessage answer(MessageHeaderSize);
+        ShmChannel::Descriptors descriptors{};
+        if (receive_descriptors(socket_.native_handle(), answer,
+                                descriptors) !=
+            static_cast<int>(ShmChannel::DescriptorsCount)) {
+            return false;
+        }
+        channel_ = ShmChannel::attach(descriptors);
+        return channel_ != nullptr;
+    }
+
+    void send(const SerializedMessage& frame) override {
+        std::span<const uint8_t> rest{frame};
+        for (;;) {
+            const auto written = channel_->write(rest);
+            if (!written) {
+                return;
+            }
+            rest = rest.subspan(*written);
+            if (rest.empty()) {
+                return;
+            }
+            if (channel_->prepare_wait(false, true) && !wait()) {
+                return;
+            }
+        }
+    }
+
+    bool receive(SerializedMessage& frame) override {
+        for (;;) {
+            switch (channel_->read(frame, MaxBodySize)) {
+                case ShmChannel::ReadResult::Frame:
+                    return true;
+                case ShmChannel::ReadResult::Invalid:
+                    return false;
+                case ShmChannel::ReadResult::Empty:
+                    break;
+            }
+            if (channel_->prepare_wait(true, false) && !wait()) {
+                return false;
+            }
+        }
+    }
+
+private:
+    bool wait() {
+        pollfd event{.fd = channel_->get_event_fd(), .events = POLLIN,
+                     .revents = 0};
+        if (::poll(&event, 1, ReceiveTimeoutMs) != 1) {
+            return false;
+        }
+        channel_->consume_event();
+        return true;
+    }
+
+    std::unique_ptr<ShmChannel> channel_;
+};
+
+enum class Transport { Tcp, UnixSocket, SharedMemory };
+
+std::unique_ptr<Client> connect_client(asio::io_context& io_context,
+                                       Transport transport,
+                                       const std::string& unix_socket) {
+    for (;;) {
+        asio::generic::stream_protocol::socket socket{io_context};
+        asio::error_code ec;
+        if (transport == Transport::Tcp) {
+            socket.connect(
+                asio::ip::tcp::endpoint{asio::ip::make_address(bench::Address),
+                                        Port},
+                ec);
+            if (!ec) {
+                socket.set_option(asio::ip::tcp::no_delay(true), ec);
+            }
+        } else {
+            socket.connect(asio::local::stream_protocol::endpoint{unix_socket},
+                           ec);
+        }
+        if (ec) {
+            std::this_thread::sleep_for(50ms);
+            continue;
+        }
+
+        if (transport != Transport::SharedMemory) {
+            return std::make_unique<SocketClient>(std::move(socket));
+        }
+        auto client = std::make_unique<ShmClient>(std::move(socket));
+        if (!client->attach()) {
+            std::println("Server refused shared memory.");
+            return nullptr;
+        }
+        return client;
+    }
+}
+
+struct Result {
+    double p50_us;
+    double p99_us;
+    double messages_per_second;
+    bool is_complete;
+};
+
+Result run(Transport transport, size_t round_trips, size_t messages) {
+    const auto unix_socket = std::format("/tmp/chat-bench-{}.sock", ::getpid());
+    const auto pid = spawn_server(unix_socket);
+
+    asio::io_context io_context;
+    auto receiver = connect_client(io_context, transport, unix_socket);
+    auto sender = receiver ? connect_client(io_context, transport, unix_socket)
+                           : nullptr;
+    Result result{};
+    if (sender) {
+        receiver->join("receiver");
+        receiver->receive(MessageType::ChatUsers);
+        sender->join("sender");
+        sender->receive(MessageType::ChatUsers);
+        result.is_complete = receiver->receive(MessageType::UserJoined);
+    }
+
+    const auto frame = serialize(Message{TextMessage{
+        .message = "the quick brown fox jumps over the lazy dog"}});
+    std::vector<double> latencies;
+    latencies.reserve(round_trips);
+    for (size_t i = 0; i < round_trips && result.is_complete; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        sender->send(frame);
+        result.is_complete = receiver->receive(MessageType::Text);
+        latencies.push_back(std::chrono::duration<double, std::micro>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+    }
+
+    if (result.is_complete) {
+        std::ranges::sort(latencies);
+        result.p50_us = latencies[latencies.size() / 2];
+        result.p99_us = latencies[latencies.size() * 99 / 100];
+
+        const auto start = std::chrono::steady_clock::now();
+        std::jthread sending{[&] {
+            for (size_t i = 0; i < messages; ++i) {
+                sender->send(frame);
+            }
+        }};
+        for (size_t i = 0; i < messages && result.is_complete; ++i) {
+            result.is_complete = receiver->receive(MessageType::Text);
+        }
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        result.messages_per_second =
+            static_cast<double>(messages) / elapsed.count();
+    }
+
+    bench::stop_server(pid);
+    return result;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t round_trips = argc > 1 ? std::stoul(argv[1]) : 20000;
+    const size_t messages = argc > 2 ? std::stoul(argv[2]) : 200000;
+
+    std::println("{:>14} {:>10} {:>10} {:>14}", "transport", "p50 us",
+                 "p99 us", "messages/s");
+    for (const auto& [transport, name] :
+         {std::pair{Transport::Tcp, "tcp loopback"},
+          std::pair{Transport::UnixSocket, "unix socket"},
+          std::pair{Transport::SharedMemory, "shared memory"}}) {
+        const auto result = run(transport, round_trips, messages);
+        std::println("{:>14} {:>10.1f} {:>10.1f} {:>14.0f}{}", name,
+                     result.p50_us, result.p99_us, result.messages_per_second,
+                     result.is_complete ? "" : "  (timed out)");
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+// Compares the cost per message of the Aho-Corasick ModerationFilter with a
+// naive std::string::find per pattern as the pattern set grows.
+//
+// usage: moderation_filter [messages]   (default: 100000)
+
+#include "../server/ModerationFilter.hpp"
+
+#include <chrono>
+#include <format>
+#include <print>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+std::string random_word(std::mt19937& random) {
+    std::uniform_int_distribution<int> length{3, 10};
+    std::uniform_int_distribution<int> letter{'a', 'z'};
+    std::string word(length(random), ' ');
+    for (auto& c : word) {
+        c = static_cast<char>(letter(random));
+    }
+    return word;
+}
+
+template <typename F>
+double nanoseconds_per_message(std::vector<std::string> messages, F&& scan) {
+    const auto start = std::chrono::steady_clock::now();
+    size_t matches{0};
+    for (auto& message : messages) {
+        matches += scan(message);
+    }
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    // Keeps the scan from being optimized away.
+    if (matches == static_cast<size_t>(-1)) {
+        std::println("{}", matches);
+    }
+    return elapsed.count() / static_cast<double>(messages.size());
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t messages_count = argc > 1 ? std::stoul(argv[1]) : 100'000;
+
+    std::mt19937 random{7};
+    std::vector<std::string> messages(messages_count);
+    for (auto& message : messages) {
+        while (message.size() < 120) {
+            message += random_word(random);
+            message += ' ';
+        }
+    }
+
+    std::println("{:>9} {:>9} {:>16} {:>16}", "patterns", "states",
+                 "automaton ns/msg", "naive ns/msg");
+    for (size_t patterns_count : {10, 100, 1'000, 10'000, 100'000}) {
+        std::vector<ModerationFilter::Pattern> patterns;
+        for (size_t i = 0; i < patterns_count; ++i) {
+            patterns.push_back({.text = random_word(random) + random_word(random),
+                                .action = ModerationFilter::Action::Mask});
+        }
+
+        const ModerationFilter filter{patterns};
+        const auto automaton =
+            nanoseconds_per_message(messages, [&](std::string& message) {
+                return filter.scan(message).matches;
+            });
+
+        std::string naive{"-"};
+        // The naive scan gets too slow to be worth waiting for past this.
+        if (patterns_count <= 10'000) {
+            naive = std::format(
+                "{:.0f}", nanoseconds_per_message(messages, [&](std::string& message) {
+                    size_t matches{0};
+                    for (const auto& pattern : patterns) {
+                        matches += message.find(pattern.text) != std::string::npos;
+                    }
+                    return matches;
+                }));
+        }
+
+        std::println("{:>9} {:>9} {:>16.0f} {:>16}", patterns_count,
+                     filter.states_count(), automaton, naive);
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+// Measures SearchIndex insert throughput and query latency over a large
+// synthetic chat history.
+//
+// usage: search_index [messages]   (default: 2000000)
+
+#include "../server/SearchIndex.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <limits>
+#include <print>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+std::vector<std::string> make_vocabulary(size_t size, std::mt19937& random) {
+    std::uniform_int_distribution<int> length{3, 9};
+    std::uniform_int_distribution<int> letter{'a', 'z'};
+    std::vector<std::string> words(size);
+    for (auto& word : words) {
+        word.resize(length(random));
+        for (auto& c : word) {
+            c = static_cast<char>(letter(random));
+        }
+    }
+    return words;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    using clock = std::chrono::steady_clock;
+
+    const size_t messages = argc > 1 ? std::stoul(argv[1]) : 2'000'000;
+
+    std::mt19937 random{42};
+    const auto vocabulary = make_vocabulary(50'000, random);
+    // Word frequencies in chat roughly follow Zipf's law.
+    std::vector<double> weights(vocabulary.size());
+    for (size_t i = 0; i < weights.size(); ++i) {
+        weights[i] = 1.0 / static_cast<double>(i + 1);
+    }
+    std::discrete_distribution<size_t> pick_word{weights.begin(), weights.end()};
+    std::uniform_int_distribution<int> words_per_message{3, 15};
+
+    // Only the message count bounds the index, so every message stays.
+    SearchIndex index{messages, std::numeric_limits<size_t>::max()};
+
+    const auto index_start = clock::now();
+    std::string text;
+    for (size_t i = 0; i < messages; ++i) {
+        text.clear();
+        for (int w = words_per_message(random); w > 0; --w) {
+            text += vocabulary[pick_word(random)];
+            text += ' ';
+        }
+        index.add(i + 1, "user", text);
+    }
+    const std::chrono::duration<double> index_time = clock::now() - index_start;
+    std::println("indexed {} messages in {:.2f}s ({:.0f} messages/s)", messages,
+                 index_time.count(), messages / index_time.count());
+    std::println("index takes {:.1f} MiB", index.bytes() / 1048576.0);
+
+    struct Query {
+        const char* name;
+        std::string text;
+    };
+    const std::vector<Query> queries{
+        {"common word", vocabulary[0]},
+        {"mid frequency word", vocabulary[500]},
+        {"rare word", vocabulary[40'000]},
+        {"two common words", vocabulary[0] + " " + vocabulary[1]},
+        {"common and rare", vocabulary[0] + " " + vocabulary[20'000]},
+        {"missing word", "zzzzzzzzzz"},
+    };
+
+    for (const auto& query : queries) {
+        constexpr int runs{20};
+        std::vector<double> latencies;
+        size_t results{0};
+        for (int run = 0; run < runs; ++run) {
+            const auto start = clock::now();
+            results = index.search(query.text, 50).size();
+            latencies.push_back(
+                std::chrono::duration<double, std::milli>(clock::now() - start)
+                    .count());
+        }
+        std::ranges::sort(latencies);
+        std::println("{:<20} {:>3} results  median {:>8.3f} ms  max {:>8.3f} ms",
+                     query.name, results, latencies[runs / 2],
+                     latencies.back());
+    }
+    return 0;
+}
@@ -0,0 +1,320 @@
+// Deterministic simulation of many clients against the server logic.
+//
+// Connection and ConnectionsManager run unchanged, but every client talks to
+// them through a MemoryStream and time is virtual: joins, chat messages and
+// the clients' once-a-second pings are scheduled on a virtual clock from a
+// seeded generator, the server reads the same clock, and the io_context is
+// polled until idle after each event. Runs with the same seed do the same
+// work, as fast as the CPU allows, and only the server logic is measured:
+// the io thread's CPU time per delivered message and the peak of the memory
+// the server allocated. Search indexing runs on its own worker and is not in
+// the CPU time.
+//
+// usage: simulation [clients] [virtual seconds] [seed]  (default: 2000 60 1)
+
+#include "../server/ConnectionsManager.hpp"
+#include "../server/MemoryStream.hpp"
+#include "../server/SlabAllocator.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <format>
+#include <memory>
+#include <new>
+#include <print>
+#include <queue>
+#include <random>
+#include <span>
+#include <tuple>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+// Mean time between two messages of one client, one in PrivateShare of
+// them is private.
+constexpr auto MeanMessageInterval = 30s;
+constexpr int PrivateShare = 10;
+constexpr auto PingInterval = 1s;
+// Virtual time 0 on the server's clock. Rate limiters start out as if their
+// last refill was at the clock's epoch, so it has to be long before.
+constexpr auto VirtualEpoch = 24h;
+
+// Memory allocated while the server logic runs, see CountedScope.
+std::atomic<bool> is_counting{false};
+std::atomic<size_t> live_bytes{0};
+std::atomic<size_t> peak_bytes{0};
+
+// Ahead of every allocation, keeps the payload 16-byte aligned.
+struct AllocationHeader {
+    size_t size;
+    bool is_counted;
+    char padding[16 - sizeof(size_t) - sizeof(bool)];
+};
+static_assert(sizeof(AllocationHeader) == 16);
+
+// Counts allocations and the io thread's CPU time while alive.
+class CountedScope {
+public:
+    CountedScope() {
+        is_counting = true;
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start_);
+    }
+
+    ~CountedScope() {
+        timespec end{};
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        cpu_time += std::chrono::seconds{end.tv_sec - start_.tv_sec} +
+                    std::chrono::nanoseconds{end.tv_nsec - start_.tv_nsec};
+        is_counting = false;
+    }
+
+    static inline std::chrono::nanoseconds cpu_time{};
+
+private:
+    timespec start_{};
+};
+
+// Reads the frames the server sends one client, without allocating.
+class SimulatedClient {
+public:
+    void consume(std::span<const uint8_t> bytes) {
+        while (!bytes.empty()) {
+            if (header_read_ < MessageHeaderSize) {
+                const auto size =
+                    std::min(MessageHeaderSize - header_read_, bytes.size());
+                std::copy_n(bytes.begin(), size,
+                            header_bytes_.begin() + header_read_);
+                header_read_ += size;
+                bytes = bytes.subspan(size);
+                if (header_read_ == MessageHeaderSize) {
+                    std::memcpy(&header_, header_bytes_.data(),
+                                MessageHeaderSize);
+                    body_left_ = header_.body_size;
+                    if (body_left_ == 0) {
+                        finish_frame();
+                    }
+                }
+                continue;
+            }
+
+            const auto size = std::min<size_t>(body_left_, bytes.size());
+            body_left_ -= size;
+            bytes = bytes.subspan(size);
+            if (body_left_ == 0) {
+                finish_frame();
+            }
+        }
+    }
+
+    MemoryStream* stream{nullptr};
+    uint64_t delivered{0};
+
+private:
+    void finish_frame() {
+        if (header_.type == MessageType::Text ||
+            header_.type == MessageType::PrivateMessage) {
+            ++delivered;
+        }
+        header_read_ = 0;
+    }
+
+    std::array<uint8_t, MessageHeaderSize> header_bytes_{};
+    size_t header_read_{0};
+    MessageHeader header_{};
+    size_t body_left_{0};
+};
+
+enum class EventKind { Join, Message, Ping };
+
+struct Event {
+    std::chrono::nanoseconds at;
+    // Breaks ties in scheduling order.
+    uint64_t sequence;
+    size_t client;
+    EventKind kind;
+
+    bool operator>(const Event& other) const {
+        return std::tie(at, sequence) > std::tie(other.at, other.sequence);
+    }
+};
+} // namespace
+
+void* operator new(size_t size) {
+    auto* header = static_cast<AllocationHeader*>(
+        std::malloc(sizeof(AllocationHeader) + size));
+    if (!header) {
+        throw std::bad_alloc{};
+    }
+    header->size = size;
+    header->is_counted = is_counting.load(std::memory_order_relaxed);
+    if (header->is_counted) {
+        const auto live = live_bytes.fetch_add(size) + size;
+        auto peak = peak_bytes.load(std::memory_order_relaxed);
+        while (live > peak && !peak_bytes.compare_exchange_weak(peak, live)) {
+        }
+    }
+    return header + 1;
+}
+
+void operator delete(void* pointer) noexcept {
+    if (!pointer) {
+        return;
+    }
+    auto* header = reinterpret_cast<AllocationHeader*>(
+        reinterpret_cast<uintptr_t>(pointer) - sizeof(AllocationHeader));
+    if (header->is_counted) {
+        live_bytes.fetch_sub(header->size);
+    }
+    std::free(header);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    operator delete(pointer);
+}
+
+int main(int argc, char** argv) {
+    const size_t clients_count = argc > 1 ? std::stoul(argv[1]) : 2000;
+    const auto duration =
+        std::chrono::seconds{argc > 2 ? std::stoul(argv[2]) : 60};
+    const auto seed = argc > 3 ? std::stoul(argv[3]) : 1;
+
+    // The server logs every join, the numbers go to the saved stdout.
+    std::fflush(stdout);
+    const int saved_stdout = ::dup(STDOUT_FILENO);
+    std::freopen("/dev/null", "w", stdout);
+
+    std::mt19937_64 random_engine{seed};
+    std::chrono::nanoseconds virtual_now{};
+    asio::io_context io_context;
+    // Keeps poll() from stopping the io_context whenever it runs out of
+    // handlers between two events.
+    auto work_guard = asio::make_work_guard(io_context);
+    std::optional<ConnectionsManager> connections_manager;
+    std::vector<SimulatedClient> clients(clients_count);
+    {
+        CountedScope counted;
+        connections_manager.emplace();
+        connections_manager->set_clock([&virtual_now] {
+            return OutboundQueue::Clock::time_point{VirtualEpoch + virtual_now};
+        });
+    }
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<>> events;
+    uint64_t sequence{0};
+    auto schedule = [&](std::chrono::nanoseconds at, size_t client,
+                        EventKind kind) {
+        if (at < duration) {
+            events.push({.at = at,
+                         .sequence = sequence++,
+                         .client = client,
+                         .kind = kind});
+        }
+    };
+    std::exponential_distribution<double> message_interval{
+        1.0 / std::chrono::duration<double>(MeanMessageInterval).count()};
+    auto next_message = [&] {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double>(message_interval(random_engine)));
+    };
+    std::uniform_int_distribution<int64_t> join_time{0, 1'000'000'000};
+    for (size_t i = 0; i < clients_count; ++i) {
+        schedule(std::chrono::nanoseconds{join_time(random_engine)}, i,
+                 EventKind::Join);
+    }
+
+    const auto ping = serialize(PingServerMessage{});
+    uint64_t messages{0};
+    const auto wall_start = std::chrono::steady_clock::now();
+    while (!events.empty()) {
+        const auto event = events.top();
+        events.pop();
+        virtual_now = event.at;
+        auto& client = clients[event.client];
+
+        SerializedMessage frame;
+        switch (event.kind) {
+            case EventKind::Join: {
+                auto stream = std::make_unique<MemoryStream>(
+                    io_context.get_executor(),
+                    [&client](std::span<const uint8_t> bytes) {
+                        client.consume(bytes);
+                    });
+                client.stream = stream.get();
+                {
+                    CountedScope counted;
+                    connections_manager->start(std::allocate_shared<Connection>(
+                        SlabAllocator<Connection>{}, std::move(stream),
+                        *connections_manager));
+                }
+                frame = serialize(Message{ConnectMessage{
+                    .nick = std::pmr::string{
+                        std::format("c{}", event.client)}}});
+                schedule(event.at + next_message(), event.client,
+                         EventKind::Message);
+                schedule(event.at + PingInterval, event.client,
+                         EventKind::Ping);
+                break;
+            }
+            case EventKind::Message: {
+                ++messages;
+                if (random_engine() % PrivateShare == 0) {
+                    frame = serialize(Message{PrivateMessage{
+                        .to_nick = std::pmr::string{std::format(
+                            "c{}", random_engine() % clients_count)},
+                        .message = "are you around?"}});
+                } else {
+                    frame = serialize(Message{TextMessage{
+                        .message = "the quick brown fox jumps over the lazy dog"}});
+                }
+                schedule(event.at + next_message(), event.client,
+                         EventKind::Message);
+                break;
+            }
+            case EventKind::Ping: {
+                frame = ping;
+                schedule(event.at + PingInterval, event.client,
+                         EventKind::Ping);
+                break;
+            }
+        }
+
+        client.stream->feed(frame);
+        CountedScope counted;
+        while (io_context.poll() != 0) {
+        }
+    }
+    const std::chrono::duration<double> wall_time =
+        std::chrono::steady_clock::now() - wall_start;
+
+    connections_manager->stop_all();
+    while (io_context.poll() != 0) {
+    }
+
+    uint64_t delivered{0};
+    for (const auto& client : clients) {
+        delivered += client.delivered;
+    }
+
+    std::fflush(stdout);
+    ::dup2(saved_stdout, STDOUT_FILENO);
+    std::println("{:>8} {:>10} {:>10} {:>12} {:>12} {:>14} {:>12}", "clients",
+                 "virtual s", "wall s", "messages", "deliveries",
+                 "cpu ns/dlv", "peak MiB");
+    std::println(
+        "{:>8} {:>10} {:>10.2f} {:>12} {:>12} {:>14.0f} {:>12.1f}",
+        clients_count, duration.count(), wall_time.count(), messages,
+        delivered,
+        static_cast<double>(CountedScope::cpu_time.count()) /
+            static_cast<double>(std::max<uint64_t>(delivered, 1)),
+        static_cast<double>(peak_bytes.load()) / (1 << 20));
+    return 0;
+}
@@ -0,0 +1,74 @@
+// Throughput of the text validation kernels on ASCII and mixed UTF-8 chat
+// messages.
+//
+// usage: text_sanitizer [megabytes]   (default: 256)
+
+#include "../server/TextSanitizer.hpp"
+
+#include <chrono>
+#include <print>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+std::vector<std::string> make_messages(size_t total_size,
+                                       const std::vector<std::string>& words) {
+    std::mt19937 random{11};
+    std::uniform_int_distribution<size_t> pick{0, words.size() - 1};
+    std::uniform_int_distribution<size_t> length{20, 200};
+
+    std::vector<std::string> messages;
+    size_t size{0};
+    while (size < total_size) {
+        std::string message;
+        const size_t message_length = length(random);
+        while (message.size() < message_length) {
+            message += words[pick(random)];
+            message += ' ';
+        }
+        size += message.size();
+        messages.push_back(std::move(message));
+    }
+    return messages;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 256;
+    const size_t total_size = megabytes << 20;
+
+    const std::vector<std::pair<std::string_view, std::vector<std::string>>>
+        corpora{
+            {"ascii",
+             make_messages(total_size, {"hello", "see", "you", "at", "the",
+                                        "meeting", "tomorrow", "ok", "lol"})},
+            {"utf-8",
+             make_messages(total_size, {"привет", "hello", "日本語", "ok",
+                                        "grüße", "🙂", "naïve", "café"})},
+        };
+
+    std::println("{:>8} {:>8} {:>10}", "corpus", "kernel", "GB/s");
+    for (const auto& [corpus_name, messages] : corpora) {
+        size_t bytes{0};
+        for (const auto& message : messages) {
+            bytes += message.size();
+        }
+
+        for (const auto& kernel : supported_text_kernels()) {
+            const auto start = std::chrono::steady_clock::now();
+            size_t invalid{0};
+            for (const auto& message : messages) {
+                invalid += !kernel.scan(message).is_valid_utf8;
+            }
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            if (invalid != 0) {
+                std::println("{} rejected {} messages", kernel.name, invalid);
+            }
+            std::println("{:>8} {:>8} {:>10.2f}", corpus_name, kernel.name,
+                         static_cast<double>(bytes) / elapsed.count() / 1e9);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,307 @@
+// TLS handshake rate and the cost of encrypting broadcasts.
+//
+// A self-signed certificate for 127.0.0.1 is generated into /tmp and the
+// server runs in a forked child. Handshakes are timed back to back until the
+// client holds the ticket the server sends afterwards, once always full and
+// once resuming with the ticket of the previous connection, as a client
+// reconnecting does. Then one sender broadcasts to a set of receivers,
+// over plaintext and over TLS, and deliveries per second are compared. Whether
+// the kernel took over the record encryption (kTLS) is reported as seen by
+// the benchmark's own connections.
+//
+// usage: tls_transport [handshakes] [receivers] [messages]
+//        (default: 2000 8 20000)
+
+#include "../TlsStream.hpp"
+#include "BenchSupport.hpp"
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <print>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+constexpr uint16_t Port{19400};
+
+struct Certificate {
+    std::string certificate_file;
+    std::string private_key_file;
+};
+
+// P-256 key and a certificate for 127.0.0.1 signed with it, valid for a day.
+bool write_self_signed(const Certificate& files) {
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key{
+        EVP_EC_gen("P-256"), &EVP_PKEY_free};
+    std::unique_ptr<X509, decltype(&X509_free)> certificate{X509_new(),
+                                                            &X509_free};
+    if (!key || !certificate) {
+        return false;
+    }
+
+    X509_set_version(certificate.get(), 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate.get()), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate.get()), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate.get()), 24 * 60 * 60);
+    X509_set_pubkey(certificate.get(), key.get());
+    auto* name = X509_get_subject_name(certificate.get());
+    X509_NAME_add_entry_by_txt(
+        name, "CN", MBSTRING_ASC,
+        reinterpret_cast<const unsigned char*>(bench::Address), -1, -1, 0);
+    X509_set_issuer_name(certificate.get(), name);
+
+    X509V3_CTX context;
+    X509V3_set_ctx_nodb(&context);
+    X509V3_set_ctx(&context, certificate.get(), certificate.get(), nullptr,
+                   nullptr, 0);
+    std::unique_ptr<X509_EXTENSION, decltype(&X509_EXTENSION_free)>
+        alt_name{X509V3_EXT_conf_nid(nullptr, &context, NID_subject_alt_name,
+                                     "IP:127.0.0.1"),
+                 &X509_EXTENSION_free};
+    if (!alt_name || !X509_add_ext(certificate.get(), alt_name.get(), -1) ||
+        !X509_sign(certificate.get(), key.get(), EVP_sha256())) {
+        return false;
+    }
+
+    std::unique_ptr<FILE, decltype(&std::fclose)> key_file{
+        std::fopen(files.private_key_file.c_str(), "w"), &std::fclose};
+    std::unique_ptr<FILE, decltype(&std::fclose)> certificate_file{
+        std::fopen(files.certificate_file.c_str(), "w"), &std::fclose};
+    return key_file && certificate_file &&
+           PEM_write_PrivateKey(key_file.get(), key.get(), nullptr, nullptr, 0,
+                                nullptr, nullptr) &&
+           PEM_write_X509(certificate_file.get(), certificate.get());
+}
+
+pid_t spawn_server(const Certificate* certificate) {
+    auto options = bench::server_options(Port);
+    if (certificate) {
+        options.tls = {.certificate_file = certificate->certificate_file,
+                       .private_key_file = certificate->private_key_file};
+    }
+    return bench::spawn_server(std::move(options));
+}
+
+struct Client {
+    asio::generic::stream_protocol::socket socket;
+    std::unique_ptr<TlsStream> tls;
+    bench::TextReader reader;
+};
+
+// Connects, and completes the handshake when `context` is set. Runs the
+// io_context until then, so nothing else may be pending on it.
+std::unique_ptr<Client> connect_client(asio::io_context& io_context,
+                                       asio::ssl::context* context,
+                                       TlsStream::Session session = nullptr) {
+    auto client = std::make_unique<Client>(Client{
+        .socket = asio::generic::stream_protocol::socket{io_context},
+        .tls = nullptr,
+        .reader = {}});
+    bench::connect(client->socket, Port);
+    if (!context) {
+        return client;
+    }
+
+    client->tls = std::make_unique<TlsStream>(
+        client->socket, *context, bench::Address, std::move(session));
+    asio::error_code handshake_ec;
+    client->tls->async_handshake(
+        [&](asio::error_code ec) { handshake_ec = ec; });
+    io_context.restart();
+    io_context.run();
+    if (handshake_ec) {
+        std::println("Handshake failed: {}", handshake_ec.message());
+        return nullptr;
+    }
+    return client;
+}
+
+template <typename Operation>
+void with_stream(Client& client, Operation&& operation) {
+    if (client.tls) {
+        operation(*client.tls);
+    } else {
+        operation(client.socket);
+    }
+}
+
+void write_frames(asio::io_context& io_context, Client& client,
+                  const SerializedMessage& frames) {
+    with_stream(client, [&](auto& stream) {
+        asio::async_write(stream, asio::buffer(frames),
+                          [](asio::error_code, size_t) {});
+    });
+    io_context.restart();
+    io_context.run();
+}
+
+void read_texts(Client& client, size_t expected) {
+    with_stream(client, [&](auto& stream) {
+        bench::read_texts(stream, client.reader, expected);
+    });
+}
+
+// Reads until the server's ticket for the next connection arrived, then
+// closes. Tickets come after the handshake and each is used only once, so
+// a client resuming again needs the one its last connection received.
+bool await_ticket(asio::io_context& io_context, Client& client) {
+    const auto offered = client.tls->get_session();
+    read_texts(client, 1);
+    io_context.restart();
+    while (client.tls->get_session() == offered &&
+           io_context.run_one_for(1s) != 0) {
+    }
+    asio::error_code ignored;
+    client.socket.close(ignored);
+    io_context.restart();
+    io_context.run();
+    return client.tls->get_session() != offered;
+}
+
+struct HandshakeResult {
+    double per_second;
+    size_t resumed;
+};
+
+HandshakeResult run_handshakes(asio::ssl::context& context, size_t handshakes,
+                               bool is_resuming) {
+    asio::io_context io_context;
+    TlsStream::Session session;
+    size_t resumed{0};
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < handshakes; ++i) {
+        auto client = connect_client(io_context, &context,
+                                     is_resuming ? session : nullptr);
+        if (!client || !await_ticket(io_context, *client)) {
+            return {};
+        }
+        resumed += client->tls->is_resumed();
+        session = client->tls->get_session();
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return {.per_second = static_cast<double>(handshakes) / elapsed.count(),
+            .resumed = resumed};
+}
+
+struct BroadcastResult {
+    double deliveries_per_second;
+    bool is_complete;
+    bool is_ktls;
+};
+
+BroadcastResult run_broadcast(asio::ssl::context* context, size_t receivers,
+                              size_t messages) {
+    asio::io_context io_context;
+    std::vector<std::unique_ptr<Client>> clients;
+    for (size_t i = 0; i <= receivers; ++i) {
+        auto client = connect_client(io_context, context);
+        if (!client) {
+            return {};
+        }
+        write_frames(io_context, *client,
+                     serialize(Message{ConnectMessage{
+                         .nick = std::pmr::string{std::format("c{}", i)}}}));
+        clients.push_back(std::move(client));
+    }
+    // Lets every join land before the sender starts.
+    std::this_thread::sleep_for(200ms);
+
+    SerializedMessage frames;
+    const auto frame = serialize(Message{TextMessage{
+        .message = "the quick brown fox jumps over the lazy dog"}});
+    for (size_t i = 0; i < messages; ++i) {
+        frames.insert(frames.end(), frame.begin(), frame.end());
+    }
+
+    auto& sender = *clients.back();
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < receivers; ++i) {
+        read_texts(*clients[i], messages);
+    }
+    with_stream(sender, [&](auto& stream) {
+        asio::async_write(stream, asio::buffer(frames),
+                          [](asio::error_code, size_t) {});
+    });
+    io_context.restart();
+    io_context.run_for(30s);
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    size_t delivered{0};
+    for (size_t i = 0; i < receivers; ++i) {
+        delivered += clients[i]->reader.texts;
+    }
+    return {.deliveries_per_second =
+                static_cast<double>(delivered) / elapsed.count(),
+            .is_complete = delivered == receivers * messages,
+            .is_ktls = sender.tls && sender.tls->is_ktls_send()};
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t handshakes = argc > 1 ? std::stoul(argv[1]) : 2000;
+    const size_t receivers = argc > 2 ? std::stoul(argv[2]) : 8;
+    const size_t messages = argc > 3 ? std::stoul(argv[3]) : 20000;
+    // TlsStream writes with write(), for the clients and the forked server.
+    ::signal(SIGPIPE, SIG_IGN);
+
+    const auto directory = std::filesystem::temp_directory_path();
+    const Certificate certificate{
+        .certificate_file =
+            directory / std::format("chat-bench-{}-cert.pem", ::getpid()),
+        .private_key_file =
+            directory / std::format("chat-bench-{}-key.pem", ::getpid())};
+    if (!write_self_signed(certificate)) {
+        std::println("Could not generate a certificate.");
+        return 1;
+    }
+
+    asio::ssl::context context{asio::ssl::context::tls_client};
+    TlsStream::configure_client(context, certificate.certificate_file);
+
+    auto pid = spawn_server(&certificate);
+    std::println("{:>10} {:>14} {:>10}", "handshake", "handshakes/s",
+                 "resumed");
+    for (const bool is_resuming : {false, true}) {
+        const auto result = run_handshakes(context, handshakes, is_resuming);
+        std::println("{:>10} {:>14.0f} {:>10}",
+                     is_resuming ? "resumed" : "full", result.per_second,
+                     result.resumed);
+    }
+
+    std::println("\n{:>10} {:>10} {:>16} {:>6}", "transport", "receivers",
+                 "deliveries/s", "kTLS");
+    for (const bool is_tls : {false, true}) {
+        if (!is_tls) {
+            bench::stop_server(pid);
+            pid = spawn_server(nullptr);
+        } else {
+            bench::stop_server(pid);
+            pid = spawn_server(&certificate);
+        }
+        const auto result =
+            run_broadcast(is_tls ? &context : nullptr, receivers, messages);
+        std::println("{:>10} {:>10} {:>16.0f} {:>6}{}",
+                     is_tls ? "tls" : "plaintext", receivers,
+                     result.deliveries_per_second,
+                     is_tls ? (result.is_ktls ? "on" : "off") : "-",
+                     result.is_complete ? "" : "  (timed out)");
+    }
+    bench::stop_server(pid);
+
+    std::filesystem::remove(certificate.certificate_file);
+    std::filesystem::remove(certificate.private_key_file);
+    return 0;
+}
@@ -0,0 +1,457 @@
+// Replays a traffic capture (see TrafficCapture, `server --capture`) against
+// a server and reports its throughput and latency.
+//
+// Every captured connection is opened, fed its frames and closed again at
+// the captured times divided by the speed, or as fast as the server takes
+// them with `max`. At `max` clients stay until the end instead, their
+// leaves and closes are dropped: sent as soon as they are read, they would
+// leave nobody to receive the messages of the others. All captured
+// connections go over TCP, frames that only make sense on the unix socket are
+// skipped. Joins are sent without resume tokens or compression, so each
+// replay starts fresh sessions and frames can be read as they are. Each chat and private message gets a trace frame
+// ahead of it, in place of any captured ones, and the replayed recipients
+// record its latency by stage.
+//
+// Start the server with rate limits raised above the captured traffic, like
+// `--message-rate 1000000 --message-burst 1000000 --byte-rate 1000000000
+// --byte-burst 1000000000`, or replayed clients are throttled.
+//
+// usage: traffic_replay <capture file> [speed] [address] [port]
+//        (default: 1x 127.0.0.1 9999, speed is like 1x, 10x or max)
+
+#include "../TraceStats.hpp"
+#include "../server/TrafficCapture.hpp"
+
+#include <asio.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <print>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Replaying pauses while this much waits to be written to the server.
+constexpr size_t MaxQueuedBytes = 64 << 20;
+// Events handled at once at max speed before reads get their turn.
+constexpr size_t EventsPerTurn = 256;
+// Once everything is sent, the replay ends when nothing arrived for this
+// long.
+constexpr auto QuietPeriod = 500ms;
+
+bool is_traced(MessageType type) {
+    return type == MessageType::Text || type == MessageType::PrivateMessage;
+}
+
+// Frames as the replay sends them, nullopt for frames it skips.
+std::optional<SerializedMessage> prepare_frame(const SerializedMessage& frame) {
+    MessageHeader header{};
+    std::memcpy(&header, frame.data(), MessageHeaderSize);
+    switch (header.type) {
+        case MessageType::ShmAttach:
+        case MessageType::Trace:
+            return std::nullopt;
+        case MessageType::Connect: {
+            ConnectMessage connect;
+            const SerializedMessage body{frame.begin() + MessageHeaderSize,
+                                         frame.end()};
+            if (!deserialize(body, connect)) {
+                return std::nullopt;
+            }
+            connect.resume_token = 0;
+            connect.last_sequence = 0;
+            connect.compression = Compression::None;
+            return serialize(Message{std::move(connect)});
+        }
+        default:
+            return frame;
+    }
+}
+
+class Replay {
+public:
+    Replay(asio::io_context& io_context, asio::ip::tcp::endpoint endpoint,
+           std::vector<CapturedEvent> events, double speed)
+        : io_context_(io_context), endpoint_(std::move(endpoint)),
+          events_(std::move(events)), speed_(speed), timer_(io_context) {
+    }
+
+    void start() {
+        start_ = Clock::now();
+        last_receive_ = start_;
+        schedule();
+    }
+
+    void print_report() const {
+        const std::chrono::duration<double> sending = sent_at_ - start_;
+        const std::chrono::duration<double> receiving =
+            last_receive_ - start_;
+        const auto captured =
+            events_.empty() ? std::chrono::duration<double>{}
+                            : std::chrono::duration<double>{
+                                  events_.back().time};
+        std::println("replayed {} connections, {:.2f} s of traffic, in "
+                     "{:.3f} s",
+                     links_.size(), captured.count(), sending.count());
+        std::println("sent {} frames, {:.0f} frames/s, at most {:.1f} ms "
+                     "behind schedule",
+                     sent_frames_,
+                     static_cast<double>(sent_frames_) /
+                         std::max(sending.count(), 1e-9),
+                     std::chrono::duration<double, std::milli>(max_lag_)
+                         .count());
+        std::println("received {} frames, {} chat and private messages, "
+                     "{:.0f} messages/s",
+                     received_frames_, received_messages_,
+                     static_cast<double>(received_messages_) /
+                         std::max(receiving.count(), 1e-9));
+        if (failed_connections_ != 0) {
+            std::println("{} connections failed", failed_connections_);
+        }
+        for (const auto stage :
+             {TraceStage::Uplink, TraceStage::ServerProcessing,
+              TraceStage::ServerQueueing, TraceStage::Downlink,
+              TraceStage::EndToEnd}) {
+            const auto& stage_stats = trace_stats_.get(stage);
+            if (stage_stats.get_count() == 0) {
+                continue;
+            }
+            std::println(
+                "{:>18}: {} messages, {} us on average, 99% under {} us, at "
+                "most {} us",
+                to_string(stage), stage_stats.get_count(),
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    stage_stats.get_mean())
+                    .count(),
+                stage_stats.get_bound(0.99).count(),
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    stage_stats.get_max())
+                    .count());
+        }
+    }
+
+private:
+    // A captured connection.
+    struct Link {
+        explicit Link(asio::io_context& io_context) : socket(io_context) {
+        }
+
+        asio::ip::tcp::socket socket;
+        bool is_connected{false};
+        // Frames for a connection that could not connect are dropped.
+        bool is_failed{false};
+        bool is_closing{false};
+        std::deque<SerializedMessage> writes;
+        // The ones in flight.
+        size_t writing{0};
+        std::array<uint8_t, MessageHeaderSize> header{};
+        SerializedMessage body;
+        std::optional<TraceMessage> pending_trace;
+    };
+
+    Clock::time_point due(const CapturedEvent& event) const {
+        return start_ + std::chrono::duration_cast<Clock::duration>(
+                            std::chrono::duration<double, std::nano>(
+                                static_cast<double>(event.time.count()) /
+                                speed_));
+    }
+
+    void schedule() {
+        if (next_event_ == events_.size()) {
+            check_sent();
+            await_quiet();
+            return;
+        }
+        if (queued_bytes_ > MaxQueuedBytes) {
+            // Resumed by the write that gets below the limit.
+            is_blocked_ = true;
+            return;
+        }
+
+        const auto now = Clock::now();
+        for (size_t handled = 0;
+             handled < EventsPerTurn && next_event_ < events_.size();
+             ++handled) {
+            const auto& event = events_[next_event_];
+            if (speed_ != 0) {
+                const auto event_due = due(event);
+                if (event_due > now) {
+                    timer_.expires_at(event_due);
+                    timer_.async_wait([this](asio::error_code ec) {
+                        if (!ec) {
+                            schedule();
+                        }
+                    });
+                    return;
+                }
+                max_lag_ = std::max(max_lag_, now - event_due);
+            }
+            handle(event);
+            ++next_event_;
+        }
+        asio::post(io_context_, [this] { schedule(); });
+    }
+
+    void handle(const CapturedEvent& event) {
+        auto& link = links_[event.connection];
+        if (!link) {
+            link = std::make_shared<Link>(io_context_);
+            connect(link);
+        }
+        switch (event.event) {
+            case CaptureEvent::Opened:
+                break;
+            case CaptureEvent::Frame: {
+                auto frame = prepare_frame(event.frame);
+                if (!frame || link->is_failed) {
+                    break;
+                }
+                MessageHeader header{};
+                std::memcpy(&header, frame->data(), MessageHeaderSize);
+                if (speed_ == 0 && header.type == MessageType::Disconnect) {
+                    break;
+                }
+                if (is_traced(header.type)) {
+                    queue(*link, serialize(Message{TraceMessage{
+                                     .trace_id = ++next_trace_id_,
+                                     .client_send = trace_clock_now()}}));
+                }
+                queue(*link, std::move(*frame));
+                ++sent_frames_;
+                break;
+            }
+            case CaptureEvent::Closed:
+                link->is_closing = speed_ != 0;
+                break;
+        }
+        if (link->is_connected) {
+            do_write(link);
+        }
+    }
+
+    void queue(Link& link, SerializedMessage frame) {
+        queued_bytes_ += frame.size();
+        link.writes.push_back(std::move(frame));
+    }
+
+    void connect(const std::shared_ptr<Link>& link) {
+        link->socket.async_connect(endpoint_, [this, link](asio::error_code ec) {
+            if (ec) {
+                ++failed_connections_;
+                link->is_failed = true;
+                for (const auto& frame : link->writes) {
+                    queued_bytes_ -= frame.size();
+                }
+                link->writes.clear();
+                resume_if_blocked();
+                check_sent();
+                return;
+            }
+            asio::error_code ignored;
+            link->socket.set_option(asio::ip::tcp::no_delay(true), ignored);
+            link->is_connected = true;
+            do_read_header(link);
+            do_write(link);
+        });
+    }
+
+    void do_write(const std::shared_ptr<Link>& link) {
+        if (link->writing != 0) {
+            return;
+        }
+        if (link->writes.empty()) {
+            if (link->is_closing && link->socket.is_open()) {
+                asio::error_code ignored;
+                link->socket.shutdown(asio::ip::tcp::socket::shutdown_both,
+                                      ignored);
+                link->socket.close(ignored);
+            }
+            return;
+        }
+
+        std::vector<asio::const_buffer> buffers;
+        for (const auto& frame : link->writes) {
+            buffers.push_back(asio::buffer(frame));
+        }
+        link->writing = buffers.size();
+        asio::async_write(link->socket, buffers,
+                          [this, link](asio::error_code ec, size_t) {
+                              for (; link->writing != 0; --link->writing) {
+                                  queued_bytes_ -= link->writes.front().size();
+                                  link->writes.pop_front();
+                              }
+                              if (ec) {
+                                  for (const auto& frame : link->writes) {
+                                      queued_bytes_ -= frame.size();
+                                  }
+                                  link->writes.clear();
+                              }
+                              resume_if_blocked();
+                              check_sent();
+                              if (!ec) {
+                                  do_write(link);
+                              }
+                          });
+    }
+
+    // Notes when the last frame was written.
+    void check_sent() {
+        if (next_event_ == events_.size() && queued_bytes_ == 0 &&
+            sent_at_ == Clock::time_point{}) {
+            sent_at_ = Clock::now();
+        }
+    }
+
+    void resume_if_blocked() {
+        if (is_blocked_ && queued_bytes_ <= MaxQueuedBytes) {
+            is_blocked_ = false;
+            schedule();
+        }
+    }
+
+    void do_read_header(const std::shared_ptr<Link>& link) {
+        asio::async_read(
+            link->socket, asio::buffer(link->header),
+            [this, link](asio::error_code ec, size_t) {
+                MessageHeader header{};
+                if (ec || !deserialize({link->header.begin(),
+                                        link->header.end()},
+                                       header)) {
+                    return;
+                }
+                link->body.resize(header.body_size);
+                asio::async_read(link->socket, asio::buffer(link->body),
+                                 [this, link, header](asio::error_code ec,
+                                                      size_t) {
+                                     if (!ec) {
+                                         handle_frame(*link, header.type);
+                                         do_read_header(link);
+                                     }
+                                 });
+            });
+    }
+
+    void handle_frame(Link& link, MessageType type) {
+        const auto now = trace_clock_now();
+        last_receive_ = Clock::now();
+        ++received_frames_;
+        if (type == MessageType::Trace) {
+            TraceMessage trace;
+            if (deserialize(link.body, trace)) {
+                trace.client_receive = now;
+                link.pending_trace = trace;
+            }
+            return;
+        }
+        if (!is_traced(type)) {
+            return;
+        }
+        ++received_messages_;
+        if (link.pending_trace) {
+            const auto& trace = *link.pending_trace;
+            trace_stats_.record_received(trace, now);
+            trace_stats_.record(TraceStage::ServerProcessing,
+                                trace.server_receive, trace.server_enqueue);
+            trace_stats_.record(TraceStage::ServerQueueing,
+                                trace.server_enqueue, trace.server_write);
+            link.pending_trace.reset();
+        }
+    }
+
+    // Waits for the messages still on their way, then closes everything.
+    void await_quiet() {
+        const auto now = Clock::now();
+        if (queued_bytes_ == 0 && now - last_receive_ >= QuietPeriod) {
+            for (auto& [id, link] : links_) {
+                asio::error_code ignored;
+                link->socket.close(ignored);
+            }
+            io_context_.stop();
+            return;
+        }
+        timer_.expires_after(QuietPeriod / 5);
+        timer_.async_wait([this](asio::error_code ec) {
+            if (!ec) {
+                await_quiet();
+            }
+        });
+    }
+
+    asio::io_context& io_context_;
+    asio::ip::tcp::endpoint endpoint_;
+    std::vector<CapturedEvent> events_;
+    // 0 replays as fast as possible.
+    double speed_;
+    asio::steady_timer timer_;
+    size_t next_event_{0};
+    std::unordered_map<uint32_t, std::shared_ptr<Link>> links_;
+    size_t queued_bytes_{0};
+    bool is_blocked_{false};
+    uint64_t next_trace_id_{0};
+
+    Clock::time_point start_;
+    Clock::time_point sent_at_;
+    Clock::time_point last_receive_;
+    Clock::duration max_lag_{};
+    size_t sent_frames_{0};
+    size_t received_frames_{0};
+    size_t received_messages_{0};
+    size_t failed_connections_{0};
+    TraceStats trace_stats_;
+};
+
+// "max" as 0.
+bool parse_speed(std::string_view text, double& speed) {
+    if (text == "max") {
+        speed = 0;
+        return true;
+    }
+    if (text.ends_with('x')) {
+        text.remove_suffix(1);
+    }
+    try {
+        speed = std::stod(std::string{text});
+    } catch (const std::exception&) {
+        return false;
+    }
+    return speed > 0;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    double speed{1};
+    if (argc < 2 || (argc > 2 && !parse_speed(argv[2], speed))) {
+        std::println("usage: traffic_replay <capture file> [1x | 10x | ... | "
+                     "max] [address] [port]");
+        return 1;
+    }
+    const std::string address = argc > 3 ? argv[3] : "127.0.0.1";
+    const std::string port = argc > 4 ? argv[4] : "9999";
+
+    auto events = read_capture(argv[1]);
+    if (!events) {
+        std::println("{} is not a traffic capture", argv[1]);
+        return 1;
+    }
+
+    asio::io_context io_context;
+    asio::ip::tcp::resolver resolver{io_context};
+    Replay replay{io_context,
+                  resolver.resolve(address, port).begin()->endpoint(),
+                  std::move(*events), speed};
+    replay.start();
+    io_context.run();
+    replay.print_report();
+    return 0;
+}
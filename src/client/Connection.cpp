@@ -1,18 +1,36 @@
 #include "Connection.hpp"
 #include "../Message.hpp"
+#include "../TraceStats.hpp"
 
 #include <asio/error.hpp>
+#include <cstring>
 #include <print>
+#include <span>
 
 using namespace std::chrono_literals;
 
-Connection::Connection(asio::io_context& io_context,
-                       asio::ip::tcp::resolver::results_type endpoints,
-                       std::queue<Message>& received_messages)
-    : io_context_(io_context), endpoints_(std::move(endpoints)),
-      socket_(io_context_), received_messages_(received_messages),
-      connect_timer_(io_context_), is_connected_(false),
-      is_server_online_(false), nick_(std::nullopt) {
+namespace {
+constexpr auto InitialReconnectDelay = 250ms;
+constexpr auto MaxReconnectDelay = 30s;
+// A server that accepts but never answers the handshake is given up on.
+constexpr auto HandshakeTimeout = 10s;
+// Queued frames written at once, at least one.
+constexpr size_t MaxWriteBytes = 64 << 10;
+} // namespace
+
+Connection::Connection(asio::io_context& io_context, Endpoint endpoint,
+                       std::queue<Message>& received_messages,
+                       asio::ssl::context* tls_context, std::string tls_host)
+    : io_context_(io_context), endpoint_(std::move(endpoint)),
+      socket_(io_context_), tls_context_(tls_context),
+      tls_host_(std::move(tls_host)), received_messages_(received_messages),
+      connect_timer_(io_context_), handshake_timer_(io_context_),
+      is_connected_(false),
+      is_server_online_(false), nick_(std::nullopt), user_id_(InvalidUserId), resume_token_(0),
+      last_sequence_(0), users_version_(0), is_users_resync_pending_(false),
+      reconnect_attempt_(0),
+      random_engine_(std::random_device{}()),
+      file_transfers_(received_messages_) {
 }
 
 void Connection::connect() {
@@ -20,95 +38,262 @@ void Connection::connect() {
 }
 
 void Connection::join(std::string nick) {
-    const auto msg_to_send = std::make_shared<SerializedMessage>(
-        serialize(Message{ConnectMessage{.nick = nick}}));
+    asio::post(io_context_, [this, nick = std::move(nick)] {
+        write_frame(serialize(Message{ConnectMessage{
+                        .nick = std::pmr::string{nick},
+                        .resume_token = resume_token_,
+                        .last_sequence = last_sequence_,
+                        .compression = Compression::Zlib}}),
+                    [this, nick](asio::error_code ec) {
+                        if (!ec) {
+                            is_connected_ = true;
+                            nick_ = nick;
+                            do_read_header();
+                        }
+                    });
+    });
+}
 
-    auto handle_send = [msg_to_send, this, nick](asio::error_code ec,
-                                                 size_t bytes) {
-        if (!ec) {
-            is_connected_ = true;
-            nick_ = nick;
-            do_read_header();
-        } else if (ec == asio::error::broken_pipe ||
-                   ec == asio::error::connection_reset) {
-            is_server_online_ = false;
+void Connection::leave() {
+    asio::post(io_context_, [this] {
+        write_frame(serialize(Message{
+                        DisconnectMessage{.nick = std::pmr::string{*nick_}}}),
+                    [this](asio::error_code ec) {
+                        if (!ec) {
+                            is_connected_ = false;
+                            nick_ = std::nullopt;
+                            user_id_ = InvalidUserId;
+                            resume_token_ = 0;
+                            last_sequence_ = 0;
+                            users_version_ = 0;
+                            file_transfers_.cancel_all();
+                        }
+                    });
+    });
+}
+
+void Connection::send(const Message& msg) {
+    std::vector<SerializedMessage> frames;
+    append_frames(msg, frames);
+    asio::post(io_context_, [this, frames = std::move(frames)]() mutable {
+        for (auto& frame : frames) {
+            write_frame(std::move(frame));
         }
-    };
+    });
+}
 
-    socket_.async_send(asio::buffer(*msg_to_send), handle_send);
+void Connection::send_batch(std::vector<Message> messages) {
+    std::vector<SerializedMessage> frames;
+    frames.reserve(messages.size());
+    for (const auto& msg : messages) {
+        append_frames(msg, frames);
+    }
+    asio::post(io_context_, [this, frames = std::move(frames)]() mutable {
+        for (auto& frame : frames) {
+            write_frame(std::move(frame));
+        }
+    });
 }
 
-void Connection::leave() {
-    const auto msg_to_send = std::make_shared<SerializedMessage>(
-        serialize(Message{DisconnectMessage{.nick = *nick_}}));
+void Connection::append_frames(const Message& msg,
+                               std::vector<SerializedMessage>& frames) {
+    if (is_tracing_ && (std::holds_alternative<TextMessage>(msg) ||
+                        std::holds_alternative<PrivateMessage>(msg))) {
+        frames.push_back(serialize(Message{
+            TraceMessage{.trace_id = ++next_trace_id_,
+                         .client_send = trace_clock_now()}}));
+    }
+    frames.push_back(serialize(msg));
+}
 
-    socket_.async_send(asio::buffer(*msg_to_send),
-                       [msg_to_send, this](asio::error_code ec, size_t bytes) {
-                           if (!ec) {
-                               is_connected_ = false;
-                               nick_ = std::nullopt;
-                           } else if (ec == asio::error::broken_pipe ||
-                                      ec == asio::error::connection_reset) {
-                               is_server_online_ = false;
-                           }
-                       });
+void Connection::set_tracing(bool is_tracing) {
+    is_tracing_ = is_tracing;
 }
 
-void Connection::send(const Message& msg) {
-    auto serialized_msg = serialize(msg);
-    const auto msg_to_send =
-        std::make_shared<SerializedMessage>(std::move(serialized_msg));
+void Connection::send_file(UserId to, std::string path) {
+    asio::post(io_context_, [this, to, path = std::move(path)] {
+        if (auto offer = file_transfers_.send_file(to, path)) {
+            write_frame(serialize(Message{std::move(*offer)}));
+        }
+    });
+}
 
-    auto handle_send = [msg_to_send, this](asio::error_code ec, size_t bytes) {
-        if (ec == asio::error::broken_pipe ||
-            ec == asio::error::connection_reset) {
-            is_server_online_ = false;
+void Connection::accept_file(UserId from) {
+    asio::post(io_context_, [this, from] {
+        if (auto ack = file_transfers_.accept(from)) {
+            write_frame(serialize(Message{*ack}));
         }
-    };
+    });
+}
 
-    socket_.async_send(asio::buffer(*msg_to_send), handle_send);
+void Connection::decline_file(UserId from) {
+    asio::post(io_context_, [this, from] {
+        if (auto ack = file_transfers_.decline(from)) {
+            write_frame(serialize(Message{*ack}));
+        }
+    });
 }
 
-void Connection::do_connect(const bool is_reconnection) {
-    socket_.async_connect(*endpoints_.begin(), [is_reconnection, this](asio::error_code ec) {
-        if (!ec) {
-            is_server_online_ = true;
-            if (is_reconnection && is_connected_ && nick_) {
-                join(*nick_);
+void Connection::write_frame(SerializedMessage frame, WriteHandler handler) {
+    writes_.push_back(
+        {.frame = std::make_shared<const SerializedMessage>(std::move(frame)),
+         .handler = std::move(handler)});
+    queued_frames_ = writes_.size();
+    if (!is_writing_) {
+        do_write();
+    }
+}
+
+void Connection::do_write() {
+    if (writes_.empty() && is_server_online_) {
+        if (auto chunk = file_transfers_.next_chunk()) {
+            writes_.push_back(
+                {.frame = std::make_shared<const SerializedMessage>(
+                     serialize(Message{std::move(*chunk)})),
+                 .handler = {}});
+        }
+    }
+    if (writes_.empty()) {
+        is_writing_ = false;
+        if (is_closing_) {
+            finish_close();
+        }
+        return;
+    }
+
+    is_writing_ = true;
+    std::vector<asio::const_buffer> buffers;
+    size_t bytes{0};
+    for (const auto& write : writes_) {
+        if (!buffers.empty() && bytes + write.frame->size() > MaxWriteBytes) {
+            break;
+        }
+        buffers.push_back(asio::buffer(*write.frame));
+        bytes += write.frame->size();
+    }
+    async_write_all(buffers, [this, count = buffers.size()](
+                                 asio::error_code ec, size_t) {
+        for (size_t i = 0; i < count && !writes_.empty(); ++i) {
+            auto write = std::move(writes_.front());
+            writes_.pop_front();
+            if (write.handler) {
+                write.handler(ec);
             }
-            check_connection();
-        } else {
-            connect_timer_.expires_after(1s);
-            connect_timer_.async_wait([this](asio::error_code ec) {
-                if (!ec && !is_server_online()) {
-                    do_connect(true);
-                }
-            });
         }
+        if (ec) {
+            if (ec == asio::error::broken_pipe ||
+                ec == asio::error::connection_reset) {
+                is_server_online_ = false;
+            }
+            // The reconnect queues the join again.
+            writes_.clear();
+            queued_frames_ = 0;
+            is_writing_ = false;
+            if (is_closing_) {
+                finish_close();
+            }
+            return;
+        }
+        queued_frames_ = writes_.size();
+        do_write();
     });
 }
 
-void Connection::check_connection() {
-    auto serialized_ping_message = serialize(PingServerMessage{});
-    const auto ping_message =
-        std::make_shared<SerializedMessage>(serialized_ping_message);
+void Connection::do_connect(const bool is_reconnection) {
+    socket_.async_connect(endpoint_, [is_reconnection, this](asio::error_code ec) {
+        if (ec) {
+            schedule_reconnect();
+            return;
+        }
+        if (!tls_context_) {
+            handle_connected(is_reconnection);
+            return;
+        }
 
-    socket_.async_send(
-        asio::buffer(*ping_message),
-        [ping_message, this](asio::error_code ec, size_t bytes) {
+        tls_ = std::make_unique<TlsStream>(socket_, *tls_context_, tls_host_,
+                                           tls_session_);
+        // Closing the socket fails the handshake, which reconnects.
+        handshake_timer_.expires_after(HandshakeTimeout);
+        handshake_timer_.async_wait([this](asio::error_code ec) {
             if (!ec) {
-                connect_timer_.expires_after(1s);
-                connect_timer_.async_wait([this](asio::error_code ec) {
-                    if (!ec) {
-                        check_connection();
-                    }
-                });
-            } else if (ec == asio::error::broken_pipe ||
-                       ec == asio::error::connection_reset) {
-                is_server_online_ = false;
-                do_connect();
+                asio::error_code ignored;
+                socket_.close(ignored);
             }
         });
+        tls_->async_handshake([is_reconnection, this](asio::error_code ec) {
+            handshake_timer_.cancel();
+            if (ec) {
+                received_messages_.push(TextMessage{
+                    .from = InvalidUserId,
+                    .message = std::pmr::string{"TLS handshake failed: " +
+                                                ec.message()}});
+                schedule_reconnect();
+                return;
+            }
+            handle_connected(is_reconnection);
+        });
+    });
+}
+
+void Connection::handle_connected(bool is_reconnection) {
+    is_server_online_ = true;
+    reconnect_attempt_ = 0;
+    if (is_reconnection && is_connected_ && nick_) {
+        join(*nick_);
+    }
+    check_connection();
+}
+
+void Connection::schedule_reconnect() {
+    // The server dropped them along with the connection.
+    file_transfers_.cancel_all();
+    connect_timer_.expires_after(next_reconnect_delay());
+    connect_timer_.async_wait([this](asio::error_code ec) {
+        if (!ec && !is_server_online() && !is_closing_) {
+            asio::error_code ignored;
+            socket_.close(ignored);
+            if (tls_) {
+                if (tls_->get_session()) {
+                    tls_session_ = tls_->get_session();
+                }
+                // Reads and writes still pending on it complete with
+                // operation_aborted, after this.
+                asio::post(io_context_, [tls = std::move(tls_)] {});
+            }
+            do_connect(true);
+        }
+    });
+}
+
+// Exponential backoff with "equal jitter": the delay is drawn from the upper
+// half of the current window so clients dropped together spread out their
+// reconnects instead of hitting a restarted server at the same moment.
+std::chrono::milliseconds Connection::next_reconnect_delay() {
+    const auto window = std::min<std::chrono::milliseconds>(
+        MaxReconnectDelay,
+        InitialReconnectDelay * (1u << std::min(reconnect_attempt_, 10u)));
+    ++reconnect_attempt_;
+
+    std::uniform_int_distribution<std::chrono::milliseconds::rep> distribution{
+        window.count() / 2, window.count()};
+    return std::chrono::milliseconds{distribution(random_engine_)};
+}
+
+void Connection::check_connection() {
+    write_frame(serialize(PingServerMessage{}), [this](asio::error_code ec) {
+        if (!ec) {
+            connect_timer_.expires_after(1s);
+            connect_timer_.async_wait([this](asio::error_code ec) {
+                if (!ec) {
+                    check_connection();
+                }
+            });
+        } else if (ec == asio::error::broken_pipe ||
+                   ec == asio::error::connection_reset) {
+            is_server_online_ = false;
+            schedule_reconnect();
+        }
+    });
 }
 
 void Connection::do_read_header() {
@@ -122,7 +307,7 @@ void Connection::do_read_header() {
                 do_read_body(std::move(header));
             } else {
                 received_messages_.push(TextMessage{
-                    .from = "Internal Client",
+                    .from = InvalidUserId,
                     .message = {"Could not deserialize header message."}});
             }
         } else if (ec == asio::error::eof) {
@@ -130,16 +315,19 @@ void Connection::do_read_header() {
         }
     };
 
-    asio::async_read(socket_, asio::buffer(buffer_),
-                     asio::transfer_exactly(sizeof(MessageHeader)),
-                     handle_read);
+    buffer_.resize(MessageHeaderSize);
+    async_read_exactly(asio::buffer(buffer_), handle_read);
 }
 
 void Connection::do_read_body(MessageHeader header) {
-    auto handle_read = [&](asio::error_code ec, size_t bytes_read) {
+    auto handle_read = [header, this](asio::error_code ec, size_t bytes_read) {
         if (!ec) {
             if (bytes_read == header.body_size) {
-                handle_new_message(header.type, bytes_read);
+                if (header.type == MessageType::Compressed) {
+                    handle_compressed();
+                } else {
+                    handle_frame(header.type);
+                }
                 do_read_header();
             }
         } else if (ec == asio::error::eof) {
@@ -147,35 +335,175 @@ void Connection::do_read_body(MessageHeader header) {
         }
     };
 
-    asio::async_read(socket_, asio::buffer(buffer_),
-                     asio::transfer_exactly(header.body_size), handle_read);
+    buffer_.resize(header.body_size);
+    async_read_exactly(asio::buffer(buffer_), handle_read);
+}
+
+void Connection::handle_frame(MessageType type) {
+    {
+        const FrameArena::Scope frame{frame_arena_};
+        handle_new_message(type);
+    }
+    if (type != MessageType::Trace) {
+        pending_trace_.reset();
+    }
 }
 
-void Connection::handle_new_message(MessageType type, size_t message_length) {
+void Connection::handle_compressed() {
+    if (!inflater_.decompress(buffer_, inflated_)) {
+        received_messages_.push(TextMessage{
+            .from = InvalidUserId,
+            .message = {"Could not decompress a frame from the server."}});
+        return;
+    }
+    std::span<const uint8_t> frames{inflated_};
+    while (frames.size() >= MessageHeaderSize) {
+        MessageHeader header{};
+        std::memcpy(&header, frames.data(), MessageHeaderSize);
+        if (frames.size() - MessageHeaderSize < header.body_size) {
+            break;
+        }
+        const auto body = frames.subspan(MessageHeaderSize, header.body_size);
+        buffer_.assign(body.begin(), body.end());
+        handle_frame(header.type);
+        frames = frames.subspan(MessageHeaderSize + header.body_size);
+    }
+}
+
+void Connection::handle_new_message(MessageType type) {
     switch (type) {
         case MessageType::Text: {
-            append_new_message<TextMessage>(message_length);
+            append_new_message<TextMessage>();
             break;
         }
         case MessageType::PrivateMessage: {
-            append_new_message<PrivateMessage>(message_length);
+            append_new_message<PrivateMessage>();
             break;
         }
         case MessageType::ChatUsers: {
-            append_new_message<ChatUsersMessage>(message_length);
+            append_new_message<ChatUsersMessage>();
+            break;
+        }
+        case MessageType::UserJoined: {
+            append_new_message<UserJoinedMessage>();
+            break;
+        }
+        case MessageType::UserLeft: {
+            append_new_message<UserLeftMessage>();
+            break;
+        }
+        case MessageType::SearchResponse: {
+            append_new_message<SearchResponseMessage>();
+            break;
+        }
+        case MessageType::OfflineMessage: {
+            append_new_message<OfflineMessage>();
+            break;
+        }
+        case MessageType::DeliveryStatus: {
+            append_new_message<DeliveryStatusMessage>();
+            break;
+        }
+        case MessageType::FileOffer:
+        case MessageType::FileChunk:
+        case MessageType::FileAck: {
+            handle_file_message(type);
+            break;
+        }
+        case MessageType::Trace: {
+            TraceMessage trace;
+            if (deserialize(buffer_, trace)) {
+                trace.client_receive = trace_clock_now();
+                pending_trace_ = trace;
+            }
+            break;
+        }
+        case MessageType::Session: {
+            SessionMessage session;
+            if (deserialize(buffer_, session)) {
+                user_id_ = session.user_id;
+                resume_token_ = session.resume_token;
+                last_sequence_ = session.sequence;
+                if (session.is_gap) {
+                    received_messages_.push(TextMessage{
+                        .from = InvalidUserId,
+                        .message = "Some messages sent while you were "
+                                   "disconnected are lost"});
+                }
+            }
             break;
         }
         case MessageType::PingServer:
         case MessageType::Connect:
-        case MessageType::Disconnect: {
+        case MessageType::Disconnect:
+        case MessageType::ResyncUsers:
+        case MessageType::SearchRequest:
+        case MessageType::PeerHello:
+        case MessageType::PeerMailbox:
+        case MessageType::ShmAttach:
+        case MessageType::Compressed: {
             break;
         }
     }
 }
 
+void Connection::handle_file_message(MessageType type) {
+    std::optional<FileAckMessage> ack;
+    if (type == MessageType::FileOffer) {
+        auto offer = make_message<FileOfferMessage>(frame_arena_.get());
+        if (deserialize(buffer_, offer)) {
+            ack = file_transfers_.handle_offer(offer);
+            if (!ack) {
+                // Copied out of the arena, the UI reads it later.
+                received_messages_.push(offer);
+            }
+        }
+    } else if (type == MessageType::FileChunk) {
+        auto chunk = make_message<FileChunkMessage>(frame_arena_.get());
+        if (deserialize(buffer_, chunk)) {
+            ack = file_transfers_.handle_chunk(chunk);
+        }
+    } else {
+        FileAckMessage file_ack;
+        if (deserialize(buffer_, file_ack)) {
+            file_transfers_.handle_ack(file_ack, user_id_);
+            // New credit, chunks go out once the queue is idle.
+            if (!is_writing_) {
+                do_write();
+            }
+        }
+    }
+
+    if (ack) {
+        write_frame(serialize(Message{*ack}));
+    }
+}
+
+void Connection::request_chat_users() {
+    is_users_resync_pending_ = true;
+    send(ResyncUsersMessage{});
+}
+
 void Connection::close() {
-    socket_.shutdown(asio::ip::tcp::socket::shutdown_both);
-    socket_.close();
+    asio::post(io_context_, [this] {
+        is_closing_ = true;
+        connect_timer_.cancel();
+        handshake_timer_.cancel();
+        if (!is_writing_) {
+            finish_close();
+        }
+    });
+}
+
+void Connection::finish_close() {
+    // close_notify goes out after the queued frames, never during a write.
+    if (tls_ && is_server_online_) {
+        tls_->shutdown();
+    }
+    is_server_online_ = false;
+    asio::error_code ignored;
+    socket_.shutdown(asio::socket_base::shutdown_both, ignored);
+    socket_.close(ignored);
 }
 
 bool Connection::is_connected() const {
@@ -186,6 +514,14 @@ const std::string& Connection::get_nick() const {
     return *nick_;
 }
 
+UserId Connection::get_user_id() const {
+    return user_id_;
+}
+
 bool Connection::is_server_online() const {
     return is_server_online_;
 }
+
+size_t Connection::get_queued_frames() const {
+    return queued_frames_;
+}
@@ -1,17 +1,32 @@
 #pragma once
 
+#include "../FrameArena.hpp"
+#include "../FrameCompression.hpp"
 #include "../Message.hpp"
+#include "../TlsStream.hpp"
+#include "FileTransfers.hpp"
 
 #include <array>
+#include <atomic>
 #include <asio.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <queue>
 #include <optional>
+#include <random>
 
 class Connection {
 public:
-    Connection(asio::io_context& io_context,
-               asio::ip::tcp::resolver::results_type endpoints,
-               std::queue<Message>& received_messages);
+    // TCP or unix socket endpoint of the server.
+    using Endpoint = asio::generic::stream_protocol::endpoint;
+
+    // With a `tls_context` the server certificate must name `tls_host`.
+    Connection(asio::io_context& io_context, Endpoint endpoint,
+               std::queue<Message>& received_messages,
+               asio::ssl::context* tls_context = nullptr,
+               std::string tls_host = {});
 
     Connection(const Connection&) = delete;
     Connection& operator=(const Connection&) = delete;
@@ -25,41 +40,161 @@ public:
     void connect();
     void join(std::string nick);
     void leave();
+    // Closes the connection once the queued frames are written.
     void close();
     void send(const Message& msg);
+    // Sends the messages in order, queued at once so they go out in as few
+    // writes as possible.
+    void send_batch(std::vector<Message> messages);
+    // Sends a TraceMessage ahead of every chat and private message.
+    void set_tracing(bool is_tracing);
+    // Offers the file at `path` to `to` and streams it once accepted.
+    void send_file(UserId to, std::string path);
+    // Answers the oldest file offer from `from`.
+    void accept_file(UserId from);
+    void decline_file(UserId from);
     bool is_connected() const;
     const std::string& get_nick() const;
+    UserId get_user_id() const;
     bool is_server_online() const;
+    // Frames queued and not written yet, for callers that produce faster
+    // than the server takes them.
+    size_t get_queued_frames() const;
 
 private:
     void do_connect(const bool is_reconnection = false);
+    void handle_connected(bool is_reconnection);
+    void schedule_reconnect();
+    std::chrono::milliseconds next_reconnect_delay();
     void check_connection();
     void do_read_header();
     void do_read_body(MessageHeader header);
-    void handle_new_message(MessageType type, size_t message_length);
+    // Handles the frame whose body is in buffer_.
+    void handle_frame(MessageType type);
+    // Handles each frame a Compressed frame carries.
+    void handle_compressed();
+    void handle_new_message(MessageType type);
+    void request_chat_users();
+    void handle_file_message(MessageType type);
+
+    using WriteHandler = std::function<void(asio::error_code)>;
+
+    // Queues a frame, written after the ones queued before it. Frames queued
+    // while a write is in flight go out together in the next one. File
+    // chunks are only written when nothing else is queued, one per write, so
+    // chat waits for at most one chunk.
+    void write_frame(SerializedMessage frame, WriteHandler handler = {});
+    void do_write();
+    void finish_close();
+    // Serializes `msg`, after a TraceMessage when tracing.
+    void append_frames(const Message& msg,
+                       std::vector<SerializedMessage>& frames);
+
+    // Reads and writes go through TLS when it is on. Writes are queued for
+    // the one-write-at-a-time rule of TlsStream.
+    template <typename Handler>
+    void async_read_exactly(asio::mutable_buffer buffer, Handler&& handler) {
+        if (tls_) {
+            asio::async_read(*tls_, buffer, std::forward<Handler>(handler));
+        } else {
+            asio::async_read(socket_, buffer, std::forward<Handler>(handler));
+        }
+    }
+
+    template <typename Buffers, typename Handler>
+    void async_write_all(const Buffers& buffers, Handler&& handler) {
+        if (tls_) {
+            asio::async_write(*tls_, buffers, std::forward<Handler>(handler));
+        } else {
+            asio::async_write(socket_, buffers, std::forward<Handler>(handler));
+        }
+    }
 
 
     template <typename Message>
-    void append_new_message(size_t message_length) {
-        Message msg;
-        if (deserialize({buffer_.begin(), buffer_.begin() + message_length},
-                        msg)) {
-            received_messages_.push(std::move(msg));
+    void append_new_message() {
+        auto msg = make_message<Message>(frame_arena_.get());
+        if (deserialize(buffer_, msg)) {
+            if constexpr (requires { msg.sequence; }) {
+                // Replayed frames may overlap with what was already received.
+                if (msg.sequence <= last_sequence_) {
+                    return;
+                }
+                last_sequence_ = msg.sequence;
+            }
+            if constexpr (std::is_same_v<Message, ChatUsersMessage>) {
+                users_version_ = msg.version;
+                is_users_resync_pending_ = false;
+            } else if constexpr (requires { msg.version; }) {
+                // Stale deltas, or deltas the requested snapshot will cover.
+                if (msg.version <= users_version_ || is_users_resync_pending_) {
+                    return;
+                }
+                if (msg.version != users_version_ + 1) {
+                    request_chat_users();
+                    return;
+                }
+                users_version_ = msg.version;
+            }
+            if constexpr (std::is_same_v<Message, TextMessage> ||
+                          std::is_same_v<Message, PrivateMessage>) {
+                if (pending_trace_) {
+                    received_messages_.push(*pending_trace_);
+                }
+            }
+            // Copied out of the arena, the UI reads it later.
+            received_messages_.push(msg);
         } else {
             received_messages_.push(TextMessage{
-                .from = "Internal Client",
+                .from = InvalidUserId,
                 .message = {"Something goes wrong during deserialization of body message"}});
         }
     }
 
     asio::io_context& io_context_;
-    asio::ip::tcp::resolver::results_type endpoints_;
-    asio::ip::tcp::socket socket_;
+    Endpoint endpoint_;
+    asio::generic::stream_protocol::socket socket_;
+    asio::ssl::context* tls_context_;
+    std::string tls_host_;
+    std::unique_ptr<TlsStream> tls_;
+    // Offered on reconnects so the server can skip the full handshake.
+    TlsStream::Session tls_session_;
     std::queue<Message>& received_messages_;
     asio::steady_timer connect_timer_;
+    asio::steady_timer handshake_timer_;
     bool is_connected_;
     bool is_server_online_;
     std::optional<std::string> nick_;
+    UserId user_id_;
+    uint64_t resume_token_;
+    uint64_t last_sequence_;
+    uint64_t users_version_;
+    bool is_users_resync_pending_;
+    unsigned reconnect_attempt_;
+    std::mt19937 random_engine_;
+    FileTransfers file_transfers_;
+    std::atomic<bool> is_tracing_{false};
+    std::atomic<uint64_t> next_trace_id_{0};
+    // Trace of the next frame from the server.
+    std::optional<TraceMessage> pending_trace_;
+
+    struct PendingWrite {
+        std::shared_ptr<const SerializedMessage> frame;
+        WriteHandler handler;
+    };
+    // Only touched on the io thread, the public methods post to it.
+    std::deque<PendingWrite> writes_;
+    bool is_writing_{false};
+    bool is_closing_{false};
+    // Size of writes_, read by other threads.
+    std::atomic<size_t> queued_frames_{0};
 
-    std::array<uint8_t, 1024> buffer_;
+    // Resized to the frame being read, roster snapshots can be large.
+    SerializedMessage buffer_;
+    // What frames are decoded into, released after each one. Room for the
+    // roster snapshot of a few thousand users.
+    FrameArena frame_arena_{1 << 20};
+    FrameInflater inflater_;
+    // Frames carried by the last Compressed frame.
+    SerializedMessage inflated_;
 };
@@ -0,0 +1,316 @@
+#include "FileTransfers.hpp"
+#include "../Crc32.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <format>
+
+namespace {
+constexpr unsigned MaxNameAttempts = 100;
+
+FileAckMessage make_cancel(UserId sender, uint32_t transfer_id) {
+    return {.sender = sender,
+            .transfer_id = transfer_id,
+            .status = FileAckStatus::Cancel,
+            .received = 0,
+            .window = 0};
+}
+} // namespace
+
+FileTransfers::FileTransfers(std::queue<Message>& notices) : notices_(notices) {
+}
+
+FileTransfers::~FileTransfers() {
+    cancel_all();
+}
+
+std::optional<FileOfferMessage> FileTransfers::send_file(UserId to,
+                                                        const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        notify(std::format("Could not open {}: {}", path, std::strerror(errno)));
+        return std::nullopt;
+    }
+    struct stat file_stat {};
+    if (::fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        ::close(fd);
+        notify(std::format("{} is not a regular file", path));
+        return std::nullopt;
+    }
+
+    const auto size = static_cast<size_t>(file_stat.st_size);
+    void* data = nullptr;
+    if (size != 0) {
+        data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // The mapping keeps the file alive.
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        notify(std::format("Could not map {}: {}", path, std::strerror(errno)));
+        return std::nullopt;
+    }
+    if (data) {
+        ::madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    const auto transfer_id = ++next_transfer_id_;
+    auto name = std::filesystem::path{path}.filename().string();
+    outgoing_[transfer_id] = {
+        .name = name,
+        .data = {static_cast<const uint8_t*>(data), size},
+        .sent = 0,
+        .credit_end = 0};
+    return FileOfferMessage{.from = InvalidUserId,
+                            .to = to,
+                            .transfer_id = transfer_id,
+                            .size = size,
+                            .name = std::pmr::string{name}};
+}
+
+std::optional<FileChunkMessage> FileTransfers::next_chunk() {
+    auto it = outgoing_.upper_bound(last_sending_);
+    for (size_t checked = 0; checked < outgoing_.size(); ++checked, ++it) {
+        if (it == std::end(outgoing_)) {
+            it = std::begin(outgoing_);
+        }
+        auto& transfer = it->second;
+        if (transfer.sent >=
+            std::min<uint64_t>(transfer.credit_end, transfer.data.size())) {
+            continue;
+        }
+
+        const auto length = std::min<uint64_t>(
+            FileChunkSize,
+            std::min<uint64_t>(transfer.credit_end, transfer.data.size()) -
+                transfer.sent);
+        const auto data = transfer.data.subspan(transfer.sent, length);
+        FileChunkMessage chunk{.from = InvalidUserId,
+                               .transfer_id = it->first,
+                               .offset = transfer.sent,
+                               .checksum = crc32(data),
+                               .data = {}};
+        chunk.data.resize(data.size());
+        std::memcpy(chunk.data.data(), data.data(), data.size());
+        transfer.sent += length;
+        last_sending_ = it->first;
+        return chunk;
+    }
+    return std::nullopt;
+}
+
+std::optional<FileAckMessage>
+FileTransfers::handle_offer(const FileOfferMessage& offer) {
+    const IncomingKey key{offer.from, offer.transfer_id};
+    if (offers_.contains(key) || incoming_.contains(key)) {
+        return std::nullopt;
+    }
+    if (offer.size > MaxFileSize) {
+        notify(std::format("{} is larger than {} bytes, declined", offer.name,
+                           MaxFileSize));
+        return make_cancel(offer.from, offer.transfer_id);
+    }
+    offers_.emplace(key, Offer{.name = std::string{offer.name},
+                               .size = offer.size});
+    return std::nullopt;
+}
+
+std::optional<FileAckMessage> FileTransfers::accept(UserId from) {
+    auto offer = offers_.lower_bound({from, 0});
+    if (offer == std::end(offers_) || offer->first.first != from) {
+        return std::nullopt;
+    }
+    const auto key = offer->first;
+    const auto [name, size] = std::move(offer->second);
+    offers_.erase(offer);
+
+    auto file = create_file(name);
+    if (!file) {
+        notify(std::format("Could not store {}, declined", name));
+        return make_cancel(key.first, key.second);
+    }
+
+    auto it = incoming_
+                  .emplace(key, Incoming{.path = std::move(file->second),
+                                         .fd = file->first,
+                                         .size = size,
+                                         .received = 0,
+                                         .acked = 0})
+                  .first;
+    if (size == 0) {
+        notify(std::format("Saved {}", it->second.path));
+        close_incoming(it);
+        return FileAckMessage{.sender = key.first,
+                              .transfer_id = key.second,
+                              .status = FileAckStatus::Window,
+                              .received = 0,
+                              .window = 0};
+    }
+    notify(std::format("Receiving {}", it->second.path));
+    return FileAckMessage{.sender = key.first,
+                          .transfer_id = key.second,
+                          .status = FileAckStatus::Window,
+                          .received = 0,
+                          .window = Window};
+}
+
+std::optional<FileAckMessage> FileTransfers::decline(UserId from) {
+    auto offer = offers_.lower_bound({from, 0});
+    if (offer == std::end(offers_) || offer->first.first != from) {
+        return std::nullopt;
+    }
+    notify(std::format("Declined {}", offer->second.name));
+    const auto key = offer->first;
+    offers_.erase(offer);
+    return make_cancel(key.first, key.second);
+}
+
+std::optional<FileAckMessage>
+FileTransfers::handle_chunk(const FileChunkMessage& chunk) {
+    auto it = incoming_.find({chunk.from, chunk.transfer_id});
+    if (it == std::end(incoming_)) {
+        return std::nullopt;
+    }
+
+    auto& transfer = it->second;
+    const bool is_valid =
+        chunk.offset == transfer.received &&
+        chunk.data.size() <= transfer.size - transfer.received &&
+        crc32(chunk.data) == chunk.checksum &&
+        ::pwrite(transfer.fd, chunk.data.data(), chunk.data.size(),
+                 static_cast<off_t>(chunk.offset)) ==
+            static_cast<ssize_t>(chunk.data.size());
+    if (!is_valid) {
+        notify(std::format("Transfer of {} failed", transfer.path));
+        close_incoming(it);
+        return make_cancel(chunk.from, chunk.transfer_id);
+    }
+
+    transfer.received += chunk.data.size();
+    if (transfer.received == transfer.size) {
+        notify(std::format("Saved {}", transfer.path));
+        const auto size = transfer.size;
+        close_incoming(it);
+        return FileAckMessage{.sender = chunk.from,
+                              .transfer_id = chunk.transfer_id,
+                              .status = FileAckStatus::Window,
+                              .received = size,
+                              .window = 0};
+    }
+    if (transfer.received - transfer.acked < Window / 2) {
+        return std::nullopt;
+    }
+    transfer.acked = transfer.received;
+    return FileAckMessage{.sender = chunk.from,
+                          .transfer_id = chunk.transfer_id,
+                          .status = FileAckStatus::Window,
+                          .received = transfer.received,
+                          .window = Window};
+}
+
+void FileTransfers::handle_ack(const FileAckMessage& ack, UserId user_id) {
+    if (ack.sender != user_id) {
+        // Only the sender cancels an incoming transfer.
+        if (ack.status != FileAckStatus::Cancel) {
+            return;
+        }
+        if (auto offer = offers_.find({ack.sender, ack.transfer_id});
+            offer != std::end(offers_)) {
+            notify(std::format("Offer of {} was withdrawn", offer->second.name));
+            offers_.erase(offer);
+            return;
+        }
+        auto it = incoming_.find({ack.sender, ack.transfer_id});
+        if (it != std::end(incoming_)) {
+            notify(std::format("Transfer of {} was cancelled", it->second.path));
+            close_incoming(it);
+        }
+        return;
+    }
+
+    auto it = outgoing_.find(ack.transfer_id);
+    if (it == std::end(outgoing_)) {
+        return;
+    }
+    auto& transfer = it->second;
+    if (ack.status == FileAckStatus::Cancel) {
+        notify(std::format("Transfer of {} was cancelled", transfer.name));
+        close_outgoing(it);
+    } else if (ack.received == transfer.data.size()) {
+        notify(std::format("Sent {}", transfer.name));
+        close_outgoing(it);
+    } else {
+        transfer.credit_end = std::max(transfer.credit_end,
+                                       ack.received + ack.window);
+    }
+}
+
+void FileTransfers::cancel_all() {
+    offers_.clear();
+    if (outgoing_.empty() && incoming_.empty()) {
+        return;
+    }
+    notify(std::format("Cancelled {} file transfer(s)",
+                       outgoing_.size() + incoming_.size()));
+    while (!outgoing_.empty()) {
+        close_outgoing(std::begin(outgoing_));
+    }
+    while (!incoming_.empty()) {
+        close_incoming(std::begin(incoming_));
+    }
+}
+
+std::optional<std::pair<int, std::string>>
+FileTransfers::create_file(std::string_view name) {
+    // The name comes from the other client, only its last component is used.
+    auto file_name = std::filesystem::path{name}.filename().string();
+    if (file_name.empty() || file_name == "." || file_name == "..") {
+        file_name = "file";
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(ReceivedFilesDirectory, ec);
+    for (unsigned attempt = 0; attempt < MaxNameAttempts; ++attempt) {
+        auto path = attempt == 0
+                        ? std::format("{}/{}", ReceivedFilesDirectory, file_name)
+                        : std::format("{}/{}.{}", ReceivedFilesDirectory,
+                                      file_name, attempt);
+        const int fd =
+            ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            return std::pair{fd, std::move(path)};
+        }
+        if (errno != EEXIST) {
+            break;
+        }
+    }
+    return std::nullopt;
+}
+
+void FileTransfers::close_outgoing(std::map<uint32_t, Outgoing>::iterator it) {
+    const auto data = it->second.data;
+    if (!data.empty()) {
+        ::munmap(const_cast<uint8_t*>(data.data()), data.size());
+    }
+    outgoing_.erase(it);
+}
+
+void FileTransfers::close_incoming(std::map<IncomingKey, Incoming>::iterator it) {
+    const auto& transfer = it->second;
+    ::close(transfer.fd);
+    if (transfer.received != transfer.size) {
+        ::unlink(transfer.path.c_str());
+    }
+    incoming_.erase(it);
+}
+
+void FileTransfers::notify(std::string notice) {
+    notices_.push(TextMessage{.from = InvalidUserId,
+                              .message = std::pmr::string{notice}});
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "../Message.hpp"
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <queue>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// File transfers of the client, in both directions.
+//
+// Outgoing files are mapped and sent a chunk at a time while the recipient
+// has granted credit. Incoming offers wait until the user accepts or
+// declines them, offers over MaxFileSize are declined at once. Accepted
+// files are written to ReceivedFilesDirectory as their chunks arrive, and
+// credit is granted back half a window at a time, so a transfer never has
+// more than a window in flight however large the file is.
+//
+// Results the user should see are pushed to `notices` as messages from
+// InvalidUserId.
+class FileTransfers {
+public:
+    static constexpr const char* ReceivedFilesDirectory{"received_files"};
+    static constexpr uint32_t Window = 256 << 10;
+    static constexpr uint64_t MaxFileSize = uint64_t{1} << 30;
+
+    explicit FileTransfers(std::queue<Message>& notices);
+    ~FileTransfers();
+
+    FileTransfers(const FileTransfers&) = delete;
+    FileTransfers& operator=(const FileTransfers&) = delete;
+
+    // Maps the file at `path` for sending to `to`, returns the offer to
+    // send, nullopt if the file can not be read.
+    std::optional<FileOfferMessage> send_file(UserId to, const std::string& path);
+
+    // Next chunk of an outgoing transfer with credit left, taking turns
+    // between transfers.
+    std::optional<FileChunkMessage> next_chunk();
+
+    // Keeps an offer for the user to accept, returns the cancel to send if
+    // it is declined right away.
+    std::optional<FileAckMessage> handle_offer(const FileOfferMessage& offer);
+    // Accept or decline the oldest offer from `from`, returning the ack to
+    // send, nullopt if there is none.
+    std::optional<FileAckMessage> accept(UserId from);
+    std::optional<FileAckMessage> decline(UserId from);
+    std::optional<FileAckMessage> handle_chunk(const FileChunkMessage& chunk);
+
+    // Credit or cancel for an outgoing transfer of `user_id`, or a cancel of
+    // an incoming one.
+    void handle_ack(const FileAckMessage& ack, UserId user_id);
+
+    // Drops every transfer, the server forgot them along with the session.
+    void cancel_all();
+
+private:
+    struct Outgoing {
+        std::string name;
+        std::span<const uint8_t> data;
+        uint64_t sent;
+        uint64_t credit_end;
+    };
+
+    struct Offer {
+        std::string name;
+        uint64_t size;
+    };
+
+    struct Incoming {
+        std::string path;
+        int fd;
+        uint64_t size;
+        uint64_t received;
+        // `received` when credit was last granted.
+        uint64_t acked;
+    };
+
+    using IncomingKey = std::pair<UserId, uint32_t>;
+
+    // Creates a file for `name` in ReceivedFilesDirectory without replacing
+    // an existing one, returns its descriptor and path.
+    static std::optional<std::pair<int, std::string>>
+    create_file(std::string_view name);
+
+    void close_outgoing(std::map<uint32_t, Outgoing>::iterator it);
+    // Closes the file, removing it unless it is complete.
+    void close_incoming(std::map<IncomingKey, Incoming>::iterator it);
+    void notify(std::string notice);
+
+    std::map<uint32_t, Outgoing> outgoing_;
+    // Offers the user did not answer yet.
+    std::map<IncomingKey, Offer> offers_;
+    std::map<IncomingKey, Incoming> incoming_;
+    uint32_t next_transfer_id_{0};
+    // Transfer that sent the last chunk.
+    uint32_t last_sending_{0};
+    std::queue<Message>& notices_;
+};
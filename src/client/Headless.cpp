@@ -0,0 +1,319 @@
+#include "Headless.hpp"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <format>
+#include <functional>
+#include <optional>
+#include <print>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+// How often what arrived is written to stdout.
+constexpr auto PrintInterval = 10ms;
+// Reading stdin waits while more frames than this are waiting to be written,
+// a writer faster than the server only grows the queue.
+constexpr size_t MaxQueuedFrames = 4096;
+constexpr size_t ReadSize = 64 << 10;
+// How long the server gets to see the leave before the client exits.
+constexpr auto LeaveTimeout = 1s;
+
+void append_json_string(std::string& out, std::string_view text) {
+    out += '"';
+    for (const char c : text) {
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    out += std::format("\\u{:04x}", static_cast<unsigned>(c));
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+}
+
+std::string_view to_string(DeliveryStatus status) {
+    switch (status) {
+        case DeliveryStatus::Sent:
+            return "sent";
+        case DeliveryStatus::Stored:
+            return "stored";
+        case DeliveryStatus::Delivered:
+            return "delivered";
+        case DeliveryStatus::Rejected:
+            return "rejected";
+    }
+    return "unknown";
+}
+
+// Writes received messages to stdout, on the io thread.
+class Printer {
+public:
+    explicit Printer(std::queue<Message>& received_messages)
+        : received_messages_(received_messages) {
+    }
+
+    void print_pending() {
+        while (!received_messages_.empty()) {
+            std::visit([this](const auto& msg) { print(msg); },
+                       received_messages_.front());
+            received_messages_.pop();
+        }
+        if (!out_.empty()) {
+            std::fwrite(out_.data(), 1, out_.size(), stdout);
+            std::fflush(stdout);
+            out_.clear();
+        }
+    }
+
+private:
+    void print(const TextMessage& msg) {
+        if (msg.from == InvalidUserId) {
+            begin("notice");
+        } else {
+            begin("text");
+            add("from", nick_of(msg.from));
+        }
+        add("message", msg.message);
+        end();
+    }
+
+    void print(const PrivateMessage& msg) {
+        begin("private");
+        add("from", nick_of(msg.from));
+        add("message", msg.message);
+        end();
+    }
+
+    void print(const OfflineMessage& msg) {
+        begin("offline");
+        add("from", msg.from);
+        add("message", msg.message);
+        out_ += std::format(",\"sent_at\":{}", msg.sent_at);
+        end();
+    }
+
+    void print(const UserJoinedMessage& msg) {
+        nicks_[msg.id] = msg.nick;
+        begin("joined");
+        add("nick", msg.nick);
+        end();
+    }
+
+    void print(const UserLeftMessage& msg) {
+        begin("left");
+        add("nick", nick_of(msg.id));
+        end();
+    }
+
+    void print(const ChatUsersMessage& msg) {
+        begin("users");
+        out_ += ",\"users\":[";
+        for (bool is_first{true}; const auto& user : msg.users) {
+            nicks_[user.id] = user.nick;
+            if (!is_first) {
+                out_ += ',';
+            }
+            is_first = false;
+            append_json_string(out_, user.nick);
+        }
+        out_ += ']';
+        end();
+    }
+
+    void print(const DeliveryStatusMessage& msg) {
+        begin("delivery");
+        add("to", msg.to);
+        add("status", to_string(msg.status));
+        out_ += std::format(",\"count\":{}", msg.count);
+        end();
+    }
+
+    void print(const FileOfferMessage& msg) {
+        begin("file_offer");
+        add("from", nick_of(msg.from));
+        add("name", msg.name);
+        out_ += std::format(",\"size\":{}", msg.size);
+        end();
+    }
+
+    // Nothing a bot acts on.
+    void print(const auto&) {
+    }
+
+    void begin(std::string_view type) {
+        out_ += "{\"type\":";
+        append_json_string(out_, type);
+    }
+
+    void add(std::string_view key, std::string_view value) {
+        out_ += ',';
+        append_json_string(out_, key);
+        out_ += ':';
+        append_json_string(out_, value);
+    }
+
+    void end() {
+        out_ += "}\n";
+    }
+
+    std::string_view nick_of(UserId id) {
+        auto& nick = nicks_[id];
+        if (nick.empty()) {
+            nick = std::format("user#{}", id);
+        }
+        return nick;
+    }
+
+    std::queue<Message>& received_messages_;
+    // Users who left are kept, the server may send their leave ahead of
+    // messages they sent before it.
+    std::unordered_map<UserId, std::pmr::string> nicks_;
+    std::string out_;
+};
+
+std::optional<Message> parse_line(std::string_view line) {
+    if (line.ends_with('\r')) {
+        line.remove_suffix(1);
+    }
+    if (line.starts_with("//")) {
+        line.remove_prefix(1);
+    } else if (line.starts_with("/private ")) {
+        line.remove_prefix(std::string_view{"/private "}.size());
+        const auto space = line.find(' ');
+        if (space == std::string_view::npos || space == 0) {
+            std::println(stderr, "usage: /private <nick> <message>");
+            return std::nullopt;
+        }
+        // The server finds the recipient by nick, and keeps the message if
+        // they are offline.
+        return PrivateMessage{.from = InvalidUserId,
+                              .to = InvalidUserId,
+                              .to_nick = std::pmr::string{line.substr(0, space)},
+                              .message = std::pmr::string{line.substr(space + 1)}};
+    } else if (line.starts_with('/')) {
+        std::println(stderr, "Unknown command: {}", line);
+        return std::nullopt;
+    }
+    if (line.empty()) {
+        return std::nullopt;
+    }
+    return TextMessage{.message = std::pmr::string{line}};
+}
+
+void wait_until(const std::function<bool()>& condition) {
+    while (!condition()) {
+        std::this_thread::sleep_for(1ms);
+    }
+}
+} // namespace
+
+int run_headless(asio::io_context& io_context, Connection& connection,
+                 std::queue<Message>& received_messages,
+                 const std::string& nick) {
+    auto work_guard = asio::make_work_guard(io_context);
+    Printer printer{received_messages};
+    asio::steady_timer print_timer{io_context};
+    std::function<void(asio::error_code)> handle_print =
+        [&](asio::error_code ec) {
+            if (!ec) {
+                printer.print_pending();
+                print_timer.expires_after(PrintInterval);
+                print_timer.async_wait(handle_print);
+            }
+        };
+    print_timer.expires_after(PrintInterval);
+    print_timer.async_wait(handle_print);
+    std::thread t{[&] { io_context.run(); }};
+
+    // Joins again if the server went away before taking the join.
+    while (!connection.is_connected()) {
+        wait_until([&] { return connection.is_server_online(); });
+        connection.join(nick);
+        const auto deadline = std::chrono::steady_clock::now() + LeaveTimeout;
+        wait_until([&] {
+            return connection.is_connected() ||
+                   std::chrono::steady_clock::now() > deadline;
+        });
+    }
+
+    std::vector<char> buffer(ReadSize);
+    std::string pending;
+    std::vector<Message> batch;
+    for (;;) {
+        const auto size = ::read(STDIN_FILENO, buffer.data(), buffer.size());
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            break;
+        }
+        pending.append(buffer.data(), static_cast<size_t>(size));
+
+        size_t start{0};
+        for (size_t end; (end = pending.find('\n', start)) != std::string::npos;
+             start = end + 1) {
+            if (auto msg = parse_line(
+                    std::string_view{pending}.substr(start, end - start))) {
+                batch.push_back(std::move(*msg));
+            }
+        }
+        pending.erase(0, start);
+
+        // Lines sent while the server is away would be lost.
+        wait_until([&] {
+            return connection.is_server_online() &&
+                   connection.get_queued_frames() <= MaxQueuedFrames;
+        });
+        if (!batch.empty()) {
+            connection.send_batch(std::move(batch));
+            batch.clear();
+        }
+    }
+    if (auto msg = parse_line(pending)) {
+        connection.send(std::move(*msg));
+    }
+
+    wait_until([&] {
+        return connection.get_queued_frames() == 0 ||
+               !connection.is_server_online();
+    });
+    connection.leave();
+    const auto deadline = std::chrono::steady_clock::now() + LeaveTimeout;
+    wait_until([&] {
+        return !connection.is_connected() ||
+               std::chrono::steady_clock::now() > deadline;
+    });
+
+    // What arrived up to the leave is still written.
+    asio::post(io_context, [&] {
+        printer.print_pending();
+        io_context.stop();
+    });
+    t.join();
+    return 0;
+}
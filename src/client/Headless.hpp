@@ -0,0 +1,21 @@
+#pragma once
+
+#include "../Message.hpp"
+#include "Connection.hpp"
+
+#include <asio.hpp>
+#include <queue>
+#include <string>
+
+// Runs the client without its UI, for bots and bridges: joins as `nick`,
+// sends every line read from stdin and writes what arrives to stdout, one
+// JSON object per line. Returns the exit status once stdin is closed and
+// what was read from it is written.
+//
+// Lines are sent as chat messages, "/private <nick> <message>" sends a
+// private message and a leading "//" sends a message starting with "/".
+// Lines that arrive together are sent together, so a burst costs a few
+// writes instead of one per line.
+int run_headless(asio::io_context& io_context, Connection& connection,
+                 std::queue<Message>& received_messages,
+                 const std::string& nick);
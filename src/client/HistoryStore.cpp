@@ -0,0 +1,391 @@
+#include "HistoryStore.hpp"
+#include "../Crc32.hpp"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <optional>
+#include <span>
+
+namespace {
+// Payload size and CRC-32 of the payload ahead of each record.
+constexpr size_t RecordHeaderSize = 2 * sizeof(uint32_t);
+constexpr size_t IndexEntrySize = sizeof(uint64_t);
+
+// Read only view of the first `size` bytes of a file.
+class Mapping {
+public:
+    Mapping(int fd, size_t size) : size_(size) {
+        if (size_ != 0) {
+            data_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        }
+    }
+
+    ~Mapping() {
+        if (data_ != MAP_FAILED && data_ != nullptr) {
+            ::munmap(data_, size_);
+        }
+    }
+
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+
+    bool is_valid() const {
+        return data_ != MAP_FAILED && (data_ != nullptr || size_ == 0);
+    }
+
+    std::span<const uint8_t> get() const {
+        return {static_cast<const uint8_t*>(data_), size_};
+    }
+
+private:
+    void* data_{nullptr};
+    size_t size_;
+};
+
+bool write_all(int fd, std::span<const uint8_t> bytes) {
+    while (!bytes.empty()) {
+        const auto written = ::write(fd, bytes.data(), bytes.size());
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes = bytes.subspan(static_cast<size_t>(written));
+    }
+    return true;
+}
+
+int open_file(const std::string& path, int flags = 0) {
+    return ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | flags,
+                  0600);
+}
+
+std::optional<uint64_t> get_file_size(int fd) {
+    struct stat file_stat {};
+    if (::fstat(fd, &file_stat) != 0) {
+        return std::nullopt;
+    }
+    return static_cast<uint64_t>(file_stat.st_size);
+}
+
+template <typename T>
+void append_value(std::vector<uint8_t>& buffer, T value) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+T read_value(std::span<const uint8_t> bytes) {
+    T value;
+    std::memcpy(&value, bytes.data(), sizeof(T));
+    return value;
+}
+
+void append_record(std::vector<uint8_t>& buffer,
+                   const HistoryStore::Entry& entry) {
+    const auto start = buffer.size();
+    const auto payload_size = 2 * sizeof(uint32_t) + entry.channel.size() +
+                              entry.nick.size() + entry.message.size();
+    append_value(buffer, static_cast<uint32_t>(payload_size));
+    append_value(buffer, uint32_t{0});
+    for (const auto* text : {&entry.channel, &entry.nick}) {
+        append_value(buffer, static_cast<uint32_t>(text->size()));
+        buffer.insert(buffer.end(), text->begin(), text->end());
+    }
+    buffer.insert(buffer.end(), entry.message.begin(), entry.message.end());
+
+    const auto crc = crc32(std::span{buffer}.subspan(start + RecordHeaderSize));
+    std::memcpy(buffer.data() + start + sizeof(uint32_t), &crc, sizeof(crc));
+}
+
+// Payload of the record at `offset`, nullopt if it is cut off or damaged.
+std::optional<std::span<const uint8_t>> read_record(
+    std::span<const uint8_t> data, uint64_t offset) {
+    if (offset > data.size() || data.size() - offset < RecordHeaderSize) {
+        return std::nullopt;
+    }
+    const auto size = read_value<uint32_t>(data.subspan(offset));
+    const auto crc = read_value<uint32_t>(data.subspan(offset + sizeof(uint32_t)));
+    if (data.size() - offset - RecordHeaderSize < size) {
+        return std::nullopt;
+    }
+    const auto payload = data.subspan(offset + RecordHeaderSize, size);
+    if (crc32(payload) != crc) {
+        return std::nullopt;
+    }
+    return payload;
+}
+
+std::optional<HistoryStore::Entry> decode_entry(std::span<const uint8_t> payload) {
+    HistoryStore::Entry entry;
+    for (auto* text : {&entry.channel, &entry.nick}) {
+        if (payload.size() < sizeof(uint32_t)) {
+            return std::nullopt;
+        }
+        const auto size = read_value<uint32_t>(payload);
+        payload = payload.subspan(sizeof(uint32_t));
+        if (payload.size() < size) {
+            return std::nullopt;
+        }
+        text->assign(reinterpret_cast<const char*>(payload.data()), size);
+        payload = payload.subspan(size);
+    }
+    entry.message.assign(reinterpret_cast<const char*>(payload.data()),
+                         payload.size());
+    return entry;
+}
+
+// Keeps file names portable whatever the server is called.
+std::string to_file_name(std::string_view server) {
+    std::string name{server};
+    std::ranges::replace_if(
+        name,
+        [](unsigned char c) { return !std::isalnum(c) && c != '.' && c != '-'; },
+        '_');
+    return name.empty() ? "server" : name;
+}
+} // namespace
+
+HistoryStore::HistoryStore(std::string_view server, size_t max_entries)
+    : max_entries_(max_entries) {
+    const auto base =
+        std::format("{}/{}", HistoryDirectory, to_file_name(server));
+    data_path_ = base + ".data";
+    index_path_ = base + ".index";
+    lock_path_ = base + ".lock";
+    if (open()) {
+        worker_ = std::thread{[this] { run(); }};
+    }
+}
+
+HistoryStore::~HistoryStore() {
+    if (worker_.joinable()) {
+        {
+            std::lock_guard lock{mutex_};
+            is_stopping_ = true;
+        }
+        condition_.notify_one();
+        worker_.join();
+    }
+    // The lock goes last, with the files closed.
+    for (const int fd : {data_fd_, index_fd_, lock_fd_}) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+}
+
+std::vector<HistoryStore::Entry> HistoryStore::get_recent(size_t count) const {
+    std::vector<Entry> entries;
+    if (data_fd_ < 0 || entry_count_ == 0 || count == 0) {
+        return entries;
+    }
+
+    const Mapping index{index_fd_, entry_count_ * IndexEntrySize};
+    const Mapping data{data_fd_, static_cast<size_t>(data_size_)};
+    if (!index.is_valid() || !data.is_valid()) {
+        return entries;
+    }
+    const auto first = entry_count_ - std::min(count, entry_count_);
+    entries.reserve(entry_count_ - first);
+    for (auto i = first; i < entry_count_; ++i) {
+        const auto offset =
+            read_value<uint64_t>(index.get().subspan(i * IndexEntrySize));
+        if (const auto payload = read_record(data.get(), offset)) {
+            if (auto entry = decode_entry(*payload)) {
+                entries.push_back(std::move(*entry));
+            }
+        }
+    }
+    return entries;
+}
+
+void HistoryStore::append(Entry entry) {
+    if (!worker_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard lock{mutex_};
+        pending_.push_back(std::move(entry));
+    }
+    condition_.notify_one();
+}
+
+bool HistoryStore::open() {
+    std::error_code ec;
+    std::filesystem::create_directories(HistoryDirectory, ec);
+    lock_fd_ = open_file(lock_path_);
+    if (lock_fd_ < 0 || ::flock(lock_fd_, LOCK_EX | LOCK_NB) != 0) {
+        return false;
+    }
+    data_fd_ = open_file(data_path_);
+    index_fd_ = open_file(index_path_);
+    if (data_fd_ < 0 || index_fd_ < 0) {
+        return false;
+    }
+    const auto data_size = get_file_size(data_fd_);
+    const auto index_size = get_file_size(index_fd_);
+    if (!data_size || !index_size) {
+        return false;
+    }
+    data_size_ = *data_size;
+
+    // Consistent when the last indexed record ends the data file, which
+    // only needs the last index entry and that record's header.
+    const auto count = *index_size / IndexEntrySize;
+    if (*index_size % IndexEntrySize == 0) {
+        if (count == 0 && data_size_ == 0) {
+            return true;
+        }
+        uint64_t offset{0};
+        uint8_t header[RecordHeaderSize];
+        if (count != 0 &&
+            ::pread(index_fd_, &offset, sizeof(offset),
+                    static_cast<off_t>((count - 1) * IndexEntrySize)) ==
+                sizeof(offset) &&
+            offset < data_size_ &&
+            ::pread(data_fd_, header, sizeof(header),
+                    static_cast<off_t>(offset)) == sizeof(header) &&
+            offset + RecordHeaderSize +
+                    read_value<uint32_t>(std::span{header}) ==
+                data_size_) {
+            entry_count_ = count;
+            return true;
+        }
+    }
+    return rebuild_index();
+}
+
+// Indexes the records of the data file up to the first damaged one and
+// drops everything from there.
+bool HistoryStore::rebuild_index() {
+    std::vector<uint8_t> index;
+    uint64_t end{0};
+    {
+        const Mapping data{data_fd_, static_cast<size_t>(data_size_)};
+        if (!data.is_valid()) {
+            return false;
+        }
+        while (const auto payload = read_record(data.get(), end)) {
+            append_value(index, end);
+            end += RecordHeaderSize + payload->size();
+        }
+    }
+    if (::ftruncate(data_fd_, static_cast<off_t>(end)) != 0 ||
+        ::ftruncate(index_fd_, 0) != 0 || !write_all(index_fd_, index)) {
+        return false;
+    }
+    data_size_ = end;
+    entry_count_ = index.size() / IndexEntrySize;
+    return true;
+}
+
+void HistoryStore::write(const std::vector<Entry>& entries) {
+    if (data_fd_ < 0) {
+        return;
+    }
+    std::vector<uint8_t> records;
+    std::vector<uint8_t> index;
+    for (const auto& entry : entries) {
+        append_value(index, data_size_ + records.size());
+        append_record(records, entry);
+    }
+    // Records first, an index entry never points past the data file.
+    if (!write_all(data_fd_, records) || !write_all(index_fd_, index)) {
+        // The next start finds what was written by scanning.
+        ::close(data_fd_);
+        ::close(index_fd_);
+        data_fd_ = index_fd_ = -1;
+        return;
+    }
+    data_size_ += records.size();
+    entry_count_ += entries.size();
+}
+
+// Records are contiguous, so the ones kept are the tail of the data file
+// from the first kept record on, and their offsets shift by its offset.
+void HistoryStore::compact() {
+    const auto first = entry_count_ - max_entries_;
+    uint64_t start{0};
+    std::vector<uint8_t> index;
+    std::vector<uint8_t> records;
+    {
+        const Mapping index_map{index_fd_, entry_count_ * IndexEntrySize};
+        const Mapping data{data_fd_, static_cast<size_t>(data_size_)};
+        if (!index_map.is_valid() || !data.is_valid()) {
+            return;
+        }
+        start = read_value<uint64_t>(
+            index_map.get().subspan(first * IndexEntrySize));
+        if (start > data_size_) {
+            return;
+        }
+        for (auto i = first; i < entry_count_; ++i) {
+            append_value(index, read_value<uint64_t>(index_map.get().subspan(
+                                    i * IndexEntrySize)) -
+                                    start);
+        }
+        const auto kept = data.get().subspan(start);
+        records.assign(kept.begin(), kept.end());
+    }
+
+    const auto data_tmp = data_path_ + ".tmp";
+    const auto index_tmp = index_path_ + ".tmp";
+    const int data_fd = open_file(data_tmp, O_TRUNC);
+    const int index_fd = open_file(index_tmp, O_TRUNC);
+    // A crash between the renames leaves an index that does not match, and
+    // the next start rebuilds it.
+    if (data_fd < 0 || index_fd < 0 || !write_all(data_fd, records) ||
+        !write_all(index_fd, index) ||
+        std::rename(data_tmp.c_str(), data_path_.c_str()) != 0 ||
+        std::rename(index_tmp.c_str(), index_path_.c_str()) != 0) {
+        for (const int fd : {data_fd, index_fd}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        ::unlink(data_tmp.c_str());
+        ::unlink(index_tmp.c_str());
+        return;
+    }
+
+    ::close(data_fd_);
+    ::close(index_fd_);
+    data_fd_ = data_fd;
+    index_fd_ = index_fd;
+    data_size_ = records.size();
+    entry_count_ = max_entries_;
+}
+
+void HistoryStore::run() {
+    std::vector<Entry> entries;
+    for (;;) {
+        {
+            std::unique_lock lock{mutex_};
+            condition_.wait(lock,
+                            [this] { return is_stopping_ || !pending_.empty(); });
+            // Stopping writes what is left first.
+            if (pending_.empty()) {
+                return;
+            }
+            entries.swap(pending_);
+        }
+        write(entries);
+        entries.clear();
+        if (data_fd_ >= 0 && entry_count_ > 2 * max_entries_) {
+            compact();
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Messages the client received and sent, kept on disk across restarts.
+//
+// Each server has its own store in HistoryDirectory: a data file of
+// length-prefixed, checksummed records and an index file with the offset of
+// each record. Startup maps both and decodes only the last records, however
+// long the history is. Appends are queued and written by a worker thread,
+// which also compacts the store to the last `max_entries` records once it
+// holds twice that many.
+//
+// Only one process at a time uses a store, it holds a lock on a lock file
+// next to it. A second client for the same server runs without history.
+//
+// Records written before a crash without their index entry are found again
+// by scanning the data file on the next start, a torn record at its end is
+// dropped.
+class HistoryStore {
+public:
+    static constexpr const char* HistoryDirectory{"history"};
+
+    struct Entry {
+        // Empty for the public chat, the other user for private messages.
+        std::string channel;
+        std::string nick;
+        std::string message;
+    };
+
+    // `server` names the server, e.g. its address, the store is disabled
+    // if its files can not be opened.
+    explicit HistoryStore(std::string_view server, size_t max_entries = 10000);
+    // Writes what is still queued.
+    ~HistoryStore();
+
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    // The last `count` entries, oldest first. Call before the first append.
+    std::vector<Entry> get_recent(size_t count) const;
+
+    // Queues `entry` for writing, safe to call from any thread.
+    void append(Entry entry);
+
+private:
+    // Opens the files and makes the index match the data file.
+    bool open();
+    bool rebuild_index();
+    void write(const std::vector<Entry>& entries);
+    void compact();
+    void run();
+
+    std::string data_path_;
+    std::string index_path_;
+    std::string lock_path_;
+    size_t max_entries_;
+    // Not the data file, compaction replaces that one.
+    int lock_fd_{-1};
+    int data_fd_{-1};
+    int index_fd_{-1};
+    // Size of the data file and records in it, owned by the worker once it
+    // runs.
+    uint64_t data_size_{0};
+    size_t entry_count_{0};
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::vector<Entry> pending_;
+    bool is_stopping_{false};
+    std::thread worker_;
+};
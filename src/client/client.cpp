@@ -1,14 +1,22 @@
 #include "../Message.hpp"
+#include "../TraceStats.hpp"
 #include "Connection.hpp"
+#include "Headless.hpp"
+#include "HistoryStore.hpp"
 
 #include <asio.hpp>
 #include <asio/error_code.hpp>
 #include <asio/executor_work_guard.hpp>
+#include <atomic>
 #include <chrono>
+#include <csignal>
 #include <ftxui/component/component.hpp>
 #include <ftxui/component/screen_interactive.hpp>
 #include <ftxui/dom/elements.hpp>
+#include <ftxui/screen/terminal.hpp>
+#include <optional>
 #include <print>
+#include <string_view>
 #include <variant>
 #include <tuple>
 
@@ -18,6 +26,10 @@ namespace command {
     constexpr const char* Join{"join"};
     constexpr const char* Leave{"leave"};
     constexpr const char* PrivateMsg{"private"};
+    constexpr const char* Search{"search"};
+    constexpr const char* SendFile{"send"};
+    constexpr const char* AcceptFile{"accept"};
+    constexpr const char* DeclineFile{"decline"};
     constexpr const char* Help{"help"};
 } // namespace command
 
@@ -27,7 +39,45 @@ struct ChatMessage {
 };
 
 using ChatMessages = std::vector<ChatMessage>;
-using ChatUsers = std::vector<std::string>;
+using ChatUsers = std::pmr::vector<ChatUser>;
+using SearchResults = std::pmr::vector<SearchResult>;
+
+// Rows each message takes in the chat window, with its border.
+constexpr int ChatMessageRows = 3;
+
+// Users who left recently, the server may send their leave ahead of
+// messages they sent before it.
+constexpr size_t MaxDepartedUsers = 64;
+
+std::string find_nick(const ChatUsers& chat_users,
+                      const ChatUsers& departed_users, UserId id) {
+    if (id == InvalidUserId) {
+        return "Internal Client";
+    }
+    for (const auto* users : {&chat_users, &departed_users}) {
+        const auto it = std::ranges::find(*users, id, &ChatUser::id);
+        if (it != std::ranges::end(*users)) {
+            return std::string{it->nick};
+        }
+    }
+    return std::format("user#{}", id);
+}
+
+ChatUsers::const_iterator find_user(const ChatUsers& chat_users,
+                                    std::string_view nick) {
+    return std::ranges::find_if(
+        chat_users, [&](const ChatUser& user) { return user.nick == nick; });
+}
+
+// Shows a message of the chat or a private conversation and keeps it in the
+// history.
+void add_chat_message(ChatMessages& chat_messages, HistoryStore& history,
+                      std::string channel, ChatMessage chat_message) {
+    history.append({.channel = std::move(channel),
+                    .nick = chat_message.nick,
+                    .message = chat_message.message});
+    chat_messages.push_back(std::move(chat_message));
+}
 
 std::tuple<std::string, std::string> parse_command(const std::string& input) {
     std::string command{};
@@ -46,6 +96,7 @@ enum class ChatViewState {
     Messages,
     NotSupportedCommand,
     MissingCommandArgument,
+    SearchResults,
     Help,
     WrongCommandUsageAlreadyDisconnected,
     WrongCommandUsageAlreadyConnected,
@@ -55,6 +106,10 @@ enum class ChatViewState {
 void process_input(
         Connection& connection,
         ChatMessages& chat_messages,
+        HistoryStore& history,
+        const ChatUsers& chat_users,
+        SearchResults& search_results,
+        std::atomic<uint32_t>& search_request_id,
         std::string input_text,
         ChatViewState& chat_view_state) {
     if (input_text.starts_with('/')) {
@@ -85,38 +140,155 @@ void process_input(
                 return;
             }
             auto to = rest.substr(0, first_space_index);
+            auto message = rest.substr(first_space_index + 1);
+            // Users who are not online get the message when they join.
+            const auto user = find_user(chat_users, to);
             connection.send(PrivateMessage{
-                .from = connection.get_nick(), .to = std::move(to),
-                .message =
-                    rest.substr(first_space_index + 1, rest.size() - first_space_index)
+                .from = connection.get_user_id(),
+                .to = user != std::ranges::end(chat_users) ? user->id : InvalidUserId,
+                .to_nick = std::pmr::string{to},
+                .message = std::pmr::string{message}
             });
+            add_chat_message(chat_messages, history, to,
+                             {.nick = std::format("{} (to {})", connection.get_nick(), to),
+                              .message = std::move(message)});
             chat_view_state = ChatViewState::Messages;
+        } else if (command == command::SendFile && connection.is_connected()) {
+            auto first_space_index = rest.find_first_of(' ');
+            if (first_space_index == std::string::npos) {
+                chat_view_state = ChatViewState::MissingCommandArgument;
+                return;
+            }
+            const auto to = rest.substr(0, first_space_index);
+            const auto user = find_user(chat_users, to);
+            if (user == std::ranges::end(chat_users)) {
+                chat_messages.push_back({.nick = "Internal Client", .message = std::format("{} is not online", to)});
+            } else {
+                connection.send_file(user->id, rest.substr(first_space_index + 1));
+            }
+            chat_view_state = ChatViewState::Messages;
+        } else if ((command == command::AcceptFile || command == command::DeclineFile) &&
+                   connection.is_connected()) {
+            if (rest.empty()) {
+                chat_view_state = ChatViewState::MissingCommandArgument;
+                return;
+            }
+            const auto user = find_user(chat_users, rest);
+            if (user == std::ranges::end(chat_users)) {
+                chat_messages.push_back({.nick = "Internal Client", .message = std::format("{} is not online", rest)});
+            } else if (command == command::AcceptFile) {
+                connection.accept_file(user->id);
+            } else {
+                connection.decline_file(user->id);
+            }
+            chat_view_state = ChatViewState::Messages;
+        } else if (command == command::Search && connection.is_connected()) {
+            if (rest.empty()) {
+                chat_view_state = ChatViewState::MissingCommandArgument;
+                return;
+            }
+            connection.send(SearchRequestMessage{
+                .request_id = ++search_request_id,
+                .query = std::pmr::string{rest}});
+            search_results.clear();
+            chat_view_state = ChatViewState::SearchResults;
         } else {
             chat_view_state = ChatViewState::NotSupportedCommand;
         }
     } else {
         if (connection.is_connected()) {
             chat_view_state = ChatViewState::Messages;
-            chat_messages.emplace_back(connection.get_nick(), input_text);
+            add_chat_message(chat_messages, history, {},
+                             {.nick = connection.get_nick(), .message = input_text});
             connection.send(
                 TextMessage{
-                    .from = connection.get_nick(),
-                    .message = std::move(input_text)
+                    .from = connection.get_user_id(),
+                    .message = std::pmr::string{input_text}
             });
         }
     }
 }
 
-int main(int, char**) {
+// Latency of the traced messages this client received, by stage.
+void print_trace_stats(const TraceStats& trace_stats) {
+    for (size_t i = 0; i < TraceStageCount; ++i) {
+        const auto stage = static_cast<TraceStage>(i);
+        const auto& stage_stats = trace_stats.get(stage);
+        if (stage_stats.get_count() == 0) {
+            continue;
+        }
+        std::println("{:>18}: {} messages, {} us on average, 99% under {} us, at most {} us",
+                     to_string(stage), stage_stats.get_count(),
+                     std::chrono::duration_cast<std::chrono::microseconds>(stage_stats.get_mean()).count(),
+                     stage_stats.get_bound(0.99).count(),
+                     std::chrono::duration_cast<std::chrono::microseconds>(stage_stats.get_max()).count());
+    }
+}
+
+int main(int argc, char** argv) {
+    // TLS connections are written with write(), a server that went away
+    // would otherwise kill the client.
+    std::signal(SIGPIPE, SIG_IGN);
     asio::io_context io_context{};
-    asio::ip::tcp::resolver resolver{io_context};
-    asio::ip::tcp::resolver::results_type endpoints{
-        resolver.resolve("127.0.0.1", "9999")};
+    constexpr const char* host{"127.0.0.1"};
+    bool is_tracing{false};
+    std::optional<std::string> unix_socket;
+    std::optional<std::string> ca_file;
+    // Nick to join with when running without the UI.
+    std::optional<std::string> headless_nick;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view option{argv[i]};
+        if (option == "--trace") {
+            is_tracing = true;
+        } else if (option == "--unix-socket" && i + 1 < argc && !ca_file) {
+            unix_socket = argv[++i];
+        } else if (option == "--tls" && i + 1 < argc && !unix_socket) {
+            ca_file = argv[++i];
+        } else if (option == "--headless" && i + 1 < argc) {
+            headless_nick = argv[++i];
+        } else {
+            std::println("usage: client [--unix-socket <path> | --tls <ca file>] [--trace] [--headless <nick>]");
+            return 1;
+        }
+    }
+
+    Connection::Endpoint endpoint;
+    // Names the history of this server.
+    std::string server;
+    std::unique_ptr<asio::ssl::context> tls_context;
+    if (unix_socket) {
+        endpoint = asio::local::stream_protocol::endpoint{*unix_socket};
+        server = *unix_socket;
+    } else {
+        asio::ip::tcp::resolver resolver{io_context};
+        endpoint = resolver.resolve(host, "9999").begin()->endpoint();
+        server = std::format("{}-9999", host);
+        if (ca_file) {
+            tls_context = std::make_unique<asio::ssl::context>(
+                asio::ssl::context::tls_client);
+            TlsStream::configure_client(*tls_context, *ca_file);
+        }
+    }
 
     std::queue<Message> received_messages;
 
-    Connection connection{io_context, std::move(endpoints), received_messages};
+    Connection connection{io_context, std::move(endpoint), received_messages,
+                          tls_context.get(), host};
+    connection.set_tracing(is_tracing);
     connection.connect();
+
+    if (headless_nick) {
+        return run_headless(io_context, connection, received_messages, *headless_nick);
+    }
+
+    // The last screen of history is shown before anything arrives.
+    HistoryStore history{server};
+    ChatMessages chat_messages;
+    const auto screen_messages = std::max(ftxui::Terminal::Size().dimy / ChatMessageRows, 1);
+    for (auto& entry : history.get_recent(static_cast<size_t>(screen_messages))) {
+        chat_messages.push_back({.nick = std::move(entry.nick), .message = std::move(entry.message)});
+    }
+
     auto work_guard = asio::make_work_guard(io_context);
 
     asio::steady_timer pool_messages_timer(io_context);
@@ -125,9 +297,15 @@ int main(int, char**) {
 
     // ---------------------- ftxui -------------------
     ChatUsers chat_users;
-    ChatMessages chat_messages;
+    ChatUsers departed_users;
+    SearchResults search_results;
+    // Only the response to the latest search is shown.
+    std::atomic<uint32_t> search_request_id{0};
+    TraceStats trace_stats;
+    // Trace of the next message to show.
+    std::optional<TraceMessage> pending_trace;
     std::string input_text;
-    ChatViewState chat_view_state{ChatViewState::Disconnected};
+    ChatViewState chat_view_state{chat_messages.empty() ? ChatViewState::Disconnected : ChatViewState::Messages};
     auto input_message =
         ftxui::Input(&input_text, "Type a message...") | ftxui::CatchEvent([&](ftxui::Event event) {
             if (event == ftxui::Event::Return && !input_text.empty()) {
@@ -135,6 +313,10 @@ int main(int, char**) {
                     process_input(
                         connection,
                         chat_messages,
+                        history,
+                        chat_users,
+                        search_results,
+                        search_request_id,
                         std::move(input_text),
                         chat_view_state);
                 } else {
@@ -167,6 +349,19 @@ int main(int, char**) {
             );
         }
 
+        if (chat_view_state == ChatViewState::SearchResults) {
+            ftxui::Elements elements;
+            std::ranges::transform(search_results, std::back_inserter(elements), [] (const auto& result) {
+                return ftxui::text(std::format("{}: {}", result.from, result.message)) | ftxui::border;
+            });
+            if (elements.empty()) {
+                elements.push_back(ftxui::text("No results."));
+            }
+            return ftxui::window(ftxui::text("Search results (Esc to go back):") | ftxui::bold | ftxui::center,
+                    ftxui::vbox(std::move(elements))
+            );
+        }
+
         ftxui::Element element;
         std::string window_title{"Help"};
         switch (chat_view_state) {
@@ -202,7 +397,8 @@ int main(int, char**) {
                 window_title = "Error:";
                 break;
             }
-            case ChatViewState::Messages: {
+            case ChatViewState::Messages:
+            case ChatViewState::SearchResults: {
                 break;
             }
         }
@@ -214,7 +410,11 @@ int main(int, char**) {
                 ftxui::text("Usage:") | ftxui::bold,
                 ftxui::text("       /join <nick>                - join the chat with nick"),
                 ftxui::text("       /leave                      - leave the chat"),
-                ftxui::text("       /private <nick> <message>   - send private message to other connected user"),
+                ftxui::text("       /private <nick> <message>   - send private message, kept for the user if offline"),
+                ftxui::text("       /search <terms>             - find earlier messages containing all terms"),
+                ftxui::text("       /send <nick> <path>         - send a file, saved by the recipient to received_files/"),
+                ftxui::text("       /accept <nick>              - accept the oldest file offer from nick"),
+                ftxui::text("       /decline <nick>             - decline the oldest file offer from nick"),
                 ftxui::text("       /help                       - show help")
         ));
     });
@@ -231,7 +431,7 @@ int main(int, char**) {
     auto users = ftxui::Renderer([&] {
         ftxui::Elements elements;
         std::ranges::transform(chat_users, std::back_inserter(elements), [](const auto& user) {
-            return ftxui::text(user) | ftxui::color(ftxui::Color::SeaGreen2); });
+            return ftxui::text(std::string{user.nick}) | ftxui::color(ftxui::Color::SeaGreen2); });
 
         return ftxui::window(ftxui::text("Chat users:") | ftxui::bold | ftxui::center,
             ftxui::vbox(std::move(elements))
@@ -248,6 +448,10 @@ int main(int, char**) {
                 process_input(
                     connection,
                     chat_messages,
+                    history,
+                    chat_users,
+                    search_results,
+                    search_request_id,
                     std::move(input_text),
                     chat_view_state);
             } else {
@@ -292,19 +496,52 @@ int main(int, char**) {
                 received_messages.pop();
 
                 auto visitor = [&] <typename MsgType> (const MsgType& msg) {
+                    if constexpr (std::is_same_v<MsgType, TextMessage> || std::is_same_v<MsgType, PrivateMessage>) {
+                        if (pending_trace) {
+                            trace_stats.record_received(*pending_trace, trace_clock_now());
+                            pending_trace.reset();
+                        }
+                    }
+
                     if constexpr (std::is_same_v<MsgType, ConnectMessage>) {
                         // chat_users.push_back(msg.nick);
                     } else if constexpr (std::is_same_v<MsgType, TextMessage>) {
-                        chat_messages.push_back({.nick = msg.from, .message = msg.message});
+                        add_chat_message(chat_messages, history, {}, {.nick = find_nick(chat_users, departed_users, msg.from), .message = std::string{msg.message}});
                     } else if constexpr (std::is_same_v<MsgType, PrivateMessage>) {
-                        chat_messages.push_back({.nick = msg.from, .message = msg.message});
-                    } else if constexpr (std::is_same_v<MsgType, DisconnectMessage>) {
-                        const auto it = std::ranges::find(chat_users, msg.nick);
+                        auto nick = find_nick(chat_users, departed_users, msg.from);
+                        add_chat_message(chat_messages, history, nick, {.nick = nick, .message = std::string{msg.message}});
+                    } else if constexpr (std::is_same_v<MsgType, UserJoinedMessage>) {
+                        std::erase_if(departed_users, [&](const ChatUser& user) { return user.id == msg.id; });
+                        chat_users.push_back({.id = msg.id, .nick = msg.nick});
+                    } else if constexpr (std::is_same_v<MsgType, UserLeftMessage>) {
+                        const auto it = std::ranges::find(chat_users, msg.id, &ChatUser::id);
                         if (it != std::ranges::end(chat_users)) {
+                            if (departed_users.size() == MaxDepartedUsers) {
+                                departed_users.erase(departed_users.begin());
+                            }
+                            departed_users.push_back(std::move(*it));
                             chat_users.erase(it);
                         }
                     } else if constexpr (std::is_same_v<MsgType, ChatUsersMessage>) {
                         chat_users = std::move(msg.users);
+                    } else if constexpr (std::is_same_v<MsgType, SearchResponseMessage>) {
+                        if (msg.request_id == search_request_id) {
+                            search_results = std::move(msg.results);
+                        }
+                    } else if constexpr (std::is_same_v<MsgType, OfflineMessage>) {
+                        add_chat_message(chat_messages, history, std::string{msg.from}, {.nick = std::format("{} (while offline)", msg.from), .message = std::string{msg.message}});
+                    } else if constexpr (std::is_same_v<MsgType, TraceMessage>) {
+                        pending_trace = msg;
+                    } else if constexpr (std::is_same_v<MsgType, FileOfferMessage>) {
+                        chat_messages.push_back({.nick = find_nick(chat_users, departed_users, msg.from), .message = std::format("sends you {} ({} bytes), /accept or /decline it", msg.name, msg.size)});
+                    } else if constexpr (std::is_same_v<MsgType, DeliveryStatusMessage>) {
+                        if (msg.status == DeliveryStatus::Stored) {
+                            chat_messages.push_back({.nick = "Server", .message = std::format("{} is offline, the message will be delivered when they join.", msg.to)});
+                        } else if (msg.status == DeliveryStatus::Delivered) {
+                            chat_messages.push_back({.nick = "Server", .message = std::format("{} received {} message(s) sent while they were offline.", msg.to, msg.count)});
+                        } else if (msg.status == DeliveryStatus::Rejected) {
+                            chat_messages.push_back({.nick = "Server", .message = std::format("Message to {} could not be delivered.", msg.to)});
+                        }
                     } else {
                         chat_messages.push_back({.nick = "Not supported", .message = "Not supported"});
                     }
@@ -325,6 +562,7 @@ int main(int, char**) {
     // ------------------------------------------------
 
     t.join();
+    print_trace_stats(trace_stats);
 
     return 0;
 }
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string_view>
+
+// When new clients are turned away. A limit of 0 disables it.
+struct AdmissionLimits {
+    // Client connections at once.
+    size_t max_connections{10000};
+    // Bytes queued for all clients together, beyond which the server is
+    // too far behind to take on more.
+    size_t max_outbound_bytes{64 << 20};
+    // How late the event loop runs its timers.
+    std::chrono::milliseconds max_loop_lag{100};
+};
+
+// Decides whether the server takes on a new client, so the ones already
+// connected keep their latency through a spike.
+//
+// Connections report the bytes they queue and write, the server probes the
+// event loop lag with a timer.
+class AdmissionControl {
+public:
+    enum class Verdict { Admit, Full, Overloaded };
+
+    Verdict admit(const AdmissionLimits& limits, size_t connections) const {
+        if (limits.max_connections != 0 &&
+            connections >= limits.max_connections) {
+            return Verdict::Full;
+        }
+        if ((limits.max_outbound_bytes != 0 &&
+             outbound_bytes_ > limits.max_outbound_bytes) ||
+            (limits.max_loop_lag.count() != 0 &&
+             loop_lag_ > limits.max_loop_lag)) {
+            return Verdict::Overloaded;
+        }
+        return Verdict::Admit;
+    }
+
+    void add_outbound_bytes(size_t bytes) {
+        outbound_bytes_ += bytes;
+    }
+
+    void remove_outbound_bytes(size_t bytes) {
+        outbound_bytes_ -= bytes;
+    }
+
+    size_t get_outbound_bytes() const {
+        return outbound_bytes_;
+    }
+
+    void set_loop_lag(std::chrono::steady_clock::duration lag) {
+        loop_lag_ = lag;
+    }
+
+    std::chrono::steady_clock::duration get_loop_lag() const {
+        return loop_lag_;
+    }
+
+private:
+    size_t outbound_bytes_{0};
+    std::chrono::steady_clock::duration loop_lag_{};
+};
+
+constexpr std::string_view to_string(AdmissionControl::Verdict verdict) {
+    switch (verdict) {
+        case AdmissionControl::Verdict::Admit:
+            return "admitted";
+        case AdmissionControl::Verdict::Full:
+            return "server is full";
+        case AdmissionControl::Verdict::Overloaded:
+            return "server is overloaded";
+    }
+    return "unknown";
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../Message.hpp"
+
+#include <vector>
+
+// Recycles read buffers so connections only hold one while a message body is
+// being read, instead of owning a fixed array for their whole lifetime.
+class BufferPool {
+public:
+    explicit BufferPool(size_t max_pooled) : max_pooled_(max_pooled) {
+    }
+
+    SerializedMessage acquire(size_t size) {
+        if (buffers_.empty()) {
+            return SerializedMessage(size);
+        }
+        auto buffer = std::move(buffers_.back());
+        buffers_.pop_back();
+        buffer.resize(size);
+        return buffer;
+    }
+
+    void release(SerializedMessage& buffer) {
+        if (buffers_.size() < max_pooled_ && buffer.capacity() != 0) {
+            buffer.clear();
+            buffers_.push_back(std::move(buffer));
+        }
+        buffer = SerializedMessage{};
+    }
+
+private:
+    size_t max_pooled_;
+    std::vector<SerializedMessage> buffers_;
+};
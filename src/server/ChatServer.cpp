@@ -1,10 +1,42 @@
 #include "ChatServer.hpp"
+#include "SlabAllocator.hpp"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <unistd.h>
 
 #include <asio.hpp>
+#include <filesystem>
 #include <print>
 
-ChatServer::ChatServer(const std::string& address, const std::string& port)
-    : io_context_(), acceptor_(io_context_), connections_manager_(), signals_(io_context_) {
+using namespace std::chrono_literals;
+
+namespace {
+// Clients whose write is still in flight by then are disconnected instead
+// of handed over.
+constexpr auto HandoverGracePeriod = 1s;
+// Accepts pause this long when out of descriptors, doubling while it lasts.
+constexpr std::chrono::milliseconds InitialAcceptBackoff{10};
+constexpr std::chrono::milliseconds MaxAcceptBackoff{1000};
+constexpr auto LagProbeInterval = 100ms;
+
+bool is_out_of_descriptors(const asio::error_code& ec) {
+    return ec == asio::error::no_descriptors ||
+           ec == asio::error::no_buffer_space ||
+           ec == asio::error::no_memory ||
+           (ec.category() == asio::error::get_system_category() &&
+            ec.value() == ENFILE);
+}
+} // namespace
+
+ChatServer::ChatServer(ServerOptions options)
+    : options_(std::move(options)), io_context_(), acceptor_(io_context_),
+      local_acceptor_(io_context_), connections_manager_(),
+      upgrade_acceptor_(io_context_), handover_timer_(io_context_),
+      lag_timer_(io_context_), capture_timer_(io_context_),
+      reserve_descriptor_(::open("/dev/null", O_RDONLY | O_CLOEXEC)),
+      signals_(io_context_),
+      reload_signals_(io_context_), stats_signals_(io_context_) {
 
     signals_.add(SIGINT);  // is signal when CTRL + C is pressed
     signals_.add(SIGTERM); // default signal when use kill command
@@ -13,44 +45,565 @@ ChatServer::ChatServer(const std::string& address, const std::string& port)
 #endif // defined(SIGQUIT)
 
     do_await_stop();
+#if defined(SIGUSR1)
+    stats_signals_.add(SIGUSR1); // print outbound queue latency
+    do_await_stats();
+#endif // defined(SIGUSR1)
+
+    connections_manager_.set_rate_limits(options_.rate_limits);
+    connections_manager_.get_mailboxes().set_limits(options_.mailbox_limits);
+    connections_manager_.get_compressor().set_threshold(options_.compress_above);
+
+    if (!options_.capture_file.empty()) {
+        capture_ = TrafficCapture::create(options_.capture_file,
+                                          connections_manager_.now());
+        if (capture_) {
+            std::println("Capturing client traffic to {}.",
+                         options_.capture_file);
+            do_flush_capture();
+        } else {
+            std::println("Could not create capture file: {}, not capturing.",
+                         options_.capture_file);
+        }
+        connections_manager_.set_capture(capture_.get());
+    }
+
+    if (!options_.moderation_file.empty()) {
+#if defined(SIGHUP)
+        reload_signals_.add(SIGHUP); // reload moderation patterns
+        do_await_reload();
+#endif // defined(SIGHUP)
+        set_moderation_filter(
+            ModerationFilter::load(options_.moderation_file));
+    }
+
+    if (!options_.tls.certificate_file.empty()) {
+        tls_context_ = std::make_unique<asio::ssl::context>(
+            asio::ssl::context::tls_server);
+        TlsStream::configure_server(*tls_context_,
+                                    options_.tls.certificate_file,
+                                    options_.tls.private_key_file);
+    }
+
+    auto handover = take_over();
+    if (handover && handover->acceptor >= 0) {
+        acceptor_.assign(socket_family(handover->acceptor) == AF_INET6
+                             ? asio::ip::tcp::v6()
+                             : asio::ip::tcp::v4(),
+                         handover->acceptor);
+        size_buffers();
+    } else {
+        asio::ip::tcp::resolver resolver{io_context_};
+        asio::ip::tcp::endpoint endpoint{
+            *resolver.resolve(options_.address, options_.port).begin()};
 
-    asio::ip::tcp::resolver resolver{io_context_};
-    asio::ip::tcp::endpoint endpoint{*resolver.resolve(address, port).begin()};
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        size_buffers();
+        acceptor_.listen();
+    }
 
-    acceptor_.open(endpoint.protocol());
-    acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
-    acceptor_.bind(endpoint);
-    acceptor_.listen();
+    if (!options_.unix_socket.empty()) {
+        if (handover && handover->local_acceptor >= 0) {
+            local_acceptor_.assign(asio::local::stream_protocol{},
+                                   handover->local_acceptor);
+        } else {
+            // Left behind by a server that did not shut down cleanly.
+            std::error_code ignored;
+            std::filesystem::remove(options_.unix_socket, ignored);
+            const asio::local::stream_protocol::endpoint local_endpoint{
+                options_.unix_socket};
+            local_acceptor_.open(local_endpoint.protocol());
+            local_acceptor_.bind(local_endpoint);
+            local_acceptor_.listen();
+        }
+        do_accept(local_acceptor_, nullptr);
+    } else if (handover && handover->local_acceptor >= 0) {
+        ::close(handover->local_acceptor);
+    }
+
+    if (handover) {
+        resume_connections(*handover);
+    }
+
+    if (!options_.federation.port.empty()) {
+        start_federation();
+    }
+
+    if (!options_.upgrade_socket.empty()) {
+        listen_for_successor();
+    }
+
+    if (options_.admission.max_loop_lag.count() != 0) {
+        do_probe_loop_lag();
+    }
+
+    do_accept(acceptor_, tls_context_.get());
+}
+
+ChatServer::~ChatServer() {
+    if (moderation_loader_.joinable()) {
+        moderation_loader_.join();
+    }
+    if (reserve_descriptor_ >= 0) {
+        ::close(reserve_descriptor_);
+    }
+}
+
+void ChatServer::start_federation() {
+    federation_ = std::make_unique<Federation>(
+        io_context_, connections_manager_, options_.federation);
+    connections_manager_.set_federation(federation_.get());
+    federation_->start();
+}
 
-    do_accept();
+void ChatServer::size_buffers() {
+    // Accepted sockets inherit them. The receive buffer has to be set before
+    // the handshake, which fixes the window scale.
+    const auto& latency = options_.latency;
+    asio::error_code ec;
+    if (latency.send_buffer != 0) {
+        acceptor_.set_option(
+            asio::socket_base::send_buffer_size(latency.send_buffer), ec);
+    }
+    if (!ec && latency.receive_buffer != 0) {
+        acceptor_.set_option(
+            asio::socket_base::receive_buffer_size(latency.receive_buffer), ec);
+    }
+    if (ec) {
+        std::println("Could not set the socket buffer sizes: {}.",
+                     ec.message());
+    }
+}
+
+void ChatServer::tune_client_socket(int descriptor) {
+    const auto ec = tune_socket(descriptor, options_.latency);
+    if (ec && !is_tuning_error_logged_) {
+        is_tuning_error_logged_ = true;
+        std::println("Could not tune client sockets for latency: {}.",
+                     ec.message());
+    }
 }
 
 void ChatServer::start() {
-    io_context_.run();
+    const auto& latency = options_.latency;
+    // Threads started earlier, like the search worker, are left unpinned.
+    if (!latency.cpus.empty() && !pin_current_thread(latency.cpus)) {
+        std::println("Could not pin the io thread to the given CPUs.");
+    }
+    if (latency.spin.count() == 0) {
+        io_context_.run();
+        return;
+    }
+    run_spinning();
+}
+
+void ChatServer::run_spinning() {
+    using Clock = std::chrono::steady_clock;
+    auto last_handler = Clock::now();
+    // poll() still asks the reactor for ready sockets, without sleeping.
+    while (!io_context_.stopped()) {
+        if (io_context_.poll() != 0) {
+            last_handler = Clock::now();
+        } else if (Clock::now() - last_handler >= options_.latency.spin) {
+            io_context_.run_one();
+            last_handler = Clock::now();
+        }
+    }
 }
 
-void ChatServer::do_accept() {
-    auto handle_accept = [this](asio::error_code ec,
-                                asio::ip::tcp::socket socket) {
-        if (!acceptor_.is_open()) {
+template <typename Acceptor>
+void ChatServer::do_accept(Acceptor& acceptor,
+                           asio::ssl::context* tls_context) {
+    auto handle_accept = [this, &acceptor,
+                          tls_context](asio::error_code ec,
+                                       typename Acceptor::protocol_type::socket
+                                           socket) {
+        if (!acceptor.is_open() || is_handing_over_) {
+            return;
+        }
+
+        if (is_out_of_descriptors(ec)) {
+            reject_pending(acceptor);
+            pause_accepting(acceptor, tls_context);
             return;
         }
+        accept_backoff_ = {};
 
         if (!ec) {
-            connections_manager_.start(std::make_shared<Connection>(
-                io_context_, std::move(socket), connections_manager_));
+            const auto verdict = connections_manager_.get_admission().admit(
+                options_.admission,
+                connections_manager_.get_connections_count());
+            log_admission(verdict);
+            if (verdict == AdmissionControl::Verdict::Admit) {
+                if constexpr (std::is_same_v<Acceptor,
+                                             asio::ip::tcp::acceptor>) {
+                    tune_client_socket(socket.native_handle());
+                }
+                connections_manager_.start(std::allocate_shared<Connection>(
+                    SlabAllocator<Connection>{},
+                    Connection::Socket{std::move(socket)}, connections_manager_,
+                    tls_context));
+            }
+            // Otherwise the socket closes here, the client backs off and
+            // reconnects later.
         } else {
             std::println("New connection was not accepted.");
         }
-        do_accept();
+        do_accept(acceptor, tls_context);
     };
 
-    acceptor_.async_accept(handle_accept);
+    acceptor.async_accept(handle_accept);
+}
+
+template <typename Acceptor>
+void ChatServer::pause_accepting(Acceptor& acceptor,
+                                 asio::ssl::context* tls_context) {
+    if (accept_backoff_.count() == 0) {
+        std::println("Out of file descriptors with {} clients, pausing "
+                     "accepts.",
+                     connections_manager_.get_connections_count());
+        accept_backoff_ = InitialAcceptBackoff;
+    } else {
+        accept_backoff_ = std::min(accept_backoff_ * 2, MaxAcceptBackoff);
+    }
+
+    auto timer =
+        std::make_shared<asio::steady_timer>(io_context_, accept_backoff_);
+    timer->async_wait(
+        [this, timer, &acceptor, tls_context](asio::error_code ec) {
+            if (!ec) {
+                do_accept(acceptor, tls_context);
+            }
+        });
+}
+
+template <typename Acceptor>
+void ChatServer::reject_pending(Acceptor& acceptor) {
+    if (reserve_descriptor_ < 0) {
+        return;
+    }
+    ::close(reserve_descriptor_);
+
+    asio::error_code ec;
+    // Without a pending client a blocking accept would wait for one.
+    acceptor.non_blocking(true, ec);
+    typename Acceptor::protocol_type::socket socket{io_context_};
+    if (!ec) {
+        acceptor.accept(socket, ec);
+    }
+    socket.close(ec);
+
+    reserve_descriptor_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+void ChatServer::log_admission(AdmissionControl::Verdict verdict) {
+    if (verdict == last_verdict_) {
+        return;
+    }
+    last_verdict_ = verdict;
+    if (verdict == AdmissionControl::Verdict::Admit) {
+        std::println("Admitting new clients again.");
+        return;
+    }
+    const auto& admission = connections_manager_.get_admission();
+    std::println(
+        "Turning new clients away, {}: {} clients, {} bytes queued, event "
+        "loop {} us late.",
+        to_string(verdict), connections_manager_.get_connections_count(),
+        admission.get_outbound_bytes(),
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            admission.get_loop_lag())
+            .count());
+}
+
+void ChatServer::do_probe_loop_lag() {
+    const auto expected = std::chrono::steady_clock::now() + LagProbeInterval;
+    lag_timer_.expires_at(expected);
+    lag_timer_.async_wait([this, expected](asio::error_code ec) {
+        if (!ec) {
+            connections_manager_.get_admission().set_loop_lag(
+                std::chrono::steady_clock::now() - expected);
+            do_probe_loop_lag();
+        }
+    });
+}
+
+void ChatServer::do_flush_capture() {
+    capture_timer_.expires_after(TrafficCapture::FlushInterval);
+    capture_timer_.async_wait([this](asio::error_code ec) {
+        if (!ec) {
+            capture_->flush();
+            do_flush_capture();
+        }
+    });
+}
+
+std::optional<HandoverState> ChatServer::take_over() {
+    if (options_.upgrade_socket.empty()) {
+        return std::nullopt;
+    }
+
+    asio::local::stream_protocol::socket predecessor{io_context_};
+    asio::error_code ec;
+    predecessor.connect({options_.upgrade_socket}, ec);
+    if (ec) {
+        // Nobody to take over from.
+        return std::nullopt;
+    }
+    if (!is_same_user(predecessor.native_handle())) {
+        std::println("The server at {} runs as another user, starting "
+                     "afresh.",
+                     options_.upgrade_socket);
+        return std::nullopt;
+    }
+
+    std::println("Taking over from the server at {}.", options_.upgrade_socket);
+    auto state = receive_handover(predecessor.native_handle());
+    if (!state) {
+        std::println("Could not take over from the server at {}, starting "
+                     "afresh.",
+                     options_.upgrade_socket);
+    }
+    return state;
+}
+
+void ChatServer::resume_connections(HandoverState& state) {
+    size_t resumed{0};
+    for (auto& connection_state : state.connections) {
+        const int family = socket_family(connection_state.descriptor);
+        if (family < 0) {
+            ::close(connection_state.descriptor);
+            continue;
+        }
+        Connection::Socket socket{
+            io_context_,
+            asio::generic::stream_protocol{
+                family, family == AF_UNIX ? 0 : static_cast<int>(IPPROTO_TCP)},
+            connection_state.descriptor};
+        connections_manager_.resume(
+            std::allocate_shared<Connection>(SlabAllocator<Connection>{},
+                                             std::move(socket),
+                                             connections_manager_),
+            std::move(connection_state));
+        ++resumed;
+    }
+    connections_manager_.restore(state);
+    std::println("Took over {} clients.", resumed);
+}
+
+void ChatServer::listen_for_successor() {
+    // Left behind by the predecessor or a server that did not shut down
+    // cleanly.
+    std::error_code ignored;
+    std::filesystem::remove(options_.upgrade_socket, ignored);
+    const asio::local::stream_protocol::endpoint endpoint{
+        options_.upgrade_socket};
+    upgrade_acceptor_.open(endpoint.protocol());
+    upgrade_acceptor_.bind(endpoint);
+    std::filesystem::permissions(options_.upgrade_socket,
+                                 std::filesystem::perms::owner_read |
+                                     std::filesystem::perms::owner_write,
+                                 ignored);
+    upgrade_acceptor_.listen();
+    do_await_successor();
+}
+
+void ChatServer::do_await_successor() {
+    upgrade_acceptor_.async_accept(
+        [this](asio::error_code ec,
+               asio::local::stream_protocol::socket successor) {
+            if (ec) {
+                return;
+            }
+            if (!is_same_user(successor.native_handle())) {
+                std::println("Refused a hot upgrade to a process of another "
+                             "user.");
+                do_await_successor();
+                return;
+            }
+            hand_over(std::make_shared<asio::local::stream_protocol::socket>(
+                std::move(successor)));
+        });
+}
+
+void ChatServer::hand_over(
+    std::shared_ptr<asio::local::stream_protocol::socket> successor) {
+    std::println("A new process is taking over, pausing clients.");
+    is_handing_over_ = true;
+    // The successor listens on the path once it took over.
+    upgrade_acceptor_.close();
+    std::error_code ignored;
+    std::filesystem::remove(options_.upgrade_socket, ignored);
+    acceptor_.cancel();
+    if (local_acceptor_.is_open()) {
+        local_acceptor_.cancel();
+    }
+    if (federation_) {
+        federation_->stop();
+        connections_manager_.set_federation(nullptr);
+    }
+
+    handover_timer_.expires_after(HandoverGracePeriod);
+    handover_timer_.async_wait([this, successor](asio::error_code) {
+        finish_handover(*successor);
+    });
+    connections_manager_.pause_all([this] { handover_timer_.cancel(); });
+}
+
+void ChatServer::finish_handover(
+    asio::local::stream_protocol::socket& successor) {
+    HandoverState state;
+    const auto connections = connections_manager_.hand_over(state);
+    state.acceptor = acceptor_.is_open() ? acceptor_.native_handle() : -1;
+    state.local_acceptor =
+        local_acceptor_.is_open() ? local_acceptor_.native_handle() : -1;
+
+    if (send_handover(successor.native_handle(), state)) {
+        std::println("Handed over {} clients.", connections.size());
+        // Closes only this process' copies of the sockets.
+        connections_manager_.stop_all();
+        io_context_.stop();
+        return;
+    }
+
+    std::println("Could not hand over to the new process, going on.");
+    is_handing_over_ = false;
+    for (size_t i = 0; i < connections.size(); ++i) {
+        connections[i]->resume(std::move(state.connections[i]));
+    }
+    connections_manager_.restore_mailboxes(std::move(state.mailboxes));
+    if (!options_.federation.port.empty()) {
+        start_federation();
+    }
+    listen_for_successor();
+    if (local_acceptor_.is_open()) {
+        do_accept(local_acceptor_, nullptr);
+    }
+    do_accept(acceptor_, tls_context_.get());
 }
 
 void ChatServer::do_await_stop() {
-    signals_.async_wait([this](asio::error_code ec, int /*signo*/) {
+    signals_.async_wait([this](asio::error_code /*ec*/, int /*signo*/) {
         acceptor_.close();
+        if (local_acceptor_.is_open()) {
+            local_acceptor_.close();
+            std::error_code ignored;
+            std::filesystem::remove(options_.unix_socket, ignored);
+        }
+        if (upgrade_acceptor_.is_open()) {
+            upgrade_acceptor_.close();
+            std::error_code ignored;
+            std::filesystem::remove(options_.upgrade_socket, ignored);
+        }
+        handover_timer_.cancel();
+        lag_timer_.cancel();
+        capture_timer_.cancel();
+        reload_signals_.cancel();
+        stats_signals_.cancel();
+        if (federation_) {
+            federation_->stop();
+        }
         connections_manager_.stop_all();
+        if (capture_) {
+            capture_->flush();
+        }
+    });
+}
+
+void ChatServer::do_await_reload() {
+    reload_signals_.async_wait([this](asio::error_code ec, int /*signo*/) {
+        if (!ec) {
+            reload_moderation_filter();
+            do_await_reload();
+        }
     });
 }
+
+void ChatServer::do_await_stats() {
+    stats_signals_.async_wait([this](asio::error_code ec, int /*signo*/) {
+        if (!ec) {
+            print_lanes_stats();
+            print_trace_stats();
+            do_await_stats();
+        }
+    });
+}
+
+void ChatServer::print_lanes_stats() {
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    const auto& stats = connections_manager_.get_lanes_stats();
+    for (const auto& [lane, name] : {std::pair{Lane::Control, "control"},
+                                     std::pair{Lane::Bulk, "bulk"}}) {
+        const auto& lane_stats = stats[static_cast<size_t>(lane)];
+        std::println("Outbound {} lane: {} frames, queued {} us on average, "
+                     "99% under {} us, at most {} us.",
+                     name, lane_stats.get_count(),
+                     duration_cast<microseconds>(lane_stats.get_mean())
+                         .count(),
+                     lane_stats.get_bound(0.99).count(),
+                     duration_cast<microseconds>(lane_stats.get_max())
+                         .count());
+    }
+}
+
+void ChatServer::print_trace_stats() {
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    const auto& stats = connections_manager_.get_trace_stats();
+    for (const auto stage : {TraceStage::ServerProcessing,
+                             TraceStage::ServerQueueing,
+                             TraceStage::ServerWrite}) {
+        const auto& stage_stats = stats.get(stage);
+        if (stage_stats.get_count() == 0) {
+            continue;
+        }
+        std::println("Traced {}: {} messages, {} us on average, 99% under {} "
+                     "us, at most {} us.",
+                     to_string(stage), stage_stats.get_count(),
+                     duration_cast<microseconds>(stage_stats.get_mean())
+                         .count(),
+                     stage_stats.get_bound(0.99).count(),
+                     duration_cast<microseconds>(stage_stats.get_max())
+                         .count());
+    }
+}
+
+void ChatServer::reload_moderation_filter() {
+    if (is_reloading_moderation_) {
+        is_reload_pending_ = true;
+        return;
+    }
+    // A loader that is done is only left to return.
+    if (moderation_loader_.joinable()) {
+        moderation_loader_.join();
+    }
+    is_reloading_moderation_ = true;
+    moderation_loader_ = std::thread{[this] {
+        auto filter = ModerationFilter::load(options_.moderation_file);
+        asio::post(io_context_, [this, filter = std::move(filter)]() mutable {
+            is_reloading_moderation_ = false;
+            set_moderation_filter(std::move(filter));
+            if (is_reload_pending_) {
+                is_reload_pending_ = false;
+                reload_moderation_filter();
+            }
+        });
+    }};
+}
+
+void ChatServer::set_moderation_filter(
+    std::shared_ptr<const ModerationFilter> filter) {
+    if (!filter) {
+        std::println("Could not read moderation file: {}, keeping previous "
+                     "patterns.",
+                     options_.moderation_file);
+        return;
+    }
+    std::println("Loaded {} moderation patterns ({} states) from {}.",
+                 filter->patterns_count(), filter->states_count(),
+                 options_.moderation_file);
+    connections_manager_.set_moderation_filter(std::move(filter));
+}
@@ -1,22 +1,100 @@
 #pragma once
 
 #include "ConnectionsManager.hpp"
+#include "Federation.hpp"
+#include "Handover.hpp"
+#include "ServerOptions.hpp"
+#include "TrafficCapture.hpp"
 
 #include <asio.hpp>
+#include <asio/ssl.hpp>
 
+#include <memory>
+#include <optional>
 #include <string>
+#include <thread>
 
 class ChatServer {
 public:
-    ChatServer(const std::string& address, const std::string& port);
+    explicit ChatServer(ServerOptions options);
+    ~ChatServer();
 
     void start();
-    void do_accept();
+    template <typename Acceptor>
+    void do_accept(Acceptor& acceptor, asio::ssl::context* tls_context);
     void do_await_stop();
+    void do_await_reload();
+    void do_await_stats();
 
 private:
+    // Out of descriptors, accepts stop for a while instead of failing in a
+    // loop.
+    template <typename Acceptor>
+    void pause_accepting(Acceptor& acceptor, asio::ssl::context* tls_context);
+    // Frees the reserve descriptor to accept and close the next client, so
+    // it is turned away at once rather than left waiting in the backlog.
+    template <typename Acceptor>
+    void reject_pending(Acceptor& acceptor);
+    // Logs when the server starts or stops turning clients away.
+    void log_admission(AdmissionControl::Verdict verdict);
+    // Measures how late a timer fires, see AdmissionLimits::max_loop_lag.
+    void do_probe_loop_lag();
+    // Hands the traffic capture to its writer every FlushInterval.
+    void do_flush_capture();
+    void start_federation();
+    // Sets the buffer sizes of LatencyOptions on the TCP acceptor.
+    void size_buffers();
+    // Applies LatencyOptions to an accepted TCP client.
+    void tune_client_socket(int descriptor);
+    // Runs the io_context, polling for LatencyOptions::spin before blocking.
+    void run_spinning();
+    // Connects to the server listening on the upgrade socket, if any, and
+    // receives what it hands over.
+    std::optional<HandoverState> take_over();
+    void resume_connections(HandoverState& state);
+    void listen_for_successor();
+    void do_await_successor();
+    // Pauses the clients for the successor, then hands them over.
+    void hand_over(std::shared_ptr<asio::local::stream_protocol::socket> successor);
+    void finish_handover(asio::local::stream_protocol::socket& successor);
+    void set_moderation_filter(std::shared_ptr<const ModerationFilter> filter);
+    // Builds the filter from the moderation file on moderation_loader_, then
+    // swaps it in on the io thread.
+    void reload_moderation_filter();
+    void print_lanes_stats();
+    // Server stages of traced messages, see TraceStage.
+    void print_trace_stats();
+
+    ServerOptions options_;
     asio::io_context io_context_;
     asio::ip::tcp::acceptor acceptor_;
+    asio::local::stream_protocol::acceptor local_acceptor_;
+    // Set when clients on the TCP port use TLS.
+    std::unique_ptr<asio::ssl::context> tls_context_;
+    // Set while capturing traffic, outlives the connections recording to it.
+    std::unique_ptr<TrafficCapture> capture_;
     ConnectionsManager connections_manager_;
+    // Set when the server is a node of a mesh.
+    std::unique_ptr<Federation> federation_;
+    // Where a new process connects to take over, see ServerOptions.
+    asio::local::stream_protocol::acceptor upgrade_acceptor_;
+    // Bounds how long a handover waits for clients to pause.
+    asio::steady_timer handover_timer_;
+    bool is_handing_over_{false};
+    asio::steady_timer lag_timer_;
+    asio::steady_timer capture_timer_;
+    // Held open for reject_pending.
+    int reserve_descriptor_{-1};
+    std::chrono::milliseconds accept_backoff_{0};
+    AdmissionControl::Verdict last_verdict_{AdmissionControl::Verdict::Admit};
+    // tune_socket failures are logged once, they repeat for every client.
+    bool is_tuning_error_logged_{false};
     asio::signal_set signals_;
+    asio::signal_set reload_signals_;
+    // Building a large pattern set takes long enough to stall clients.
+    std::thread moderation_loader_;
+    bool is_reloading_moderation_{false};
+    // A SIGHUP arrived while reloading, the file may have changed since.
+    bool is_reload_pending_{false};
+    asio::signal_set stats_signals_;
 };
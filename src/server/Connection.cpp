@@ -1,8 +1,18 @@
 #include "Connection.hpp"
 #include "../Message.hpp"
 #include "ConnectionsManager.hpp"
+#include "Federation.hpp"
+#include "TextSanitizer.hpp"
+#include "TrafficCapture.hpp"
+#include "../ShmChannel.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <asio.hpp>
+#include <cstring>
+#include <deque>
+#include <iterator>
 #include <print>
 #include <ranges>
 
@@ -18,185 +28,922 @@ void info(const std::string& msg) {
 }
 } // namespace logger
 
-Connection::Connection(asio::io_context& io_context,
-                       asio::ip::tcp::socket socket,
+struct Connection::ShmTransport {
+    std::unique_ptr<ShmChannel> channel;
+    // Waits on the server eventfd of the channel.
+    asio::posix::stream_descriptor event;
+    // Frames the ring had no room for, the first one maybe partly written.
+    std::deque<std::shared_ptr<const SerializedMessage>> pending;
+    size_t pending_offset{0};
+    SerializedMessage frame;
+};
+
+const std::unordered_map<MessageType, Connection::MessageHandler>
+    Connection::dispatcher_{
+        {MessageType::Connect, &Connection::handle_connect_message},
+        {MessageType::Disconnect, &Connection::handle_disconnect_message},
+        {MessageType::Text, &Connection::handle_text_message},
+        {MessageType::PrivateMessage, &Connection::handle_private_message},
+        {MessageType::SearchRequest, &Connection::handle_search_message},
+        {MessageType::FileOffer, &Connection::handle_file_offer_message},
+        {MessageType::FileChunk, &Connection::handle_file_chunk_message},
+        {MessageType::FileAck, &Connection::handle_file_ack_message},
+        {MessageType::Trace, &Connection::handle_trace_message},
+    };
+
+Connection::Connection(Socket socket, ConnectionsManager& connections_manager,
+                       asio::ssl::context* tls_context)
+    : socket_(std::move(socket)),
+      tls_(tls_context ? std::make_unique<TlsStream>(socket_, *tls_context)
+                       : nullptr),
+      connections_manager_(connections_manager),
+      connection_info_(make_connection_info(socket_)) {
+    logger::info(std::format("New client connected: {}", connection_info_));
+}
+
+Connection::Connection(std::unique_ptr<MemoryStream> stream,
                        ConnectionsManager& connections_manager)
-    : io_context_(io_context), socket_(std::move(socket)),
-      connections_manager_(connections_manager), timer_(io_context_),
-      connection_info_(ConnectionInfo{
-          .address = socket_.remote_endpoint().address().to_string(),
-          .port = socket_.remote_endpoint().port()}) {
+    : socket_(stream->get_executor()), memory_(std::move(stream)),
+      connections_manager_(connections_manager),
+      connection_info_{.endpoint = {}, .is_in_memory = true} {
     logger::info(std::format("New client connected: {}", connection_info_));
-    setup_dispatcher();
+}
+
+Connection::~Connection() = default;
+
+Connection::ConnectionInfo Connection::make_connection_info(Socket& socket) {
+    asio::error_code ec;
+    const auto endpoint = socket.remote_endpoint(ec);
+    if (!ec && endpoint.protocol().family() == AF_UNIX) {
+        return {.endpoint = {}, .local_descriptor = socket.native_handle()};
+    }
+
+    asio::ip::tcp::endpoint tcp_endpoint;
+    if (!ec && endpoint.size() <= tcp_endpoint.capacity()) {
+        std::memcpy(tcp_endpoint.data(), endpoint.data(), endpoint.size());
+        tcp_endpoint.resize(endpoint.size());
+    }
+    return {.endpoint = tcp_endpoint};
 }
 
 void Connection::start() {
-    do_read_header();
+    if (!tls_) {
+        do_read_header();
+        return;
+    }
+
+    tls_->async_handshake([self = shared_from_this(), this](asio::error_code ec) {
+        if (ec) {
+            logger::error(std::format("TLS handshake with client {} failed: {}",
+                                      connection_info_, ec.message()));
+            handle_client_disconnected();
+            return;
+        }
+        logger::info(std::format("Client {} completed a {} TLS handshake{}",
+                                 connection_info_,
+                                 tls_->is_resumed() ? "resumed" : "full",
+                                 tls_->is_ktls_send() ? ", kTLS on" : ""));
+        do_read_header();
+    });
 }
 
 void Connection::stop() {
+    is_stopped_ = true;
+    if (tls_ && socket_.is_open()) {
+        tls_->shutdown();
+    }
     socket_.close();
+    if (memory_) {
+        memory_->close();
+    }
+    if (throttle_timer_) {
+        throttle_timer_->cancel();
+    }
+    if (shm_) {
+        asio::error_code ignored;
+        shm_->event.close(ignored);
+    }
+    on_paused_.reset();
+    connections_manager_.get_admission().remove_outbound_bytes(
+        outbound_.get_bytes());
+    outbound_.clear();
+}
+
+void Connection::disconnect() {
+    handle_client_disconnected();
+}
+
+void Connection::pause(std::shared_ptr<void> on_paused) {
+    if (tls_ || shm_ || memory_ || !socket_.is_open()) {
+        return;
+    }
+
+    is_pausing_ = true;
+    on_paused_ = std::move(on_paused);
+    if (throttle_timer_) {
+        throttle_timer_->cancel();
+    }
+    // The read completes with what it got so far, see pause_reading. A
+    // write in flight is left to finish, it cancels the read itself.
+    if (writing_.empty()) {
+        socket_.cancel();
+    }
+}
+
+bool Connection::is_paused() const {
+    return is_read_paused_ && writing_.empty() && socket_.is_open();
+}
+
+HandoverConnection Connection::hand_over() {
+    LanesStats ignored;
+    std::vector<OutboundQueue::Frame> frames;
+    while (!outbound_.empty()) {
+        outbound_.take_batch(frames, ignored, connections_manager_.now());
+    }
+    SerializedMessage output;
+    for (const auto& frame : frames) {
+        output.insert(output.end(), frame->begin(), frame->end());
+    }
+    connections_manager_.get_admission().remove_outbound_bytes(output.size());
+
+    return {.descriptor = socket_.native_handle(),
+            .user_id = user_id_,
+            .nick = std::string{
+                connections_manager_.get_nick(user_id_).value_or("")},
+            .resume_token = resume_token_,
+            .compression = compression_,
+            .partial_input = std::move(partial_input_),
+            .output = std::move(output)};
+}
+
+void Connection::resume(HandoverConnection state) {
+    // Also goes on after a handover that failed.
+    is_pausing_ = false;
+    is_read_paused_ = false;
+    on_paused_.reset();
+    resume_token_ = state.resume_token;
+    compression_ = state.compression;
+    partial_input_ = std::move(state.partial_input);
+    // Queued one frame at a time so they get their lanes back.
+    std::span<const uint8_t> output{state.output};
+    while (output.size() >= MessageHeaderSize) {
+        MessageHeader header{};
+        std::memcpy(&header, output.data(), MessageHeaderSize);
+        const auto size =
+            std::min(output.size(), MessageHeaderSize + header.body_size);
+        send_frame(std::make_shared<const SerializedMessage>(
+            output.begin(), output.begin() + size));
+        output = output.subspan(size);
+    }
+    start();
+}
+
+size_t Connection::max_body_size(MessageType type) {
+    return type == MessageType::FileChunk ? MaxChunkBodySize : MaxBodySize;
+}
+
+bool Connection::is_rate_limited(MessageType type) {
+    return type != MessageType::FileChunk && type != MessageType::FileAck &&
+           type != MessageType::Trace;
 }
 
 void Connection::do_read_header() {
-    auto handle_read_header = [self = shared_from_this(),
-                               this](asio::error_code ec, size_t bytes_read) {
-        if (!ec && bytes_read == MessageHeaderSize) {
+    if (is_pausing_) {
+        pause_reading({});
+        return;
+    }
+
+    const auto prefilled = take_partial_input(header_buffer_);
+    auto handle_read_header = [self = shared_from_this(), this,
+                               prefilled](asio::error_code ec,
+                                          size_t bytes_read) {
+        if (!ec && prefilled + bytes_read == MessageHeaderSize) {
             MessageHeader header{};
-            if (deserialize({buffer_.begin(), buffer_.begin() + bytes_read},
+            if (deserialize({header_buffer_.begin(), header_buffer_.end()},
                             header)) {
-
-                switch (header.type) {
-                    case MessageType::Text:
-                    case MessageType::Connect:
-                    case MessageType::Disconnect:
-                    case MessageType::PrivateMessage: {
-                        do_read_body(std::move(header));
-                        break;
-                    }
-                    case MessageType::PingServer: {
-                        do_read_header();
-                        break;
-                    }
-                    case MessageType::ChatUsers: {
-                        logger::error("Not supporter message type: ChatUsers");
-                        do_read_header();
-                        break;
-                    }
-                }
+                admit_frame(header);
             } else {
                 logger::error("Could not deserialize MessageHeader");
+                handle_client_disconnected();
             }
-        } else {
-            if (ec == asio::error::eof) {
-                logger::info(
-                    std::format("Client: {} disconnected.", connection_info_));
-                auto nick = connections_manager_.unset_nick(shared_from_this());
-                if (nick) {
-                    broadcast_message(
-                        DisconnectMessage{.nick = std::move(*nick)});
-                }
+        } else if (ec == asio::error::operation_aborted) {
+            // Otherwise stop() closed the socket, the connection is gone.
+            if (is_pausing_) {
+                pause_reading(
+                    std::span{header_buffer_}.first(prefilled + bytes_read));
             }
+        } else {
+            log_read_error(ec);
+            handle_client_disconnected();
         }
     };
 
-    asio::async_read(socket_, asio::buffer(buffer_),
-                     asio::transfer_exactly(MessageHeaderSize),
-                     handle_read_header);
+    with_stream([&](auto& stream) {
+        asio::async_read(stream, asio::buffer(header_buffer_) + prefilled,
+                         asio::transfer_exactly(MessageHeaderSize - prefilled),
+                         handle_read_header);
+    });
+}
+
+size_t Connection::take_partial_input(std::span<uint8_t> buffer) {
+    const auto size = std::min(buffer.size(), partial_input_.size());
+    std::copy_n(partial_input_.begin(), size, buffer.begin());
+    partial_input_.erase(partial_input_.begin(), partial_input_.begin() + size);
+    return size;
+}
+
+void Connection::pause_reading(std::span<const uint8_t> header,
+                               std::span<const uint8_t> body) {
+    // Ahead of whatever a predecessor handed over that was not read yet.
+    SerializedMessage input{header.begin(), header.end()};
+    input.insert(input.end(), body.begin(), body.end());
+    input.insert(input.end(), partial_input_.begin(), partial_input_.end());
+    partial_input_ = std::move(input);
+    is_read_paused_ = true;
+    check_paused();
+}
+
+void Connection::check_paused() {
+    if (is_read_paused_ && writing_.empty()) {
+        on_paused_.reset();
+    }
+}
+
+void Connection::admit_frame(MessageHeader header) {
+    // Checked before charging, the frame would otherwise be throttled for
+    // its claimed size first.
+    if (header.body_size > max_body_size(header.type)) {
+        logger::error(std::format("Message body of {} bytes from client: {} "
+                                  "exceeds the limit",
+                                  header.body_size, connection_info_));
+        handle_client_disconnected();
+        return;
+    }
+    if (!is_rate_limited(header.type)) {
+        handle_header(header);
+        return;
+    }
+
+    const auto delay = charge_frame(MessageHeaderSize + header.body_size);
+    if (!delay) {
+        return;
+    }
+    if (*delay <= RateLimiter::Clock::duration::zero()) {
+        handle_header(header);
+        return;
+    }
+    if (is_pausing_) {
+        pause_reading(header_buffer_);
+        return;
+    }
+
+    throttle_timer_->expires_after(*delay);
+    throttle_timer_->async_wait(
+        [self = shared_from_this(), this, header](asio::error_code ec) {
+            if (!ec) {
+                handle_header(header);
+            } else if (is_pausing_) {
+                pause_reading(header_buffer_);
+            }
+        });
+}
+
+std::optional<RateLimiter::Clock::duration>
+Connection::charge_frame(size_t frame_size) {
+    const auto& limits = connections_manager_.get_rate_limits();
+    const auto delay =
+        rate_limiter_.charge(limits, frame_size, connections_manager_.now());
+    if (delay <= RateLimiter::Clock::duration::zero()) {
+        throttled_frames_ = 0;
+        return delay;
+    }
+
+    ++throttled_frames_;
+    if (limits.disconnect_after != 0 &&
+        throttled_frames_ >= limits.disconnect_after) {
+        logger::error(std::format("Client {} kept flooding, disconnecting",
+                                  connection_info_));
+        handle_client_disconnected();
+        return std::nullopt;
+    }
+    if (throttled_frames_ == 1) {
+        logger::info(
+            std::format("Client {} is over its rate limit", connection_info_));
+    }
+
+    if (!throttle_timer_) {
+        throttle_timer_ =
+            std::make_unique<asio::steady_timer>(socket_.get_executor());
+    }
+    return delay;
+}
+
+std::optional<RateLimiter::Clock::duration>
+Connection::charge_stray_frame(size_t frame_size) {
+    if (!is_stray_) {
+        return RateLimiter::Clock::duration::zero();
+    }
+    is_stray_ = false;
+    return charge_frame(frame_size);
+}
+
+void Connection::handle_header(MessageHeader header) {
+    switch (header.type) {
+        case MessageType::Text:
+        case MessageType::Connect:
+        case MessageType::Disconnect:
+        case MessageType::PrivateMessage:
+        case MessageType::SearchRequest:
+        case MessageType::FileOffer:
+        case MessageType::FileChunk:
+        case MessageType::FileAck:
+        case MessageType::Trace: {
+            do_read_body(std::move(header));
+            break;
+        }
+        case MessageType::PingServer: {
+            capture_frame(header);
+            do_read_header();
+            break;
+        }
+        case MessageType::ChatUsers: {
+            logger::error("Not supporter message type: ChatUsers");
+            do_read_header();
+            break;
+        }
+        case MessageType::ResyncUsers: {
+            capture_frame(header);
+            send_chat_users();
+            do_read_header();
+            break;
+        }
+        case MessageType::ShmAttach: {
+            capture_frame(header);
+            attach_shm();
+            do_read_header();
+            break;
+        }
+        case MessageType::Session:
+        case MessageType::UserJoined:
+        case MessageType::UserLeft:
+        case MessageType::SearchResponse:
+        case MessageType::OfflineMessage:
+        case MessageType::DeliveryStatus:
+        case MessageType::PeerHello:
+        case MessageType::PeerMailbox:
+        case MessageType::Compressed: {
+            logger::error("Not supporter message type: server "
+                          "to client only");
+            do_read_header();
+            break;
+        }
+    }
 }
 
 void Connection::do_read_body(MessageHeader header) {
-    auto handle_body_read = [header, self = shared_from_this(),
-                             this](asio::error_code ec, size_t bytes_read) {
+    if (is_pausing_) {
+        pause_reading(header_buffer_);
+        return;
+    }
+
+    body_ = connections_manager_.get_buffer_pool().acquire(header.body_size);
+    const auto prefilled = take_partial_input(body_);
+
+    auto handle_body_read = [header, self = shared_from_this(), this,
+                             prefilled](asio::error_code ec,
+                                        size_t bytes_read) {
         if (!ec) {
-            if (bytes_read == header.body_size) {
+            if (prefilled + bytes_read == header.body_size) {
                 const auto handler = dispatcher_.find(header.type);
                 if (handler != std::end(dispatcher_)) {
-                    handler->second(header, bytes_read);
+                    capture_frame(header,
+                                  std::span{body_}.first(header.body_size));
+                    const FrameArena::Scope frame{frame_arena_};
+                    (this->*handler->second)(header, header.body_size);
                 } else {
                     logger::error("Could not find handler for message");
                 }
-                do_read_header();
+                if (header.type != MessageType::Trace) {
+                    // Only a charged frame pays for the trace ahead of it.
+                    is_stray_ |= pending_trace_ && !is_rate_limited(header.type);
+                    pending_trace_.reset();
+                }
+                release_body();
+                const auto delay = charge_stray_frame(MessageHeaderSize +
+                                                      header.body_size);
+                if (!delay) {
+                    return;
+                }
+                if (*delay <= RateLimiter::Clock::duration::zero()) {
+                    do_read_header();
+                    return;
+                }
+                throttle_timer_->expires_after(*delay);
+                throttle_timer_->async_wait(
+                    [self = shared_from_this(), this](asio::error_code ec) {
+                        if (!ec) {
+                            do_read_header();
+                        } else if (is_pausing_) {
+                            pause_reading({});
+                        }
+                    });
             } else {
+                release_body();
                 logger::error("Could not read whole message body");
+                handle_client_disconnected();
+            }
+        } else if (ec == asio::error::operation_aborted) {
+            if (is_pausing_) {
+                pause_reading(header_buffer_,
+                              std::span{body_}.first(prefilled + bytes_read));
             }
+            release_body();
         } else {
-            if (ec == asio::error::eof) {
-                logger::info(
-                    std::format("Client: {} disconnected.", connection_info_));
-                auto nick = connections_manager_.unset_nick(shared_from_this());
-                if (nick) {
-                    broadcast_message(
-                        DisconnectMessage{.nick = std::move(*nick)});
+            release_body();
+            log_read_error(ec);
+            handle_client_disconnected();
+        }
+    };
+
+    with_stream([&](auto& stream) {
+        asio::async_read(stream, asio::buffer(body_) + prefilled,
+                         asio::transfer_exactly(header.body_size - prefilled),
+                         handle_body_read);
+    });
+}
+
+void Connection::attach_shm() {
+    std::unique_ptr<ShmChannel> channel;
+    if (shm_ || connection_info_.local_descriptor < 0 ||
+        user_id_ != InvalidUserId) {
+        // Frames already on their way to a joined client could interleave
+        // with the answer.
+        logger::error(std::format(
+            "Client {} asked for shared memory outside of the unix socket or "
+            "after joining",
+            connection_info_));
+    } else if (channel = ShmChannel::create(ShmRingCapacity); !channel) {
+        logger::error("Could not create a shared memory channel");
+    }
+
+    const auto frame = serialize(Message{ShmAttachMessage{}});
+    if (!channel) {
+        send_frame(std::make_shared<const SerializedMessage>(frame));
+        return;
+    }
+    const auto descriptors = channel->get_descriptors();
+    if (!send_descriptors(socket_.native_handle(), frame, descriptors)) {
+        logger::error(std::format("Could not pass shared memory to client {}",
+                                  connection_info_));
+        return;
+    }
+
+    const int event_fd = ::dup(channel->get_event_fd());
+    if (event_fd < 0) {
+        return;
+    }
+    shm_ = std::make_unique<ShmTransport>(ShmTransport{
+        .channel = std::move(channel),
+        .event = asio::posix::stream_descriptor{socket_.get_executor(),
+                                                event_fd},
+        .pending = {},
+        .frame = {}});
+    logger::info(
+        std::format("Client {} attached shared memory", connection_info_));
+    do_read_shm();
+}
+
+void Connection::do_read_shm() {
+    if (!socket_.is_open()) {
+        return;
+    }
+
+    auto& shm = *shm_;
+    for (size_t frames = 0;;) {
+        switch (shm.channel->read(shm.frame, MaxChunkBodySize)) {
+            case ShmChannel::ReadResult::Frame: {
+                MessageHeader header{};
+                std::memcpy(&header, shm.frame.data(), MessageHeaderSize);
+                if (header.body_size > max_body_size(header.type)) {
+                    logger::error(std::format(
+                        "Message body of {} bytes from client: {} exceeds "
+                        "the limit",
+                        header.body_size, connection_info_));
+                    handle_client_disconnected();
+                    return;
+                }
+                const bool is_charged = is_rate_limited(header.type);
+                auto delay =
+                    is_charged
+                        ? charge_frame(shm.frame.size())
+                        : std::optional{RateLimiter::Clock::duration::zero()};
+                if (!delay) {
+                    return;
+                }
+                handle_shm_frame(shm.frame);
+                if (!is_charged) {
+                    delay = charge_stray_frame(shm.frame.size());
+                    if (!delay) {
+                        return;
+                    }
+                }
+                if (*delay > RateLimiter::Clock::duration::zero()) {
+                    // Leaves the ring alone until the client is back under
+                    // its limits.
+                    throttle_timer_->expires_after(*delay);
+                    throttle_timer_->async_wait(
+                        [self = shared_from_this(), this](asio::error_code ec) {
+                            if (!ec) {
+                                do_read_shm();
+                            }
+                        });
+                    return;
                 }
+                if (++frames == ShmFramesPerTurn) {
+                    asio::post(socket_.get_executor(),
+                               [self = shared_from_this(), this] {
+                                   do_read_shm();
+                               });
+                    return;
+                }
+                continue;
+            }
+            case ShmChannel::ReadResult::Invalid: {
+                logger::error(std::format(
+                    "Client {} broke its shared memory channel",
+                    connection_info_));
+                handle_client_disconnected();
+                return;
+            }
+            case ShmChannel::ReadResult::Empty: {
+                break;
             }
         }
-    };
 
-    asio::async_read(socket_, asio::buffer(buffer_),
-                     asio::transfer_exactly(header.body_size),
-                     handle_body_read);
+        flush_shm();
+        if (shm.channel->prepare_wait(true, !shm.pending.empty())) {
+            break;
+        }
+    }
+
+    shm.event.async_wait(asio::posix::stream_descriptor::wait_read,
+                         [self = shared_from_this(), this](asio::error_code ec) {
+                             if (!ec) {
+                                 shm_->channel->consume_event();
+                                 do_read_shm();
+                             }
+                         });
 }
 
-void Connection::do_send_chat_users() {
-    timer_.expires_after(1s);
-    timer_.async_wait([self = shared_from_this(), this](asio::error_code ec) {
-        if (!ec) {
-            std::vector<std::string> users{};
-            if (connections_manager_.get_nick(self)) {
-                const auto& connections =
-                    connections_manager_.get_connections();
-
-                users = std::ranges::to<std::vector>(
-                    connections | std::views::values |
-                    std::views::filter(
-                        [](const auto& u) { return !u.empty(); }));
+void Connection::handle_shm_frame(const SerializedMessage& frame) {
+    MessageHeader header{};
+    std::memcpy(&header, frame.data(), MessageHeaderSize);
+
+    const auto handler = dispatcher_.find(header.type);
+    if (handler != std::end(dispatcher_) ||
+        header.type == MessageType::ResyncUsers ||
+        header.type == MessageType::PingServer) {
+        capture_frame(header, std::span{frame}.subspan(MessageHeaderSize));
+    }
+    if (handler != std::end(dispatcher_)) {
+        body_ = connections_manager_.get_buffer_pool().acquire(header.body_size);
+        std::copy(frame.begin() + MessageHeaderSize, frame.end(),
+                  body_.begin());
+        {
+            const FrameArena::Scope frame{frame_arena_};
+            (this->*handler->second)(header, header.body_size);
+        }
+        release_body();
+        if (header.type != MessageType::Trace) {
+            is_stray_ |= pending_trace_ && !is_rate_limited(header.type);
+            pending_trace_.reset();
+        }
+    } else if (header.type == MessageType::ResyncUsers) {
+        send_chat_users();
+    } else if (header.type != MessageType::PingServer) {
+        logger::error(std::format(
+            "Not supported message type {} over shared memory",
+            static_cast<int>(header.type)));
+    }
+}
+
+void Connection::flush_shm() {
+    auto& shm = *shm_;
+    while (!shm.pending.empty()) {
+        const auto& frame = *shm.pending.front();
+        const auto written =
+            shm.channel->write(std::span{frame}.subspan(shm.pending_offset));
+        if (!written) {
+            logger::error(std::format(
+                "Client {} broke its shared memory channel", connection_info_));
+            shm.pending.clear();
+            // Not from within the send, whoever sends may be iterating the
+            // users.
+            asio::post(socket_.get_executor(),
+                       [self = shared_from_this(), this] {
+                           if (socket_.is_open()) {
+                               handle_client_disconnected();
+                           }
+                       });
+            return;
+        }
+        shm.pending_offset += *written;
+        if (shm.pending_offset < frame.size()) {
+            if (shm.channel->prepare_wait(false, true)) {
+                // The rest goes out when the client frees room.
+                return;
             }
+            continue;
+        }
+        shm.pending.pop_front();
+        shm.pending_offset = 0;
+    }
+}
+
+bool Connection::sanitize(std::pmr::string& text) {
+    switch (sanitize_text(text)) {
+        case TextVerdict::Clean:
+            return !text.empty();
+        case TextVerdict::Sanitized:
+            logger::info(std::format(
+                "Stripped control characters from client {}", connection_info_));
+            return !text.empty();
+        case TextVerdict::Invalid:
+            logger::error(std::format("Invalid UTF-8 from client {}",
+                                      connection_info_));
+            return false;
+    }
+    return false;
+}
 
-            auto serialized_msg =
-                serialize(Message{ChatUsersMessage{.users = std::move(users)}});
-            auto msg_to_send =
-                std::make_shared<SerializedMessage>(serialized_msg);
+bool Connection::moderate(std::pmr::string& message) {
+    const auto* filter = connections_manager_.get_moderation_filter();
+    if (!filter) {
+        return true;
+    }
 
-            socket_.async_send(
-                asio::buffer(*msg_to_send),
-                [self, this, msg_to_send](asio::error_code ec, size_t bytes) {
-                    if (!ec) {
-                        do_send_chat_users();
-                    }
-                });
+    const auto verdict = filter->scan(message);
+    if (verdict.action == ModerationFilter::Action::Flag ||
+        verdict.action == ModerationFilter::Action::Reject) {
+        logger::info(std::format("Moderation: {} message from client {}: {}",
+                                 to_string(verdict.action), connection_info_,
+                                 message));
+    }
+    return verdict.action != ModerationFilter::Action::Reject;
+}
+
+void Connection::handle_client_disconnected() {
+    if (is_stopped_) {
+        return;
+    }
+    logger::info(std::format("Client: {} disconnected.", connection_info_));
+    if (auto* capture = connections_manager_.get_capture()) {
+        capture->record_closed(capture_id_, connections_manager_.now());
+    }
+    auto self = shared_from_this();
+    const auto id = user_id_;
+    if (connections_manager_.remove_user(self)) {
+        announce_leave(id);
+    }
+    // Drop the manager's reference so the connection and its slab block are
+    // released once the last pending handler completes.
+    connections_manager_.stop(self);
+}
+
+void Connection::log_read_error(asio::error_code ec) {
+    // A client closing its end is the normal way to leave.
+    if (ec != asio::error::eof && ec != asio::error::connection_reset) {
+        logger::error(std::format("Read from client: {} failed: {}",
+                                  connection_info_, ec.message()));
+    }
+}
+
+void Connection::release_body() {
+    connections_manager_.get_buffer_pool().release(body_);
+}
+
+void Connection::capture_frame(const MessageHeader& header,
+                               std::span<const uint8_t> body) {
+    if (auto* capture = connections_manager_.get_capture()) {
+        capture->record_frame(capture_id_, header, body,
+                              connections_manager_.now());
+    }
+}
+
+void Connection::send_chat_users() {
+    send_message(Message{connections_manager_.get_chat_users()});
+}
+
+void Connection::send_message(const Message& msg) {
+    send_frame(std::make_shared<const SerializedMessage>(serialize(msg)));
+}
+
+void Connection::send_frame(std::shared_ptr<const SerializedMessage> frame) {
+    if (shm_) {
+        shm_->pending.push_back(std::move(frame));
+        flush_shm();
+        return;
+    }
+    if (compression_ == Compression::Zlib) {
+        frame = connections_manager_.get_compressor().compress(frame);
+    }
+    connections_manager_.get_admission().add_outbound_bytes(frame->size());
+    MessageHeader header{};
+    std::memcpy(&header, frame->data(), MessageHeaderSize);
+    if (header.type == MessageType::Trace) {
+        ++queued_traces_;
+    }
+    outbound_.push(std::move(frame), connections_manager_.now());
+    // A paused connection keeps its frames for the successor.
+    if (writing_.empty() && !is_pausing_) {
+        do_write();
+    }
+}
+
+void Connection::do_write() {
+    outbound_.take_batch(writing_, connections_manager_.get_lanes_stats(),
+                         connections_manager_.now());
+    stamp_traces();
+    std::vector<asio::const_buffer> buffers;
+    buffers.reserve(writing_.size());
+    for (const auto& frame : writing_) {
+        buffers.push_back(asio::buffer(*frame));
+    }
+
+    auto handle_write = [self = shared_from_this(),
+                         this](asio::error_code ec, size_t) {
+        if (!ec) {
+            record_traces();
         }
+        auto& admission = connections_manager_.get_admission();
+        for (const auto& frame : writing_) {
+            admission.remove_outbound_bytes(frame->size());
+        }
+        writing_.clear();
+        if (ec) {
+            // The read side notices the broken connection.
+            admission.remove_outbound_bytes(outbound_.get_bytes());
+            outbound_.clear();
+            queued_traces_ = 0;
+            on_paused_.reset();
+        } else if (is_pausing_) {
+            if (!is_read_paused_) {
+                socket_.cancel();
+            }
+            check_paused();
+        } else if (!outbound_.empty()) {
+            do_write();
+        }
+    };
+    with_stream([&](auto& stream) {
+        asio::async_write(stream, buffers, handle_write);
     });
 }
 
-void Connection::broadcast_message(Message msg) {
-    const auto message_data =
-        std::make_shared<SerializedMessage>(serialize(msg));
-    auto self = shared_from_this();
-    for (auto& [connection, nick] : connections_manager_.get_connections()) {
-        if (connection == self || nick.empty()) {
+void Connection::stamp_traces() {
+    writing_traces_ = 0;
+    for (auto& frame : writing_) {
+        if (queued_traces_ == 0) {
+            break;
+        }
+        MessageHeader header{};
+        std::memcpy(&header, frame->data(), MessageHeaderSize);
+        TraceMessage trace;
+        if (header.type != MessageType::Trace ||
+            !deserialize({frame->begin() + MessageHeaderSize, frame->end()},
+                         trace)) {
             continue;
         }
+        --queued_traces_;
+        ++writing_traces_;
+        // The frame is shared by every recipient, each gets its own stamp.
+        trace.server_write = trace_clock_now();
+        connections_manager_.get_trace_stats().record(
+            TraceStage::ServerQueueing, trace.server_enqueue,
+            trace.server_write);
+        frame = std::make_shared<const SerializedMessage>(
+            serialize(Message{trace}));
+    }
+}
+
+void Connection::record_traces() {
+    if (writing_traces_ == 0) {
+        return;
+    }
+    const auto now = trace_clock_now();
+    for (const auto& frame : writing_) {
+        MessageHeader header{};
+        std::memcpy(&header, frame->data(), MessageHeaderSize);
+        TraceMessage trace;
+        if (header.type == MessageType::Trace &&
+            deserialize({frame->begin() + MessageHeaderSize, frame->end()},
+                        trace)) {
+            connections_manager_.get_trace_stats().record(
+                TraceStage::ServerWrite, trace.server_write, now);
+        }
+    }
+}
+
+void Connection::broadcast_message(Message msg) {
+    connections_manager_.broadcast(
+        std::make_shared<const SerializedMessage>(serialize(msg)),
+        shared_from_this());
+}
+
+void Connection::announce_join(UserJoinedMessage joined) {
+    if (auto* federation = connections_manager_.get_federation()) {
+        federation->user_joined(joined.id, joined.nick);
+    }
+    broadcast_message(std::move(joined));
+}
 
-        connection->get_socket().async_send(
-            asio::buffer(*message_data),
-            [self, connection, message_data](asio::error_code ec,
-                                             size_t bytes_send) {});
-    }
-}
-
-void Connection::setup_dispatcher() {
-    dispatcher_.insert(
-        {MessageType::Connect, [this](MessageHeader header, size_t bytes_read) {
-             logger::info("New connect message");
-             handle_connect_message(header, bytes_read);
-         }});
-    dispatcher_.insert({MessageType::Disconnect,
-                        [this](MessageHeader header, size_t bytes_read) {
-                            handle_disconnect_message(header, bytes_read);
-                        }});
-    dispatcher_.insert(
-        {MessageType::Text, [this](MessageHeader header, size_t bytes_read) {
-             handle_text_message(header, bytes_read);
-         }});
-    dispatcher_.insert({MessageType::PrivateMessage,
-                        [this](MessageHeader header, size_t bytes_read) {
-                            handle_private_message(header, bytes_read);
-                        }});
+void Connection::announce_leave(UserId id) {
+    broadcast_message(UserLeftMessage{
+        .version = connections_manager_.next_roster_version(), .id = id});
+    if (auto* federation = connections_manager_.get_federation()) {
+        federation->user_left(id);
+    }
 }
 
 void Connection::handle_connect_message(MessageHeader header,
                                         size_t bytes_read) {
     if (bytes_read == header.body_size) {
-        ConnectMessage connect_message;
-        if (deserialize({buffer_.begin(), buffer_.begin() + bytes_read},
-                        connect_message)) {
+        auto connect_message =
+            make_message<ConnectMessage>(frame_arena_.get());
+        logger::info("New connect message");
+        if (deserialize(body_, connect_message)) {
+            if (!sanitize(connect_message.nick)) {
+                logger::error(std::format("Client {} sent an invalid nick",
+                                          connection_info_));
+                return;
+            }
+            // Applies from the session frames on.
+            compression_ = connect_message.compression;
 
-            connections_manager_.set_nick(shared_from_this(),
-                                          connect_message.nick);
-            logger::info(
-                std::format("{} joined the chat.", connect_message.nick));
-            do_send_chat_users();
+            auto& sessions = connections_manager_.get_sessions();
+            auto& replay_buffer = connections_manager_.get_replay_buffer();
+
+            const auto* session =
+                connect_message.resume_token != 0
+                    ? sessions.find(connect_message.resume_token)
+                    : nullptr;
+            const bool is_resumed =
+                session &&
+                session->nick == std::string_view{connect_message.nick};
+
+            resume_token_ = is_resumed ? connect_message.resume_token : 0;
+            const auto user_id = connections_manager_.add_user(
+                shared_from_this(), connect_message.nick,
+                is_resumed ? session->user_id : InvalidUserId);
+
+            SessionMessage session_message{};
+            if (is_resumed) {
+                sessions.set_user_id(resume_token_, user_id);
+                session_message = {
+                    .resume_token = resume_token_,
+                    .user_id = user_id,
+                    .sequence = connect_message.last_sequence,
+                    .is_gap = !replay_buffer.can_replay_since(
+                        connect_message.last_sequence)};
+            } else {
+                resume_token_ = sessions.create(
+                    {.nick = std::string{connect_message.nick},
+                     .user_id = user_id});
+                session_message = {.resume_token = resume_token_,
+                                   .user_id = user_id,
+                                   .sequence = replay_buffer.last_sequence(),
+                                   .is_gap = false};
+            }
+
+            const auto roster_version =
+                connections_manager_.next_roster_version();
+
+            // Session confirmation, the roster snapshot and the missed frames
+            // go out as one write.
+            auto frames = std::make_shared<SerializedMessage>(
+                serialize(Message{session_message}));
+            const auto snapshot =
+                serialize(Message{connections_manager_.get_chat_users()});
+            frames->insert(frames->end(), snapshot.begin(), snapshot.end());
+            if (is_resumed) {
+                replay_buffer.collect_since(connect_message.last_sequence,
+                                            resume_token_, *frames);
+                logger::info(std::format(
+                    "{} resumed the session from {}{}.", connect_message.nick,
+                    connect_message.last_sequence,
+                    session_message.is_gap ? ", older messages are lost" : ""));
+            } else {
+                logger::info(
+                    std::format("{} joined the chat.", connect_message.nick));
+            }
+            const auto senders = connections_manager_.get_mailboxes().take(
+                connect_message.nick, *frames);
+            send_frame(std::move(frames));
+
+            announce_join({.version = roster_version,
+                           .id = user_id,
+                           .nick = connect_message.nick});
+            connections_manager_.notify_senders(connect_message.nick, senders);
         } else {
             logger::error("Could not deserialize ConnectMessage");
         }
@@ -210,12 +957,17 @@ void Connection::handle_connect_message(MessageHeader header,
 void Connection::handle_disconnect_message(MessageHeader header,
                                            size_t bytes_read) {
     if (bytes_read == header.body_size) {
-        DisconnectMessage disconnect_message;
-        if (deserialize({buffer_.begin(), buffer_.begin() + bytes_read},
-                        disconnect_message)) {
+        auto disconnect_message =
+            make_message<DisconnectMessage>(frame_arena_.get());
+        if (deserialize(body_, disconnect_message)) {
             logger::info(
                 std::format("{} left the chat.", disconnect_message.nick));
-            auto _ = connections_manager_.unset_nick(shared_from_this());
+            const auto id = user_id_;
+            if (connections_manager_.remove_user(shared_from_this())) {
+                announce_leave(id);
+            }
+            connections_manager_.get_sessions().erase(resume_token_);
+            resume_token_ = 0;
         } else {
             logger::error("Could not deserialize DisconnectMessage");
         }
@@ -228,10 +980,26 @@ void Connection::handle_disconnect_message(MessageHeader header,
 
 void Connection::handle_text_message(MessageHeader header, size_t bytes_read) {
     if (bytes_read == header.body_size) {
-        TextMessage text_message;
-        if (deserialize({buffer_.begin(), buffer_.begin() + bytes_read},
-                        text_message)) {
-            broadcast_message(text_message);
+        auto text_message = make_message<TextMessage>(frame_arena_.get());
+        if (deserialize(body_, text_message)) {
+            if (user_id_ == InvalidUserId) {
+                logger::error(std::format(
+                    "Client {} sent TextMessage before joining",
+                    connection_info_));
+                return;
+            }
+            text_message.from = user_id_;
+            if (!sanitize(text_message.message) ||
+                !moderate(text_message.message)) {
+                return;
+            }
+
+            const auto frame = connections_manager_.publish_text(
+                std::move(text_message), shared_from_this(),
+                pending_trace_ ? &*pending_trace_ : nullptr);
+            if (auto* federation = connections_manager_.get_federation()) {
+                federation->forward_text(*frame);
+            }
         } else {
             logger::error("Could not deserialize TextMessage");
         }
@@ -245,25 +1013,49 @@ void Connection::handle_text_message(MessageHeader header, size_t bytes_read) {
 void Connection::handle_private_message(MessageHeader header,
                                         size_t bytes_read) {
     if (bytes_read == header.body_size) {
-        PrivateMessage private_message;
-        if (deserialize({buffer_.begin(), buffer_.begin() + bytes_read},
-                        private_message)) {
-
-            auto connection =
-                connections_manager_.get_connection_by_nick(private_message.to);
-            if (connection) {
-                auto serialized_message = std::make_shared<SerializedMessage>(
-                    serialize(Message{private_message}));
-                connection->get()->get_socket().async_send(
-                    asio::buffer(*serialized_message),
-                    [serialized_message, connection = connection->get()](
-                        asio::error_code, size_t) {});
+        auto private_message =
+            make_message<PrivateMessage>(frame_arena_.get());
+        if (deserialize(body_, private_message)) {
+            if (user_id_ == InvalidUserId) {
+                logger::error(std::format(
+                    "Client {} sent PrivateMessage before joining",
+                    connection_info_));
+                return;
+            }
+            private_message.from = user_id_;
+            if (!sanitize(private_message.message) ||
+                !moderate(private_message.message)) {
+                return;
+            }
+
+            private_message.to = connections_manager_.resolve_recipient(
+                private_message.to, private_message.to_nick);
+            // Taken before the message is handed on.
+            auto delivery_status =
+                make_message<DeliveryStatusMessage>(frame_arena_.get());
+            delivery_status.to =
+                connections_manager_.get_nick(private_message.to)
+                    .value_or(private_message.to_nick);
+
+            auto status = DeliveryStatus::Sent;
+            auto* federation = connections_manager_.get_federation();
+            if (federation &&
+                connections_manager_.get_remote_user(private_message.to)) {
+                federation->forward_private(std::move(private_message));
             } else {
-                logger::error(
-                    std::format("Client {} trying send message to not "
-                                "connected client {}",
-                                private_message.from, private_message.to));
+                status = connections_manager_.deliver_private(
+                    std::move(private_message),
+                    pending_trace_ ? &*pending_trace_ : nullptr);
             }
+
+            if (delivery_status.to.empty()) {
+                logger::error(std::format(
+                    "Client {} trying send message to not connected client",
+                    connection_info_));
+            }
+            delivery_status.status = status;
+            delivery_status.count = 1;
+            send_message(std::move(delivery_status));
         } else {
             logger::error("Could not deserialize PrivateMessage");
         }
@@ -273,3 +1065,203 @@ void Connection::handle_private_message(MessageHeader header,
                         connection_info_));
     }
 }
+
+void Connection::handle_search_message(MessageHeader header,
+                                       size_t bytes_read) {
+    if (bytes_read == header.body_size) {
+        auto search_message =
+            make_message<SearchRequestMessage>(frame_arena_.get());
+        if (deserialize(body_, search_message)) {
+            constexpr size_t max_results{50};
+            connections_manager_.get_search().search(
+                search_message.query, max_results,
+                [self = shared_from_this(),
+                 request_id = search_message.request_id](
+                    std::vector<SearchResult> results) mutable {
+                    // Called on the search thread. The reference is moved to
+                    // the io thread so the connection is never released here.
+                    auto executor = self->socket_.get_executor();
+                    asio::post(executor, [self = std::move(self), request_id,
+                                          results = std::move(results)]() mutable {
+                        self->send_search_results(request_id,
+                                                  std::move(results));
+                    });
+                });
+        } else {
+            logger::error("Could not deserialize SearchRequestMessage");
+        }
+    } else {
+        logger::error(std::format(
+            "Not all SearchRequestMessage body was read from client: {}",
+            connection_info_));
+    }
+}
+
+void Connection::send_search_results(uint32_t request_id,
+                                     std::vector<SearchResult> results) {
+    send_message(SearchResponseMessage{
+        .request_id = request_id,
+        .results = {std::make_move_iterator(results.begin()),
+                    std::make_move_iterator(results.end())}});
+}
+
+void Connection::handle_file_offer_message(MessageHeader header,
+                                          size_t bytes_read) {
+    if (bytes_read == header.body_size) {
+        auto offer = make_message<FileOfferMessage>(frame_arena_.get());
+        if (deserialize(body_, offer)) {
+            if (user_id_ == InvalidUserId) {
+                logger::error(std::format(
+                    "Client {} sent FileOfferMessage before joining",
+                    connection_info_));
+                return;
+            }
+            offer.from = user_id_;
+
+            // Only local recipients, chunks are not relayed across the mesh.
+            auto recipient = offer.to != user_id_
+                                 ? connections_manager_.get_connection(offer.to)
+                                 : nullptr;
+            if (!recipient || !sanitize(offer.name) ||
+                !connections_manager_.get_file_relay().open(
+                    user_id_, offer.to, offer.transfer_id, offer.size)) {
+                send_message(FileAckMessage{.sender = user_id_,
+                                            .transfer_id = offer.transfer_id,
+                                            .status = FileAckStatus::Cancel,
+                                            .received = 0,
+                                            .window = 0});
+                return;
+            }
+            recipient->send_message(offer);
+        } else {
+            logger::error("Could not deserialize FileOfferMessage");
+        }
+    } else {
+        logger::error(
+            std::format("Not all FileOfferMessage body was read from client: {}",
+                        connection_info_));
+    }
+}
+
+void Connection::handle_file_chunk_message(MessageHeader header,
+                                          size_t bytes_read) {
+    if (bytes_read == header.body_size) {
+        auto chunk = make_message<FileChunkMessage>(frame_arena_.get());
+        if (deserialize(body_, chunk)) {
+            auto* transfer = connections_manager_.get_file_relay().find(
+                user_id_, chunk.transfer_id);
+            if (!transfer) {
+                // Chunks already sent when the transfer was cancelled, or
+                // made up.
+                is_stray_ = true;
+                return;
+            }
+            const auto end = chunk.offset + chunk.data.size();
+            if (chunk.offset != transfer->next_offset ||
+                end > transfer->credit_end) {
+                logger::error(std::format(
+                    "Client {} sent a chunk outside of its window",
+                    connection_info_));
+                cancel_transfer(*transfer, chunk.transfer_id);
+                return;
+            }
+            transfer->next_offset = end;
+            chunk.from = user_id_;
+            if (auto recipient =
+                    connections_manager_.get_connection(transfer->recipient)) {
+                recipient->send_message(Message{std::move(chunk)});
+            }
+        } else {
+            logger::error("Could not deserialize FileChunkMessage");
+            is_stray_ = true;
+        }
+    } else {
+        logger::error(
+            std::format("Not all FileChunkMessage body was read from client: {}",
+                        connection_info_));
+    }
+}
+
+void Connection::handle_file_ack_message(MessageHeader header,
+                                        size_t bytes_read) {
+    if (bytes_read == header.body_size) {
+        FileAckMessage ack;
+        if (deserialize(body_, ack)) {
+            auto& file_relay = connections_manager_.get_file_relay();
+            auto* transfer = file_relay.find(ack.sender, ack.transfer_id);
+            if (!transfer || user_id_ == InvalidUserId ||
+                (user_id_ != transfer->recipient &&
+                 user_id_ != transfer->sender)) {
+                is_stray_ = true;
+                return;
+            }
+
+            if (ack.status == FileAckStatus::Cancel) {
+                cancel_transfer(*transfer, ack.transfer_id);
+                return;
+            }
+            // Every credit has to acknowledge data relayed since the last
+            // one, so acks are bounded by the chunks.
+            const bool is_progress =
+                ack.received <= transfer->next_offset &&
+                (ack.received > transfer->received ||
+                 (!transfer->is_accepted && ack.received == 0));
+            if (user_id_ != transfer->recipient || !is_progress) {
+                is_stray_ = true;
+                return;
+            }
+            transfer->is_accepted = true;
+            transfer->received = ack.received;
+            transfer->credit_end =
+                std::min(ack.received + ack.window, transfer->size);
+            if (auto sender =
+                    connections_manager_.get_connection(transfer->sender)) {
+                sender->send_message(ack);
+            }
+            if (ack.received == transfer->size) {
+                file_relay.close(ack.sender, ack.transfer_id);
+            }
+        } else {
+            logger::error("Could not deserialize FileAckMessage");
+            is_stray_ = true;
+        }
+    } else {
+        logger::error(
+            std::format("Not all FileAckMessage body was read from client: {}",
+                        connection_info_));
+    }
+}
+
+void Connection::cancel_transfer(const FileRelay::Transfer& transfer,
+                                 uint32_t transfer_id) {
+    const FileAckMessage cancel{.sender = transfer.sender,
+                                .transfer_id = transfer_id,
+                                .status = FileAckStatus::Cancel,
+                                .received = 0,
+                                .window = 0};
+    for (const auto id : {transfer.sender, transfer.recipient}) {
+        if (auto connection = connections_manager_.get_connection(id)) {
+            connection->send_message(cancel);
+        }
+    }
+    connections_manager_.get_file_relay().close(transfer.sender, transfer_id);
+}
+
+void Connection::handle_trace_message(MessageHeader header, size_t bytes_read) {
+    if (bytes_read == header.body_size) {
+        TraceMessage trace;
+        if (deserialize(body_, trace)) {
+            // The one before went with no message.
+            is_stray_ = pending_trace_.has_value();
+            trace.server_receive = trace_clock_now();
+            pending_trace_ = trace;
+        } else {
+            logger::error("Could not deserialize TraceMessage");
+            is_stray_ = true;
+        }
+    } else {
+        logger::error(
+            std::format("Not all TraceMessage body was read from client: {}",
+                        connection_info_));
+    }
+}
@@ -1,9 +1,21 @@
 #pragma once
 
+#include "../FrameArena.hpp"
 #include "../Message.hpp"
+#include "../TlsStream.hpp"
+#include "FileRelay.hpp"
+#include "Handover.hpp"
+#include "MemoryStream.hpp"
+#include "OutboundQueue.hpp"
+#include "RateLimiter.hpp"
 
 #include <asio.hpp>
+#include <array>
 #include <memory>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <vector>
 #include <format>
 
 class ConnectionsManager;
@@ -11,47 +23,223 @@ struct MessageHeader;
 
 class Connection : public std::enable_shared_from_this<Connection> {
 public:
-    Connection(asio::io_context& io_context, asio::ip::tcp::socket socket, ConnectionsManager& connections_manager);
+    // TCP clients and co-located clients on the unix socket.
+    using Socket = asio::generic::stream_protocol::socket;
+
+    // `tls_context` is null for plaintext clients.
+    Connection(Socket socket, ConnectionsManager& connections_manager,
+               asio::ssl::context* tls_context = nullptr);
+    // A simulated client, see MemoryStream.
+    Connection(std::unique_ptr<MemoryStream> stream,
+               ConnectionsManager& connections_manager);
+    ~Connection();
     // TODO: close socket in destructor ???
 
     void start();
     void stop();
+    // Drops the client as if it had disconnected.
+    void disconnect();
+    void send_message(const Message& msg);
+    // Queues a serialized frame for the socket, or writes it to the shared
+    // memory channel once the client attached one.
+    void send_frame(std::shared_ptr<const SerializedMessage> frame);
+
+    // Hot upgrade, see Handover. Stops reading, keeping the part of a frame
+    // already read, and lets the write in flight finish without starting
+    // another; `on_paused` is released once both are done. TLS, shared
+    // memory and simulated clients can't be handed over and are left alone.
+    void pause(std::shared_ptr<void> on_paused);
+    bool is_paused() const;
+    // What the successor needs to go on, the socket stays open here.
+    HandoverConnection hand_over();
+    // Takes over a connection of the predecessor instead of start(), or
+    // goes on with a paused one after a handover failed.
+    void resume(HandoverConnection state);
 
-    inline asio::ip::tcp::socket& get_socket() {
+    inline Socket& get_socket() {
         return socket_;
     }
 
+    inline UserId get_user_id() const {
+        return user_id_;
+    }
+
+    inline void set_user_id(UserId user_id) {
+        user_id_ = user_id;
+    }
+
+    // 0 until the client joined.
+    inline uint64_t get_resume_token() const {
+        return resume_token_;
+    }
+
 private:
     struct ConnectionInfo {
-        std::string address;
-        asio::ip::port_type port;
+        asio::ip::tcp::endpoint endpoint;
+        // Set instead of the endpoint for clients on the unix socket.
+        int local_descriptor{-1};
+        bool is_in_memory{false};
     };
     friend struct std::formatter<ConnectionInfo>;
 
-    using MessageHandler = std::function<void(MessageHeader, size_t)>;
+    struct ShmTransport;
+
+    static ConnectionInfo make_connection_info(Socket& socket);
+
+    using MessageHandler = void (Connection::*)(MessageHeader, size_t);
+
+    // Bodies above this size are rejected before anything is allocated.
+    static constexpr size_t MaxBodySize = 1024;
+    // File chunks carry up to FileChunkSize bytes besides their fields.
+    static constexpr size_t MaxChunkBodySize = FileChunkSize + 64;
+    // Per direction. Frames larger than this go through in pieces.
+    static constexpr size_t ShmRingCapacity = 256 << 10;
+    // Frames handled per wakeup before other connections get a turn.
+    static constexpr size_t ShmFramesPerTurn = 64;
+
+    // Calls `operation` with the TLS stream, with the memory stream of a
+    // simulated client, or with the socket for plaintext clients.
+    template <typename Operation>
+    void with_stream(Operation&& operation) {
+        if (memory_) {
+            operation(*memory_);
+        } else if (tls_) {
+            operation(*tls_);
+        } else {
+            operation(socket_);
+        }
+    }
+
+    static size_t max_body_size(MessageType type);
+    // File chunks and acks are held back by the recipient's window instead,
+    // charging them would throttle the chat of both sides along with the
+    // transfer. Ones that turn out to belong to no transfer are charged
+    // after all, see is_stray_. A trace rides on the charge of the frame
+    // after it, and is stray when that frame is not charged or another
+    // trace.
+    static bool is_rate_limited(MessageType type);
 
     void do_read_header();
+    // Copies what is left of the input a predecessor handed over into the
+    // start of `buffer`, returns how much.
+    size_t take_partial_input(std::span<uint8_t> buffer);
+    // Keeps the bytes of an unfinished frame for the successor.
+    void pause_reading(std::span<const uint8_t> header,
+                       std::span<const uint8_t> body = {});
+    // Releases the pause token once reading and writing stopped.
+    void check_paused();
+    // Charges the frame to the rate limiter, pauses reading while the
+    // client is over its limits.
+    void admit_frame(MessageHeader header);
+    // Returns how long reading should pause, nullopt if the client kept
+    // flooding and was disconnected.
+    std::optional<RateLimiter::Clock::duration> charge_frame(size_t frame_size);
+    // Charges the frame just handled if it was stray, like charge_frame.
+    std::optional<RateLimiter::Clock::duration>
+    charge_stray_frame(size_t frame_size);
+    void handle_header(MessageHeader header);
     void do_read_body(MessageHeader header);
 
-    void do_send_chat_users();
+    // Answers ShmAttach with the descriptors of a new channel.
+    void attach_shm();
+    void do_read_shm();
+    void handle_shm_frame(const SerializedMessage& frame);
+    void flush_shm();
 
+    // Writes the next batch of queued frames, see OutboundQueue.
+    void do_write();
+    // Stamps the traces in `writing_` with the time they are handed to the
+    // socket, or records how long the completed write took. Neither looks
+    // at the frames unless traces are queued.
+    void stamp_traces();
+    void record_traces();
+    void send_chat_users();
+    void send_search_results(uint32_t request_id,
+                             std::vector<SearchResult> results);
     void broadcast_message(Message msg);
+    // Sends to the local clients and the other nodes of the mesh.
+    void announce_join(UserJoinedMessage joined);
+    void announce_leave(UserId id);
+
+    // Rejects malformed UTF-8 and strips control characters, returns false
+    // if nothing is left to forward.
+    bool sanitize(std::pmr::string& text);
 
-    void setup_dispatcher();
+    // Applies the moderation filter, returns false if the message is
+    // rejected.
+    bool moderate(std::pmr::string& message);
+
+    // Removes the client, once. Does nothing after stop().
+    void handle_client_disconnected();
+    // Logs a read error unless the client just closed the connection.
+    void log_read_error(asio::error_code ec);
+    void release_body();
+    // Records a frame the client sent, when the server captures traffic.
+    void capture_frame(const MessageHeader& header,
+                       std::span<const uint8_t> body = {});
 
     void handle_connect_message(MessageHeader header, size_t bytes_read);
     void handle_disconnect_message(MessageHeader header, size_t bytes_read);
     void handle_text_message(MessageHeader header, size_t bytes_read);
     void handle_private_message(MessageHeader header, size_t bytes_read);
+    void handle_search_message(MessageHeader header, size_t bytes_read);
+    void handle_file_offer_message(MessageHeader header, size_t bytes_read);
+    void handle_file_chunk_message(MessageHeader header, size_t bytes_read);
+    void handle_file_ack_message(MessageHeader header, size_t bytes_read);
+    void handle_trace_message(MessageHeader header, size_t bytes_read);
+    // Tells both sides the transfer is cancelled and forgets it.
+    void cancel_transfer(const FileRelay::Transfer& transfer,
+                         uint32_t transfer_id);
+
+    static const std::unordered_map<MessageType, MessageHandler> dispatcher_;
 
-    asio::io_context& io_context_;
-    asio::ip::tcp::socket socket_;
+    Socket socket_;
+    std::unique_ptr<TlsStream> tls_;
+    std::unique_ptr<MemoryStream> memory_;
     ConnectionsManager& connections_manager_;
-    asio::steady_timer timer_;
     ConnectionInfo connection_info_;
+    uint64_t resume_token_{0};
+    UserId user_id_{InvalidUserId};
+    // What the client announced in its ConnectMessage.
+    Compression compression_{Compression::None};
+    // Id in the traffic capture, 0 until the first frame is recorded.
+    uint32_t capture_id_{0};
+    RateLimiter rate_limiter_;
+    uint32_t throttled_frames_{0};
+    // Set by stop(), a read failing afterwards does not remove the client
+    // again.
+    bool is_stopped_{false};
+    // Set by a handler when a frame that is not rate limited did nothing,
+    // like a chunk of a transfer that does not exist.
+    bool is_stray_{false};
+    // Created the first time the client is throttled.
+    std::unique_ptr<asio::steady_timer> throttle_timer_;
+    // Set once a co-located client attached a shared memory channel.
+    std::unique_ptr<ShmTransport> shm_;
+    // Frames queued while a write is in flight, and the ones it writes.
+    OutboundQueue outbound_;
+    std::vector<OutboundQueue::Frame> writing_;
+    // Trace frames in `outbound_` and in `writing_`.
+    size_t queued_traces_{0};
+    size_t writing_traces_{0};
+
+    // Trace of the next frame the client sends.
+    std::optional<TraceMessage> pending_trace_;
+
+    // Set while the connection is being handed over, see pause().
+    bool is_pausing_{false};
+    bool is_read_paused_{false};
+    std::shared_ptr<void> on_paused_;
+    // Start of a frame the client had not finished sending when the
+    // connection was paused or handed over.
+    SerializedMessage partial_input_;
 
-    std::array<uint8_t, 1024> buffer_;
-    std::unordered_map<MessageType, MessageHandler> dispatcher_;
+    std::array<uint8_t, MessageHeaderSize> header_buffer_;
+    // Taken from the BufferPool only while a body is being read.
+    SerializedMessage body_;
+    // What handlers decode the body into, released after each frame. Sized
+    // for file chunks, the largest frames clients send.
+    FrameArena frame_arena_{64 << 10};
 };
 
 using ConnectionPtr = std::shared_ptr<Connection>;
@@ -63,6 +251,15 @@ struct std::formatter<Connection::ConnectionInfo> {
     }
 
     auto format(const Connection::ConnectionInfo& ci, std::format_context& ctx) const {
-        return std::format_to(ctx.out(), "{}:{}", ci.address, ci.port);
+        if (ci.is_in_memory) {
+            return std::format_to(ctx.out(), "in-memory client");
+        }
+        if (ci.local_descriptor >= 0) {
+            return std::format_to(ctx.out(), "unix socket {}",
+                                  ci.local_descriptor);
+        }
+        return std::format_to(ctx.out(), "{}:{}",
+                              ci.endpoint.address().to_string(),
+                              ci.endpoint.port());
     }
 };
@@ -1,75 +1,708 @@
 #pragma once
 
+#include "../TraceStats.hpp"
+#include "AdmissionControl.hpp"
+#include "BufferPool.hpp"
 #include "Connection.hpp"
+#include "FileRelay.hpp"
+#include "FrameCompressor.hpp"
+#include "Handover.hpp"
+#include "MailboxStore.hpp"
+#include "ModerationFilter.hpp"
+#include "RateLimiter.hpp"
+#include "ReplayBuffer.hpp"
+#include "SearchService.hpp"
+#include "SessionStore.hpp"
+#include "StringInterner.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <print>
+#include <span>
+#include <string_view>
 #include <unordered_map>
-// #include <unordered_set>
+#include <unordered_set>
+#include <vector>
+
+class Federation;
+class TrafficCapture;
+
+// Node of a federated mesh, see Federation.
+using NodeId = uint16_t;
 
 class ConnectionsManager {
 public:
-    using Connections = std::unordered_map<ConnectionPtr, std::string>;
+    // Slot of a joined user, indexed by its UserId. Free slots have no nick,
+    // users joined on another node have no connection.
+    struct User {
+        ConnectionPtr connection;
+        std::string_view nick;
+    };
+    using Users = std::vector<User>;
+
+    // Where a user joined on another node lives, and the id it has there.
+    struct RemoteUser {
+        NodeId node;
+        UserId id;
+    };
 
     void start(ConnectionPtr connection) {
-        connections_.insert({connection, ""});
+        connections_.insert(connection);
         connection->start();
     }
 
     void stop(ConnectionPtr connection) {
         connection->stop();
+        remove_user(connection);
         connections_.erase(connection);
     }
 
     void stop_all() {
-        std::ranges::for_each(connections_, [](auto& c) { c.first->stop(); });
+        std::ranges::for_each(connections_, [](auto& c) { c->stop(); });
         connections_.clear();
+        for (auto& user : users_) {
+            nicks_.release(user.nick);
+        }
+        users_.clear();
+        free_ids_.clear();
+        ids_by_nick_.clear();
+        remote_users_.clear();
+        local_ids_.clear();
+        file_relay_.clear();
     }
 
-    void set_nick(ConnectionPtr connection, std::string nick) {
-        if (auto it = connections_.find(connection);
-            it != std::end(connections_)) {
-            connections_[connection] = nick;
+    // Pauses every connection for a hot upgrade. `on_paused` runs once all
+    // that can be handed over are paused, see Connection::pause.
+    void pause_all(std::function<void()> on_paused) {
+        const std::shared_ptr<void> token{
+            nullptr, [on_paused = std::move(on_paused)](void*) { on_paused(); }};
+        for (const auto& connection : connections_) {
+            connection->pause(token);
         }
     }
 
-    std::optional<std::string> unset_nick(ConnectionPtr connection) {
-        if (auto it = connections_.find(connection);
-            it != std::end(connections_)) {
-            auto nick = std::move(connections_[connection]);
-            connections_[connection].clear();
-            return nick;
+    // Moves the paused connections and what their clients rely on into
+    // `state`, returns the connections in the order of state.connections.
+    //
+    // Clients that could not be paused are disconnected, they resume their
+    // sessions with the successor. File transfers are cancelled and users of
+    // other nodes leave until the successor's links are up; the frames that
+    // tell the remaining clients are part of their output.
+    std::vector<ConnectionPtr> hand_over(HandoverState& state) {
+        std::vector<ConnectionPtr> dropped;
+        for (const auto& connection : connections_) {
+            if (!connection->is_paused()) {
+                dropped.push_back(connection);
+            }
         }
-        return std::nullopt;
+        for (const auto& connection : dropped) {
+            connection->disconnect();
+        }
+
+        std::vector<UserId> remote_ids;
+        for (const auto& [id, remote] : remote_users_) {
+            remote_ids.push_back(id);
+        }
+        for (const auto id : remote_ids) {
+            remove_remote_user(remote_users_[id].node, remote_users_[id].id);
+            broadcast(std::make_shared<const SerializedMessage>(
+                serialize(Message{UserLeftMessage{
+                    .version = next_roster_version(), .id = id}})));
+        }
+
+        for (UserId id = 0; id < users_.size(); ++id) {
+            for (const auto& [transfer_id, transfer] :
+                 file_relay_.drop_user(id)) {
+                for (const auto side : {transfer.sender, transfer.recipient}) {
+                    if (auto connection = get_connection(side)) {
+                        connection->send_message(FileAckMessage{
+                            .sender = transfer.sender,
+                            .transfer_id = transfer_id,
+                            .status = FileAckStatus::Cancel,
+                            .received = 0,
+                            .window = 0});
+                    }
+                }
+            }
+        }
+
+        state.last_sequence = replay_buffer_.last_sequence();
+        state.roster_version = roster_version_;
+        state.sessions = sessions_.get_sessions();
+        state.replay = replay_buffer_.get_entries();
+        for (auto& recipient : mailboxes_.get_recipients()) {
+            SerializedMessage frames;
+            mailboxes_.take(recipient, frames);
+            state.mailboxes.emplace_back(std::move(recipient),
+                                         std::move(frames));
+        }
+
+        std::vector<ConnectionPtr> connections{std::begin(connections_),
+                                               std::end(connections_)};
+        for (const auto& connection : connections) {
+            state.connections.push_back(connection->hand_over());
+        }
+        return connections;
+    }
+
+    // Goes on with a connection of a predecessor under the same user id.
+    void resume(ConnectionPtr connection, HandoverConnection state) {
+        connections_.insert(connection);
+        if (!state.nick.empty()) {
+            add_user(connection, state.nick, state.user_id);
+        }
+        connection->resume(std::move(state));
+    }
+
+    // Takes over what a predecessor handed over besides its connections,
+    // after they were resumed.
+    void restore(HandoverState& state) {
+        roster_version_ = state.roster_version;
+        for (auto& [token, session] : state.sessions) {
+            sessions_.restore(token, std::move(session));
+        }
+        // Search history goes back as far as the replay buffer does.
+        for (const auto& entry : state.replay) {
+            MessageHeader header{};
+            std::memcpy(&header, entry.frame->data(), MessageHeaderSize);
+            if (header.type == MessageType::Text) {
+                search_.index(entry.sequence,
+                              std::string{get_nick(entry.from).value_or("")},
+                              entry.frame);
+            }
+        }
+        for (const auto& entry : state.replay) {
+            hold_id(entry.from, entry.from_session);
+        }
+        for (const auto& entry : replay_buffer_.restore(
+                 state.last_sequence, std::move(state.replay))) {
+            unhold_id(entry.from);
+        }
+        restore_mailboxes(std::move(state.mailboxes));
+    }
+
+    void restore_mailboxes(
+        std::vector<std::pair<std::string, SerializedMessage>> mailboxes) {
+        for (const auto& [recipient, frames] : mailboxes) {
+            std::span<const uint8_t> rest{frames};
+            while (rest.size() >= MessageHeaderSize) {
+                MessageHeader header{};
+                std::memcpy(&header, rest.data(), MessageHeaderSize);
+                const auto size =
+                    std::min(rest.size(), MessageHeaderSize + header.body_size);
+                const SerializedMessage frame{rest.begin(),
+                                              rest.begin() + size};
+                OfflineMessage offline_message;
+                if (deserialize({frame.begin() + MessageHeaderSize, frame.end()},
+                                offline_message)) {
+                    mailboxes_.store(recipient,
+                                     std::string{offline_message.from}, frame);
+                }
+                rest = rest.subspan(size);
+            }
+        }
+    }
+
+    // Assigns the connection a user id, `preferred_id` when it is free so a
+    // resumed session keeps the id other clients already know. Call it with
+    // the resume token of the session already set.
+    UserId add_user(ConnectionPtr connection, std::string_view nick,
+                    UserId preferred_id = InvalidUserId) {
+        remove_user(connection);
+
+        const auto id =
+            allocate_id(preferred_id, connection->get_resume_token());
+        assign_id(id, connection, nick);
+        connection->set_user_id(id);
+        return id;
+    }
+
+    // Gives a user joined on another node a local id, so clients here can
+    // address it like any other user.
+    UserId add_remote_user(NodeId node, UserId remote_id,
+                           std::string_view nick) {
+        remove_remote_user(node, remote_id);
+
+        const auto id = allocate_id(InvalidUserId, 0);
+        assign_id(id, nullptr, nick);
+        remote_users_[id] = {.node = node, .id = remote_id};
+        local_ids_[remote_key(node, remote_id)] = id;
+        return id;
     }
 
-    std::optional<std::string> get_nick(ConnectionPtr connection) {
-        auto it = connections_.find(connection);
-        if (it != std::end(connections_)) {
-            if (it->second.empty()) {
-                return std::nullopt;
+    // Returns the local id the remote user had.
+    std::optional<UserId> remove_remote_user(NodeId node, UserId remote_id) {
+        auto it = local_ids_.find(remote_key(node, remote_id));
+        if (it == std::end(local_ids_)) {
+            return std::nullopt;
+        }
+        const auto id = it->second;
+        local_ids_.erase(it);
+        remote_users_.erase(id);
+        release_id(id);
+        return id;
+    }
+
+    // Drops every user of a node whose link went down, returns their local
+    // ids.
+    std::vector<UserId> remove_remote_users(NodeId node) {
+        std::vector<UserId> ids;
+        for (const auto& [id, remote] : remote_users_) {
+            if (remote.node == node) {
+                ids.push_back(id);
             }
+        }
+        for (const auto id : ids) {
+            remove_remote_user(node, remote_users_[id].id);
+        }
+        return ids;
+    }
+
+    std::optional<RemoteUser> get_remote_user(UserId id) const {
+        if (auto it = remote_users_.find(id); it != std::end(remote_users_)) {
             return it->second;
         }
         return std::nullopt;
     }
 
-    Connections& get_connections() {
-        return connections_;
+    std::optional<UserId> get_local_id(NodeId node, UserId remote_id) const {
+        if (auto it = local_ids_.find(remote_key(node, remote_id));
+            it != std::end(local_ids_)) {
+            return it->second;
+        }
+        return std::nullopt;
+    }
+
+    // Frees the connection's user id, returns the nick it was joined with.
+    std::optional<std::string> remove_user(ConnectionPtr connection) {
+        const auto id = connection->get_user_id();
+        if (id == InvalidUserId || id >= users_.size() ||
+            users_[id].connection != connection) {
+            return std::nullopt;
+        }
+
+        std::string nick{users_[id].nick};
+        release_id(id);
+        connection->set_user_id(InvalidUserId);
+        cancel_transfers(id);
+        return nick;
+    }
+
+    // `to` while it is still joined as `to_nick`, otherwise whoever has
+    // that nick now. Ids are reused, so one known to the sender may belong
+    // to someone else by the time the message arrives.
+    UserId resolve_recipient(UserId to, std::string_view to_nick) const {
+        if (to_nick.empty() ||
+            (to < users_.size() && users_[to].nick == to_nick)) {
+            return to;
+        }
+        return get_user_id(to_nick).value_or(InvalidUserId);
+    }
+
+    // Sequences a text message, keeps it for replay and search and sends it
+    // to the local clients other than `except`, after its `trace` if it is
+    // traced. Returns the frame.
+    std::shared_ptr<const SerializedMessage>
+    publish_text(TextMessage text_message, const ConnectionPtr& except,
+                 const TraceMessage* trace = nullptr) {
+        text_message.sequence = replay_buffer_.next_sequence();
+
+        auto frame = std::make_shared<const SerializedMessage>(
+            serialize(Message{text_message}));
+        keep_for_replay({.sequence = text_message.sequence,
+                         .from = text_message.from,
+                         .from_session = except ? except->get_resume_token() : 0,
+                         .to_session = 0,
+                         .frame = frame});
+        broadcast(frame, except, make_trace_frame(trace));
+
+        search_.index(text_message.sequence,
+                      std::string{get_nick(text_message.from).value_or("")},
+                      frame);
+        return frame;
     }
 
-    std::optional<const ConnectionPtr>
-    get_connection_by_nick(const std::string& nick) {
-        auto it =
-            std::ranges::find_if(connections_, [&nick](const auto& connection) {
-                return connection.second == nick;
-            });
-        if (it != std::ranges::end(connections_)) {
-            return it->first;
+    // Hands a private message to a local recipient, or queues it in the
+    // mailbox of its `to_nick` when nobody here is joined under `to`.
+    DeliveryStatus deliver_private(PrivateMessage private_message,
+                                   const TraceMessage* trace = nullptr) {
+        auto connection = get_connection(private_message.to);
+        if (!connection) {
+            if (private_message.to_nick.empty()) {
+                return DeliveryStatus::Rejected;
+            }
+            return store_offline(private_message.to_nick, private_message.from,
+                                 private_message.message)
+                       ? DeliveryStatus::Stored
+                       : DeliveryStatus::Rejected;
+        }
+        private_message.to_nick.clear();
+
+        private_message.sequence = replay_buffer_.next_sequence();
+        auto frame = std::make_shared<const SerializedMessage>(
+            serialize(Message{private_message}));
+        const auto sender = get_connection(private_message.from);
+        keep_for_replay({.sequence = private_message.sequence,
+                         .from = private_message.from,
+                         .from_session = sender ? sender->get_resume_token() : 0,
+                         .to_session = connection->get_resume_token(),
+                         .frame = frame});
+        if (auto trace_frame = make_trace_frame(trace)) {
+            connection->send_frame(std::move(trace_frame));
+        }
+        connection->send_frame(std::move(frame));
+        return DeliveryStatus::Sent;
+    }
+
+    // Tells the senders of mailbox messages that `recipient` received them,
+    // or that they were lost. Senders that are not joined here are skipped.
+    void notify_senders(std::string_view recipient,
+                        const std::vector<MailboxStore::Sender>& senders) {
+        for (const auto& sender : senders) {
+            const auto id = get_user_id(sender.nick);
+            auto connection = id ? get_connection(*id) : nullptr;
+            if (!connection) {
+                continue;
+            }
+            if (sender.count != 0) {
+                connection->send_message(
+                    DeliveryStatusMessage{.to = std::pmr::string{recipient},
+                                          .status = DeliveryStatus::Delivered,
+                                          .count = sender.count});
+            }
+            if (sender.lost != 0) {
+                connection->send_message(
+                    DeliveryStatusMessage{.to = std::pmr::string{recipient},
+                                          .status = DeliveryStatus::Rejected,
+                                          .count = sender.lost});
+            }
+        }
+    }
+
+    // `trace_frame`, if any, goes right before the frame.
+    void broadcast(
+        std::shared_ptr<const SerializedMessage> frame,
+        const ConnectionPtr& except = nullptr,
+        std::shared_ptr<const SerializedMessage> trace_frame = nullptr) {
+        for (const auto& [connection, nick] : users_) {
+            if (!connection || connection == except) {
+                continue;
+            }
+
+            if (trace_frame) {
+                connection->send_frame(trace_frame);
+            }
+            connection->send_frame(frame);
+        }
+    }
+
+    // Valid until the user leaves.
+    std::optional<std::string_view> get_nick(UserId id) const {
+        if (id < users_.size() && !users_[id].nick.empty()) {
+            return users_[id].nick;
         }
         return std::nullopt;
     }
 
+    ConnectionPtr get_connection(UserId id) const {
+        if (id < users_.size()) {
+            return users_[id].connection;
+        }
+        return nullptr;
+    }
+
+    std::optional<UserId> get_user_id(std::string_view nick) const {
+        if (auto it = ids_by_nick_.find(nick); it != std::end(ids_by_nick_)) {
+            return it->second;
+        }
+        return std::nullopt;
+    }
+
+    const Users& get_users() const {
+        return users_;
+    }
+
+    ReplayBuffer& get_replay_buffer() {
+        return replay_buffer_;
+    }
+
+    SessionStore& get_sessions() {
+        return sessions_;
+    }
+
+    MailboxStore& get_mailboxes() {
+        return mailboxes_;
+    }
+
+    // nullptr when moderation is disabled.
+    const ModerationFilter* get_moderation_filter() const {
+        return moderation_filter_.get();
+    }
+
+    void set_moderation_filter(
+        std::shared_ptr<const ModerationFilter> moderation_filter) {
+        moderation_filter_ = std::move(moderation_filter);
+    }
+
+    // nullptr when the server runs alone.
+    Federation* get_federation() const {
+        return federation_;
+    }
+
+    void set_federation(Federation* federation) {
+        federation_ = federation;
+    }
+
+    // nullptr unless the server captures its traffic.
+    TrafficCapture* get_capture() const {
+        return capture_;
+    }
+
+    void set_capture(TrafficCapture* capture) {
+        capture_ = capture;
+    }
+
+    const RateLimits& get_rate_limits() const {
+        return rate_limits_;
+    }
+
+    void set_rate_limits(const RateLimits& rate_limits) {
+        rate_limits_ = rate_limits;
+    }
+
+    SearchService& get_search() {
+        return search_;
+    }
+
+    BufferPool& get_buffer_pool() {
+        return buffer_pool_;
+    }
+
+    FileRelay& get_file_relay() {
+        return file_relay_;
+    }
+
+    size_t get_connections_count() const {
+        return connections_.size();
+    }
+
+    AdmissionControl& get_admission() {
+        return admission_;
+    }
+
+    FrameCompressor& get_compressor() {
+        return compressor_;
+    }
+
+    // Latency of traced messages by stage, see TraceMessage.
+    TraceStats& get_trace_stats() {
+        return trace_stats_;
+    }
+
+    // Queueing delay of outbound frames per lane, over all connections.
+    LanesStats& get_lanes_stats() {
+        return lanes_stats_;
+    }
+
+    // Time as the server logic sees it, the steady clock unless a
+    // simulation installed a virtual one.
+    OutboundQueue::Clock::time_point now() const {
+        return clock_ ? clock_() : OutboundQueue::Clock::now();
+    }
+
+    void set_clock(std::function<OutboundQueue::Clock::time_point()> clock) {
+        clock_ = std::move(clock);
+    }
+
+    uint64_t next_roster_version() {
+        return ++roster_version_;
+    }
+
+    ChatUsersMessage get_chat_users() const {
+        ChatUsersMessage chat_users{.version = roster_version_, .users = {}};
+        for (UserId id = 0; id < users_.size(); ++id) {
+            if (!users_[id].nick.empty()) {
+                chat_users.users.push_back(
+                    {.id = id, .nick = std::pmr::string{users_[id].nick}});
+            }
+        }
+        return chat_users;
+    }
+
 private:
-    // std::unordered_set<ConnectionPtr> connections_;
-    Connections connections_;
+    UserId allocate_id(UserId preferred_id, uint64_t session) {
+        UserId id{InvalidUserId};
+        if (preferred_id != InvalidUserId && is_free(preferred_id, session)) {
+            id = preferred_id;
+            std::erase(free_ids_, id);
+        } else if (!free_ids_.empty()) {
+            id = free_ids_.front();
+            free_ids_.pop_front();
+        } else {
+            id = static_cast<UserId>(std::max<size_t>(users_.size(), 1));
+        }
+
+        if (id >= users_.size()) {
+            for (auto free_id = static_cast<UserId>(
+                     std::max<size_t>(users_.size(), 1));
+                 free_id < id; ++free_id) {
+                if (!held_ids_.contains(free_id)) {
+                    free_ids_.push_back(free_id);
+                }
+            }
+            users_.resize(id + 1);
+        }
+
+        return id;
+    }
+
+    void assign_id(UserId id, ConnectionPtr connection,
+                   std::string_view nick) {
+        users_[id] = User{.connection = std::move(connection),
+                          .nick = nicks_.intern(nick)};
+        ids_by_nick_[users_[id].nick] = id;
+    }
+
+    void release_id(UserId id) {
+        auto& user = users_[id];
+        if (auto it = ids_by_nick_.find(user.nick);
+            it != std::end(ids_by_nick_) && it->second == id) {
+            ids_by_nick_.erase(it);
+        }
+        nicks_.release(user.nick);
+        user = User{};
+        // Reused last so a dropped client is likely to get its id back.
+        if (!held_ids_.contains(id)) {
+            free_ids_.push_back(id);
+        }
+    }
+
+    // Frames in the replay buffer name their sender by id, so an id is not
+    // given to anyone else while one is left. Replaying them after the
+    // sender left must not show them under the nick of a newcomer.
+    void keep_for_replay(ReplayBuffer::Entry entry) {
+        hold_id(entry.from, entry.from_session);
+        if (auto evicted = replay_buffer_.push(std::move(entry))) {
+            unhold_id(evicted->from);
+        }
+    }
+
+    void hold_id(UserId id, uint64_t session) {
+        auto& hold = held_ids_[id];
+        if (hold.entries++ == 0) {
+            hold.session = session;
+            std::erase(free_ids_, id);
+        }
+    }
+
+    void unhold_id(UserId id) {
+        auto it = held_ids_.find(id);
+        if (it == std::end(held_ids_) || --it->second.entries > 0) {
+            return;
+        }
+        held_ids_.erase(it);
+        if (id != 0 && id < users_.size() && users_[id].nick.empty()) {
+            free_ids_.push_back(id);
+        }
+    }
+
+    bool store_offline(std::string_view recipient, UserId from,
+                       std::string_view message) {
+        const auto sender = get_nick(from).value_or("");
+        const auto frame = serialize(Message{OfflineMessage{
+            .from = std::pmr::string{sender},
+            .message = std::pmr::string{message},
+            .sent_at = std::chrono::duration_cast<std::chrono::seconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count()}});
+
+        if (!mailboxes_.store(recipient, sender, frame)) {
+            std::println("Mailbox of {} is full, dropped message from {}",
+                         recipient, sender);
+            return false;
+        }
+        return true;
+    }
+
+    // Stamps the time a traced message is queued for its recipients.
+    std::shared_ptr<const SerializedMessage>
+    make_trace_frame(const TraceMessage* trace) {
+        if (!trace) {
+            return nullptr;
+        }
+        auto stamped = *trace;
+        stamped.server_enqueue = trace_clock_now();
+        trace_stats_.record(TraceStage::ServerProcessing,
+                            stamped.server_receive, stamped.server_enqueue);
+        return std::make_shared<const SerializedMessage>(
+            serialize(Message{stamped}));
+    }
+
+    // Tells the other side of every transfer `id` took part in that it is
+    // cancelled.
+    void cancel_transfers(UserId id) {
+        for (const auto& [transfer_id, transfer] : file_relay_.drop_user(id)) {
+            const auto peer =
+                transfer.sender == id ? transfer.recipient : transfer.sender;
+            if (auto connection = get_connection(peer)) {
+                connection->send_message(
+                    FileAckMessage{.sender = transfer.sender,
+                                   .transfer_id = transfer_id,
+                                   .status = FileAckStatus::Cancel,
+                                   .received = 0,
+                                   .window = 0});
+            }
+        }
+    }
+
+    static uint64_t remote_key(NodeId node, UserId remote_id) {
+        return (static_cast<uint64_t>(node) << 32) | remote_id;
+    }
+
+    // A held id is only free again for the session that held it.
+    bool is_free(UserId id, uint64_t session) const {
+        if (id < users_.size() && !users_[id].nick.empty()) {
+            return false;
+        }
+        auto it = held_ids_.find(id);
+        return it == std::end(held_ids_) ||
+               (session != 0 && it->second.session == session);
+    }
+
+    std::unordered_set<ConnectionPtr> connections_;
+    Users users_;
+    std::deque<UserId> free_ids_;
+    // Senders of the frames in the replay buffer, see keep_for_replay.
+    struct Hold {
+        size_t entries;
+        // Of the first frame, all of them come from the same user.
+        uint64_t session;
+    };
+    std::unordered_map<UserId, Hold> held_ids_;
+    std::unordered_map<std::string_view, UserId> ids_by_nick_;
+    StringInterner nicks_;
+    ReplayBuffer replay_buffer_{4096};
+    SessionStore sessions_{4096};
+    MailboxStore mailboxes_;
+    BufferPool buffer_pool_{256};
+    LanesStats lanes_stats_;
+    AdmissionControl admission_;
+    FrameCompressor compressor_;
+    TraceStats trace_stats_;
+    FileRelay file_relay_;
+    SearchService search_;
+    std::shared_ptr<const ModerationFilter> moderation_filter_;
+    RateLimits rate_limits_;
+    Federation* federation_{nullptr};
+    TrafficCapture* capture_{nullptr};
+    std::unordered_map<UserId, RemoteUser> remote_users_;
+    // Local id by remote_key(node, remote id).
+    std::unordered_map<uint64_t, UserId> local_ids_;
+    std::function<OutboundQueue::Clock::time_point()> clock_;
+    // Bumped on every join and leave, see ChatUsersMessage.
+    uint64_t roster_version_{0};
 };
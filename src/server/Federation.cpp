@@ -0,0 +1,487 @@
+#include "Federation.hpp"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <print>
+#include <span>
+
+using namespace std::chrono_literals;
+
+namespace {
+constexpr auto RedialDelay = 1s;
+} // namespace
+
+PeerLink::PeerLink(asio::ip::tcp::socket socket, Federation& federation,
+                   std::string dialed_peer)
+    : socket_(std::move(socket)), federation_(federation),
+      dialed_peer_(std::move(dialed_peer)) {
+}
+
+void PeerLink::start(NodeId node_id) {
+    asio::error_code ignored;
+    socket_.set_option(asio::ip::tcp::no_delay(true), ignored);
+    if (RAND_bytes(nonce_.data(), static_cast<int>(nonce_.size())) != 1) {
+        std::println("Could not create a nonce for a peer link.");
+        handle_error();
+        return;
+    }
+    send(Message{
+        PeerHelloMessage{.node_id = node_id, .nonce = nonce_, .proof = {}}});
+    do_read_header();
+}
+
+void PeerLink::stop() {
+    is_stopped_ = true;
+    asio::error_code ignored;
+    socket_.close(ignored);
+}
+
+void PeerLink::send(const SerializedMessage& frame) {
+    if (is_stopped_) {
+        return;
+    }
+    if (pending_.size() + frame.size() > MaxPendingSize) {
+        std::println("Node {} does not keep up, dropping the link.", node_id_);
+        pending_.clear();
+        // The read in flight fails and takes the link down. Not from here,
+        // the caller may be going through the links.
+        asio::error_code ignored;
+        socket_.close(ignored);
+        return;
+    }
+    pending_.insert(pending_.end(), frame.begin(), frame.end());
+    if (writing_.empty()) {
+        do_write();
+    }
+}
+
+void PeerLink::do_write() {
+    writing_.swap(pending_);
+    asio::async_write(socket_, asio::buffer(writing_),
+                      [self = shared_from_this(), this](asio::error_code ec,
+                                                        size_t) {
+                          writing_.clear();
+                          if (ec) {
+                              handle_error();
+                          } else if (!pending_.empty()) {
+                              do_write();
+                          }
+                      });
+}
+
+void PeerLink::do_read_header() {
+    asio::async_read(
+        socket_, asio::buffer(header_buffer_),
+        [self = shared_from_this(), this](asio::error_code ec, size_t) {
+            MessageHeader header{};
+            if (ec || !deserialize({header_buffer_.begin(), header_buffer_.end()},
+                                   header) ||
+                header.body_size > MaxBodySize) {
+                handle_error();
+                return;
+            }
+            do_read_body(header);
+        });
+}
+
+void PeerLink::do_read_body(MessageHeader header) {
+    body_.resize(header.body_size);
+    asio::async_read(socket_, asio::buffer(body_),
+                     [self = shared_from_this(), this,
+                      header](asio::error_code ec, size_t) {
+                         if (ec) {
+                             handle_error();
+                             return;
+                         }
+                         federation_.handle_frame(self, header.type, body_);
+                         if (!is_stopped_) {
+                             do_read_header();
+                         }
+                     });
+}
+
+void PeerLink::handle_error() {
+    if (is_stopped_) {
+        return;
+    }
+    stop();
+    federation_.handle_link_down(shared_from_this());
+}
+
+Federation::Federation(asio::io_context& io_context,
+                       ConnectionsManager& connections_manager,
+                       FederationOptions options)
+    : io_context_(io_context), connections_manager_(connections_manager),
+      options_(std::move(options)), acceptor_(io_context) {
+    asio::ip::tcp::resolver resolver{io_context_};
+    asio::ip::tcp::endpoint endpoint{
+        *resolver.resolve(options_.address, options_.port).begin()};
+
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+}
+
+void Federation::start() {
+    do_accept();
+    for (const auto& peer : options_.peers) {
+        dial(peer);
+    }
+}
+
+void Federation::stop() {
+    is_stopped_ = true;
+    acceptor_.close();
+    for (auto& [node, link] : links_) {
+        link->stop();
+    }
+    for (auto& link : pending_links_) {
+        link->stop();
+    }
+    links_.clear();
+    pending_links_.clear();
+}
+
+void Federation::user_joined(UserId id, std::string_view nick) {
+    const auto frame = serialize(Message{UserJoinedMessage{
+        .version = 0, .id = id, .nick = std::pmr::string{nick}}});
+    for (auto& [node, link] : links_) {
+        link->send(frame);
+    }
+}
+
+void Federation::user_left(UserId id) {
+    const auto frame =
+        serialize(Message{UserLeftMessage{.version = 0, .id = id}});
+    for (auto& [node, link] : links_) {
+        link->send(frame);
+    }
+}
+
+void Federation::forward_text(const SerializedMessage& frame) {
+    for (auto& [node, link] : links_) {
+        link->send(frame);
+    }
+}
+
+void Federation::forward_private(PrivateMessage private_message) {
+    const auto remote =
+        connections_manager_.get_remote_user(private_message.to);
+    if (!remote) {
+        return;
+    }
+    auto link = links_.find(remote->node);
+    if (link == std::end(links_)) {
+        return;
+    }
+
+    // Lets the owner check the id still names the same user.
+    private_message.to_nick =
+        connections_manager_.get_nick(private_message.to).value_or("");
+    private_message.to = remote->id;
+    link->second->send(Message{private_message});
+}
+
+void Federation::do_accept() {
+    acceptor_.async_accept([this](asio::error_code ec,
+                                  asio::ip::tcp::socket socket) {
+        if (!acceptor_.is_open()) {
+            return;
+        }
+
+        if (!ec) {
+            auto link = std::make_shared<PeerLink>(std::move(socket), *this,
+                                                   std::string{});
+            pending_links_.push_back(link);
+            link->start(options_.node_id);
+        }
+        do_accept();
+    });
+}
+
+void Federation::dial(std::string peer) {
+    const auto colon = peer.rfind(':');
+    if (colon == std::string::npos) {
+        std::println("Invalid peer address: {}", peer);
+        return;
+    }
+
+    asio::ip::tcp::resolver resolver{io_context_};
+    asio::error_code ec;
+    const auto endpoints =
+        resolver.resolve(peer.substr(0, colon), peer.substr(colon + 1), ec);
+    if (ec) {
+        std::println("Could not resolve peer {}: {}", peer, ec.message());
+        schedule_dial(std::move(peer));
+        return;
+    }
+
+    auto socket = std::make_shared<asio::ip::tcp::socket>(io_context_);
+    asio::async_connect(
+        *socket, endpoints,
+        [this, socket, peer = std::move(peer)](
+            asio::error_code ec, const asio::ip::tcp::endpoint&) mutable {
+            if (is_stopped_) {
+                return;
+            }
+            if (ec) {
+                schedule_dial(std::move(peer));
+                return;
+            }
+
+            auto link = std::make_shared<PeerLink>(std::move(*socket), *this,
+                                                   std::move(peer));
+            pending_links_.push_back(link);
+            link->start(options_.node_id);
+        });
+}
+
+void Federation::schedule_dial(std::string peer) {
+    auto timer = std::make_shared<asio::steady_timer>(io_context_, RedialDelay);
+    timer->async_wait(
+        [this, timer, peer = std::move(peer)](asio::error_code ec) mutable {
+            if (!ec && !is_stopped_) {
+                dial(std::move(peer));
+            }
+        });
+}
+
+void Federation::handle_frame(const PeerLinkPtr& link, MessageType type,
+                              const SerializedMessage& body) {
+    if (type == MessageType::PeerHello) {
+        handle_hello(link, body);
+        return;
+    }
+    if (link->get_node_id() == 0) {
+        std::println("Frame from a peer before its hello, dropping the link.");
+        link->stop();
+        handle_link_down(link);
+        return;
+    }
+
+    switch (type) {
+        case MessageType::UserJoined: {
+            handle_user_joined(link, body);
+            break;
+        }
+        case MessageType::UserLeft: {
+            handle_user_left(link, body);
+            break;
+        }
+        case MessageType::Text: {
+            handle_text(link, body);
+            break;
+        }
+        case MessageType::PrivateMessage: {
+            handle_private(link, body);
+            break;
+        }
+        case MessageType::PeerMailbox: {
+            handle_mailbox(body);
+            break;
+        }
+        default: {
+            std::println("Not supported message type {} from node {}",
+                         static_cast<int>(type), link->get_node_id());
+            break;
+        }
+    }
+}
+
+void Federation::handle_hello(const PeerLinkPtr& link,
+                              const SerializedMessage& body) {
+    PeerHelloMessage hello{};
+    if (!deserialize(body, hello) || hello.node_id == 0 ||
+        hello.node_id == options_.node_id || links_.contains(hello.node_id) ||
+        link->get_node_id() != 0) {
+        reject(link, hello.node_id);
+        return;
+    }
+
+    const auto& first_hello = link->get_peer_hello();
+    if (!first_hello) {
+        link->set_peer_hello(hello);
+        link->send(Message{PeerHelloMessage{
+            .node_id = options_.node_id,
+            .nonce = link->get_nonce(),
+            .proof = make_proof(hello.nonce, options_.node_id)}});
+        return;
+    }
+    const auto proof = make_proof(link->get_nonce(), hello.node_id);
+    if (hello.node_id != first_hello->node_id ||
+        CRYPTO_memcmp(proof.data(), hello.proof.data(), proof.size()) != 0) {
+        std::println("Peer with node id {} does not know the secret.",
+                     hello.node_id);
+        reject(link, hello.node_id);
+        return;
+    }
+
+    std::erase(pending_links_, link);
+    link->set_node_id(hello.node_id);
+    links_[hello.node_id] = link;
+    std::println("Linked with node {}.", hello.node_id);
+
+    const auto& users = connections_manager_.get_users();
+    for (UserId id = 0; id < users.size(); ++id) {
+        if (users[id].connection) {
+            link->send(Message{UserJoinedMessage{
+                .version = 0, .id = id, .nick = std::pmr::string{users[id].nick}}});
+        }
+    }
+}
+
+void Federation::reject(const PeerLinkPtr& link, NodeId node_id) {
+    std::println("Rejected peer with node id {}.", node_id);
+    link->stop();
+    handle_link_down(link);
+}
+
+std::array<uint8_t, 32>
+Federation::make_proof(const std::array<uint8_t, 16>& nonce,
+                       NodeId node_id) const {
+    std::array<uint8_t, sizeof(nonce) + sizeof(node_id)> data{};
+    std::memcpy(data.data(), nonce.data(), nonce.size());
+    std::memcpy(data.data() + nonce.size(), &node_id, sizeof(node_id));
+
+    std::array<uint8_t, 32> proof{};
+    unsigned int size{0};
+    HMAC(EVP_sha256(), options_.secret.data(),
+         static_cast<int>(options_.secret.size()), data.data(), data.size(),
+         proof.data(), &size);
+    return proof;
+}
+
+void Federation::handle_link_down(const PeerLinkPtr& link) {
+    std::erase(pending_links_, link);
+    const auto node = link->get_node_id();
+    if (auto it = links_.find(node);
+        it != std::end(links_) && it->second == link) {
+        links_.erase(it);
+        std::println("Lost link with node {}.", node);
+
+        for (const auto id : connections_manager_.remove_remote_users(node)) {
+            connections_manager_.broadcast(
+                std::make_shared<const SerializedMessage>(
+                    serialize(Message{UserLeftMessage{
+                        .version = connections_manager_.next_roster_version(),
+                        .id = id}})));
+        }
+    }
+
+    if (!link->get_dialed_peer().empty() && !is_stopped_) {
+        schedule_dial(link->get_dialed_peer());
+    }
+}
+
+void Federation::handle_user_joined(const PeerLinkPtr& link,
+                                    const SerializedMessage& body) {
+    UserJoinedMessage joined;
+    if (!deserialize(body, joined) || joined.nick.empty()) {
+        return;
+    }
+
+    const auto id = connections_manager_.add_remote_user(
+        link->get_node_id(), joined.id, joined.nick);
+    connections_manager_.broadcast(std::make_shared<const SerializedMessage>(
+        serialize(Message{UserJoinedMessage{
+            .version = connections_manager_.next_roster_version(),
+            .id = id,
+            .nick = joined.nick}})));
+
+    // Messages queued here while the user was offline, in frames the
+    // other node takes.
+    SerializedMessage frames;
+    const auto senders = connections_manager_.get_mailboxes().take(
+        joined.nick, frames);
+    std::span<const uint8_t> rest{frames};
+    while (!rest.empty()) {
+        size_t size{0};
+        while (size + MessageHeaderSize <= rest.size()) {
+            MessageHeader header{};
+            std::memcpy(&header, rest.data() + size, MessageHeaderSize);
+            const auto end = size + MessageHeaderSize + header.body_size;
+            if (size != 0 && sizeof(UserId) + end > PeerLink::MaxBodySize) {
+                break;
+            }
+            size = end;
+        }
+        size = size == 0 ? rest.size() : std::min(size, rest.size());
+        link->send(Message{PeerMailboxMessage{
+            .to = joined.id, .frames = {rest.begin(), rest.begin() + size}}});
+        rest = rest.subspan(size);
+    }
+    connections_manager_.notify_senders(joined.nick, senders);
+}
+
+void Federation::handle_user_left(const PeerLinkPtr& link,
+                                  const SerializedMessage& body) {
+    UserLeftMessage left;
+    if (!deserialize(body, left)) {
+        return;
+    }
+
+    if (const auto id = connections_manager_.remove_remote_user(
+            link->get_node_id(), left.id)) {
+        connections_manager_.broadcast(std::make_shared<const SerializedMessage>(
+            serialize(Message{UserLeftMessage{
+                .version = connections_manager_.next_roster_version(),
+                .id = *id}})));
+    }
+}
+
+void Federation::handle_text(const PeerLinkPtr& link,
+                             const SerializedMessage& body) {
+    TextMessage text_message;
+    if (!deserialize(body, text_message)) {
+        return;
+    }
+
+    const auto from =
+        connections_manager_.get_local_id(link->get_node_id(), text_message.from);
+    if (!from) {
+        return;
+    }
+    text_message.from = *from;
+    connections_manager_.publish_text(std::move(text_message), nullptr);
+}
+
+void Federation::handle_private(const PeerLinkPtr& link,
+                                const SerializedMessage& body) {
+    PrivateMessage private_message;
+    if (!deserialize(body, private_message)) {
+        return;
+    }
+
+    const auto from = connections_manager_.get_local_id(link->get_node_id(),
+                                                        private_message.from);
+    if (!from) {
+        return;
+    }
+    private_message.from = *from;
+
+    private_message.to = connections_manager_.resolve_recipient(
+        private_message.to, private_message.to_nick);
+    if (connections_manager_.get_remote_user(private_message.to)) {
+        // Moved to another node meanwhile, keep it for the next join here.
+        private_message.to = InvalidUserId;
+    }
+    connections_manager_.deliver_private(std::move(private_message));
+}
+
+void Federation::handle_mailbox(const SerializedMessage& body) {
+    PeerMailboxMessage mailbox;
+    if (!deserialize(body, mailbox)) {
+        return;
+    }
+
+    auto connection = connections_manager_.get_connection(mailbox.to);
+    if (!connection) {
+        return;
+    }
+    connection->send_frame(
+        std::make_shared<const SerializedMessage>(std::move(mailbox.frames)));
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "../Message.hpp"
+#include "ConnectionsManager.hpp"
+
+#include <asio.hpp>
+
+#include <array>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct FederationOptions {
+    // Address links from other nodes are accepted on, apart from the one
+    // for clients so the peer port can stay on a private network.
+    std::string address{"127.0.0.1"};
+    // Port other nodes connect to, empty runs the server alone.
+    std::string port;
+    // Shared by all nodes of the mesh, a link is only used once the other
+    // side proved it knows it (see PeerHelloMessage). Must not be empty.
+    std::string secret;
+    // Unique within the mesh.
+    NodeId node_id{1};
+    // "host:port" of nodes to connect to. Every pair of nodes needs exactly
+    // one link, so each node lists the nodes started before it.
+    std::vector<std::string> peers;
+};
+
+class Federation;
+
+// TCP link to another node. Speaks the client framing with two PeerHello
+// frames first, then UserJoined/UserLeft for the roster of the sending node
+// and Text/PrivateMessage frames addressed with the sending node's user ids.
+//
+// Frames queued while a write is in flight are appended to one buffer and go
+// out together in the next write, so a busy link sends large batches. A
+// node that does not read what is queued for it loses the link.
+class PeerLink : public std::enable_shared_from_this<PeerLink> {
+public:
+    // Mailboxes go in frames of up to this size.
+    static constexpr size_t MaxBodySize = 64 << 10;
+
+    PeerLink(asio::ip::tcp::socket socket, Federation& federation,
+             std::string dialed_peer);
+
+    // Sends the first hello, with a fresh nonce.
+    void start(NodeId node_id);
+    void stop();
+    void send(const SerializedMessage& frame);
+    void send(const Message& msg) {
+        send(serialize(msg));
+    }
+
+    NodeId get_node_id() const {
+        return node_id_;
+    }
+
+    void set_node_id(NodeId node_id) {
+        node_id_ = node_id;
+    }
+
+    // "host:port" this node dialed, empty for accepted links.
+    const std::string& get_dialed_peer() const {
+        return dialed_peer_;
+    }
+
+    const std::array<uint8_t, 16>& get_nonce() const {
+        return nonce_;
+    }
+
+    // The first hello of the other side, until it proved itself.
+    const std::optional<PeerHelloMessage>& get_peer_hello() const {
+        return peer_hello_;
+    }
+
+    void set_peer_hello(const PeerHelloMessage& hello) {
+        peer_hello_ = hello;
+    }
+
+private:
+    // Bytes queued for a write before the link is dropped.
+    static constexpr size_t MaxPendingSize = 16 << 20;
+
+    void do_read_header();
+    void do_read_body(MessageHeader header);
+    void do_write();
+    void handle_error();
+
+    asio::ip::tcp::socket socket_;
+    Federation& federation_;
+    std::string dialed_peer_;
+    NodeId node_id_{0};
+    bool is_stopped_{false};
+    std::array<uint8_t, 16> nonce_{};
+    std::optional<PeerHelloMessage> peer_hello_;
+
+    std::array<uint8_t, MessageHeaderSize> header_buffer_;
+    SerializedMessage body_;
+    // Frames queued since the last write started.
+    SerializedMessage pending_;
+    SerializedMessage writing_;
+};
+
+using PeerLinkPtr = std::shared_ptr<PeerLink>;
+
+// Joins this server to a mesh of server processes.
+//
+// Every node serves its own clients and sends each broadcast or private
+// frame of a local sender directly to the peers that need it, so frames
+// cross at most one link. Users joined on other nodes get local ids in the
+// ConnectionsManager (see add_remote_user) and look like any other user to
+// local clients, nick lookups for private messages route to the node that
+// owns the user.
+class Federation {
+public:
+    Federation(asio::io_context& io_context,
+               ConnectionsManager& connections_manager,
+               FederationOptions options);
+
+    void start();
+    void stop();
+
+    // Called for users of local clients.
+    void user_joined(UserId id, std::string_view nick);
+    void user_left(UserId id);
+    void forward_text(const SerializedMessage& frame);
+    // `private_message.to` is the local id of a remote user.
+    void forward_private(PrivateMessage private_message);
+
+private:
+    friend class PeerLink;
+
+    void do_accept();
+    void dial(std::string peer);
+    void schedule_dial(std::string peer);
+
+    void handle_hello(const PeerLinkPtr& link, const SerializedMessage& body);
+    void reject(const PeerLinkPtr& link, NodeId node_id);
+    // What a node with `node_id` answers to `nonce`, see PeerHelloMessage.
+    std::array<uint8_t, 32> make_proof(const std::array<uint8_t, 16>& nonce,
+                                       NodeId node_id) const;
+    void handle_frame(const PeerLinkPtr& link, MessageType type,
+                      const SerializedMessage& body);
+    void handle_link_down(const PeerLinkPtr& link);
+
+    void handle_user_joined(const PeerLinkPtr& link,
+                            const SerializedMessage& body);
+    void handle_user_left(const PeerLinkPtr& link,
+                          const SerializedMessage& body);
+    void handle_text(const PeerLinkPtr& link, const SerializedMessage& body);
+    void handle_private(const PeerLinkPtr& link,
+                        const SerializedMessage& body);
+    void handle_mailbox(const SerializedMessage& body);
+
+    asio::io_context& io_context_;
+    ConnectionsManager& connections_manager_;
+    FederationOptions options_;
+    asio::ip::tcp::acceptor acceptor_;
+    bool is_stopped_{false};
+    // Links that completed the hello, by node.
+    std::unordered_map<NodeId, PeerLinkPtr> links_;
+    // Links still waiting for the hello.
+    std::vector<PeerLinkPtr> pending_links_;
+};
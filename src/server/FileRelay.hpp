@@ -0,0 +1,97 @@
+#pragma once
+
+#include "../Message.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// File transfers between local clients that the server is relaying.
+//
+// Only the bookkeeping of a transfer lives here, its chunks are forwarded
+// as they arrive. The sender may not run ahead of the credit the recipient
+// granted, so what a transfer holds in the recipient's outbound queue is
+// bounded by its window rather than by the size of the file.
+class FileRelay {
+public:
+    struct Transfer {
+        UserId sender;
+        UserId recipient;
+        uint64_t size;
+        // Offset the recipient allowed the sender to send up to.
+        uint64_t credit_end;
+        // Offset the next chunk must start at.
+        uint64_t next_offset;
+        // Bytes the recipient acknowledged so far.
+        uint64_t received;
+        bool is_accepted;
+    };
+
+    // Per sender, further offers are refused.
+    static constexpr size_t MaxTransfersPerUser = 8;
+
+    bool open(UserId sender, UserId recipient, uint32_t transfer_id,
+              uint64_t size) {
+        auto& count = open_by_sender_[sender];
+        if (count == MaxTransfersPerUser) {
+            return false;
+        }
+        const auto [it, inserted] =
+            transfers_.try_emplace(key(sender, transfer_id),
+                                   Transfer{.sender = sender,
+                                            .recipient = recipient,
+                                            .size = size,
+                                            .credit_end = 0,
+                                            .next_offset = 0,
+                                            .received = 0,
+                                            .is_accepted = false});
+        if (inserted) {
+            ++count;
+        }
+        return inserted;
+    }
+
+    Transfer* find(UserId sender, uint32_t transfer_id) {
+        auto it = transfers_.find(key(sender, transfer_id));
+        return it != std::end(transfers_) ? &it->second : nullptr;
+    }
+
+    void close(UserId sender, uint32_t transfer_id) {
+        if (transfers_.erase(key(sender, transfer_id)) != 0) {
+            if (--open_by_sender_[sender] == 0) {
+                open_by_sender_.erase(sender);
+            }
+        }
+    }
+
+    // Closes every transfer `id` sends or receives, returns them with their
+    // ids so the other sides can be told.
+    std::vector<std::pair<uint32_t, Transfer>> drop_user(UserId id) {
+        std::vector<std::pair<uint32_t, Transfer>> dropped;
+        for (const auto& [transfer_key, transfer] : transfers_) {
+            if (transfer.sender == id || transfer.recipient == id) {
+                dropped.emplace_back(static_cast<uint32_t>(transfer_key),
+                                     transfer);
+            }
+        }
+        for (const auto& [transfer_id, transfer] : dropped) {
+            close(transfer.sender, transfer_id);
+        }
+        return dropped;
+    }
+
+    void clear() {
+        transfers_.clear();
+        open_by_sender_.clear();
+    }
+
+private:
+    static uint64_t key(UserId sender, uint32_t transfer_id) {
+        return (static_cast<uint64_t>(sender) << 32) | transfer_id;
+    }
+
+    std::unordered_map<uint64_t, Transfer> transfers_;
+    std::unordered_map<UserId, size_t> open_by_sender_;
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "../FrameCompression.hpp"
+
+#include <cstring>
+#include <memory>
+
+// Compresses the frames queued for clients that read compressed frames,
+// see FrameCompression, with one deflate context for the whole server.
+//
+// A broadcast queues the same frame for every recipient in turn, so the
+// last frame and what it compressed to are kept: it is compressed once
+// however many clients get it.
+class FrameCompressor {
+public:
+    using Frame = std::shared_ptr<const SerializedMessage>;
+
+    // Frames up to `threshold` bytes go as they are, 0 disables compression.
+    void set_threshold(size_t threshold) {
+        threshold_ = threshold;
+    }
+
+    // The frame to send instead of `frame`, `frame` itself if it is small
+    // or does not compress.
+    Frame compress(const Frame& frame) {
+        if (threshold_ == 0 || frame->size() <= threshold_) {
+            return frame;
+        }
+        if (last_frame_ == frame) {
+            return last_result_;
+        }
+
+        MessageHeader header{};
+        std::memcpy(&header, frame->data(), MessageHeaderSize);
+        // File data is mostly compressed already.
+        if (header.type == MessageType::Compressed ||
+            header.type == MessageType::FileChunk) {
+            return frame;
+        }
+        auto compressed = deflater_.compress(*frame);
+        last_frame_ = frame;
+        last_result_ = compressed ? std::make_shared<const SerializedMessage>(
+                                        std::move(*compressed))
+                                  : frame;
+        return last_result_;
+    }
+
+private:
+    // Saves nearly as much as the default level on chat and rosters for a
+    // third of the time, see the frame_compression benchmark.
+    FrameDeflater deflater_{Z_BEST_SPEED};
+    size_t threshold_{512};
+    Frame last_frame_;
+    Frame last_result_;
+};
@@ -0,0 +1,346 @@
+#include "Handover.hpp"
+#include "../ShmChannel.hpp"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <span>
+#include <type_traits>
+
+namespace {
+// Either side gives up on a peer that stopped responding.
+constexpr timeval Timeout{.tv_sec = 10, .tv_usec = 0};
+// Bound of the serialized state, the successor allocates it up front.
+constexpr uint64_t MaxStateSize = 1 << 30;
+
+class Writer {
+public:
+    template <typename T>
+        requires std::is_trivially_copyable_v<T>
+    void write_value(const T& value) {
+        const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+        buffer_.insert(buffer_.end(), bytes, bytes + sizeof(T));
+    }
+
+    void write_bytes(std::span<const uint8_t> bytes) {
+        write_value(static_cast<uint64_t>(bytes.size()));
+        buffer_.insert(buffer_.end(), bytes.begin(), bytes.end());
+    }
+
+    void write_string(const std::string& text) {
+        write_bytes({reinterpret_cast<const uint8_t*>(text.data()),
+                     text.size()});
+    }
+
+    const SerializedMessage& get() const {
+        return buffer_;
+    }
+
+private:
+    SerializedMessage buffer_;
+};
+
+class Reader {
+public:
+    explicit Reader(const SerializedMessage& buffer) : buffer_(buffer) {
+    }
+
+    template <typename T>
+        requires std::is_trivially_copyable_v<T>
+    bool read_value(T& value) {
+        if (buffer_.size() - offset_ < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, buffer_.data() + offset_, sizeof(T));
+        offset_ += sizeof(T);
+        return true;
+    }
+
+    bool read_bytes(SerializedMessage& bytes) {
+        uint64_t size{0};
+        if (!read_value(size) || buffer_.size() - offset_ < size) {
+            return false;
+        }
+        bytes.assign(buffer_.begin() + offset_,
+                     buffer_.begin() + offset_ + size);
+        offset_ += size;
+        return true;
+    }
+
+    bool read_string(std::string& text) {
+        uint64_t size{0};
+        if (!read_value(size) || buffer_.size() - offset_ < size) {
+            return false;
+        }
+        text.assign(buffer_.begin() + offset_,
+                    buffer_.begin() + offset_ + size);
+        offset_ += size;
+        return true;
+    }
+
+    bool is_done() const {
+        return offset_ == buffer_.size();
+    }
+
+private:
+    const SerializedMessage& buffer_;
+    size_t offset_{0};
+};
+
+SerializedMessage write_state(const HandoverState& state) {
+    Writer writer;
+    writer.write_value(state.acceptor >= 0);
+    writer.write_value(state.local_acceptor >= 0);
+    writer.write_value(state.last_sequence);
+    writer.write_value(state.roster_version);
+
+    writer.write_value(static_cast<uint64_t>(state.sessions.size()));
+    for (const auto& [token, session] : state.sessions) {
+        writer.write_value(token);
+        writer.write_string(session.nick);
+        writer.write_value(session.user_id);
+    }
+
+    writer.write_value(static_cast<uint64_t>(state.replay.size()));
+    for (const auto& entry : state.replay) {
+        writer.write_value(entry.sequence);
+        writer.write_value(entry.from);
+        writer.write_value(entry.from_session);
+        writer.write_value(entry.to_session);
+        writer.write_bytes(*entry.frame);
+    }
+
+    writer.write_value(static_cast<uint64_t>(state.mailboxes.size()));
+    for (const auto& [recipient, frames] : state.mailboxes) {
+        writer.write_string(recipient);
+        writer.write_bytes(frames);
+    }
+
+    writer.write_value(static_cast<uint64_t>(state.connections.size()));
+    for (const auto& connection : state.connections) {
+        writer.write_value(connection.user_id);
+        writer.write_string(connection.nick);
+        writer.write_value(connection.resume_token);
+        writer.write_value(connection.compression);
+        writer.write_bytes(connection.partial_input);
+        writer.write_bytes(connection.output);
+    }
+    return writer.get();
+}
+
+// Descriptors arrive after the blob, see receive_handover.
+bool read_state(const SerializedMessage& blob, HandoverState& state) {
+    Reader reader{blob};
+    bool has_acceptor{false};
+    bool has_local_acceptor{false};
+    uint64_t count{0};
+    if (!reader.read_value(has_acceptor) ||
+        !reader.read_value(has_local_acceptor) ||
+        !reader.read_value(state.last_sequence) ||
+        !reader.read_value(state.roster_version)) {
+        return false;
+    }
+    // Marks the descriptors that follow.
+    state.acceptor = has_acceptor ? 0 : -1;
+    state.local_acceptor = has_local_acceptor ? 0 : -1;
+
+    if (!reader.read_value(count)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        auto& [token, session] = state.sessions.emplace_back();
+        if (!reader.read_value(token) || !reader.read_string(session.nick) ||
+            !reader.read_value(session.user_id)) {
+            return false;
+        }
+    }
+
+    if (!reader.read_value(count)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        auto& entry = state.replay.emplace_back();
+        SerializedMessage frame;
+        if (!reader.read_value(entry.sequence) ||
+            !reader.read_value(entry.from) ||
+            !reader.read_value(entry.from_session) ||
+            !reader.read_value(entry.to_session) || !reader.read_bytes(frame)) {
+            return false;
+        }
+        entry.frame = std::make_shared<const SerializedMessage>(std::move(frame));
+    }
+
+    if (!reader.read_value(count)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        auto& [recipient, frames] = state.mailboxes.emplace_back();
+        if (!reader.read_string(recipient) || !reader.read_bytes(frames)) {
+            return false;
+        }
+    }
+
+    if (!reader.read_value(count)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        auto& connection = state.connections.emplace_back();
+        if (!reader.read_value(connection.user_id) ||
+            !reader.read_string(connection.nick) ||
+            !reader.read_value(connection.resume_token) ||
+            !reader.read_value(connection.compression) ||
+            !reader.read_bytes(connection.partial_input) ||
+            !reader.read_bytes(connection.output)) {
+            return false;
+        }
+    }
+    return reader.is_done();
+}
+
+bool send_all(int socket, std::span<const uint8_t> bytes) {
+    while (!bytes.empty()) {
+        const auto sent = ::send(socket, bytes.data(), bytes.size(),
+                                 MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes = bytes.subspan(static_cast<size_t>(sent));
+    }
+    return true;
+}
+
+bool receive_all(int socket, std::span<uint8_t> bytes) {
+    while (!bytes.empty()) {
+        const auto received = ::recv(socket, bytes.data(), bytes.size(), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes = bytes.subspan(static_cast<size_t>(received));
+    }
+    return true;
+}
+
+// One byte per descriptor, so each receive gets exactly one.
+bool send_descriptor(int socket, int descriptor) {
+    const uint8_t marker{0};
+    iovec io{.iov_base = const_cast<uint8_t*>(&marker), .iov_len = 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+    msghdr message{};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    auto* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &descriptor, sizeof(int));
+
+    ssize_t sent{0};
+    do {
+        sent = ::sendmsg(socket, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent == 1;
+}
+
+int receive_descriptor(int socket) {
+    uint8_t marker{0};
+    int descriptor{-1};
+    if (receive_descriptors(socket, {&marker, 1}, {&descriptor, 1}) != 1) {
+        return -1;
+    }
+    return descriptor;
+}
+
+void set_timeouts(int socket) {
+    ::setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+    ::setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+}
+} // namespace
+
+bool send_handover(int socket, const HandoverState& state) {
+    set_timeouts(socket);
+    const auto blob = write_state(state);
+    const auto size = static_cast<uint64_t>(blob.size());
+    if (size > MaxStateSize ||
+        !send_all(socket, {reinterpret_cast<const uint8_t*>(&size),
+                           sizeof(size)}) ||
+        !send_all(socket, blob)) {
+        return false;
+    }
+
+    for (const int descriptor : {state.acceptor, state.local_acceptor}) {
+        if (descriptor >= 0 && !send_descriptor(socket, descriptor)) {
+            return false;
+        }
+    }
+    for (const auto& connection : state.connections) {
+        if (!send_descriptor(socket, connection.descriptor)) {
+            return false;
+        }
+    }
+    // Descriptors in flight stay open when the sender closes its copies.
+    return true;
+}
+
+std::optional<HandoverState> receive_handover(int socket) {
+    set_timeouts(socket);
+    uint64_t size{0};
+    if (!receive_all(socket, {reinterpret_cast<uint8_t*>(&size),
+                              sizeof(size)}) ||
+        size > MaxStateSize) {
+        return std::nullopt;
+    }
+    SerializedMessage blob(size);
+    HandoverState state;
+    if (!receive_all(socket, blob) || !read_state(blob, state)) {
+        return std::nullopt;
+    }
+
+    std::vector<int*> descriptors;
+    for (int* descriptor : {&state.acceptor, &state.local_acceptor}) {
+        if (*descriptor >= 0) {
+            descriptors.push_back(descriptor);
+        }
+    }
+    for (auto& connection : state.connections) {
+        descriptors.push_back(&connection.descriptor);
+    }
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        *descriptors[i] = receive_descriptor(socket);
+        if (*descriptors[i] < 0) {
+            for (size_t j = 0; j < i; ++j) {
+                ::close(*descriptors[j]);
+            }
+            return std::nullopt;
+        }
+    }
+    return state;
+}
+
+bool is_same_user(int socket) {
+    ucred credentials{};
+    socklen_t length = sizeof(credentials);
+    return ::getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials,
+                        &length) == 0 &&
+           credentials.uid == ::geteuid();
+}
+
+int socket_family(int descriptor) {
+    sockaddr_storage address{};
+    socklen_t length = sizeof(address);
+    if (::getsockname(descriptor, reinterpret_cast<sockaddr*>(&address),
+                      &length) != 0) {
+        return -1;
+    }
+    return address.ss_family;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "../Message.hpp"
+#include "ReplayBuffer.hpp"
+#include "SessionStore.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// What a running server hands to the process replacing it in a hot upgrade,
+// see ServerOptions::upgrade_socket.
+//
+// Descriptors travel over the unix socket the new process connected to as
+// SCM_RIGHTS, the rest as one serialized blob ahead of them. The new process
+// accepts on the same listening sockets and goes on reading and writing the
+// same client connections, so clients only see a short pause.
+struct HandoverConnection {
+    int descriptor{-1};
+    // InvalidUserId and an empty nick if the client had not joined.
+    UserId user_id{InvalidUserId};
+    std::string nick;
+    uint64_t resume_token{0};
+    Compression compression{Compression::None};
+    // Bytes of a frame the client was in the middle of sending.
+    SerializedMessage partial_input;
+    // Whole frames queued for the client but not written yet.
+    SerializedMessage output;
+};
+
+struct HandoverState {
+    // -1 when the predecessor had no such acceptor.
+    int acceptor{-1};
+    int local_acceptor{-1};
+    uint64_t last_sequence{0};
+    uint64_t roster_version{0};
+    // Oldest first.
+    std::vector<std::pair<uint64_t, SessionStore::Session>> sessions;
+    // In delivery order.
+    std::vector<ReplayBuffer::Entry> replay;
+    // Queued OfflineMessage frames by recipient.
+    std::vector<std::pair<std::string, SerializedMessage>> mailboxes;
+    std::vector<HandoverConnection> connections;
+};
+
+// Both block until done. The sender's descriptors stay open, the received
+// ones belong to the caller.
+bool send_handover(int socket, const HandoverState& state);
+std::optional<HandoverState> receive_handover(int socket);
+
+// True if the process at the other end of a unix socket runs as the same
+// user as this one. Anyone else must not get the clients of the server.
+bool is_same_user(int socket);
+
+// AF_INET, AF_INET6 or AF_UNIX for a socket descriptor, -1 on error.
+int socket_family(int descriptor);
@@ -0,0 +1,52 @@
+#include "LatencyProfile.hpp"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+
+using namespace std::chrono_literals;
+
+LatencyOptions low_latency_profile() {
+    return {.cpus = {},
+            .no_delay = true,
+            .busy_poll = 50us,
+            .spin = 1ms,
+            .send_buffer = 0,
+            .receive_buffer = 0};
+}
+
+bool pin_current_thread(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            return false;
+        }
+        CPU_SET(cpu, &set);
+    }
+    return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+}
+
+std::error_code tune_socket(int descriptor, const LatencyOptions& options) {
+    std::error_code first_error;
+    const auto set = [&](int level, int name, int value) {
+        if (::setsockopt(descriptor, level, name, &value, sizeof(value)) != 0 &&
+            !first_error) {
+            first_error = {errno, std::system_category()};
+        }
+    };
+    if (options.no_delay) {
+        set(IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+#if defined(SO_BUSY_POLL)
+    if (options.busy_poll.count() != 0) {
+        set(SOL_SOCKET, SO_BUSY_POLL,
+            static_cast<int>(options.busy_poll.count()));
+    }
+#endif // defined(SO_BUSY_POLL)
+    return first_error;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+#include <system_error>
+#include <vector>
+
+// Tuning for deployments where tail latency matters more than CPU time.
+// Everything is off by default, the low-latency profile turns on what does
+// not depend on the host; CPUs and buffer sizes are set separately.
+struct LatencyOptions {
+    // CPUs the io thread may run on, empty leaves it to the scheduler.
+    std::vector<int> cpus;
+    // TCP_NODELAY on clients' sockets. Frames are written whole, so Nagle
+    // only holds a small frame back until the previous one is acknowledged,
+    // which delayed ACKs can stretch to tens of milliseconds.
+    bool no_delay{false};
+    // SO_BUSY_POLL on clients' sockets: reads poll the device queue for this
+    // long instead of waiting for the interrupt. Raising it above the
+    // net.core.busy_read sysctl needs CAP_NET_ADMIN, it does nothing on
+    // loopback.
+    std::chrono::microseconds busy_poll{0};
+    // How long the io thread keeps polling for ready handlers after the last
+    // one before it blocks in the kernel, so a message arriving meanwhile
+    // does not wait for the thread to be woken up.
+    std::chrono::microseconds spin{0};
+    // SO_SNDBUF and SO_RCVBUF of clients' sockets in bytes, 0 keeps the
+    // kernel's auto-tuned sizes.
+    int send_buffer{0};
+    int receive_buffer{0};
+};
+
+LatencyOptions low_latency_profile();
+
+// Restricts the calling thread to `cpus`, false if the kernel refused.
+bool pin_current_thread(const std::vector<int>& cpus);
+
+// Applies no_delay and busy_poll to a connected TCP socket, the first error.
+std::error_code tune_socket(int descriptor, const LatencyOptions& options);
@@ -0,0 +1,150 @@
+#include "MailboxStore.hpp"
+
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <utility>
+
+MailboxStore::MailboxStore(MailboxLimits limits) : limits_(std::move(limits)) {
+}
+
+bool MailboxStore::store(std::string_view recipient, std::string_view sender,
+                         const SerializedMessage& frame) {
+    auto it = mailboxes_.find(recipient);
+    const bool is_new = it == std::end(mailboxes_);
+    if (is_new) {
+        it = mailboxes_.try_emplace(std::string{recipient}).first;
+    }
+    auto& mailbox = it->second;
+
+    bool is_stored{false};
+    bool is_spilled{false};
+    if (mailbox.frames.size() + mailbox.spilled_bytes + frame.size() <=
+        limits_.per_user_cap) {
+        if (memory_used_ + frame.size() <= limits_.memory_budget) {
+            mailbox.frames.insert(mailbox.frames.end(), frame.begin(),
+                                  frame.end());
+            memory_used_ += frame.size();
+            is_stored = true;
+        } else if (!limits_.spill_directory.empty()) {
+            is_stored = is_spilled = spill(it->first, mailbox, frame);
+        }
+    }
+
+    if (!is_stored) {
+        if (is_new) {
+            mailboxes_.erase(it);
+        }
+        return false;
+    }
+
+    add_sender(is_spilled ? mailbox.spilled_senders : mailbox.senders,
+               {.nick = std::string{sender}, .count = 1});
+    return true;
+}
+
+std::vector<MailboxStore::Sender>
+MailboxStore::take(std::string_view recipient, SerializedMessage& out) {
+    auto it = mailboxes_.find(recipient);
+    if (it == std::end(mailboxes_)) {
+        return {};
+    }
+    auto& mailbox = it->second;
+    auto senders = std::move(mailbox.senders);
+
+    if (mailbox.spilled_bytes != 0) {
+        const auto path = spill_path(recipient);
+        std::ifstream file{path, std::ios::binary};
+        const auto offset = out.size();
+        out.resize(offset + mailbox.spilled_bytes);
+        const bool is_read =
+            file.read(reinterpret_cast<char*>(out.data() + offset),
+                      static_cast<std::streamsize>(mailbox.spilled_bytes))
+                .good();
+        if (!is_read) {
+            // A torn log would desynchronize the client's frame stream.
+            out.resize(offset);
+        }
+        for (auto& sender : mailbox.spilled_senders) {
+            if (!is_read) {
+                sender.lost = std::exchange(sender.count, 0);
+            }
+            add_sender(senders, sender);
+        }
+        spilled_ -= mailbox.spilled_bytes;
+        std::error_code ignored;
+        std::filesystem::remove(path, ignored);
+    }
+
+    out.insert(out.end(), mailbox.frames.begin(), mailbox.frames.end());
+    memory_used_ -= mailbox.frames.size();
+
+    mailboxes_.erase(it);
+    return senders;
+}
+
+std::vector<std::string> MailboxStore::get_recipients() const {
+    std::vector<std::string> recipients;
+    recipients.reserve(mailboxes_.size());
+    for (const auto& [recipient, mailbox] : mailboxes_) {
+        recipients.push_back(recipient);
+    }
+    return recipients;
+}
+
+bool MailboxStore::spill(const std::string& recipient, Mailbox& mailbox,
+                         const SerializedMessage& frame) {
+    const auto size = mailbox.frames.size() + frame.size();
+    if (spilled_ + size > limits_.spill_budget) {
+        return false;
+    }
+    const auto path = spill_path(recipient);
+    std::ofstream file{path, std::ios::binary |
+                                 (mailbox.spilled_bytes == 0 ? std::ios::trunc
+                                                             : std::ios::app)};
+    file.write(reinterpret_cast<const char*>(mailbox.frames.data()),
+               static_cast<std::streamsize>(mailbox.frames.size()));
+    file.write(reinterpret_cast<const char*>(frame.data()),
+               static_cast<std::streamsize>(frame.size()));
+    file.flush();
+    if (!file) {
+        // Cut off a partial write so later appends stay frame aligned.
+        file.close();
+        std::error_code ignored;
+        std::filesystem::resize_file(path, mailbox.spilled_bytes, ignored);
+        return false;
+    }
+
+    mailbox.spilled_bytes += size;
+    spilled_ += size;
+    memory_used_ -= mailbox.frames.size();
+    SerializedMessage{}.swap(mailbox.frames);
+    for (const auto& sender : mailbox.senders) {
+        add_sender(mailbox.spilled_senders, sender);
+    }
+    mailbox.senders.clear();
+    return true;
+}
+
+void MailboxStore::add_sender(std::vector<Sender>& senders,
+                              const Sender& sender) {
+    auto it = std::ranges::find(senders, sender.nick, &Sender::nick);
+    if (it != std::ranges::end(senders)) {
+        it->count += sender.count;
+        it->lost += sender.lost;
+    } else {
+        senders.push_back(sender);
+    }
+}
+
+std::filesystem::path
+MailboxStore::spill_path(std::string_view recipient) const {
+    // Hex keeps any nick a valid file name.
+    std::string name;
+    name.reserve(recipient.size() * 2 + 5);
+    for (const unsigned char c : recipient) {
+        name += std::format("{:02x}", c);
+    }
+    name += ".mbox";
+    return std::filesystem::path{limits_.spill_directory} / name;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "../Message.hpp"
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct MailboxLimits {
+    // Frame bytes kept in memory across all mailboxes.
+    size_t memory_budget{16 << 20};
+    // Frame bytes queued for one recipient, in memory and on disk.
+    size_t per_user_cap{64 << 10};
+    // Mailboxes that don't fit the memory budget are moved to a log file
+    // here. Empty rejects the message instead.
+    std::string spill_directory;
+    // Frame bytes in spill logs across all mailboxes.
+    size_t spill_budget{256 << 20};
+};
+
+// Private messages waiting for recipients that are not online.
+//
+// Each mailbox is a single byte arena of complete, already serialized
+// OfflineMessage frames, so delivery on join is one append to the outgoing
+// buffer. A message that would exceed the memory budget moves the whole
+// mailbox, old frames first, to an append-only log in the spill directory;
+// later messages stay in memory behind it and delivery reads the log back
+// before the arena. The first spill of a mailbox starts the log afresh, so
+// one left behind by an earlier process is never read back.
+class MailboxStore {
+public:
+    struct Sender {
+        std::string nick;
+        // Messages delivered.
+        uint32_t count;
+        // Messages lost because their spill log could not be read back.
+        uint32_t lost{0};
+    };
+
+    explicit MailboxStore(MailboxLimits limits = {});
+
+    // Queues a serialized frame for `recipient`. Returns false if the
+    // recipient's cap or the memory budget would be exceeded and the mailbox
+    // can't be spilled.
+    bool store(std::string_view recipient, std::string_view sender,
+               const SerializedMessage& frame);
+
+    // Appends all frames queued for `recipient` to `out` and removes the
+    // mailbox. Returns who sent them, empty if there was nothing queued.
+    // Frames of a spill log that can't be read back are counted as lost
+    // rather than delivered.
+    std::vector<Sender> take(std::string_view recipient,
+                             SerializedMessage& out);
+
+    void set_limits(MailboxLimits limits) {
+        limits_ = std::move(limits);
+    }
+
+    // Recipients with queued frames.
+    std::vector<std::string> get_recipients() const;
+
+    size_t get_memory_used() const {
+        return memory_used_;
+    }
+
+    size_t get_spilled() const {
+        return spilled_;
+    }
+
+private:
+    struct Mailbox {
+        SerializedMessage frames;
+        size_t spilled_bytes{0};
+        // Senders of the frames in memory and of the ones in the log.
+        std::vector<Sender> senders;
+        std::vector<Sender> spilled_senders;
+    };
+
+    // Adds to the counts of the same nick, if any.
+    static void add_sender(std::vector<Sender>& senders, const Sender& sender);
+
+    bool spill(const std::string& recipient, Mailbox& mailbox,
+               const SerializedMessage& frame);
+    std::filesystem::path spill_path(std::string_view recipient) const;
+
+    struct Hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view value) const {
+            return std::hash<std::string_view>{}(value);
+        }
+    };
+
+    MailboxLimits limits_;
+    std::unordered_map<std::string, Mailbox, Hash, std::equal_to<>> mailboxes_;
+    size_t memory_used_{0};
+    size_t spilled_{0};
+};
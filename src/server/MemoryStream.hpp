@@ -0,0 +1,133 @@
+#pragma once
+
+#include <asio.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+// In-process byte stream standing in for a client socket, so the server
+// logic can run without kernel networking (see src/bench/simulation.cpp).
+//
+// Bytes the client side feeds in are handed to the server's reads, bytes the
+// server writes go straight to `on_output`. Completions are posted to the
+// executor like a socket's, so one thread polling the io_context runs every
+// stream in a fixed order.
+class MemoryStream {
+public:
+    using executor_type = asio::any_io_executor;
+    using OutputHandler = std::function<void(std::span<const uint8_t>)>;
+
+    MemoryStream(executor_type executor, OutputHandler on_output)
+        : executor_(std::move(executor)), on_output_(std::move(on_output)) {
+    }
+
+    executor_type get_executor() {
+        return executor_;
+    }
+
+    // Bytes the client sent.
+    void feed(std::span<const uint8_t> bytes) {
+        input_.insert(input_.end(), bytes.begin(), bytes.end());
+        complete_read();
+    }
+
+    // The client closed its end, the server reads end of file.
+    void close_input() {
+        is_input_closed_ = true;
+        complete_read();
+    }
+
+    // The server closed the stream, a pending read is aborted.
+    void close() {
+        is_closed_ = true;
+        complete_read();
+    }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    auto async_read_some(const MutableBufferSequence& buffers,
+                         ReadHandler&& handler) {
+        return asio::async_initiate<ReadHandler,
+                                    void(asio::error_code, size_t)>(
+            [this, &buffers](auto handler) {
+                // Like a socket, a read may fill only the first buffer.
+                read_buffer_ = *asio::buffer_sequence_begin(buffers);
+                auto shared = std::make_shared<decltype(handler)>(
+                    std::move(handler));
+                read_handler_ = [shared](asio::error_code ec, size_t bytes) {
+                    (*shared)(ec, bytes);
+                };
+                complete_read();
+            },
+            handler);
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    auto async_write_some(const ConstBufferSequence& buffers,
+                          WriteHandler&& handler) {
+        return asio::async_initiate<WriteHandler,
+                                    void(asio::error_code, size_t)>(
+            [this, &buffers](auto handler) {
+                asio::error_code ec;
+                size_t written{0};
+                if (is_closed_) {
+                    ec = asio::error::bad_descriptor;
+                } else {
+                    for (auto it = asio::buffer_sequence_begin(buffers);
+                         it != asio::buffer_sequence_end(buffers); ++it) {
+                        const asio::const_buffer buffer{*it};
+                        on_output_({static_cast<const uint8_t*>(buffer.data()),
+                                    buffer.size()});
+                        written += buffer.size();
+                    }
+                }
+                asio::post(executor_, [handler = std::move(handler), ec,
+                                       written]() mutable {
+                    handler(ec, written);
+                });
+            },
+            handler);
+    }
+
+private:
+    void complete_read() {
+        if (!read_handler_) {
+            return;
+        }
+
+        asio::error_code ec;
+        size_t bytes{0};
+        if (is_closed_) {
+            ec = asio::error::operation_aborted;
+        } else if (read_offset_ < input_.size() || read_buffer_.size() == 0) {
+            bytes = asio::buffer_copy(read_buffer_,
+                                      asio::buffer(input_) + read_offset_);
+            read_offset_ += bytes;
+            if (read_offset_ == input_.size()) {
+                input_.clear();
+                read_offset_ = 0;
+            }
+        } else if (is_input_closed_) {
+            ec = asio::error::eof;
+        } else {
+            return;
+        }
+
+        auto handler = std::move(read_handler_);
+        read_handler_ = nullptr;
+        asio::post(executor_, [handler = std::move(handler), ec, bytes] {
+            handler(ec, bytes);
+        });
+    }
+
+    executor_type executor_;
+    OutputHandler on_output_;
+    std::vector<uint8_t> input_;
+    size_t read_offset_{0};
+    asio::mutable_buffer read_buffer_;
+    std::function<void(asio::error_code, size_t)> read_handler_;
+    bool is_input_closed_{false};
+    bool is_closed_{false};
+};
@@ -0,0 +1,167 @@
+#include "ModerationFilter.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <limits>
+#include <queue>
+
+namespace {
+unsigned char fold(unsigned char byte) {
+    return static_cast<unsigned char>(std::tolower(byte));
+}
+} // namespace
+
+ModerationFilter::ModerationFilter(const std::vector<Pattern>& patterns) {
+    // Equivalence classes: one per distinct (case folded) pattern byte.
+    for (const auto& pattern : patterns) {
+        for (unsigned char byte : pattern.text) {
+            byte = fold(byte);
+            if (byte_class_[byte] == 0) {
+                byte_class_[byte] = static_cast<uint16_t>(classes_count_++);
+            }
+        }
+    }
+    for (int byte = 'A'; byte <= 'Z'; ++byte) {
+        byte_class_[byte] = byte_class_[fold(static_cast<unsigned char>(byte))];
+    }
+
+    // Trie. Transition 0 means "no child" while building, root is never a
+    // child so that is unambiguous.
+    auto add_state = [this] {
+        transitions_.resize(transitions_.size() + classes_count_, 0);
+        output_length_.push_back(0);
+        mask_length_.push_back(0);
+        output_action_.push_back(Action::None);
+        return static_cast<uint32_t>(output_length_.size() - 1);
+    };
+    add_state();
+
+    for (const auto& pattern : patterns) {
+        if (pattern.text.empty() ||
+            pattern.text.size() > std::numeric_limits<uint16_t>::max()) {
+            continue;
+        }
+        uint32_t state{0};
+        for (unsigned char byte : pattern.text) {
+            const auto index = state * classes_count_ + byte_class_[byte];
+            if (transitions_[index] == 0) {
+                const auto child = add_state();
+                transitions_[state * classes_count_ + byte_class_[byte]] =
+                    child;
+            }
+            state = transitions_[state * classes_count_ + byte_class_[byte]];
+        }
+        output_length_[state] = static_cast<uint16_t>(pattern.text.size());
+        if (pattern.action == Action::Mask) {
+            mask_length_[state] = output_length_[state];
+        }
+        output_action_[state] = std::max(output_action_[state], pattern.action);
+        ++patterns_count_;
+    }
+
+    // Breadth first pass computing failure links and folding them into the
+    // table, which turns the trie into a DFA.
+    std::vector<uint32_t> failure(states_count(), 0);
+    std::queue<uint32_t> queue;
+    for (size_t c = 0; c < classes_count_; ++c) {
+        if (auto child = transitions_[c]; child != 0) {
+            queue.push(child);
+        }
+    }
+    while (!queue.empty()) {
+        const auto state = queue.front();
+        queue.pop();
+        const auto fail = failure[state];
+        if (output_length_[state] == 0) {
+            output_length_[state] = output_length_[fail];
+        }
+        if (mask_length_[state] == 0) {
+            mask_length_[state] = mask_length_[fail];
+        }
+        output_action_[state] =
+            std::max(output_action_[state], output_action_[fail]);
+
+        for (size_t c = 0; c < classes_count_; ++c) {
+            auto& transition = transitions_[state * classes_count_ + c];
+            const auto fail_transition = transitions_[fail * classes_count_ + c];
+            if (transition != 0) {
+                failure[transition] = fail_transition;
+                queue.push(transition);
+            } else {
+                transition = fail_transition;
+            }
+        }
+    }
+}
+
+std::shared_ptr<const ModerationFilter>
+ModerationFilter::load(const std::string& path) {
+    std::ifstream file{path};
+    if (!file) {
+        return nullptr;
+    }
+
+    std::vector<Pattern> patterns;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line.starts_with('#')) {
+            continue;
+        }
+        const auto space = line.find(' ');
+        if (space == std::string::npos || space + 1 == line.size()) {
+            continue;
+        }
+        const std::string_view action{line.data(), space};
+        Pattern pattern{.text = line.substr(space + 1), .action = Action::None};
+        if (action == "flag") {
+            pattern.action = Action::Flag;
+        } else if (action == "mask") {
+            pattern.action = Action::Mask;
+        } else if (action == "reject") {
+            pattern.action = Action::Reject;
+        } else {
+            continue;
+        }
+        patterns.push_back(std::move(pattern));
+    }
+    return std::make_shared<const ModerationFilter>(patterns);
+}
+
+ModerationFilter::Verdict ModerationFilter::scan(std::span<char> text) const {
+    Verdict verdict{};
+    uint32_t state{0};
+    for (size_t i = 0; i < text.size(); ++i) {
+        state = next(state, static_cast<unsigned char>(text[i]));
+        if (output_length_[state] == 0) {
+            continue;
+        }
+
+        ++verdict.matches;
+        const auto action = output_action_[state];
+        verdict.action = std::max(verdict.action, action);
+        if (action == Action::Reject) {
+            break;
+        }
+        // A longer Flag pattern can end at the same byte, only the Mask
+        // pattern's bytes are replaced.
+        if (const size_t length = mask_length_[state]; length != 0) {
+            std::fill_n(text.begin() + (i + 1 - length), length, '*');
+        }
+    }
+    return verdict;
+}
+
+std::string_view to_string(ModerationFilter::Action action) {
+    switch (action) {
+        case ModerationFilter::Action::None:
+            return "none";
+        case ModerationFilter::Action::Flag:
+            return "flag";
+        case ModerationFilter::Action::Mask:
+            return "mask";
+        case ModerationFilter::Action::Reject:
+            return "reject";
+    }
+    return "unknown";
+}
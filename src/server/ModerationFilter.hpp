@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Multi-pattern matcher for banned words and URLs.
+//
+// The patterns are compiled into an Aho-Corasick automaton whose failure
+// links are folded into a complete DFA, stored as one flat transition table.
+// Input bytes are first mapped to equivalence classes (every byte that occurs
+// in no pattern shares class 0), which keeps rows short and the whole table
+// cache friendly. There are at most 231 classes (class 0 and every byte but
+// the upper case letters), so any pattern set fits. Scanning is a single
+// pass with one table load per byte, so the cost per message does not depend
+// on the number of patterns. Matching is ASCII case insensitive.
+class ModerationFilter {
+public:
+    // Ordered by severity, the strongest matching action wins.
+    enum class Action : uint8_t {
+        None,
+        Flag,
+        Mask,
+        Reject,
+    };
+
+    struct Pattern {
+        std::string text;
+        Action action;
+    };
+
+    struct Verdict {
+        Action action{Action::None};
+        size_t matches{0};
+    };
+
+    explicit ModerationFilter(const std::vector<Pattern>& patterns);
+
+    // Reads "<flag|mask|reject> <pattern>" lines, empty lines and lines
+    // starting with '#' are skipped. Returns nullptr if the file can't be read.
+    static std::shared_ptr<const ModerationFilter> load(const std::string& path);
+
+    // Scans `text` and replaces the bytes of every pattern with a Mask action
+    // by '*'. Stops early on a Reject match.
+    Verdict scan(std::span<char> text) const;
+
+    size_t patterns_count() const {
+        return patterns_count_;
+    }
+
+    size_t states_count() const {
+        return output_length_.size();
+    }
+
+private:
+    uint32_t next(uint32_t state, unsigned char byte) const {
+        return transitions_[state * classes_count_ + byte_class_[byte]];
+    }
+
+    std::array<uint16_t, 256> byte_class_{};
+    size_t classes_count_{1};
+    size_t patterns_count_{0};
+    // states_count() * classes_count_ entries, row per state.
+    std::vector<uint32_t> transitions_;
+    // Length of the longest pattern ending in a state, 0 if none.
+    std::vector<uint16_t> output_length_;
+    // Length of the longest Mask pattern ending in a state, 0 if none. Shorter
+    // ones ending there are its suffixes, so masking it masks them too.
+    std::vector<uint16_t> mask_length_;
+    // Strongest action of all patterns ending in a state.
+    std::vector<Action> output_action_;
+};
+
+std::string_view to_string(ModerationFilter::Action action);
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "../LatencyHistogram.hpp"
+#include "../Message.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// Control frames keep a client's view of the chat current: its session,
+// the roster, joins and leaves, delivery reports, file transfer credit.
+// Bulk frames carry chat payloads, search results and file chunks, and the
+// traces that go right before chat payloads.
+enum class Lane { Control, Bulk };
+constexpr size_t LaneCount = 2;
+
+inline Lane lane_of(MessageType type) {
+    switch (type) {
+        case MessageType::Text:
+        case MessageType::PrivateMessage:
+        case MessageType::OfflineMessage:
+        case MessageType::SearchResponse:
+        case MessageType::FileChunk:
+        case MessageType::Trace:
+            return Lane::Bulk;
+        default:
+            return Lane::Control;
+    }
+}
+
+// How long frames of one lane waited between being queued and being handed
+// to a write.
+using LaneStats = LatencyHistogram;
+using LanesStats = std::array<LaneStats, LaneCount>;
+
+// Frames waiting to be written to one connection, one queue per lane.
+//
+// A write takes every queued control frame first, then bulk frames up to a
+// byte budget. A control frame queued behind a burst of large messages thus
+// waits for at most the write in flight, which holds one budget of bulk,
+// instead of for the whole burst, while bulk still gets a full budget on
+// every write.
+//
+// UserLeft is the exception. Ids are reused, so a leave that overtook the
+// messages its user sent before would have the client show them under
+// whoever joins with the id next. It waits for the bulk frames queued
+// before it, and control frames behind it keep their order.
+class OutboundQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Frame = std::shared_ptr<const SerializedMessage>;
+
+    static constexpr size_t BulkBudget = 64 << 10;
+
+    void push(Frame frame, Clock::time_point now) {
+        MessageHeader header{};
+        std::memcpy(&header, frame->data(), MessageHeaderSize);
+        if (header.type == MessageType::Compressed &&
+            frame->size() >= MessageHeaderSize + sizeof(MessageType)) {
+            // Filed like the first frame it carries, see FrameCompression.
+            std::memcpy(&header.type, frame->data() + MessageHeaderSize,
+                        sizeof(MessageType));
+        }
+        bytes_ += frame->size();
+        const auto lane = lane_of(header.type);
+        if (lane == Lane::Bulk) {
+            ++bulk_pushed_;
+        }
+        lanes_[static_cast<size_t>(lane)].push_back(
+            {.frame = std::move(frame),
+             .queued_at = now,
+             .bulk_before =
+                 header.type == MessageType::UserLeft ? bulk_pushed_ : 0});
+    }
+
+    bool empty() const {
+        return lanes_[0].empty() && lanes_[1].empty();
+    }
+
+    // Of the frames still queued.
+    size_t get_bytes() const {
+        return bytes_;
+    }
+
+    void clear() {
+        for (auto& lane : lanes_) {
+            lane.clear();
+        }
+        bytes_ = 0;
+        bulk_taken_ = bulk_pushed_;
+    }
+
+    // Moves the frames of the next write to `batch` and records how long
+    // they waited. A bulk frame larger than the budget goes alone.
+    void take_batch(std::vector<Frame>& batch, LanesStats& stats,
+                    Clock::time_point now) {
+        take_control(batch, stats, now);
+
+        auto& bulk = lanes_[static_cast<size_t>(Lane::Bulk)];
+        auto& bulk_stats = stats[static_cast<size_t>(Lane::Bulk)];
+        const auto& control = lanes_[static_cast<size_t>(Lane::Control)];
+        // Bulk frames queued after a waiting leave go after it.
+        const auto bulk_end =
+            control.empty() ? bulk_pushed_ : control.front().bulk_before;
+        size_t bytes{0};
+        while (!bulk.empty() && bulk_taken_ < bulk_end &&
+               (bytes == 0 || bytes + bulk.front().frame->size() <= BulkBudget)) {
+            bytes += bulk.front().frame->size();
+            bytes_ -= bulk.front().frame->size();
+            bulk_stats.record(now - bulk.front().queued_at);
+            batch.push_back(std::move(bulk.front().frame));
+            bulk.pop_front();
+            ++bulk_taken_;
+        }
+
+        take_control(batch, stats, now);
+    }
+
+private:
+    struct Queued {
+        Frame frame;
+        Clock::time_point queued_at;
+        // Of a UserLeft frame, the number of bulk frames pushed before it,
+        // which are taken first. 0 for other frames.
+        uint64_t bulk_before;
+    };
+
+    // Takes control frames up to the first leave that still waits for bulk.
+    void take_control(std::vector<Frame>& batch, LanesStats& stats,
+                      Clock::time_point now) {
+        auto& control = lanes_[static_cast<size_t>(Lane::Control)];
+        auto& control_stats = stats[static_cast<size_t>(Lane::Control)];
+        while (!control.empty() && control.front().bulk_before <= bulk_taken_) {
+            control_stats.record(now - control.front().queued_at);
+            bytes_ -= control.front().frame->size();
+            batch.push_back(std::move(control.front().frame));
+            control.pop_front();
+        }
+    }
+
+    std::array<std::deque<Queued>, LaneCount> lanes_;
+    size_t bytes_{0};
+    // Counted since the queue was created, see Queued::bulk_before.
+    uint64_t bulk_pushed_{0};
+    uint64_t bulk_taken_{0};
+};
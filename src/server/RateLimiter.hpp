@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Sustained rate per second and burst size of a token bucket. A rate of 0
+// disables the bucket.
+struct RateLimit {
+    double rate{0};
+    double burst{0};
+};
+
+struct RateLimits {
+    RateLimit messages{.rate = 20, .burst = 40};
+    RateLimit bytes{.rate = 16 * 1024, .burst = 64 * 1024};
+    // Consecutive throttled frames after which a client is disconnected, 0
+    // only pauses it.
+    uint32_t disconnect_after{100};
+};
+
+// Message and byte token buckets of one connection.
+//
+// Every frame is charged when its header arrives. A bucket may go into debt,
+// the returned delay is how long the connection has to stop reading until
+// the debt is paid back, so a flooding client is held back by TCP flow
+// control instead of by buffering its frames here.
+class RateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    Clock::duration charge(const RateLimits& limits, size_t bytes,
+                           Clock::time_point now) {
+        const double elapsed =
+            std::chrono::duration<double>(now - last_refill_).count();
+        last_refill_ = now;
+
+        const double delay =
+            std::max(charge(limits.messages, messages_, 1, elapsed),
+                     charge(limits.bytes, bytes_, static_cast<double>(bytes),
+                            elapsed));
+        return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(delay));
+    }
+
+private:
+    // Returns the seconds until `tokens` is no longer negative.
+    static double charge(const RateLimit& limit, float& tokens, double cost,
+                         double elapsed) {
+        if (limit.rate <= 0) {
+            return 0;
+        }
+        tokens = static_cast<float>(
+            std::min(limit.burst, tokens + limit.rate * elapsed) - cost);
+        return tokens < 0 ? -tokens / limit.rate : 0;
+    }
+
+    // Starts far in the past so the first frame finds both buckets full.
+    Clock::time_point last_refill_{};
+    float messages_{0};
+    float bytes_{0};
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "../Message.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Fixed size ring of the last delivered TextMessage/PrivateMessage frames,
+// used to replay the gap to a client that resumes its session.
+class ReplayBuffer {
+public:
+    using Frame = std::shared_ptr<const SerializedMessage>;
+
+    struct Entry {
+        uint64_t sequence;
+        UserId from;
+        // Resume tokens of the sending and the receiving session. They stay
+        // with a client across reconnects, while user ids are reused. 0 for
+        // a sender without a session and for the recipient of a broadcast.
+        uint64_t from_session;
+        uint64_t to_session;
+        Frame frame;
+    };
+
+    explicit ReplayBuffer(size_t capacity) : entries_(capacity) {
+    }
+
+    uint64_t next_sequence() {
+        return ++last_sequence_;
+    }
+
+    uint64_t last_sequence() const {
+        return last_sequence_;
+    }
+
+    // False if entries newer than `sequence` were already dropped, so a
+    // replay from there would have a gap.
+    bool can_replay_since(uint64_t sequence) const {
+        return sequence >= dropped_through_;
+    }
+
+    // Returns the oldest entry if it had to make room for `entry`.
+    std::optional<Entry> push(Entry entry) {
+        auto evicted = std::exchange(entries_[head_], std::move(entry));
+        head_ = (head_ + 1) % entries_.size();
+        if (size_ < entries_.size()) {
+            ++size_;
+            return std::nullopt;
+        }
+        dropped_through_ = evicted.sequence;
+        return evicted;
+    }
+
+    // Appends frames newer than `sequence` that are addressed to `session`
+    // into `out`, in delivery order.
+    void collect_since(uint64_t sequence, uint64_t session,
+                       SerializedMessage& out) const {
+        const auto first = (head_ + entries_.size() - size_) % entries_.size();
+        for (size_t i = 0; i < size_; ++i) {
+            const auto& entry = entries_[(first + i) % entries_.size()];
+            if (entry.sequence <= sequence || entry.from_session == session) {
+                continue;
+            }
+            if (entry.to_session != 0 && entry.to_session != session) {
+                continue;
+            }
+            out.insert(out.end(), entry.frame->begin(), entry.frame->end());
+        }
+    }
+
+    // Entries in delivery order, for a successor's restore().
+    std::vector<Entry> get_entries() const {
+        std::vector<Entry> entries;
+        entries.reserve(size_);
+        const auto first = (head_ + entries_.size() - size_) % entries_.size();
+        for (size_t i = 0; i < size_; ++i) {
+            entries.push_back(entries_[(first + i) % entries_.size()]);
+        }
+        return entries;
+    }
+
+    // Continues the sequence of a predecessor's buffer. Returns the entries
+    // that did not fit.
+    std::vector<Entry> restore(uint64_t last_sequence,
+                               std::vector<Entry> entries) {
+        // Every sequence gets an entry, the ones before the first were
+        // dropped by the predecessor.
+        if (!entries.empty()) {
+            dropped_through_ = entries.front().sequence - 1;
+        }
+        std::vector<Entry> evicted;
+        for (auto& entry : entries) {
+            if (auto oldest = push(std::move(entry))) {
+                evicted.push_back(std::move(*oldest));
+            }
+        }
+        last_sequence_ = last_sequence;
+        return evicted;
+    }
+
+private:
+    std::vector<Entry> entries_;
+    size_t head_{0};
+    size_t size_{0};
+    uint64_t last_sequence_{0};
+    // Sequence of the newest entry dropped to make room.
+    uint64_t dropped_through_{0};
+};
@@ -0,0 +1,232 @@
+#include "SearchIndex.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <ranges>
+
+namespace {
+constexpr size_t MaxTokenLength{32};
+// A segment is closed once it takes this fraction of the byte budget.
+constexpr size_t SegmentsPerBudget{8};
+// Per token cost of a hash map node on top of the token and its postings.
+constexpr size_t TokenOverhead{sizeof(void*) * 2 + sizeof(std::string)};
+
+void append_varint(std::vector<uint8_t>& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+uint32_t read_varint(const uint8_t*& it) {
+    uint32_t value{0};
+    for (unsigned shift = 0;; shift += 7) {
+        const uint8_t byte = *it++;
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+bool is_token_char(unsigned char c) {
+    // Bytes >= 0x80 belong to UTF-8 sequences and are kept as is.
+    return std::isalnum(c) || c >= 0x80;
+}
+} // namespace
+
+struct SearchIndex::Segment {
+    struct Document {
+        uint64_t sequence;
+        uint32_t from_offset;
+        uint32_t text_offset;
+        uint32_t text_length;
+        uint16_t from_length;
+    };
+
+    struct Postings {
+        std::vector<uint8_t> deltas;
+        uint32_t last_document{0};
+        uint32_t count{0};
+    };
+
+    struct Hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view value) const {
+            return std::hash<std::string_view>{}(value);
+        }
+    };
+
+    std::vector<uint32_t> decode(const Postings& postings) const {
+        std::vector<uint32_t> documents;
+        documents.reserve(postings.count);
+        const uint8_t* it = postings.deltas.data();
+        uint32_t document{0};
+        for (uint32_t i = 0; i < postings.count; ++i) {
+            document += read_varint(it);
+            documents.push_back(document);
+        }
+        return documents;
+    }
+
+    void add(uint64_t sequence, std::string_view from, std::string_view text) {
+        const auto document = static_cast<uint32_t>(documents.size());
+        documents.push_back(
+            {.sequence = sequence,
+             .from_offset = static_cast<uint32_t>(arena.size()),
+             .text_offset = static_cast<uint32_t>(arena.size() + from.size()),
+             .text_length = static_cast<uint32_t>(text.size()),
+             .from_length = static_cast<uint16_t>(from.size())});
+        arena.append(from);
+        arena.append(text);
+
+        for (const auto& token : tokenize(text)) {
+            auto it = index.find(token);
+            if (it == std::end(index)) {
+                index_bytes += token.size() + sizeof(Postings) + TokenOverhead;
+                it = index.emplace(token, Postings{}).first;
+            }
+            auto& postings = it->second;
+            // A token repeated in one message is only posted once.
+            if (postings.count != 0 && postings.last_document == document) {
+                continue;
+            }
+            const auto capacity = postings.deltas.capacity();
+            append_varint(postings.deltas,
+                          document - (postings.count ? postings.last_document : 0));
+            index_bytes += postings.deltas.capacity() - capacity;
+            postings.last_document = document;
+            ++postings.count;
+        }
+    }
+
+    // Document indexes matching all tokens, ascending.
+    std::vector<uint32_t> match(const std::vector<std::string>& tokens) const {
+        std::vector<const Postings*> lists;
+        for (const auto& token : tokens) {
+            auto it = index.find(token);
+            if (it == std::end(index)) {
+                return {};
+            }
+            lists.push_back(&it->second);
+        }
+        std::ranges::sort(lists, {}, &Postings::count);
+
+        auto documents = decode(*lists.front());
+        for (auto* list : lists | std::views::drop(1)) {
+            const auto other = decode(*list);
+            std::vector<uint32_t> common;
+            std::ranges::set_intersection(documents, other,
+                                          std::back_inserter(common));
+            documents = std::move(common);
+            if (documents.empty()) {
+                break;
+            }
+        }
+        return documents;
+    }
+
+    SearchResult result(uint32_t document) const {
+        const auto& d = documents[document];
+        return SearchResult{
+            .sequence = d.sequence,
+            .from = std::pmr::string{
+                std::string_view{arena}.substr(d.from_offset, d.from_length)},
+            .message = std::pmr::string{
+                std::string_view{arena}.substr(d.text_offset, d.text_length)}};
+    }
+
+    size_t bytes() const {
+        return documents.capacity() * sizeof(Document) + arena.capacity() +
+               index_bytes;
+    }
+
+    std::vector<Document> documents;
+    std::string arena;
+    std::unordered_map<std::string, Postings, Hash, std::equal_to<>> index;
+    // Tokens and postings, the rest is counted from capacities.
+    size_t index_bytes{0};
+};
+
+SearchIndex::SearchIndex(size_t max_messages, size_t max_bytes,
+                         size_t segment_size)
+    : max_messages_(max_messages), max_bytes_(max_bytes),
+      segment_size_(segment_size) {
+}
+
+SearchIndex::~SearchIndex() = default;
+
+void SearchIndex::add(uint64_t sequence, std::string_view from,
+                      std::string_view text) {
+    if (segments_.empty() ||
+        segments_.back()->documents.size() == segment_size_ ||
+        segments_.back()->bytes() >= max_bytes_ / SegmentsPerBudget) {
+        segments_.push_back(std::make_unique<Segment>());
+    }
+    auto& segment = *segments_.back();
+    const auto bytes = segment.bytes();
+    segment.add(sequence, from, text);
+    ++size_;
+    bytes_ += segment.bytes() - bytes;
+
+    while ((size_ > max_messages_ || bytes_ > max_bytes_) &&
+           segments_.size() > 1) {
+        size_ -= segments_.front()->documents.size();
+        bytes_ -= segments_.front()->bytes();
+        segments_.pop_front();
+    }
+}
+
+std::vector<SearchResult> SearchIndex::search(std::string_view query,
+                                              size_t limit) const {
+    std::vector<SearchResult> results;
+    const auto tokens = tokenize(query);
+    if (tokens.empty()) {
+        return results;
+    }
+
+    for (const auto& segment : segments_ | std::views::reverse) {
+        const auto documents = segment->match(tokens);
+        for (auto document : documents | std::views::reverse) {
+            results.push_back(segment->result(document));
+            if (results.size() == limit) {
+                return results;
+            }
+        }
+    }
+    return results;
+}
+
+size_t SearchIndex::size() const {
+    return size_;
+}
+
+size_t SearchIndex::bytes() const {
+    return bytes_;
+}
+
+std::vector<std::string> SearchIndex::tokenize(std::string_view text) {
+    std::vector<std::string> tokens;
+    size_t i{0};
+    while (i < text.size()) {
+        while (i < text.size() && !is_token_char(text[i])) {
+            ++i;
+        }
+        std::string token;
+        while (i < text.size() && is_token_char(text[i])) {
+            if (token.size() < MaxTokenLength) {
+                token.push_back(static_cast<char>(
+                    std::tolower(static_cast<unsigned char>(text[i]))));
+            }
+            ++i;
+        }
+        if (!token.empty()) {
+            tokens.push_back(std::move(token));
+        }
+    }
+    std::ranges::sort(tokens);
+    const auto [first, last] = std::ranges::unique(tokens);
+    tokens.erase(first, last);
+    return tokens;
+}
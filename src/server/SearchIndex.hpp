@@ -0,0 +1,51 @@
+#pragma once
+
+#include "../Message.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Inverted index over the most recent chat messages.
+//
+// Messages are grouped into segments of `segment_size` documents. Each
+// segment maps tokens to posting lists of varint encoded document index
+// deltas, so a posting usually costs a single byte. Once more than
+// `max_messages` are indexed or the segments take more than `max_bytes` the
+// oldest segment is dropped as a whole, which keeps eviction O(1). A segment
+// is closed early once it takes an eighth of `max_bytes`, so long messages
+// cannot grow one past the budget. Not thread safe, see SearchService.
+class SearchIndex {
+public:
+    explicit SearchIndex(size_t max_messages = 1 << 20,
+                         size_t max_bytes = 256 << 20,
+                         size_t segment_size = 1 << 16);
+    ~SearchIndex();
+
+    void add(uint64_t sequence, std::string_view from, std::string_view text);
+
+    // Messages containing every term of `query`, newest first.
+    std::vector<SearchResult> search(std::string_view query,
+                                     size_t limit) const;
+
+    size_t size() const;
+
+    // Approximate memory taken by the segments.
+    size_t bytes() const;
+
+    static std::vector<std::string> tokenize(std::string_view text);
+
+private:
+    struct Segment;
+
+    size_t max_messages_;
+    size_t max_bytes_;
+    size_t segment_size_;
+    size_t size_{0};
+    size_t bytes_{0};
+    std::deque<std::unique_ptr<Segment>> segments_;
+};
@@ -0,0 +1,61 @@
+#include "SearchService.hpp"
+
+SearchService::SearchService(size_t max_messages, size_t max_bytes)
+    : index_(max_messages, max_bytes), worker_([this] { run(); }) {
+}
+
+SearchService::~SearchService() {
+    {
+        std::lock_guard lock{mutex_};
+        is_stopping_ = true;
+    }
+    condition_.notify_one();
+    worker_.join();
+}
+
+void SearchService::index(uint64_t sequence, std::string from,
+                          std::shared_ptr<const SerializedMessage> frame) {
+    post([this, sequence, from = std::move(from), frame = std::move(frame)] {
+        TextMessage text_message;
+        if (deserialize({frame->begin() + MessageHeaderSize, frame->end()},
+                        text_message)) {
+            index_.add(sequence, from, text_message.message);
+        }
+    });
+}
+
+void SearchService::search(std::string_view query, size_t limit,
+                           Callback callback) {
+    post([this, query = std::string{query}, limit,
+          callback = std::move(callback)] {
+        callback(index_.search(query, limit));
+    });
+}
+
+void SearchService::post(std::function<void()> task) {
+    {
+        std::lock_guard lock{mutex_};
+        tasks_.push_back(std::move(task));
+    }
+    condition_.notify_one();
+}
+
+void SearchService::run() {
+    std::deque<std::function<void()>> tasks;
+    for (;;) {
+        {
+            std::unique_lock lock{mutex_};
+            condition_.wait(lock,
+                            [this] { return is_stopping_ || !tasks_.empty(); });
+            if (is_stopping_) {
+                return;
+            }
+            // Take the whole backlog at once to keep lock hold times short.
+            tasks.swap(tasks_);
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+        tasks.clear();
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "SearchIndex.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Owns a SearchIndex and a worker thread that does all indexing and querying,
+// so the io thread only pays for queueing a task.
+class SearchService {
+public:
+    using Callback = std::function<void(std::vector<SearchResult>)>;
+
+    explicit SearchService(size_t max_messages = 1 << 20,
+                           size_t max_bytes = 256 << 20);
+    ~SearchService();
+
+    SearchService(const SearchService&) = delete;
+    SearchService& operator=(const SearchService&) = delete;
+
+    // `frame` is a serialized TextMessage, decoded on the worker thread.
+    void index(uint64_t sequence, std::string from,
+               std::shared_ptr<const SerializedMessage> frame);
+
+    // `callback` runs on the worker thread.
+    void search(std::string_view query, size_t limit, Callback callback);
+
+private:
+    void post(std::function<void()> task);
+    void run();
+
+    SearchIndex index_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::deque<std::function<void()>> tasks_;
+    bool is_stopping_{false};
+    std::thread worker_;
+};
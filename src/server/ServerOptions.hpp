@@ -0,0 +1,46 @@
+#pragma once
+
+#include "AdmissionControl.hpp"
+#include "Federation.hpp"
+#include "LatencyProfile.hpp"
+#include "MailboxStore.hpp"
+#include "RateLimiter.hpp"
+
+#include <string>
+
+// TLS for clients on the TCP port, off while the files are empty. The unix
+// socket stays plaintext.
+struct TlsOptions {
+    // PEM certificate chain, leaf first.
+    std::string certificate_file;
+    // PEM private key of the leaf certificate.
+    std::string private_key_file;
+};
+
+struct ServerOptions {
+    std::string address{"127.0.0.1"};
+    std::string port{"9999"};
+    // Path of an AF_UNIX listening socket for clients on the same host, which
+    // may also switch to shared memory (see ShmChannel). Empty disables it.
+    std::string unix_socket;
+    TlsOptions tls;
+    // Moderation patterns, see ModerationFilter::load. Reloaded on SIGHUP,
+    // empty disables moderation.
+    std::string moderation_file;
+    // Path of an AF_UNIX socket for hot upgrades. A server started while
+    // another one listens here takes over its listening sockets and clients
+    // (see Handover), then listens here itself. Empty disables it.
+    std::string upgrade_socket;
+    // Frames above this size are compressed for clients that can read them,
+    // see FrameCompression. 0 disables compression.
+    size_t compress_above{512};
+    // File recording every frame clients send, see TrafficCapture. Replaced
+    // when the server starts, so a server taking over in a hot upgrade needs
+    // another path. Empty disables capturing.
+    std::string capture_file;
+    LatencyOptions latency;
+    RateLimits rate_limits;
+    AdmissionLimits admission;
+    MailboxLimits mailbox_limits;
+    FederationOptions federation;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "../Message.hpp"
+
+#include <openssl/rand.h>
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Maps resume tokens handed out at join to the user that owns them. The
+// oldest sessions are forgotten once `capacity` is reached.
+class SessionStore {
+public:
+    struct Session {
+        std::string nick;
+        // Id the user had, reused on resume when it is still free.
+        UserId user_id;
+    };
+
+    explicit SessionStore(size_t capacity) : capacity_(capacity) {
+    }
+
+    // Tokens come from the OpenSSL CSPRNG, every client sees its own and
+    // must not be able to predict the others. 0, which never resumes, if
+    // no random bytes could be drawn.
+    uint64_t create(Session session) {
+        uint64_t token{0};
+        while (token == 0 || sessions_.contains(token)) {
+            if (RAND_bytes(reinterpret_cast<unsigned char*>(&token),
+                           sizeof(token)) != 1) {
+                return 0;
+            }
+        }
+        insert(token, std::move(session));
+        return token;
+    }
+
+    // nullptr if the token is unknown or its session was forgotten.
+    const Session* find(uint64_t token) const {
+        if (auto it = sessions_.find(token); it != std::end(sessions_)) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    // A session is resumed under the nick it was created with, only the id
+    // may change.
+    void set_user_id(uint64_t token, UserId user_id) {
+        if (auto it = sessions_.find(token); it != std::end(sessions_)) {
+            it->second.user_id = user_id;
+        }
+    }
+
+    // Oldest first, for a successor's restore().
+    std::vector<std::pair<uint64_t, Session>> get_sessions() const {
+        std::vector<std::pair<uint64_t, Session>> sessions;
+        sessions.reserve(order_.size());
+        for (const auto token : order_) {
+            sessions.emplace_back(token, sessions_.at(token));
+        }
+        return sessions;
+    }
+
+    // Takes over a session of a predecessor under the same token.
+    void restore(uint64_t token, Session session) {
+        if (token != 0 && !sessions_.contains(token)) {
+            insert(token, std::move(session));
+        }
+    }
+
+    void erase(uint64_t token) {
+        if (sessions_.erase(token)) {
+            std::erase(order_, token);
+        }
+    }
+
+private:
+    void insert(uint64_t token, Session session) {
+        if (sessions_.size() == capacity_) {
+            sessions_.erase(order_.front());
+            order_.pop_front();
+        }
+        sessions_.insert({token, std::move(session)});
+        order_.push_back(token);
+    }
+
+    size_t capacity_;
+    std::unordered_map<uint64_t, Session> sessions_;
+    std::deque<uint64_t> order_;
+};
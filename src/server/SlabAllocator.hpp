@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Fixed size block allocator. Blocks are carved out of large chunks and
+// recycled through an intrusive free list, so many small long-lived objects
+// don't pay malloc's per-allocation header and fragmentation. Not thread safe,
+// the server runs its io_context on a single thread.
+class Slab {
+public:
+    explicit Slab(size_t block_size, size_t blocks_per_chunk = 1024)
+        : block_size_(round_up(std::max(block_size, sizeof(FreeBlock)))),
+          blocks_per_chunk_(blocks_per_chunk) {
+    }
+
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+
+    void* allocate() {
+        if (!free_list_) {
+            grow();
+        }
+        auto* block = free_list_;
+        free_list_ = block->next;
+        return block;
+    }
+
+    void deallocate(void* p) {
+        auto* block = static_cast<FreeBlock*>(p);
+        block->next = free_list_;
+        free_list_ = block;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static constexpr size_t round_up(size_t size) {
+        constexpr size_t alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    void grow() {
+        auto& chunk = chunks_.emplace_back(
+            std::make_unique<std::byte[]>(block_size_ * blocks_per_chunk_));
+        for (size_t i = blocks_per_chunk_; i > 0; --i) {
+            deallocate(chunk.get() + (i - 1) * block_size_);
+        }
+    }
+
+    size_t block_size_;
+    size_t blocks_per_chunk_;
+    std::vector<std::unique_ptr<std::byte[]>> chunks_;
+    FreeBlock* free_list_{nullptr};
+};
+
+// Standard allocator backed by one Slab per value type, meant for
+// std::allocate_shared so the object and its control block share a block.
+template <typename T>
+class SlabAllocator {
+public:
+    using value_type = T;
+
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+    SlabAllocator() = default;
+
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U>&) noexcept {
+    }
+
+    T* allocate(size_t n) {
+        if (n != 1) {
+            return std::allocator<T>{}.allocate(n);
+        }
+        return static_cast<T*>(slab().allocate());
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1) {
+            std::allocator<T>{}.deallocate(p, n);
+            return;
+        }
+        slab().deallocate(p);
+    }
+
+    template <typename U>
+    bool operator==(const SlabAllocator<U>&) const noexcept {
+        return true;
+    }
+
+private:
+    static Slab& slab() {
+        static Slab slab{sizeof(T)};
+        return slab;
+    }
+};
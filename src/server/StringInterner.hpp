@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Reference counted pool of strings. Every interned copy of the same value
+// shares one allocation and is handed out as a string_view that stays valid
+// until the matching release().
+class StringInterner {
+public:
+    std::string_view intern(std::string_view value) {
+        if (value.empty()) {
+            return {};
+        }
+        auto it = strings_.find(value);
+        if (it == std::end(strings_)) {
+            it = strings_.emplace(std::string{value}, 0).first;
+        }
+        ++it->second;
+        return it->first;
+    }
+
+    void release(std::string_view value) {
+        if (value.empty()) {
+            return;
+        }
+        if (auto it = strings_.find(value); it != std::end(strings_)) {
+            if (--it->second == 0) {
+                strings_.erase(it);
+            }
+        }
+    }
+
+private:
+    struct Hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view value) const {
+            return std::hash<std::string_view>{}(value);
+        }
+    };
+
+    std::unordered_map<std::string, size_t, Hash, std::equal_to<>> strings_;
+};
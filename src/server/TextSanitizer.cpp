@@ -0,0 +1,307 @@
+#include "TextSanitizer.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CHAT_TEXT_X86 1
+#define CHAT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace {
+// Length of the well formed UTF-8 sequence at `data`, 0 if it is malformed
+// or truncated.
+size_t sequence_length(const uint8_t* data, size_t remaining) {
+    const auto is_in = [&](size_t i, uint8_t low, uint8_t high) {
+        return i < remaining && data[i] >= low && data[i] <= high;
+    };
+
+    const uint8_t lead = data[0];
+    if (lead < 0x80) {
+        return 1;
+    }
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        return is_in(1, 0x80, 0xBF) ? 2 : 0;
+    }
+    if (lead >= 0xE0 && lead <= 0xEF) {
+        const uint8_t low = lead == 0xE0 ? 0xA0 : 0x80;
+        const uint8_t high = lead == 0xED ? 0x9F : 0xBF;
+        return is_in(1, low, high) && is_in(2, 0x80, 0xBF) ? 3 : 0;
+    }
+    if (lead >= 0xF0 && lead <= 0xF4) {
+        const uint8_t low = lead == 0xF0 ? 0x90 : 0x80;
+        const uint8_t high = lead == 0xF4 ? 0x8F : 0xBF;
+        return is_in(1, low, high) && is_in(2, 0x80, 0xBF) &&
+                       is_in(3, 0x80, 0xBF)
+                   ? 4
+                   : 0;
+    }
+    return 0;
+}
+
+// C0 controls, DEL and C1 controls (U+0080..U+009F, encoded as C2 80..C2 9F).
+bool is_control(const uint8_t* data, size_t length) {
+    if (length == 1) {
+        return data[0] < 0x20 || data[0] == 0x7F;
+    }
+    return length == 2 && data[0] == 0xC2 && data[1] < 0xA0;
+}
+
+// Decodes the sequences starting before `end`, the last one may extend past
+// it. Leaves `i` on the first byte after it.
+bool scan_sequences(const uint8_t* data, size_t size, size_t end, size_t& i,
+                    TextScan& scan) {
+    while (i < end) {
+        const size_t length = sequence_length(data + i, size - i);
+        if (length == 0) {
+            scan.is_valid_utf8 = false;
+            return false;
+        }
+        scan.has_control_characters |= is_control(data + i, length);
+        i += length;
+    }
+    return true;
+}
+
+TextScan scan_scalar(std::string_view text) {
+    const auto* data = reinterpret_cast<const uint8_t*>(text.data());
+    TextScan scan{};
+    size_t i{0};
+    scan_sequences(data, text.size(), text.size(), i, scan);
+    return scan;
+}
+
+#ifdef CHAT_TEXT_X86
+TextScan scan_sse2(std::string_view text) {
+    const auto* data = reinterpret_cast<const uint8_t*>(text.data());
+    const size_t size = text.size();
+    const __m128i below_printable = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+
+    TextScan scan{};
+    size_t i{0};
+    while (i + 16 <= size) {
+        const __m128i input =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        // Signed compares, bytes >= 0x80 are negative and fail the first one.
+        const __m128i printable =
+            _mm_and_si128(_mm_cmpgt_epi8(input, below_printable),
+                          _mm_cmplt_epi8(input, del));
+        if (_mm_movemask_epi8(printable) == 0xFFFF) {
+            i += 16;
+            continue;
+        }
+        if (!scan_sequences(data, size, i + 16, i, scan)) {
+            return scan;
+        }
+    }
+    scan_sequences(data, size, size, i, scan);
+    return scan;
+}
+
+// Lookup-table UTF-8 validation (Keiser and Lemire, "Validating UTF-8 in
+// less than one instruction per byte"). Each error class is a bit, a byte
+// pair is invalid if the three nibble lookups share one.
+constexpr uint8_t TooShort = 1 << 0;
+constexpr uint8_t TooLong = 1 << 1;
+constexpr uint8_t Overlong3 = 1 << 2;
+constexpr uint8_t TooLarge = 1 << 3;
+constexpr uint8_t Surrogate = 1 << 4;
+constexpr uint8_t Overlong2 = 1 << 5;
+constexpr uint8_t TooLarge1000 = 1 << 6;
+constexpr uint8_t Overlong4 = 1 << 6;
+constexpr uint8_t TwoConts = 1 << 7;
+constexpr uint8_t Carry = TooShort | TooLong | TwoConts;
+
+constexpr std::array<uint8_t, 16> byte_1_high{
+    TooLong, TooLong, TooLong, TooLong,
+    TooLong, TooLong, TooLong, TooLong,
+    TwoConts, TwoConts, TwoConts, TwoConts,
+    TooShort | Overlong2,
+    TooShort,
+    TooShort | Overlong3 | Surrogate,
+    TooShort | TooLarge | TooLarge1000 | Overlong4,
+};
+
+constexpr std::array<uint8_t, 16> byte_1_low{
+    Carry | Overlong3 | Overlong2 | Overlong4,
+    Carry | Overlong2,
+    Carry,
+    Carry,
+    Carry | TooLarge,
+    Carry | TooLarge | TooLarge1000,
+    Carry | TooLarge | TooLarge1000,
+    Carry | TooLarge | TooLarge1000,
+    Carry | TooLarge | TooLarge1000,
+    Carry | TooLarge | TooLarge1000,
+    Carry | TooLarge | TooLarge1000,
+    Carry | TooLarge | TooLarge1000,
+    Carry | TooLarge | TooLarge1000,
+    Carry | TooLarge | TooLarge1000 | Surrogate,
+    Carry | TooLarge | TooLarge1000,
+    Carry | TooLarge | TooLarge1000,
+};
+
+constexpr std::array<uint8_t, 16> byte_2_high{
+    TooShort, TooShort, TooShort, TooShort,
+    TooShort, TooShort, TooShort, TooShort,
+    TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,
+    TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,
+    TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+    TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+    TooShort, TooShort, TooShort, TooShort,
+};
+
+// A lead byte in the last three positions needs bytes from the next block.
+constexpr auto incomplete_limits = [] {
+    std::array<uint8_t, 32> limits{};
+    limits.fill(0xFF);
+    limits[29] = 0xF0 - 1;
+    limits[30] = 0xE0 - 1;
+    limits[31] = 0xC0 - 1;
+    return limits;
+}();
+
+struct Avx2State {
+    __m256i error;
+    __m256i controls;
+    __m256i previous_input;
+    __m256i previous_incomplete;
+};
+
+CHAT_TARGET_AVX2 __m256i load_table(const std::array<uint8_t, 16>& table) {
+    return _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(table.data())));
+}
+
+CHAT_TARGET_AVX2 __m256i high_nibbles(__m256i input) {
+    return _mm256_and_si256(_mm256_srli_epi16(input, 4), _mm256_set1_epi8(0x0F));
+}
+
+// Input shifted right by N bytes, the gap filled from the previous block.
+template <int N>
+CHAT_TARGET_AVX2 __m256i previous(__m256i input, __m256i previous_input) {
+    return _mm256_alignr_epi8(
+        input, _mm256_permute2x128_si256(previous_input, input, 0x21), 16 - N);
+}
+
+CHAT_TARGET_AVX2 void check_block(__m256i input, Avx2State& state) {
+    const __m256i previous_1 = previous<1>(input, state.previous_input);
+
+    const __m256i c0 = _mm256_cmpeq_epi8(
+        _mm256_min_epu8(input, _mm256_set1_epi8(0x1F)), input);
+    const __m256i del = _mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x7F));
+    const __m256i c1 = _mm256_and_si256(
+        _mm256_cmpeq_epi8(previous_1, _mm256_set1_epi8(static_cast<char>(0xC2))),
+        _mm256_cmpeq_epi8(
+            _mm256_min_epu8(input, _mm256_set1_epi8(static_cast<char>(0x9F))),
+            input));
+    state.controls = _mm256_or_si256(
+        state.controls, _mm256_or_si256(c0, _mm256_or_si256(del, c1)));
+
+    if (_mm256_movemask_epi8(input) == 0) {
+        // All ASCII, only a sequence left open by the previous block can fail.
+        state.error = _mm256_or_si256(state.error, state.previous_incomplete);
+        state.previous_incomplete = _mm256_setzero_si256();
+        state.previous_input = input;
+        return;
+    }
+
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0F);
+    const __m256i special_cases = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(load_table(byte_1_high), high_nibbles(previous_1)),
+            _mm256_shuffle_epi8(load_table(byte_1_low),
+                                _mm256_and_si256(previous_1, low_nibbles))),
+        _mm256_shuffle_epi8(load_table(byte_2_high), high_nibbles(input)));
+
+    // Third and fourth bytes of a sequence must be continuations, which the
+    // two byte lookup above can't see.
+    const __m256i is_third_byte = _mm256_subs_epu8(
+        previous<2>(input, state.previous_input), _mm256_set1_epi8(0xE0 - 0x80));
+    const __m256i is_fourth_byte = _mm256_subs_epu8(
+        previous<3>(input, state.previous_input), _mm256_set1_epi8(0xF0 - 0x80));
+    const __m256i must_be_continuation = _mm256_and_si256(
+        _mm256_or_si256(is_third_byte, is_fourth_byte),
+        _mm256_set1_epi8(static_cast<char>(0x80)));
+
+    state.error = _mm256_or_si256(
+        state.error, _mm256_xor_si256(must_be_continuation, special_cases));
+    state.previous_incomplete = _mm256_subs_epu8(
+        input, _mm256_loadu_si256(
+                   reinterpret_cast<const __m256i*>(incomplete_limits.data())));
+    state.previous_input = input;
+}
+
+CHAT_TARGET_AVX2 TextScan scan_avx2(std::string_view text) {
+    const auto* data = reinterpret_cast<const uint8_t*>(text.data());
+    const size_t size = text.size();
+
+    Avx2State state{_mm256_setzero_si256(), _mm256_setzero_si256(),
+                    _mm256_setzero_si256(), _mm256_setzero_si256()};
+    size_t i{0};
+    for (; i + 32 <= size; i += 32) {
+        check_block(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)),
+                    state);
+    }
+    if (i < size) {
+        // Padded with spaces, they are neither controls nor continuations.
+        std::array<uint8_t, 32> tail;
+        tail.fill(' ');
+        std::memcpy(tail.data(), data + i, size - i);
+        check_block(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(tail.data())),
+                    state);
+    }
+    state.error = _mm256_or_si256(state.error, state.previous_incomplete);
+
+    return {.is_valid_utf8 = _mm256_testz_si256(state.error, state.error) != 0,
+            .has_control_characters =
+                _mm256_testz_si256(state.controls, state.controls) == 0};
+}
+#endif
+} // namespace
+
+const std::vector<TextKernel>& supported_text_kernels() {
+    static const std::vector<TextKernel> kernels = [] {
+        std::vector<TextKernel> kernels{{.name = "scalar", .scan = scan_scalar}};
+#ifdef CHAT_TEXT_X86
+        kernels.push_back({.name = "sse2", .scan = scan_sse2});
+        if (__builtin_cpu_supports("avx2")) {
+            kernels.push_back({.name = "avx2", .scan = scan_avx2});
+        }
+#endif
+        return kernels;
+    }();
+    return kernels;
+}
+
+TextScan scan_text(std::string_view text) {
+    static const auto scan = supported_text_kernels().back().scan;
+    return scan(text);
+}
+
+TextVerdict sanitize_text(std::pmr::string& text) {
+    const auto scan = scan_text(text);
+    if (!scan.is_valid_utf8) {
+        return TextVerdict::Invalid;
+    }
+    if (!scan.has_control_characters) {
+        return TextVerdict::Clean;
+    }
+
+    // Rare path, the text is known to be well formed here.
+    auto* data = reinterpret_cast<uint8_t*>(text.data());
+    size_t kept{0};
+    for (size_t i = 0; i < text.size();) {
+        const size_t length = sequence_length(data + i, text.size() - i);
+        if (!is_control(data + i, length)) {
+            std::memmove(data + kept, data + i, length);
+            kept += length;
+        }
+        i += length;
+    }
+    text.resize(kept);
+    return TextVerdict::Sanitized;
+}
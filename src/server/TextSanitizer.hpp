@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Validation of user supplied text (messages and nicks) before it is
+// forwarded to other clients.
+//
+// Text must be well formed UTF-8 (no overlongs, surrogates or code points
+// above U+10FFFF) and must not contain C0/C1 control characters or DEL, which
+// would let a client drive the terminals of other users. Scanning runs on
+// the widest kernel the CPU supports: AVX2 validates UTF-8 fully in vector
+// registers, SSE2 skips runs of printable ASCII and falls back to the scalar
+// decoder for the rest.
+
+struct TextScan {
+    bool is_valid_utf8{true};
+    bool has_control_characters{false};
+};
+
+enum class TextVerdict {
+    Clean,
+    // Control characters were removed.
+    Sanitized,
+    Invalid,
+};
+
+struct TextKernel {
+    std::string_view name;
+    TextScan (*scan)(std::string_view text);
+};
+
+// Kernels usable on this CPU, scalar first and the fastest last.
+const std::vector<TextKernel>& supported_text_kernels();
+
+// Scans with the fastest supported kernel.
+TextScan scan_text(std::string_view text);
+
+// Rejects malformed UTF-8 and strips control characters in place.
+TextVerdict sanitize_text(std::pmr::string& text);
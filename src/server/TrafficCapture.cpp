@@ -0,0 +1,221 @@
+#include "TrafficCapture.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <print>
+
+namespace {
+constexpr size_t MaxBufferSize = 1 << 20;
+// Buffered output the writer may fall behind by before capturing stops.
+constexpr size_t MaxPendingSize = 64 * MaxBufferSize;
+constexpr size_t EventHeaderSize =
+    sizeof(CaptureEvent) + sizeof(uint32_t) + sizeof(uint64_t);
+constexpr size_t FileHeaderSize = sizeof(CaptureMagic) + sizeof(int64_t);
+// A ConnectMessage body ends with resume_token, last_sequence and
+// compression.
+constexpr size_t ResumeTokenFromEnd =
+    sizeof(uint64_t) + sizeof(uint64_t) + sizeof(Compression);
+
+template <typename T>
+void append(std::vector<uint8_t>& buffer, const T& value) {
+    const auto offset = buffer.size();
+    buffer.resize(offset + sizeof(T));
+    std::memcpy(buffer.data() + offset, &value, sizeof(T));
+}
+
+bool write_all(int descriptor, const uint8_t* data, size_t size) {
+    while (size != 0) {
+        const auto written = ::write(descriptor, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+} // namespace
+
+std::unique_ptr<TrafficCapture> TrafficCapture::create(const std::string& path,
+                                                       Clock::time_point now) {
+    const int descriptor =
+        ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (descriptor < 0) {
+        return nullptr;
+    }
+    std::vector<uint8_t> header;
+    append(header, CaptureMagic);
+    append(header, static_cast<int64_t>(
+                       std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count()));
+    // The mode given to open() only applies to a new file.
+    if (::fchmod(descriptor, 0600) != 0 ||
+        !write_all(descriptor, header.data(), header.size())) {
+        ::close(descriptor);
+        return nullptr;
+    }
+    return std::unique_ptr<TrafficCapture>{
+        new TrafficCapture{descriptor, now}};
+}
+
+TrafficCapture::TrafficCapture(int descriptor, Clock::time_point now)
+    : descriptor_(descriptor), start_(now), writer_([this] { run(); }) {
+    buffer_.reserve(MaxBufferSize);
+}
+
+TrafficCapture::~TrafficCapture() {
+    flush();
+    {
+        std::lock_guard lock{mutex_};
+        is_stopping_ = true;
+    }
+    condition_.notify_one();
+    writer_.join();
+    ::close(descriptor_);
+}
+
+void TrafficCapture::record_frame(uint32_t& connection,
+                                  const MessageHeader& header,
+                                  std::span<const uint8_t> body,
+                                  Clock::time_point now) {
+    if (is_stopped_) {
+        return;
+    }
+    if (connection == 0) {
+        connection = next_connection_++;
+        append_event(CaptureEvent::Opened, connection, now);
+    }
+    append_event(CaptureEvent::Frame, connection, now);
+    const auto offset = buffer_.size();
+    buffer_.resize(offset + MessageHeaderSize);
+    std::memcpy(buffer_.data() + offset, &header, MessageHeaderSize);
+    buffer_.insert(buffer_.end(), body.begin(), body.end());
+    // Would let anyone who reads the capture take over the session.
+    if (header.type == MessageType::Connect &&
+        body.size() >= sizeof(unsigned long) + ResumeTokenFromEnd) {
+        std::memset(buffer_.data() + buffer_.size() - ResumeTokenFromEnd, 0,
+                    sizeof(uint64_t));
+    }
+
+    if (buffer_.size() >= MaxBufferSize) {
+        flush();
+    }
+}
+
+void TrafficCapture::record_closed(uint32_t connection, Clock::time_point now) {
+    if (connection != 0 && !is_stopped_) {
+        append_event(CaptureEvent::Closed, connection, now);
+    }
+}
+
+void TrafficCapture::flush() {
+    if (buffer_.empty()) {
+        return;
+    }
+    {
+        std::lock_guard lock{mutex_};
+        is_stopped_ = pending_size_ + buffer_.size() > MaxPendingSize;
+        if (!is_stopped_) {
+            pending_size_ += buffer_.size();
+            pending_.push_back(std::move(buffer_));
+        }
+    }
+    buffer_ = {};
+    if (is_stopped_) {
+        std::println("Traffic capture stopped, the file is not written fast "
+                     "enough.");
+        return;
+    }
+    condition_.notify_one();
+    buffer_.reserve(MaxBufferSize);
+}
+
+void TrafficCapture::append_event(CaptureEvent event, uint32_t connection,
+                                  Clock::time_point now) {
+    const auto time = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_)
+            .count());
+    append(buffer_, event);
+    append(buffer_, connection);
+    append(buffer_, time);
+}
+
+void TrafficCapture::run() {
+    bool is_failed{false};
+    for (;;) {
+        std::vector<uint8_t> buffer;
+        {
+            std::unique_lock lock{mutex_};
+            condition_.wait(lock,
+                            [this] { return is_stopping_ || !pending_.empty(); });
+            if (pending_.empty()) {
+                return;
+            }
+            buffer = std::move(pending_.front());
+            pending_.pop_front();
+            pending_size_ -= buffer.size();
+        }
+        if (!is_failed &&
+            !write_all(descriptor_, buffer.data(), buffer.size())) {
+            is_failed = true;
+            std::println("Could not write the traffic capture: {}",
+                         std::strerror(errno));
+        }
+    }
+}
+
+std::optional<std::vector<CapturedEvent>> read_capture(const std::string& path) {
+    std::ifstream file{path, std::ios::binary};
+    const std::vector<uint8_t> data{std::istreambuf_iterator<char>{file},
+                                    std::istreambuf_iterator<char>{}};
+    if (data.size() < FileHeaderSize ||
+        std::memcmp(data.data(), CaptureMagic, sizeof(CaptureMagic)) != 0) {
+        return std::nullopt;
+    }
+
+    std::vector<CapturedEvent> events;
+    size_t offset{FileHeaderSize};
+    while (data.size() - offset >= EventHeaderSize) {
+        CapturedEvent captured{};
+        uint64_t time{0};
+        std::memcpy(&captured.event, data.data() + offset, sizeof(CaptureEvent));
+        offset += sizeof(CaptureEvent);
+        std::memcpy(&captured.connection, data.data() + offset, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        std::memcpy(&time, data.data() + offset, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        captured.time = std::chrono::nanoseconds{time};
+
+        if (captured.event == CaptureEvent::Frame) {
+            MessageHeader header{};
+            if (data.size() - offset < MessageHeaderSize) {
+                break;
+            }
+            std::memcpy(&header, data.data() + offset, MessageHeaderSize);
+            if (data.size() - offset - MessageHeaderSize < header.body_size) {
+                break;
+            }
+            const auto end = data.begin() + static_cast<std::ptrdiff_t>(
+                                                offset + MessageHeaderSize +
+                                                header.body_size);
+            captured.frame.assign(
+                data.begin() + static_cast<std::ptrdiff_t>(offset), end);
+            offset += MessageHeaderSize + header.body_size;
+        } else if (captured.event != CaptureEvent::Opened &&
+                   captured.event != CaptureEvent::Closed) {
+            return std::nullopt;
+        }
+        events.push_back(std::move(captured));
+    }
+    return events;
+}
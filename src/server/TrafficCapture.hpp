@@ -0,0 +1,98 @@
+#pragma once
+
+#include "../Message.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records what clients send, for replaying production traffic against a
+// test server (see src/bench/traffic_replay.cpp).
+//
+// The file starts with CaptureMagic and the wall clock time the capture
+// started at, in nanoseconds since the Unix epoch. Then come events in the
+// order the server handled them: the event type (one byte), the id of the
+// connection (u32) and nanoseconds since the capture started (u64); frame
+// events go on with the frame as the client sent it, MessageHeader and body.
+// Ids are given in the order connections sent their first frame and are not
+// reused. Frames that do not reach a handler, like ones over the size limit,
+// are not recorded, and joins are recorded without their resume token.
+//
+// Events are buffered on the io thread and handed to a writer thread when
+// the buffer fills, on flush(), which the server calls every second, and when
+// the capture is destroyed. If the writer falls too far behind, capturing
+// stops rather than holding more in memory; the file ends with whole events.
+// The file is readable by its owner only.
+
+inline constexpr char CaptureMagic[8]{'c', 'h', 'a', 't', 'c', 'a', 'p', '1'};
+
+enum class CaptureEvent : uint8_t {
+    // The first frame of the connection follows.
+    Opened,
+    Frame,
+    Closed,
+};
+
+class TrafficCapture {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr auto FlushInterval = std::chrono::seconds{1};
+
+    // nullptr if `path` cannot be written. An existing file is replaced.
+    static std::unique_ptr<TrafficCapture> create(const std::string& path,
+                                                  Clock::time_point now);
+    ~TrafficCapture();
+
+    TrafficCapture(const TrafficCapture&) = delete;
+    TrafficCapture& operator=(const TrafficCapture&) = delete;
+
+    // `connection` is 0 until the connection's first frame, which gives it
+    // an id.
+    void record_frame(uint32_t& connection, const MessageHeader& header,
+                      std::span<const uint8_t> body, Clock::time_point now);
+    // Does nothing for a connection that never sent a frame.
+    void record_closed(uint32_t connection, Clock::time_point now);
+    // Hands what is buffered to the writer thread.
+    void flush();
+
+private:
+    TrafficCapture(int descriptor, Clock::time_point now);
+    void append_event(CaptureEvent event, uint32_t connection,
+                      Clock::time_point now);
+    void run();
+
+    int descriptor_;
+    Clock::time_point start_;
+    uint32_t next_connection_{1};
+    std::vector<uint8_t> buffer_;
+    bool is_stopped_{false};
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    // Buffers waiting for the writer, and their size in bytes.
+    std::deque<std::vector<uint8_t>> pending_;
+    size_t pending_size_{0};
+    bool is_stopping_{false};
+    std::thread writer_;
+};
+
+struct CapturedEvent {
+    CaptureEvent event;
+    uint32_t connection;
+    std::chrono::nanoseconds time;
+    // Header and body, empty for other events.
+    SerializedMessage frame;
+};
+
+// Events of a capture file, nullopt if it is not one. A torn last event, as
+// left by a server that was killed, is dropped.
+std::optional<std::vector<CapturedEvent>> read_capture(const std::string& path);
@@ -1,9 +1,209 @@
+#include <charconv>
+#include <csignal>
+#include <chrono>
+#include <fstream>
+#include <iterator>
 #include <print>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "ChatServer.hpp"
 
-int main(int, char**) {
-    ChatServer server{"127.0.0.1", "9999"};
+namespace {
+template <typename T>
+bool parse_number(std::string_view text, T& value) {
+    const auto [end, ec] =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    return ec == std::errc{} && end == text.data() + text.size();
+}
+
+// CPU numbers and ranges separated by commas, like "2" or "2-5,8".
+bool parse_cpus(std::string_view text, std::vector<int>& cpus) {
+    cpus.clear();
+    while (!text.empty()) {
+        const auto comma = text.find(',');
+        const auto item = text.substr(0, comma);
+        text = comma == std::string_view::npos ? std::string_view{}
+                                               : text.substr(comma + 1);
+        const auto dash = item.find('-');
+        int first{0};
+        int last{0};
+        if (!parse_number(item.substr(0, dash), first)) {
+            return false;
+        }
+        last = first;
+        if (dash != std::string_view::npos &&
+            !parse_number(item.substr(dash + 1), last)) {
+            return false;
+        }
+        if (last < first) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return !cpus.empty();
+}
+
+// The whole file without trailing line breaks, false if it is empty.
+bool read_secret(const std::string& path, std::string& secret) {
+    std::ifstream file{path, std::ios::binary};
+    secret.assign(std::istreambuf_iterator<char>{file},
+                  std::istreambuf_iterator<char>{});
+    while (!secret.empty() &&
+           (secret.back() == '\n' || secret.back() == '\r')) {
+        secret.pop_back();
+    }
+    return !secret.empty();
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    // TLS connections are written with write(), a client that went away
+    // would otherwise kill the server.
+    std::signal(SIGPIPE, SIG_IGN);
+    ServerOptions options{};
+    auto& limits = options.rate_limits;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string_view option{argv[i]};
+        const std::string_view value{argv[i + 1]};
+        bool is_valid{true};
+        if (option == "--address") {
+            options.address = value;
+        } else if (option == "--port") {
+            options.port = value;
+        } else if (option == "--unix-socket") {
+            options.unix_socket = value;
+        } else if (option == "--tls-cert") {
+            options.tls.certificate_file = value;
+        } else if (option == "--tls-key") {
+            options.tls.private_key_file = value;
+        } else if (option == "--upgrade-socket") {
+            options.upgrade_socket = value;
+        } else if (option == "--compress-above") {
+            is_valid = parse_number(value, options.compress_above);
+        } else if (option == "--capture") {
+            options.capture_file = value;
+        } else if (option == "--latency-profile") {
+            // Keeps the CPUs and buffer sizes, which it does not set.
+            // Options after it override the rest.
+            is_valid = value == "default" || value == "low";
+            auto profile = value == "low" ? low_latency_profile()
+                                          : LatencyOptions{};
+            profile.cpus = std::move(options.latency.cpus);
+            profile.send_buffer = options.latency.send_buffer;
+            profile.receive_buffer = options.latency.receive_buffer;
+            options.latency = std::move(profile);
+        } else if (option == "--cpus") {
+            is_valid = parse_cpus(value, options.latency.cpus);
+        } else if (option == "--busy-poll") {
+            std::chrono::microseconds::rep busy_poll{0};
+            is_valid = parse_number(value, busy_poll);
+            options.latency.busy_poll = std::chrono::microseconds{busy_poll};
+        } else if (option == "--spin-poll") {
+            std::chrono::microseconds::rep spin{0};
+            is_valid = parse_number(value, spin);
+            options.latency.spin = std::chrono::microseconds{spin};
+        } else if (option == "--send-buffer") {
+            is_valid = parse_number(value, options.latency.send_buffer);
+        } else if (option == "--receive-buffer") {
+            is_valid = parse_number(value, options.latency.receive_buffer);
+        } else if (option == "--moderation-file") {
+            options.moderation_file = value;
+        } else if (option == "--message-rate") {
+            is_valid = parse_number(value, limits.messages.rate);
+        } else if (option == "--message-burst") {
+            is_valid = parse_number(value, limits.messages.burst);
+        } else if (option == "--byte-rate") {
+            is_valid = parse_number(value, limits.bytes.rate);
+        } else if (option == "--byte-burst") {
+            is_valid = parse_number(value, limits.bytes.burst);
+        } else if (option == "--flood-disconnect") {
+            is_valid = parse_number(value, limits.disconnect_after);
+        } else if (option == "--max-connections") {
+            is_valid = parse_number(value, options.admission.max_connections);
+        } else if (option == "--shed-queued-bytes") {
+            is_valid =
+                parse_number(value, options.admission.max_outbound_bytes);
+        } else if (option == "--shed-loop-lag") {
+            std::chrono::milliseconds::rep lag{0};
+            is_valid = parse_number(value, lag);
+            options.admission.max_loop_lag = std::chrono::milliseconds{lag};
+        } else if (option == "--mailbox-budget") {
+            is_valid = parse_number(value, options.mailbox_limits.memory_budget);
+        } else if (option == "--mailbox-cap") {
+            is_valid = parse_number(value, options.mailbox_limits.per_user_cap);
+        } else if (option == "--mailbox-spill-dir") {
+            options.mailbox_limits.spill_directory = value;
+        } else if (option == "--mailbox-spill-budget") {
+            is_valid =
+                parse_number(value, options.mailbox_limits.spill_budget);
+        } else if (option == "--node-id") {
+            is_valid = parse_number(value, options.federation.node_id) &&
+                       options.federation.node_id != 0;
+        } else if (option == "--peer-address") {
+            options.federation.address = value;
+        } else if (option == "--peer-port") {
+            options.federation.port = value;
+        } else if (option == "--peer-secret-file") {
+            is_valid =
+                read_secret(std::string{value}, options.federation.secret);
+        } else if (option == "--peer") {
+            options.federation.peers.emplace_back(value);
+        } else {
+            std::println("Unknown option: {}", option);
+            return 1;
+        }
+        if (!is_valid) {
+            std::println("Invalid value for {}: {}", option, value);
+            return 1;
+        }
+    }
+    if (argc % 2 == 0) {
+        std::println("usage: server [--address <address>] [--port <port>] "
+                     "[--unix-socket <path>]\n"
+                     "              [--tls-cert <pem file>] "
+                     "[--tls-key <pem file>]\n"
+                     "              [--moderation-file <path>] "
+                     "[--upgrade-socket <path>]\n"
+                     "              [--compress-above <bytes>] "
+                     "[--capture <path>]\n"
+                     "              [--latency-profile <default|low>] "
+                     "[--cpus <list>] [--busy-poll <us>] "
+                     "[--spin-poll <us>]\n"
+                     "              [--send-buffer <bytes>] "
+                     "[--receive-buffer <bytes>]\n"
+                     "              [--message-rate <per second>] "
+                     "[--message-burst <messages>]\n"
+                     "              [--byte-rate <per second>] "
+                     "[--byte-burst <bytes>]\n"
+                     "              [--flood-disconnect <throttled frames>]\n"
+                     "              [--max-connections <clients>] "
+                     "[--shed-queued-bytes <bytes>] "
+                     "[--shed-loop-lag <ms>]\n"
+                     "              [--mailbox-budget <bytes>] "
+                     "[--mailbox-cap <bytes>] [--mailbox-spill-dir <path>]\n"
+                     "              [--mailbox-spill-budget <bytes>]\n"
+                     "              [--node-id <id>] [--peer-address <address>] "
+                     "[--peer-port <port>]\n"
+                     "              [--peer-secret-file <path>] "
+                     "[--peer <host:port>]...");
+        return 1;
+    }
+
+    if (options.tls.certificate_file.empty() !=
+        options.tls.private_key_file.empty()) {
+        std::println("--tls-cert and --tls-key must be given together");
+        return 1;
+    }
+    if (!options.federation.port.empty() && options.federation.secret.empty()) {
+        std::println("--peer-port needs --peer-secret-file");
+        return 1;
+    }
+
+    ChatServer server{std::move(options)};
     server.start();
     return 0;
 }
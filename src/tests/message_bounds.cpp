@@ -0,0 +1,124 @@
+// Frames whose length fields point past the body must be rejected, not
+// read or thrown on. Lengths near 2^64 used to wrap the size checks of
+// Connect, Private and Offline frames, which a client could send before
+// joining.
+//
+// Each length field of a valid frame is overwritten with a value just past
+// the body and with values near 2^64, and every truncation of the body is
+// decoded. Exits with 1 if such a frame is accepted or decoding throws.
+
+#include "../Message.hpp"
+
+#include <cstring>
+#include <exception>
+#include <format>
+#include <initializer_list>
+#include <limits>
+#include <print>
+#include <string_view>
+
+namespace {
+int failures{0};
+
+void check(bool condition, std::string_view what) {
+    if (!condition) {
+        std::println("FAIL: {}", what);
+        ++failures;
+    }
+}
+
+SerializedMessage body_of(const Message& message) {
+    const auto frame = serialize(message);
+    return {frame.begin() + MessageHeaderSize, frame.end()};
+}
+
+SerializedMessage with_length(SerializedMessage body, size_t offset,
+                              unsigned long length) {
+    std::memcpy(body.data() + offset, &length, sizeof(length));
+    return body;
+}
+
+// Decodes `body` as a T, false if it threw.
+template <typename T>
+bool decodes_safely(const SerializedMessage& body, bool& is_accepted) {
+    try {
+        T message{};
+        is_accepted = deserialize(body, message);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// `length_offsets` are the offsets of the length fields in `valid`.
+template <typename T>
+void check_lengths(std::string_view name, const SerializedMessage& valid,
+                   std::initializer_list<size_t> length_offsets) {
+    bool is_accepted{false};
+    check(decodes_safely<T>(valid, is_accepted) && is_accepted,
+          std::format("{} round trip", name));
+
+    constexpr auto Max = std::numeric_limits<unsigned long>::max();
+    for (const auto offset : length_offsets) {
+        unsigned long length{0};
+        std::memcpy(&length, valid.data() + offset, sizeof(length));
+        for (const unsigned long bad :
+             {length + 1, Max, Max - valid.size(), Max - valid.size() + 1,
+              Max - offset, Max - 7, Max - 15, Max - 16, Max - 17}) {
+            const auto body = with_length(valid, offset, bad);
+            check(decodes_safely<T>(body, is_accepted) && !is_accepted,
+                  std::format("{} length {} at {}", name, bad, offset));
+        }
+    }
+    for (size_t size = 0; size < valid.size(); ++size) {
+        const SerializedMessage body{valid.begin(), valid.begin() + size};
+        check(decodes_safely<T>(body, is_accepted) && !is_accepted,
+              std::format("{} cut to {} bytes", name, size));
+    }
+}
+} // namespace
+
+int main() {
+    constexpr size_t length_size = sizeof(unsigned long);
+
+    {
+        // A 16 byte body whose nick length makes the sizes add up to 16
+        // once the sum wraps around.
+        SerializedMessage body(16);
+        constexpr size_t fixed_size =
+            length_size + sizeof(ConnectMessage::resume_token) +
+            sizeof(ConnectMessage::last_sequence) +
+            sizeof(ConnectMessage::compression);
+        const unsigned long length = body.size() - fixed_size;
+        std::memcpy(body.data(), &length, sizeof(length));
+        bool is_accepted{false};
+        check(decodes_safely<ConnectMessage>(body, is_accepted) && !is_accepted,
+              "Connect with a wrapping nick length");
+    }
+
+    check_lengths<ConnectMessage>(
+        "Connect", body_of(ConnectMessage{.nick = "alice"}), {0});
+
+    const PrivateMessage private_message{
+        .to_nick = "bob", .message = "hello"};
+    const size_t to_nick_offset = sizeof(private_message.sequence) +
+                                  sizeof(private_message.from) +
+                                  sizeof(private_message.to);
+    check_lengths<PrivateMessage>(
+        "Private", body_of(private_message),
+        {to_nick_offset,
+         to_nick_offset + length_size + private_message.to_nick.size()});
+
+    const OfflineMessage offline_message{
+        .from = "alice", .message = "hello", .sent_at = 1};
+    const size_t from_offset = sizeof(offline_message.sent_at);
+    check_lengths<OfflineMessage>(
+        "Offline", body_of(offline_message),
+        {from_offset,
+         from_offset + length_size + offline_message.from.size()});
+
+    if (failures == 0) {
+        std::println("all frames rejected");
+    }
+    return failures == 0 ? 0 : 1;
+}